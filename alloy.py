@@ -372,6 +372,7 @@ def validation_run(only, only_targets, reference_branch, number, notify, update,
         stability.silent = True
         stability.in_file = "." + os.sep + f_date + os.sep + "run_tests_log.log"
         stability.verify = False
+        stability.tasksys = ""
 # stability varying options
         stability.target = ""
         stability.arch = ""
@@ -43,6 +43,11 @@
 #include "stmt.h"
 #include "sym.h"
 #include "util.h"
+#if defined(LLVM_3_1) || defined(LLVM_3_2)
+  #include <llvm/Function.h>
+#else
+  #include <llvm/IR/Function.h>
+#endif
 
 ///////////////////////////////////////////////////////////////////////////
 // ASTNode
@@ -51,6 +56,18 @@ ASTNode::~ASTNode() {
 }
 
 
+static void
+lDestroyASTNode(void *node) {
+    ((ASTNode *)node)->~ASTNode();
+}
+
+
+void *
+ASTNode::operator new(size_t size) {
+    return Arena::Allocate(size, lDestroyASTNode);
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // AST
 
@@ -58,7 +75,12 @@ void
 AST::AddFunction(Symbol *sym, Stmt *code) {
     if (sym == NULL)
         return;
-    functions.push_back(new Function(sym, code));
+    Function *function = new Function(sym, code);
+    if (deferUnusedFunctions && sym->function != NULL &&
+        sym->function->hasLocalLinkage())
+        deferredFunctions.push_back(std::make_pair(function, sym));
+    else
+        functions.push_back(function);
 }
 
 
@@ -66,6 +88,34 @@ void
 AST::GenerateIR() {
     for (unsigned int i = 0; i < functions.size(); ++i)
         functions[i]->GenerateIR();
+
+    // Generate IR for the deferred functions that are used.  They may
+    // use other deferred functions in turn, so keep going until we've
+    // generated all of the ones that are needed.
+    std::vector<bool> generated(deferredFunctions.size(), false);
+    bool generatedAny = true;
+    while (generatedAny) {
+        generatedAny = false;
+        for (unsigned int i = 0; i < deferredFunctions.size(); ++i) {
+            if (!generated[i] && !deferredFunctions[i].second->function->use_empty()) {
+                deferredFunctions[i].first->GenerateIR();
+                generated[i] = true;
+                generatedAny = true;
+            }
+        }
+    }
+
+    // The rest are unused; since they have internal linkage, their
+    // declarations have to go as well, unless the program has its own
+    // definition of the same function.
+    for (unsigned int i = 0; i < deferredFunctions.size(); ++i) {
+        Symbol *sym = deferredFunctions[i].second;
+        if (!generated[i] && sym->function->empty()) {
+            Assert(sym->function->use_empty());
+            sym->function->eraseFromParent();
+            sym->function = NULL;
+        }
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -224,8 +274,10 @@ WalkAST(ASTNode *node, ASTPreCallBackFunc preFunc, ASTPostCallBackFunc postFunc,
             fce->func = (Expr *)WalkAST(fce->func, preFunc, postFunc, data);
             fce->args = (ExprList *)WalkAST(fce->args, preFunc, postFunc, data);
             for (int k = 0; k < 3; k++)
-              fce->launchCountExpr[0] = (Expr *)WalkAST(fce->launchCountExpr[0], preFunc,
+              fce->launchCountExpr[k] = (Expr *)WalkAST(fce->launchCountExpr[k], preFunc,
                                                    postFunc, data);
+            fce->launchPredecessors = (ExprList *)WalkAST(fce->launchPredecessors,
+                                                          preFunc, postFunc, data);
         }
         else if ((ie = dynamic_cast<IndexExpr *>(node)) != NULL) {
             ie->baseExpr = (Expr *)WalkAST(ie->baseExpr, preFunc, postFunc, data);
@@ -482,3 +534,798 @@ SafeToRunWithMaskAllOff(ASTNode *root) {
     WalkAST(root, lCheckAllOffSafety, NULL, &safe);
     return safe;
 }
+
+
+///////////////////////////////////////////////////////////////////////////
+// SOA layout for local struct arrays
+
+struct SOAArrayInfo {
+    /** Local arrays of uniform structs that haven't been found to be used
+        in a way that depends on their memory layout. */
+    std::set<Symbol *> candidates;
+
+    /** References to candidate arrays that are being indexed. */
+    std::set<SymbolExpr *> indexedUses;
+};
+
+
+static bool
+lRemoveSOACandidatesPre(ASTNode *node, void *d) {
+    SymbolExpr *se;
+    if ((se = dynamic_cast<SymbolExpr *>(node)) != NULL)
+        ((SOAArrayInfo *)d)->candidates.erase(se->GetBaseSymbol());
+    return true;
+}
+
+
+static void
+lRemoveSOACandidatesIn(ASTNode *node, SOAArrayInfo *info) {
+    if (node != NULL)
+        WalkAST(node, lRemoveSOACandidatesPre, NULL, info);
+}
+
+
+/** Preorder callback that collects the candidate arrays and removes the
+    ones that are used other than by indexing into them, or whose
+    elements or members have their address taken or are bound to
+    references. */
+static bool
+lCheckSOAUsesPre(ASTNode *node, void *d) {
+    SOAArrayInfo *info = (SOAArrayInfo *)d;
+
+    DeclStmt *ds;
+    if ((ds = dynamic_cast<DeclStmt *>(node)) != NULL) {
+        for (int i = 0; i < (int)ds->vars.size(); ++i) {
+            Symbol *sym = ds->vars[i].sym;
+            Expr *init = ds->vars[i].init;
+            if (sym != NULL && init != NULL &&
+                CastType<ReferenceType>(sym->type) != NULL)
+                info->candidates.erase(init->GetBaseSymbol());
+
+            if (sym == NULL || init != NULL ||
+                (sym->storageClass != SC_NONE && sym->storageClass != SC_STATIC))
+                continue;
+
+            const ArrayType *at = CastType<ArrayType>(sym->type);
+            if (at == NULL || at->GetElementCount() == 0)
+                continue;
+            const StructType *st = CastType<StructType>(at->GetElementType());
+            if (st != NULL && st->IsUniformType() && st->IsConstType() == false &&
+                st->CanBeSOA())
+                info->candidates.insert(sym);
+        }
+        return true;
+    }
+
+    IndexExpr *ie;
+    if ((ie = dynamic_cast<IndexExpr *>(node)) != NULL) {
+        SymbolExpr *se = dynamic_cast<SymbolExpr *>(ie->baseExpr);
+        if (se != NULL)
+            info->indexedUses.insert(se);
+        return true;
+    }
+
+    SymbolExpr *se;
+    if ((se = dynamic_cast<SymbolExpr *>(node)) != NULL) {
+        // Passing the array itself anywhere, taking its size, doing
+        // pointer arithmetic with it, etc.
+        if (info->indexedUses.find(se) == info->indexedUses.end())
+            info->candidates.erase(se->GetBaseSymbol());
+        return true;
+    }
+
+    AddressOfExpr *aoe;
+    if ((aoe = dynamic_cast<AddressOfExpr *>(node)) != NULL) {
+        if (aoe->expr != NULL)
+            info->candidates.erase(aoe->expr->GetBaseSymbol());
+        return true;
+    }
+
+    ReferenceExpr *re;
+    if ((re = dynamic_cast<ReferenceExpr *>(node)) != NULL) {
+        if (re->expr != NULL)
+            info->candidates.erase(re->expr->GetBaseSymbol());
+        return true;
+    }
+
+    // MemberExpr::create() type checks the expression it's applied to
+    // while parsing, which leaves the lvalue types of the nested member
+    // and index expressions under "a[i].b.c" computed for the original
+    // layout.
+    MemberExpr *me;
+    if ((me = dynamic_cast<MemberExpr *>(node)) != NULL) {
+        if (dynamic_cast<MemberExpr *>(me->expr) != NULL)
+            info->candidates.erase(me->expr->GetBaseSymbol());
+        return true;
+    }
+
+    if (dynamic_cast<SizeOfExpr *>(node) != NULL) {
+        lRemoveSOACandidatesIn(node, info);
+        return false;
+    }
+
+    // Likewise for the expression that foreach_unique iterates over.
+    ForeachUniqueStmt *fus;
+    if ((fus = dynamic_cast<ForeachUniqueStmt *>(node)) != NULL) {
+        lRemoveSOACandidatesIn(fus->expr, info);
+        return true;
+    }
+
+    // Elements and members passed directly as arguments may be bound to
+    // reference parameters, and array members decay to pointers.
+    FunctionCallExpr *fce;
+    if ((fce = dynamic_cast<FunctionCallExpr *>(node)) != NULL &&
+        fce->args != NULL) {
+        FunctionSymbolExpr *fse = dynamic_cast<FunctionSymbolExpr *>(fce->func);
+        for (int i = 0; i < (int)fce->args->exprs.size(); ++i) {
+            Expr *arg = fce->args->exprs[i];
+            if (arg == NULL)
+                continue;
+            if (fse == NULL) {
+                info->candidates.erase(arg->GetBaseSymbol());
+                continue;
+            }
+            const std::vector<Symbol *> &funcs = fse->GetCandidates();
+            for (int j = 0; j < (int)funcs.size(); ++j) {
+                const FunctionType *ft = CastType<FunctionType>(funcs[j]->type);
+                if (ft == NULL || i >= ft->GetNumParameters())
+                    continue;
+                const Type *paramType = ft->GetParameterType(i);
+                if (CastType<ReferenceType>(paramType) != NULL ||
+                    CastType<PointerType>(paramType) != NULL ||
+                    CastType<ArrayType>(paramType) != NULL)
+                    info->candidates.erase(arg->GetBaseSymbol());
+            }
+        }
+    }
+
+    return true;
+}
+
+
+void
+ConvertSOAStructArrays(Stmt *code) {
+    if (code == NULL)
+        return;
+
+    SOAArrayInfo info;
+    WalkAST(code, lCheckSOAUsesPre, NULL, &info);
+
+    int width = g->target->getVectorWidth();
+    std::set<Symbol *>::iterator iter;
+    for (iter = info.candidates.begin(); iter != info.candidates.end(); ++iter) {
+        Symbol *sym = *iter;
+        const ArrayType *at = CastType<ArrayType>(sym->type);
+        const StructType *st = CastType<StructType>(at->GetElementType());
+        int count = (at->GetElementCount() + width - 1) / width;
+        Debug(sym->pos, "Giving array \"%s\" SOA layout.", sym->name.c_str());
+        sym->type = new ArrayType(st->GetAsSOAType(width), count);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// Uniformization
+
+/** State for the analysis done by UniformizeVariables(). */
+struct UniformizeInfo {
+    UniformizeInfo() {
+        varyingControlFlowDepth = 0;
+        changed = false;
+        returnType = NULL;
+    }
+
+    /** Local varying variables that haven't been shown to possibly have
+        different values in different program instances, each mapped to
+        the varying control flow depth of its declaration. */
+    std::map<Symbol *, int> candidates;
+
+    /** Number of varying control flow constructs around the statement
+        currently being visited. */
+    int varyingControlFlowDepth;
+
+    /** Set whenever a variable is removed from the candidates. */
+    bool changed;
+
+    /** Return type of the function being analyzed. */
+    const Type *returnType;
+};
+
+
+static void
+lRemoveCandidate(Symbol *sym, UniformizeInfo *info) {
+    if (sym != NULL && info->candidates.erase(sym) > 0)
+        info->changed = true;
+}
+
+
+/** If the given expression refers directly to a variable that's a
+    candidate for uniformization, return its symbol. */
+static Symbol *
+lGetCandidateSymbol(Expr *expr, UniformizeInfo *info) {
+    SymbolExpr *se = dynamic_cast<SymbolExpr *>(expr);
+    if (se == NULL)
+        return NULL;
+    Symbol *sym = se->GetBaseSymbol();
+    return (info->candidates.find(sym) != info->candidates.end()) ? sym : NULL;
+}
+
+
+/** If the given expression assigns to (or increments or decrements) a
+    variable, return the variable's symbol. */
+static Symbol *
+lGetAssignedCandidate(Expr *expr, UniformizeInfo *info) {
+    AssignExpr *ae;
+    if ((ae = dynamic_cast<AssignExpr *>(expr)) != NULL)
+        return lGetCandidateSymbol(ae->lvalue, info);
+
+    UnaryExpr *ue;
+    if ((ue = dynamic_cast<UnaryExpr *>(expr)) != NULL &&
+        (ue->op == UnaryExpr::PreInc || ue->op == UnaryExpr::PreDec ||
+         ue->op == UnaryExpr::PostInc || ue->op == UnaryExpr::PostDec))
+        return lGetCandidateSymbol(ue->expr, info);
+
+    return NULL;
+}
+
+
+/** Returns true if the given (not yet type checked) expression is certain
+    to have the same value in all of the program instances, assuming that
+    all of the remaining candidate variables do. */
+static bool
+lIsLaneInvariant(Expr *expr, UniformizeInfo *info) {
+    if (expr == NULL)
+        return false;
+
+    ConstExpr *ce;
+    if ((ce = dynamic_cast<ConstExpr *>(expr)) != NULL)
+        return ce->GetType()->IsUniformType();
+
+    if (dynamic_cast<NullPointerExpr *>(expr) != NULL ||
+        dynamic_cast<SizeOfExpr *>(expr) != NULL)
+        return true;
+
+    SymbolExpr *se;
+    if ((se = dynamic_cast<SymbolExpr *>(expr)) != NULL) {
+        Symbol *sym = se->GetBaseSymbol();
+        return (sym != NULL && sym->type != NULL &&
+                (sym->type->IsUniformType() ||
+                 info->candidates.find(sym) != info->candidates.end()));
+    }
+
+    UnaryExpr *ue;
+    if ((ue = dynamic_cast<UnaryExpr *>(expr)) != NULL)
+        return lIsLaneInvariant(ue->expr, info);
+
+    BinaryExpr *be;
+    if ((be = dynamic_cast<BinaryExpr *>(expr)) != NULL)
+        return (lIsLaneInvariant(be->arg0, info) &&
+                lIsLaneInvariant(be->arg1, info));
+
+    SelectExpr *sel;
+    if ((sel = dynamic_cast<SelectExpr *>(expr)) != NULL)
+        return (lIsLaneInvariant(sel->test, info) &&
+                lIsLaneInvariant(sel->expr1, info) &&
+                lIsLaneInvariant(sel->expr2, info));
+
+    TypeCastExpr *tce;
+    if ((tce = dynamic_cast<TypeCastExpr *>(expr)) != NULL)
+        return lIsLaneInvariant(tce->expr, info);
+
+    // A call is lane invariant if every function it may resolve to
+    // returns a uniform value (e.g. the reduce_*() functions), regardless
+    // of its arguments.
+    FunctionCallExpr *fce;
+    if ((fce = dynamic_cast<FunctionCallExpr *>(expr)) != NULL &&
+        fce->isLaunch == false) {
+        FunctionSymbolExpr *fse = dynamic_cast<FunctionSymbolExpr *>(fce->func);
+        if (fse == NULL || fse->GetCandidates().size() == 0)
+            return false;
+
+        const std::vector<Symbol *> &funcs = fse->GetCandidates();
+        for (int i = 0; i < (int)funcs.size(); ++i) {
+            const FunctionType *ft = CastType<FunctionType>(funcs[i]->type);
+            if (ft == NULL || ft->GetReturnType() == NULL ||
+                ft->GetReturnType()->IsVoidType() ||
+                ft->GetReturnType()->IsUniformType() == false)
+                return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+static bool
+lRemoveCandidatesPre(ASTNode *node, void *d) {
+    SymbolExpr *se;
+    if ((se = dynamic_cast<SymbolExpr *>(node)) != NULL)
+        lRemoveCandidate(se->GetBaseSymbol(), (UniformizeInfo *)d);
+    return true;
+}
+
+
+/** Removes all of the candidate variables that the given expression
+    refers to. */
+static void
+lRemoveCandidatesIn(ASTNode *node, UniformizeInfo *info) {
+    if (node != NULL)
+        WalkAST(node, lRemoveCandidatesPre, NULL, info);
+}
+
+
+/** Returns true if the given (not yet type checked) lvalue expression is
+    certain to refer to varying storage, assuming that all of the
+    remaining candidate variables are uniform.  Storing a uniform value
+    there is then just as legal as storing a varying one. */
+static bool
+lIsVaryingLValue(Expr *expr, UniformizeInfo *info) {
+    SymbolExpr *se;
+    if ((se = dynamic_cast<SymbolExpr *>(expr)) != NULL) {
+        Symbol *sym = se->GetBaseSymbol();
+        return (sym != NULL && sym->type != NULL &&
+                info->candidates.find(sym) == info->candidates.end() &&
+                sym->type->IsVaryingType());
+    }
+
+    // Indexing with a varying index, or into varying elements.
+    IndexExpr *ie;
+    if ((ie = dynamic_cast<IndexExpr *>(expr)) != NULL)
+        return (lIsLaneInvariant(ie->index, info) == false ||
+                lIsVaryingLValue(ie->baseExpr, info));
+
+    // Dereferencing a varying pointer, or a member of a varying struct.
+    MemberExpr *me;
+    if ((me = dynamic_cast<MemberExpr *>(expr)) != NULL)
+        return (me->dereferenceExpr ?
+                lIsLaneInvariant(me->expr, info) == false :
+                lIsVaryingLValue(me->expr, info));
+
+    PtrDerefExpr *pde;
+    if ((pde = dynamic_cast<PtrDerefExpr *>(expr)) != NULL)
+        return lIsLaneInvariant(pde->expr, info) == false;
+
+    return false;
+}
+
+
+/** Returns true if a call to any of the given overloads may resolve to a
+    different function if one of its arguments becomes uniform, where the
+    uniform variant does something other than the varying one would do
+    in each program instance. */
+static bool
+lOverloadsDependOnVariability(const std::vector<Symbol *> &funcs) {
+    if (funcs.size() <= 1)
+        return false;
+
+    // The uniform and varying variants of the standard library functions
+    // compute the same per-instance values, with the exception of the
+    // atomics, which do a single operation for a uniform value.
+    for (int i = 0; i < (int)funcs.size(); ++i)
+        if (strcmp(funcs[i]->pos.name, "stdlib.ispc") != 0 ||
+            strncmp(funcs[i]->name.c_str(), "atomic_", 7) == 0)
+            return true;
+    return false;
+}
+
+
+struct UniformizeUseInfo {
+    UniformizeInfo *info;
+    Expr *allowedAssignment;
+};
+
+
+/** Returns true if the i'th argument of a call to one of the given
+    functions has to be uniform: some of them take a uniform value there
+    and none of them take a varying one. */
+static bool
+lArgumentMustBeUniform(const std::vector<Symbol *> &funcs, int i) {
+    bool anyUniform = false;
+    for (int j = 0; j < (int)funcs.size(); ++j) {
+        const FunctionType *ft = CastType<FunctionType>(funcs[j]->type);
+        if (ft == NULL || i >= ft->GetNumParameters())
+            continue;
+        const Type *paramType = ft->GetParameterType(i);
+        if (paramType->IsUniformType())
+            anyUniform = true;
+        else
+            return false;
+    }
+    return anyUniform;
+}
+
+
+/** Preorder callback that removes candidate variables that are used in
+    ways that uniformizing them could change the meaning of, or make an
+    invalid program valid: assignments other than the one at the top of
+    an expression statement, indexing an lvalue or taking an address with
+    them, binding a reference to them, using them where a uniform value
+    is required, passing them to overloaded functions, and so forth. */
+static bool
+lCheckUsesPre(ASTNode *node, void *d) {
+    UniformizeUseInfo *useInfo = (UniformizeUseInfo *)d;
+    UniformizeInfo *info = useInfo->info;
+
+    Expr *expr = dynamic_cast<Expr *>(node);
+    if (expr != NULL && expr != useInfo->allowedAssignment)
+        lRemoveCandidate(lGetAssignedCandidate(expr, info), info);
+
+    // With a uniform index or pointer offset, an lvalue may become
+    // uniform, and so may no longer be assignable from a varying value.
+    // Conversely, a uniform value can only be stored where a varying one
+    // could have been if the lvalue is varying regardless.
+    AssignExpr *ae;
+    if ((ae = dynamic_cast<AssignExpr *>(node)) != NULL &&
+        lGetCandidateSymbol(ae->lvalue, info) == NULL) {
+        lRemoveCandidatesIn(ae->lvalue, info);
+        if (lIsVaryingLValue(ae->lvalue, info) == false)
+            lRemoveCandidatesIn(ae->rvalue, info);
+    }
+
+    UnaryExpr *ue;
+    if ((ue = dynamic_cast<UnaryExpr *>(node)) != NULL &&
+        (ue->op == UnaryExpr::PreInc || ue->op == UnaryExpr::PreDec ||
+         ue->op == UnaryExpr::PostInc || ue->op == UnaryExpr::PostDec) &&
+        lGetCandidateSymbol(ue->expr, info) == NULL)
+        lRemoveCandidatesIn(ue->expr, info);
+
+    AddressOfExpr *aoe;
+    if ((aoe = dynamic_cast<AddressOfExpr *>(node)) != NULL)
+        lRemoveCandidatesIn(aoe->expr, info);
+
+    ReferenceExpr *re;
+    if ((re = dynamic_cast<ReferenceExpr *>(node)) != NULL)
+        lRemoveCandidatesIn(re->expr, info);
+
+    // MemberExpr::create() type checks the expression it's applied to
+    // while parsing, so the types computed for it then have to stay
+    // valid.
+    MemberExpr *me;
+    if ((me = dynamic_cast<MemberExpr *>(node)) != NULL)
+        lRemoveCandidatesIn(me->expr, info);
+
+    TypeCastExpr *tce;
+    if ((tce = dynamic_cast<TypeCastExpr *>(node)) != NULL &&
+        tce->type != NULL && tce->type->IsUniformType())
+        lRemoveCandidatesIn(tce->expr, info);
+
+    if (dynamic_cast<SizeOfExpr *>(node) != NULL ||
+        dynamic_cast<NewExpr *>(node) != NULL) {
+        lRemoveCandidatesIn(node, info);
+        return false;
+    }
+
+    FunctionCallExpr *fce;
+    if ((fce = dynamic_cast<FunctionCallExpr *>(node)) != NULL &&
+        fce->isLaunch) {
+        for (int i = 0; i < 3; ++i)
+            lRemoveCandidatesIn(fce->launchCountExpr[i], info);
+    }
+    if (fce != NULL && fce->args != NULL) {
+        FunctionSymbolExpr *fse = dynamic_cast<FunctionSymbolExpr *>(fce->func);
+        if (fse != NULL && lOverloadsDependOnVariability(fse->GetCandidates()))
+            lRemoveCandidatesIn(fce->args, info);
+        else {
+            if (fse != NULL) {
+                for (int i = 0; i < (int)fce->args->exprs.size(); ++i)
+                    if (lArgumentMustBeUniform(fse->GetCandidates(), i))
+                        lRemoveCandidatesIn(fce->args->exprs[i], info);
+            }
+
+            // Variables passed directly as arguments may be bound to
+            // reference parameters.
+            for (int i = 0; i < (int)fce->args->exprs.size(); ++i) {
+                Symbol *sym = lGetCandidateSymbol(fce->args->exprs[i], info);
+                if (sym == NULL)
+                    continue;
+                if (fse == NULL)
+                    lRemoveCandidate(sym, info);
+                else {
+                    const std::vector<Symbol *> &funcs = fse->GetCandidates();
+                    for (int j = 0; j < (int)funcs.size(); ++j) {
+                        const FunctionType *ft = CastType<FunctionType>(funcs[j]->type);
+                        if (ft == NULL ||
+                            (i < ft->GetNumParameters() &&
+                             CastType<ReferenceType>(ft->GetParameterType(i)) != NULL))
+                            lRemoveCandidate(sym, info);
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+
+/** Removes the candidates used in the given expression in ways that
+    prevent uniformizing them; \c allowedAssignment, if non-NULL, is an
+    assignment that has already been checked by the caller. */
+static void
+lCheckUses(Expr *expr, UniformizeInfo *info, Expr *allowedAssignment = NULL) {
+    if (expr == NULL)
+        return;
+    UniformizeUseInfo useInfo;
+    useInfo.info = info;
+    useInfo.allowedAssignment = allowedAssignment;
+    WalkAST(expr, lCheckUsesPre, NULL, &useInfo);
+}
+
+
+struct UniformizeBCInfo {
+    UniformizeInfo *info;
+    int varyingControlFlowDepth;
+    bool foundVaryingBreakOrContinue;
+};
+
+
+static bool
+lIsUniformizeVaryingIf(ASTNode *node, UniformizeInfo *info) {
+    IfStmt *ifStmt;
+    SwitchStmt *switchStmt;
+    if ((ifStmt = dynamic_cast<IfStmt *>(node)) != NULL)
+        return lIsLaneInvariant(ifStmt->test, info) == false;
+    else if ((switchStmt = dynamic_cast<SwitchStmt *>(node)) != NULL)
+        return lIsLaneInvariant(switchStmt->expr, info) == false;
+    else
+        return false;
+}
+
+
+static bool
+lUniformizeBCPre(ASTNode *node, void *d) {
+    UniformizeBCInfo *bcInfo = (UniformizeBCInfo *)d;
+
+    if ((dynamic_cast<BreakStmt *>(node) != NULL ||
+         dynamic_cast<ContinueStmt *>(node) != NULL) &&
+        bcInfo->varyingControlFlowDepth > 0) {
+        bcInfo->foundVaryingBreakOrContinue = true;
+        return false;
+    }
+
+    if (lIsUniformizeVaryingIf(node, bcInfo->info))
+        ++bcInfo->varyingControlFlowDepth;
+
+    return (dynamic_cast<ForStmt *>(node) == NULL &&
+            dynamic_cast<DoStmt *>(node) == NULL &&
+            dynamic_cast<ForeachStmt *>(node) == NULL);
+}
+
+
+static ASTNode *
+lUniformizeBCPost(ASTNode *node, void *d) {
+    UniformizeBCInfo *bcInfo = (UniformizeBCInfo *)d;
+    if (lIsUniformizeVaryingIf(node, bcInfo->info))
+        --bcInfo->varyingControlFlowDepth;
+    return node;
+}
+
+
+/** Like lHasVaryingBreakOrContinue() in stmt.cpp, but treating the
+    remaining candidate variables as uniform. */
+static bool
+lHasVaryingBreakOrContinue(Stmt *stmt, UniformizeInfo *info) {
+    if (stmt == NULL)
+        return false;
+    UniformizeBCInfo bcInfo;
+    bcInfo.info = info;
+    bcInfo.varyingControlFlowDepth = 0;
+    bcInfo.foundVaryingBreakOrContinue = false;
+    WalkAST(stmt, lUniformizeBCPre, lUniformizeBCPost, &bcInfo);
+    return bcInfo.foundVaryingBreakOrContinue;
+}
+
+
+static void lUniformizeStmt(Stmt *stmt, UniformizeInfo *info);
+
+/** Visits the given statement nested inside of a control flow construct;
+    if \c isVarying is true, then it's executed under varying control
+    flow. */
+static void
+lUniformizeNestedStmt(Stmt *stmt, bool isVarying, UniformizeInfo *info) {
+    if (isVarying)
+        ++info->varyingControlFlowDepth;
+    lUniformizeStmt(stmt, info);
+    if (isVarying)
+        --info->varyingControlFlowDepth;
+}
+
+
+/** Checks an assignment of the given value to the given candidate
+    variable: both the value has to be lane invariant and the assignment
+    has to be done under the same control flow as the variable's
+    declaration, so that all of the program instances that may later
+    read the variable perform it. */
+static void
+lCheckAssignment(Symbol *sym, Expr *value, UniformizeInfo *info) {
+    std::map<Symbol *, int>::iterator iter = info->candidates.find(sym);
+    if (iter == info->candidates.end())
+        return;
+    if (iter->second != info->varyingControlFlowDepth ||
+        (value != NULL && lIsLaneInvariant(value, info) == false))
+        lRemoveCandidate(sym, info);
+}
+
+
+static void
+lUniformizeStmt(Stmt *stmt, UniformizeInfo *info) {
+    if (stmt == NULL)
+        return;
+
+    StmtList *sl;
+    ExprStmt *es;
+    DeclStmt *ds;
+    IfStmt *is;
+    DoStmt *dos;
+    ForStmt *fs;
+    ForeachStmt *fes;
+    ForeachActiveStmt *fas;
+    ForeachUniqueStmt *fus;
+    UnmaskedStmt *ums;
+    SwitchStmt *ss;
+    CaseStmt *cs;
+    DefaultStmt *defs;
+    ReturnStmt *rs;
+    AssertStmt *as;
+    DeleteStmt *dels;
+
+    if ((sl = dynamic_cast<StmtList *>(stmt)) != NULL) {
+        for (int i = 0; i < (int)sl->stmts.size(); ++i)
+            lUniformizeStmt(sl->stmts[i], info);
+    }
+    else if ((es = dynamic_cast<ExprStmt *>(stmt)) != NULL) {
+        Symbol *sym = lGetAssignedCandidate(es->expr, info);
+        if (sym != NULL) {
+            AssignExpr *ae = dynamic_cast<AssignExpr *>(es->expr);
+            lCheckAssignment(sym, ae ? ae->rvalue : NULL, info);
+        }
+        lCheckUses(es->expr, info, sym ? es->expr : NULL);
+    }
+    else if ((ds = dynamic_cast<DeclStmt *>(stmt)) != NULL) {
+        for (int i = 0; i < (int)ds->vars.size(); ++i) {
+            Symbol *sym = ds->vars[i].sym;
+            Expr *init = ds->vars[i].init;
+            std::map<Symbol *, int>::iterator iter = info->candidates.find(sym);
+            if (iter != info->candidates.end()) {
+                iter->second = info->varyingControlFlowDepth;
+                lCheckAssignment(sym, init, info);
+            }
+            if (sym != NULL && CastType<ReferenceType>(sym->type) != NULL)
+                lRemoveCandidate(lGetCandidateSymbol(init, info), info);
+            // Uniform variables can't be initialized with varying values.
+            if (sym != NULL && sym->type != NULL && sym->type->IsUniformType())
+                lRemoveCandidatesIn(init, info);
+            lCheckUses(init, info);
+        }
+    }
+    else if ((is = dynamic_cast<IfStmt *>(stmt)) != NULL) {
+        // Coherent control flow statements warn about uniform tests, so
+        // leave the variables they test alone.
+        if (is->doAllCheck)
+            lRemoveCandidatesIn(is->test, info);
+        lCheckUses(is->test, info);
+        bool isVarying = !lIsLaneInvariant(is->test, info);
+        lUniformizeNestedStmt(is->trueStmts, isVarying, info);
+        lUniformizeNestedStmt(is->falseStmts, isVarying, info);
+    }
+    else if ((dos = dynamic_cast<DoStmt *>(stmt)) != NULL) {
+        if (dos->doCoherentCheck)
+            lRemoveCandidatesIn(dos->testExpr, info);
+        lCheckUses(dos->testExpr, info);
+        bool isVarying = (!lIsLaneInvariant(dos->testExpr, info) ||
+                          lHasVaryingBreakOrContinue(dos->bodyStmts, info));
+        lUniformizeNestedStmt(dos->bodyStmts, isVarying, info);
+    }
+    else if ((fs = dynamic_cast<ForStmt *>(stmt)) != NULL) {
+        lUniformizeStmt(fs->init, info);
+        if (fs->doCoherentCheck)
+            lRemoveCandidatesIn(fs->test, info);
+        lCheckUses(fs->test, info);
+        bool isVarying = ((fs->test != NULL && !lIsLaneInvariant(fs->test, info)) ||
+                          lHasVaryingBreakOrContinue(fs->stmts, info));
+        lUniformizeNestedStmt(fs->stmts, isVarying, info);
+        lUniformizeNestedStmt(fs->step, isVarying, info);
+    }
+    else if ((fes = dynamic_cast<ForeachStmt *>(stmt)) != NULL) {
+        // foreach requires uniform bounds.
+        for (int i = 0; i < (int)fes->startExprs.size(); ++i)
+            lRemoveCandidatesIn(fes->startExprs[i], info);
+        for (int i = 0; i < (int)fes->endExprs.size(); ++i)
+            lRemoveCandidatesIn(fes->endExprs[i], info);
+        lUniformizeNestedStmt(fes->stmts, true, info);
+    }
+    else if ((fas = dynamic_cast<ForeachActiveStmt *>(stmt)) != NULL)
+        lUniformizeNestedStmt(fas->stmts, true, info);
+    else if ((fus = dynamic_cast<ForeachUniqueStmt *>(stmt)) != NULL) {
+        // foreach_unique requires a varying value to iterate over.
+        lRemoveCandidatesIn(fus->expr, info);
+        lUniformizeNestedStmt(fus->stmts, true, info);
+    }
+    else if ((ums = dynamic_cast<UnmaskedStmt *>(stmt)) != NULL)
+        lUniformizeStmt(ums->stmts, info);
+    else if ((ss = dynamic_cast<SwitchStmt *>(stmt)) != NULL) {
+        lCheckUses(ss->expr, info);
+        bool isVarying = (!lIsLaneInvariant(ss->expr, info) ||
+                          lHasVaryingBreakOrContinue(ss->stmts, info));
+        lUniformizeNestedStmt(ss->stmts, isVarying, info);
+    }
+    else if ((cs = dynamic_cast<CaseStmt *>(stmt)) != NULL)
+        lUniformizeStmt(cs->stmts, info);
+    else if ((defs = dynamic_cast<DefaultStmt *>(stmt)) != NULL)
+        lUniformizeStmt(defs->stmts, info);
+    else if ((rs = dynamic_cast<ReturnStmt *>(stmt)) != NULL) {
+        if (info->returnType != NULL && info->returnType->IsUniformType())
+            lRemoveCandidatesIn(rs->expr, info);
+        lCheckUses(rs->expr, info);
+    }
+    else if ((as = dynamic_cast<AssertStmt *>(stmt)) != NULL)
+        lCheckUses(as->expr, info);
+    else if ((dels = dynamic_cast<DeleteStmt *>(stmt)) != NULL)
+        lCheckUses(dels->expr, info);
+    else if (dynamic_cast<BreakStmt *>(stmt) == NULL &&
+             dynamic_cast<ContinueStmt *>(stmt) == NULL)
+        // print statements print one value per program instance for
+        // varying values; anything else we don't know about is handled
+        // conservatively as well.
+        lRemoveCandidatesIn(stmt, info);
+}
+
+
+/** Preorder callback that collects the local variables that are
+    candidates for uniformization, and notes if there are any gotos or
+    labels, which the analysis doesn't handle. */
+static bool
+lCollectCandidatesPre(ASTNode *node, void *d) {
+    UniformizeInfo *info = (UniformizeInfo *)d;
+
+    if (dynamic_cast<GotoStmt *>(node) != NULL ||
+        dynamic_cast<LabeledStmt *>(node) != NULL) {
+        info->changed = true;
+        return false;
+    }
+
+    DeclStmt *ds;
+    if ((ds = dynamic_cast<DeclStmt *>(node)) != NULL) {
+        for (int i = 0; i < (int)ds->vars.size(); ++i) {
+            Symbol *sym = ds->vars[i].sym;
+            if (sym == NULL || sym->type == NULL ||
+                sym->storageClass != SC_NONE ||
+                sym->type->IsVaryingType() == false)
+                continue;
+            if (CastType<AtomicType>(sym->type) != NULL ||
+                CastType<EnumType>(sym->type) != NULL)
+                info->candidates[sym] = 0;
+        }
+    }
+    return true;
+}
+
+
+void
+UniformizeVariables(Stmt *code, const Type *returnType) {
+    if (code == NULL)
+        return;
+
+    UniformizeInfo info;
+    info.returnType = returnType;
+    WalkAST(code, lCollectCandidatesPre, NULL, &info);
+    if (info.changed)
+        // gotos and labels
+        return;
+
+    // Start by assuming that all of the candidates are lane invariant and
+    // iterate until none of the remaining ones turn out not to be.
+    do {
+        info.changed = false;
+        info.varyingControlFlowDepth = 0;
+        lUniformizeStmt(code, &info);
+    } while (info.changed);
+
+    std::map<Symbol *, int>::iterator iter;
+    for (iter = info.candidates.begin(); iter != info.candidates.end(); ++iter) {
+        Symbol *sym = iter->first;
+        Debug(sym->pos, "Uniformizing variable \"%s\".", sym->name.c_str());
+        sym->type = sym->type->GetAsUniformType();
+    }
+}
@@ -74,6 +74,11 @@ public:
     /** All AST nodes must track the file position where they are
         defined. */
     SourcePos pos;
+
+    /** AST nodes are allocated from the current Arena and freed along
+        with it, never individually. */
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr) { }
 };
 
 
@@ -82,16 +87,30 @@ public:
  */
 class AST {
 public:
+    AST() : deferUnusedFunctions(false) { }
+
     /** Add the AST for a function described by the given declaration
         information and source code. */
     void AddFunction(Symbol *sym, Stmt *code);
 
+    /** While this is set, IR is only generated for the functions with
+        internal linkage that are added by AddFunction() if other
+        functions use them; the others are removed from the module.  This
+        is used for the standard library, most of which any given program
+        doesn't use. */
+    void SetDeferUnusedFunctions(bool defer) { deferUnusedFunctions = defer; }
+
     /** Generate LLVM IR for all of the functions into the current
         module. */
     void GenerateIR();
 
 private:
     std::vector<Function *> functions;
+
+    /** Functions whose IR is only generated if they're used, along with
+        their symbols. */
+    std::vector<std::pair<Function *, Symbol *> > deferredFunctions;
+    bool deferUnusedFunctions;
 };
 
 
@@ -147,4 +166,18 @@ extern int EstimateCost(ASTNode *root);
     off" mask. */
 extern bool SafeToRunWithMaskAllOff(ASTNode *root);
 
+/** Gives the local fixed-size arrays of uniform structs in the given (not
+    yet type checked) function body soa<N> layout, with N the target's
+    vector width, as long as the only thing done with each array is
+    indexing into it. */
+extern void ConvertSOAStructArrays(Stmt *code);
+
+/** Finds the local variables in the given (not yet type checked) function
+    body that have varying type but are certain to have the same value in
+    all of the program instances, and changes their types to be uniform.
+    This way, they're held in scalar registers and control flow that
+    depends on them is uniform control flow.  \c returnType is the
+    function's return type. */
+extern void UniformizeVariables(Stmt *code, const Type *returnType);
+
 #endif // ISPC_AST_H
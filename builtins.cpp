@@ -44,9 +44,11 @@
 #include "llvmutil.h"
 #include "module.h"
 #include "ctx.h"
+#include "opt.h"
 
 #include <math.h>
 #include <stdlib.h>
+#include <vector>
 #if defined(LLVM_3_2)
   #include <llvm/Attributes.h>
 #endif
@@ -71,6 +73,8 @@
 #include <llvm/ADT/Triple.h>
 #include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
 
 extern int yyparse();
 struct yy_buffer_state;
@@ -631,6 +635,68 @@ lSetInternalFunctions(llvm::Module *module) {
 }
 
 
+/** Checks that the given bitcode was compiled for a target that's
+    compatible with the given module's.
+ */
+static void
+lCheckBitcodeTarget(llvm::Module *module, llvm::Module *bcModule) {
+    // FIXME: this feels like a bad idea, but the issue is that when we
+    // set the llvm::Module's target triple in the ispc Module::Module
+    // constructor, we start by calling llvm::sys::getHostTriple() (and
+    // then change the arch if needed).  Somehow that ends up giving us
+    // strings like 'x86_64-apple-darwin11.0.0', while the stuff we
+    // compile to bitcode with clang has module triples like
+    // 'i386-apple-macosx10.7.0'.  And then LLVM issues a warning about
+    // linking together modules with incompatible target triples..
+    llvm::Triple mTriple(m->module->getTargetTriple());
+    llvm::Triple bcTriple(bcModule->getTargetTriple());
+    Debug(SourcePos(), "module triple: %s\nbitcode triple: %s\n",
+          mTriple.str().c_str(), bcTriple.str().c_str());
+#if defined(ISPC_ARM_ENABLED) && !defined(__arm__)
+    // FIXME: More ugly and dangerous stuff.  We really haven't set up
+    // proper build and runtime infrastructure for ispc to do
+    // cross-compilation, yet it's at minimum useful to be able to emit
+    // ARM code from x86 for ispc development.  One side-effect is that
+    // when the build process turns builtins/builtins.c to LLVM bitcode
+    // for us to link in at runtime, that bitcode has been compiled for
+    // an IA target, which in turn causes the checks in the following
+    // code to (appropraitely) fail.
+    //
+    // In order to be able to have some ability to generate ARM code on
+    // IA, we'll just skip those tests in that case and allow the
+    // setTargetTriple() and setDataLayout() calls below to shove in
+    // the values for an ARM target.  This maybe won't cause problems
+    // in the generated code, since bulitins.c doesn't do anything too
+    // complex w.r.t. struct layouts, etc.
+    if (g->target->getISA() != Target::NEON32 &&
+        g->target->getISA() != Target::NEON16 &&
+        g->target->getISA() != Target::NEON8)
+#endif // !__arm__
+    {
+        Assert(bcTriple.getArch() == llvm::Triple::UnknownArch ||
+               mTriple.getArch() == bcTriple.getArch());
+        Assert(bcTriple.getVendor() == llvm::Triple::UnknownVendor ||
+               mTriple.getVendor() == bcTriple.getVendor());
+
+        // We unconditionally set module DataLayout to library, but we must
+        // ensure that library and module DataLayouts are compatible.
+        // If they are not, we should recompile the library for problematic
+        // architecture and investigate what happened.
+        // Generally we allow library DataLayout to be subset of module
+        // DataLayout or library DataLayout to be empty.
+        if (!VerifyDataLayoutCompatibility(module->getDataLayout(),
+                                           bcModule->getDataLayout())) {
+          Warning(SourcePos(), "Module DataLayout is incompatible with "
+                  "library DataLayout:\n"
+                  "Module  DL: %s\n"
+                  "Library DL: %s\n",
+                  module->getDataLayout().c_str(),
+                  bcModule->getDataLayout().c_str());
+        }
+    }
+}
+
+
 /** This utility function takes serialized binary LLVM bitcode and adds its
     definitions to the given module.  Functions in the bitcode that can be
     mapped to ispc functions are also added to the symbol table.
@@ -658,62 +724,9 @@ AddBitcodeToModule(const unsigned char *bitcode, int length,
         Error(SourcePos(), "Error parsing stdlib bitcode: %s", bcErr.c_str());
     else {
 #endif
-        // FIXME: this feels like a bad idea, but the issue is that when we
-        // set the llvm::Module's target triple in the ispc Module::Module
-        // constructor, we start by calling llvm::sys::getHostTriple() (and
-        // then change the arch if needed).  Somehow that ends up giving us
-        // strings like 'x86_64-apple-darwin11.0.0', while the stuff we
-        // compile to bitcode with clang has module triples like
-        // 'i386-apple-macosx10.7.0'.  And then LLVM issues a warning about
-        // linking together modules with incompatible target triples..
-        llvm::Triple mTriple(m->module->getTargetTriple());
-        llvm::Triple bcTriple(bcModule->getTargetTriple());
-        Debug(SourcePos(), "module triple: %s\nbitcode triple: %s\n",
-              mTriple.str().c_str(), bcTriple.str().c_str());
-#if defined(ISPC_ARM_ENABLED) && !defined(__arm__)
-        // FIXME: More ugly and dangerous stuff.  We really haven't set up
-        // proper build and runtime infrastructure for ispc to do
-        // cross-compilation, yet it's at minimum useful to be able to emit
-        // ARM code from x86 for ispc development.  One side-effect is that
-        // when the build process turns builtins/builtins.c to LLVM bitcode
-        // for us to link in at runtime, that bitcode has been compiled for
-        // an IA target, which in turn causes the checks in the following
-        // code to (appropraitely) fail.
-        //
-        // In order to be able to have some ability to generate ARM code on
-        // IA, we'll just skip those tests in that case and allow the
-        // setTargetTriple() and setDataLayout() calls below to shove in
-        // the values for an ARM target.  This maybe won't cause problems
-        // in the generated code, since bulitins.c doesn't do anything too
-        // complex w.r.t. struct layouts, etc.
-        if (g->target->getISA() != Target::NEON32 &&
-            g->target->getISA() != Target::NEON16 &&
-            g->target->getISA() != Target::NEON8)
-#endif // !__arm__
-        {
-            Assert(bcTriple.getArch() == llvm::Triple::UnknownArch ||
-                   mTriple.getArch() == bcTriple.getArch());
-            Assert(bcTriple.getVendor() == llvm::Triple::UnknownVendor ||
-                   mTriple.getVendor() == bcTriple.getVendor());
-
-            // We unconditionally set module DataLayout to library, but we must
-            // ensure that library and module DataLayouts are compatible.
-            // If they are not, we should recompile the library for problematic
-            // architecture and investigate what happened.
-            // Generally we allow library DataLayout to be subset of module
-            // DataLayout or library DataLayout to be empty.
-            if (!VerifyDataLayoutCompatibility(module->getDataLayout(),
-                                               bcModule->getDataLayout())) {
-              Warning(SourcePos(), "Module DataLayout is incompatible with "
-                      "library DataLayout:\n"
-                      "Module  DL: %s\n"
-                      "Library DL: %s\n",
-                      module->getDataLayout().c_str(),
-                      bcModule->getDataLayout().c_str());
-            }
-        }
+        lCheckBitcodeTarget(module, bcModule);
 
-        bcModule->setTargetTriple(mTriple.str());
+        bcModule->setTargetTriple(m->module->getTargetTriple());
         bcModule->setDataLayout(module->getDataLayout());
 
         std::string(linkError);
@@ -829,6 +842,198 @@ lDefineProgramIndex(llvm::Module *module, SymbolTable *symbolTable) {
 }
 
 
+/** A builtins bitcode module that has been loaded lazily by
+    lDeclareBitcodeInModule(); its function bodies are only read and cloned
+    into the destination module once DefineUsedBuiltins() finds that they
+    are needed.
+ */
+struct LazyBitcodeModule {
+    LazyBitcodeModule(llvm::Module *s, llvm::Module *d)
+        : src(s), dst(d) { }
+
+    llvm::Module *src, *dst;
+    /** Maps the functions and globals in src to their counterparts in
+        dst. */
+    llvm::ValueToValueMapTy vmap;
+};
+
+static std::vector<LazyBitcodeModule *> lLazyBitcodeModules;
+
+
+/** Lazily parses the given bitcode and adds declarations of all of its
+    functions to the given module, so that the symbol table and the code we
+    generate can refer to them without paying to parse and link the bodies
+    of the several hundred builtins that a typical program never calls.
+    Global variables are added with their initializers right away, since
+    they're small and the stdlib code sets some of them directly.
+ */
+static void
+lDeclareBitcodeInModule(const unsigned char *bitcode, int length,
+                        llvm::Module *module, SymbolTable *symbolTable) {
+    llvm::StringRef sb = llvm::StringRef((char *)bitcode, length);
+    llvm::MemoryBuffer *bcBuf = llvm::MemoryBuffer::getMemBuffer(sb);
+#if defined(LLVM_3_5)
+    llvm::ErrorOr<llvm::Module *> ModuleOrErr =
+        llvm::getLazyBitcodeModule(bcBuf, *g->ctx);
+    if (llvm::error_code EC = ModuleOrErr.getError()) {
+        Error(SourcePos(), "Error parsing stdlib bitcode: %s", EC.message().c_str());
+        delete bcBuf;
+        return;
+    }
+    llvm::Module *bcModule = ModuleOrErr.get();
+#else
+    std::string bcErr;
+    llvm::Module *bcModule = llvm::getLazyBitcodeModule(bcBuf, *g->ctx, &bcErr);
+    if (bcModule == NULL) {
+        Error(SourcePos(), "Error parsing stdlib bitcode: %s", bcErr.c_str());
+        delete bcBuf;
+        return;
+    }
+#endif
+    lCheckBitcodeTarget(module, bcModule);
+
+    LazyBitcodeModule *lazy = new LazyBitcodeModule(bcModule, module);
+    lLazyBitcodeModules.push_back(lazy);
+
+    for (llvm::Module::iterator iter = bcModule->begin();
+         iter != bcModule->end(); ++iter) {
+        llvm::Function *func = iter;
+        llvm::Function *declFunc = module->getFunction(func->getName());
+        if (declFunc == NULL || func->hasLocalLinkage()) {
+            // Functions with local linkage get a declaration of their own
+            // even if the name is already taken; they're given their
+            // original linkage back once their body is cloned.
+            declFunc = llvm::Function::Create(func->getFunctionType(),
+                                              llvm::GlobalValue::ExternalLinkage,
+                                              func->getName(), module);
+            declFunc->copyAttributesFrom(func);
+        }
+        if (declFunc->getType() == func->getType())
+            lazy->vmap[func] = declFunc;
+        else
+            lazy->vmap[func] =
+                llvm::ConstantExpr::getBitCast(declFunc, func->getType());
+    }
+
+    std::vector<llvm::GlobalVariable *> newGlobals;
+    for (llvm::Module::global_iterator iter = bcModule->global_begin();
+         iter != bcModule->global_end(); ++iter) {
+        llvm::GlobalVariable *gv = iter;
+        llvm::GlobalVariable *declGV = module->getNamedGlobal(gv->getName());
+        if (declGV == NULL || gv->hasLocalLinkage()) {
+            declGV = new llvm::GlobalVariable(*module, gv->getType()->getElementType(),
+                                              gv->isConstant(), gv->getLinkage(),
+                                              NULL, gv->getName());
+            declGV->copyAttributesFrom(gv);
+        }
+        if (gv->hasInitializer() && !declGV->hasInitializer())
+            newGlobals.push_back(declGV);
+        else
+            newGlobals.push_back(NULL);
+        lazy->vmap[gv] = declGV;
+    }
+
+    // Now that everything in the bitcode has a counterpart, map the global
+    // initializers over, since they may refer to other functions and
+    // globals.
+    int i = 0;
+    for (llvm::Module::global_iterator iter = bcModule->global_begin();
+         iter != bcModule->global_end(); ++iter, ++i) {
+        if (newGlobals[i] == NULL)
+            continue;
+        llvm::Constant *init = llvm::cast<llvm::Constant>(
+            llvm::MapValue(iter->getInitializer(), lazy->vmap));
+        newGlobals[i]->setInitializer(init);
+        newGlobals[i]->setLinkage(iter->getLinkage());
+    }
+
+    if (symbolTable != NULL)
+        lAddModuleSymbols(module, symbolTable);
+    lCheckModuleIntrinsics(module);
+}
+
+
+/** Returns true if the given function needs a definition: either the code
+    we've generated calls it or the optimization passes may introduce
+    calls to it later.
+ */
+static bool
+lBuiltinIsNeeded(llvm::Function *func) {
+    return (func->use_empty() == false ||
+            IsOptimizerBuiltin(func->getName().str().c_str()));
+}
+
+
+void
+DefineUsedBuiltins(llvm::Module *module) {
+    // Defining one builtin may add uses of others, so keep going until we
+    // get through all of the bitcode without defining anything new.
+    bool changed;
+    do {
+        changed = false;
+        for (int i = 0; i < (int)lLazyBitcodeModules.size(); ++i) {
+            LazyBitcodeModule *lazy = lLazyBitcodeModules[i];
+            if (lazy->dst != module)
+                continue;
+
+            for (llvm::Module::iterator iter = lazy->src->begin();
+                 iter != lazy->src->end(); ++iter) {
+                llvm::Function *func = iter;
+                if (func->isMaterializable() == false && func->empty())
+                    // Just a declaration in the bitcode
+                    continue;
+
+                llvm::Function *declFunc =
+                    llvm::dyn_cast<llvm::Function>(lazy->vmap[func]->stripPointerCasts());
+                if (declFunc == NULL || declFunc->empty() == false ||
+                    lBuiltinIsNeeded(declFunc) == false)
+                    continue;
+
+#if defined(LLVM_3_5)
+                if (llvm::error_code EC = func->Materialize()) {
+                    Error(SourcePos(), "Error reading stdlib bitcode for \"%s\": %s",
+                          func->getName().str().c_str(), EC.message().c_str());
+                    continue;
+                }
+#else
+                std::string matErr;
+                if (func->Materialize(&matErr)) {
+                    Error(SourcePos(), "Error reading stdlib bitcode for \"%s\": %s",
+                          func->getName().str().c_str(), matErr.c_str());
+                    continue;
+                }
+#endif
+
+                llvm::Function::arg_iterator declArg = declFunc->arg_begin();
+                for (llvm::Function::const_arg_iterator arg = func->arg_begin();
+                     arg != func->arg_end(); ++arg, ++declArg) {
+                    declArg->setName(arg->getName());
+                    lazy->vmap[arg] = declArg;
+                }
+
+                llvm::SmallVector<llvm::ReturnInst *, 8> returns;
+                llvm::CloneFunctionInto(declFunc, func, lazy->vmap, true, returns);
+                declFunc->setLinkage(func->getLinkage());
+                func->Dematerialize();
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    for (int i = 0; i < (int)lLazyBitcodeModules.size(); ++i) {
+        if (lLazyBitcodeModules[i]->dst != module)
+            continue;
+        // Deleting the lazily-loaded module also frees its bitcode buffer.
+        delete lLazyBitcodeModules[i]->src;
+        delete lLazyBitcodeModules[i];
+        lLazyBitcodeModules.erase(lLazyBitcodeModules.begin() + i);
+        --i;
+    }
+
+    lSetInternalFunctions(module);
+}
+
+
 void
 DefineStdlib(SymbolTable *symbolTable, llvm::LLVMContext *ctx, llvm::Module *module,
              bool includeStdlibISPC) {
@@ -837,8 +1042,8 @@ DefineStdlib(SymbolTable *symbolTable, llvm::LLVMContext *ctx, llvm::Module *mod
 #define EXPORT_MODULE(export_module)                            \
     extern unsigned char export_module[];                       \
     extern int export_module##_length;                          \
-    AddBitcodeToModule(export_module, export_module##_length,   \
-                       module, symbolTable);
+    lDeclareBitcodeInModule(export_module, export_module##_length, \
+                            module, symbolTable);
 
     // Add the definitions from the compiled builtins-c.c file
     if (runtime32) {
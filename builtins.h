@@ -58,4 +58,14 @@ void DefineStdlib(SymbolTable *symbolTable, llvm::LLVMContext *ctx, llvm::Module
 void AddBitcodeToModule(const unsigned char *bitcode, int length,
                         llvm::Module *module, SymbolTable *symbolTable = NULL);
 
+/** DefineStdlib() only declares the functions from the builtins bitcode;
+    this function adds definitions of the ones that the program ended up
+    using (along with those that the optimizer may introduce calls to) to
+    the given module.  It should be called after all of the program's
+    functions have been generated and before it is optimized, and it must
+    be called for every module given to DefineStdlib(), since it also frees
+    the bitcode that was loaded for it.
+ */
+void DefineUsedBuiltins(llvm::Module *module);
+
 #endif // ISPC_STDLIB_H
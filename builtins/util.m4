@@ -1831,8 +1831,10 @@ define(`stdlib_core', `
 declare i32 @__fast_masked_vload()
 
 declare i8* @ISPCAlloc(i8**, i64, i32) nounwind
-declare void @ISPCLaunch(i8**, i8*, i8*, i32, i32, i32) nounwind
+declare i8* @ISPCLaunch(i8**, i8*, i8*, i32, i32, i32) nounwind
+declare i8* @ISPCLaunchAfter(i8**, i8*, i8*, i32, i32, i32, i8**, i32) nounwind
 declare void @ISPCSync(i8*) nounwind
+declare void @ISPCBeginAsync(i8**) nounwind
 declare void @ISPCInstrument(i8*, i8*, i32, i64) nounwind
 
 declare i1 @__is_compile_time_constant_mask(<WIDTH x MASK> %mask)
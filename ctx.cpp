@@ -236,7 +236,8 @@ CFInfo::GetSwitch(bool isUniform, llvm::BasicBlock *breakTarget,
 
 FunctionEmitContext::FunctionEmitContext(Function *func, Symbol *funSym,
                                          llvm::Function *lf,
-                                         SourcePos firstStmtPos) {
+                                         SourcePos firstStmtPos,
+                                         bool isAsyncEntryPoint) {
     function = func;
     llvmFunction = lf;
 
@@ -382,6 +383,10 @@ FunctionEmitContext::FunctionEmitContext(Function *func, Symbol *funSym,
         /* And start a scope representing the initial function scope */
         StartScope();
     }
+
+    asyncEntryPoint = isAsyncEntryPoint;
+    if (asyncEntryPoint)
+        beginAsyncGroup();
 }
 
 
@@ -2367,10 +2372,10 @@ FunctionEmitContext::AddElementOffset(llvm::Value *fullBasePtr, int elementNum,
         const CollectionType *ct =
             CastType<CollectionType>(ptrType->GetBaseType());
         AssertPos(currentPos, ct != NULL);
-        *resultPtrType = new PointerType(ct->GetElementType(elementNum),
-                                         ptrType->GetVariability(),
-                                         ptrType->IsConstType(),
-                                         ptrType->IsSlice());
+        *resultPtrType = PointerType::Get(ct->GetElementType(elementNum),
+                                          ptrType->GetVariability(),
+                                          ptrType->IsConstType(),
+                                          ptrType->IsSlice());
     }
 
     llvm::Value *resultPtr = NULL;
@@ -3497,12 +3502,18 @@ FunctionEmitContext::CallInst(llvm::Value *func, const FunctionType *funcType,
 
 llvm::Instruction *
 FunctionEmitContext::ReturnInst() {
-    if (launchedTasks)
+    if (launchedTasks && !asyncEntryPoint)
         // Add a sync call at the end of any function that launched tasks
         SyncInst();
 
     llvm::Instruction *rinst = NULL;
-    if (returnValuePtr != NULL) {
+    if (asyncEntryPoint) {
+        // Hand the task group to the application, which waits for it with
+        // ISPCWait().
+        llvm::Value *handle = LoadInst(launchGroupHandlePtr, "async_handle");
+        rinst = llvm::ReturnInst::Create(*g->ctx, handle, bblock);
+    }
+    else if (returnValuePtr != NULL) {
         // We have value(s) to return; load them from their storage
         // location
         llvm::Value *retVal = LoadInst(returnValuePtr, "return_value");
@@ -3522,7 +3533,8 @@ FunctionEmitContext::ReturnInst() {
 llvm::Value *
 FunctionEmitContext::LaunchInst(llvm::Value *callee,
                                 std::vector<llvm::Value *> &argVals,
-                                llvm::Value *launchCount[3]){
+                                llvm::Value *launchCount[3],
+                                const std::vector<llvm::Value *> &predecessors){
     if (callee == NULL) {
         AssertPos(currentPos, m->errorCount > 0);
         return NULL;
@@ -3577,8 +3589,6 @@ FunctionEmitContext::LaunchInst(llvm::Value *callee,
     // a pointer to the task function being called and a pointer to the
     // argument block we just filled in
     llvm::Value *fptr = BitCastInst(callee, LLVMTypes::VoidPointerType);
-    llvm::Function *flaunch = m->module->getFunction("ISPCLaunch");
-    AssertPos(currentPos, flaunch != NULL);
     std::vector<llvm::Value *> args;
     args.push_back(launchGroupHandlePtr);
     args.push_back(fptr);
@@ -3586,7 +3596,31 @@ FunctionEmitContext::LaunchInst(llvm::Value *callee,
     args.push_back(launchCount[0]);
     args.push_back(launchCount[1]);
     args.push_back(launchCount[2]);
-    return CallInst(flaunch, NULL, args, "");
+
+    if (predecessors.size() == 0) {
+        llvm::Function *flaunch = m->module->getFunction("ISPCLaunch");
+        AssertPos(currentPos, flaunch != NULL);
+        return CallInst(flaunch, NULL, args, "launch_handle");
+    }
+
+    // Launches with an "after" clause pass the runtime an array of the
+    // handles of the launches that they depend on.
+    llvm::Type *predArrayType =
+        llvm::ArrayType::get(LLVMTypes::VoidPointerType, predecessors.size());
+    llvm::Value *predArray = AllocaInst(predArrayType, "launch_predecessors");
+    for (unsigned int i = 0; i < predecessors.size(); ++i) {
+        llvm::Value *ptr = AddElementOffset(predArray, i, NULL, "predecessor");
+        StoreInst(predecessors[i], ptr);
+    }
+    llvm::Value *predPtr =
+        BitCastInst(predArray, llvm::PointerType::get(LLVMTypes::VoidPointerType, 0),
+                    "launch_predecessors_ptr");
+    args.push_back(predPtr);
+    args.push_back(LLVMInt32((int32_t)predecessors.size()));
+
+    llvm::Function *flaunch = m->module->getFunction("ISPCLaunchAfter");
+    AssertPos(currentPos, flaunch != NULL);
+    return CallInst(flaunch, NULL, args, "launch_handle");
 }
 
 
@@ -3615,6 +3649,20 @@ FunctionEmitContext::SyncInst() {
     BranchInst(bPostSync);
 
     SetCurrentBasicBlock(bPostSync);
+
+    // Any tasks launched after an explicit sync in an 'export async'
+    // function go in a new group, which is the one that's returned.
+    if (asyncEntryPoint)
+        beginAsyncGroup();
+}
+
+
+void
+FunctionEmitContext::beginAsyncGroup() {
+    llvm::Function *fbegin = m->module->getFunction("ISPCBeginAsync");
+    if (fbegin == NULL)
+        FATAL("Couldn't find ISPCBeginAsync declaration?!");
+    CallInst(fbegin, NULL, launchGroupHandlePtr, "");
 }
 
 
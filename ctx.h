@@ -74,10 +74,15 @@ public:
                             to the function
         @param firstStmtPos Source file position of the first statement in the
                             function
+        @param isAsyncEntryPoint True when emitting the application's entry
+                            point for an 'export async' function, which
+                            returns its task group handle rather than
+                            waiting for its tasks
      */
     FunctionEmitContext(Function *function, Symbol *funSym,
                         llvm::Function *llvmFunction,
-                        SourcePos firstStmtPos);
+                        SourcePos firstStmtPos,
+                        bool isAsyncEntryPoint = false);
     ~FunctionEmitContext();
 
     /** Returns the Function * corresponding to the function that we're
@@ -539,10 +544,13 @@ public:
                           const char *name = NULL);
 
     /** Launch an asynchronous task to run the given function, passing it
-        he given argument values. */
+        he given argument values.  If any predecessor launch handles are
+        given, the tasks don't start until those launches have finished.
+        Returns the handle for the new launch. */
     llvm::Value *LaunchInst(llvm::Value *callee,
                             std::vector<llvm::Value *> &argVals,
-                            llvm::Value *launchCount[3]);
+                            llvm::Value *launchCount[3],
+                            const std::vector<llvm::Value *> &predecessors);
 
     void SyncInst();
 
@@ -680,6 +688,11 @@ private:
         tasks launched from the current function. */
     llvm::Value *launchGroupHandlePtr;
 
+    /** True if this is the application's entry point for an 'export
+        async' function.  Its task group is started with ISPCBeginAsync(),
+        and it's returned to the caller instead of being synced. */
+    bool asyncEntryPoint;
+
     /** Nesting count of the number of times calling code has disabled (and
         not yet reenabled) gather/scatter performance warnings. */
     int disableGSWarningCount;
@@ -688,6 +701,7 @@ private:
 
     static bool initLabelBBlocks(ASTNode *node, void *data);
 
+    void beginAsyncGroup();
     llvm::Value *pointerVectorToVoidPointers(llvm::Value *value);
     static void addGSMetadata(llvm::Value *inst, SourcePos pos);
     bool ifsInCFAllUniform(int cfType) const;
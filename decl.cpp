@@ -58,6 +58,7 @@ lPrintTypeQualifiers(int typeQualifiers) {
     if (typeQualifiers & TYPEQUAL_UNSIGNED)  printf("unsigned ");
     if (typeQualifiers & TYPEQUAL_EXPORT)    printf("export ");
     if (typeQualifiers & TYPEQUAL_UNMASKED)  printf("unmasked ");
+    if (typeQualifiers & TYPEQUAL_ASYNC)     printf("async ");
 }
 
 
@@ -318,6 +319,7 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
     bool isExported =     ((typeQualifiers & TYPEQUAL_EXPORT) != 0);
     bool isConst =        ((typeQualifiers & TYPEQUAL_CONST) != 0);
     bool isUnmasked =     ((typeQualifiers & TYPEQUAL_UNMASKED) != 0);
+    bool isAsync =        ((typeQualifiers & TYPEQUAL_ASYNC) != 0);
 
     if (hasUniformQual && hasVaryingQual) {
         Error(pos, "Can't provide both \"uniform\" and \"varying\" qualifiers.");
@@ -335,6 +337,10 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
         Error(pos, "\"export\" qualifier illegal in variable declaration.");
         return;
     }
+    if (kind != DK_FUNCTION && isAsync) {
+        Error(pos, "\"async\" qualifier illegal in variable declaration.");
+        return;
+    }
 
     Variability variability(Variability::Unbound);
     if (hasUniformQual)
@@ -353,8 +359,8 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
         /* For now, any pointer to an SOA type gets the slice property; if
            we add the capability to declare pointers as slices or not,
            we'll want to set this based on a type qualifier here. */
-        const Type *ptrType = new PointerType(baseType, variability, isConst,
-                                              baseType->IsSOAType());
+        const Type *ptrType = PointerType::Get(baseType, variability, isConst,
+                                               baseType->IsSOAType());
         if (child != NULL) {
             child->InitFromType(ptrType, ds);
             type = child->type;
@@ -534,6 +540,7 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
         bool isExported = ds && ((ds->typeQualifiers & TYPEQUAL_EXPORT) != 0);
         bool isTask =     ds && ((ds->typeQualifiers & TYPEQUAL_TASK) != 0);
         bool isUnmasked = ds && ((ds->typeQualifiers & TYPEQUAL_UNMASKED) != 0);
+        bool isAsync =    ds && ((ds->typeQualifiers & TYPEQUAL_ASYNC) != 0);
 
         if (isExported && isTask) {
             Error(pos, "Function can't have both \"task\" and \"export\" "
@@ -553,6 +560,16 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
         if (isUnmasked && isExported)
             Warning(pos, "\"unmasked\" qualifier is redundant for exported "
                     "functions.");
+        if (isAsync && !isExported) {
+            Error(pos, "\"async\" qualifier is only allowed with \"export\" "
+                  "functions.");
+            return;
+        }
+        if (isAsync && !Type::Equal(returnType, AtomicType::Void)) {
+            Error(pos, "\"export async\" function must return \"void\"; its "
+                  "application entry point returns an \"ISPCHandle\".");
+            return;
+        }
 
         if (child == NULL) {
             AssertPos(pos, m->errorCount > 0);
@@ -561,7 +578,8 @@ Declarator::InitFromType(const Type *baseType, DeclSpecs *ds) {
 
         const FunctionType *functionType =
             new FunctionType(returnType, args, argNames, argDefaults,
-                             argPos, isTask, isExported, isExternC, isUnmasked);
+                             argPos, isTask, isExported, isExternC, isUnmasked,
+                             isAsync);
 
         // handle any explicit __declspecs on the function
         if (ds != NULL) {
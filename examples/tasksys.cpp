@@ -43,7 +43,8 @@
   There are several task systems in this file, built using:
     - Microsoft's Concurrency Runtime (ISPC_USE_CONCRT)
     - Apple's Grand Central Dispatch (ISPC_USE_GCD)
-    - bare pthreads (ISPC_USE_PTHREADS, ISPC_USE_PTHREADS_FULLY_SUBSCRIBED)
+    - bare pthreads (ISPC_USE_PTHREADS, ISPC_USE_PTHREADS_FULLY_SUBSCRIBED,
+      ISPC_USE_PTHREADS_WORK_STEALING)
     - Cilk Plus (ISPC_USE_CILK)
     - TBB (ISPC_USE_TBB_TASK_GROUP, ISPC_USE_TBB_PARALLEL_FOR)
     - OpenMP (ISPC_USE_OMP)
@@ -58,22 +59,70 @@
 #define ISPC_USE_CONCRT
 #define ISPC_USE_PTHREADS
 #define ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+#define ISPC_USE_PTHREADS_WORK_STEALING
 #define ISPC_USE_CILK
 #define ISPC_USE_OMP
 #define ISPC_USE_TBB_TASK_GROUP
 #define ISPC_USE_TBB_PARALLEL_FOR
 
   The ISPC_USE_PTHREADS_FULLY_SUBSCRIBED model essentially takes over the machine
-  by assigning one pthread to each hyper-thread, and then uses spinlocks and atomics
+  by pinning one pthread to each hyper-thread, and then uses spinlocks and atomics
   for task management.  This model is useful for KNC where tasks can take over 
   the machine, but less so when there are other tasks that need running on the machine.
 
+  The ISPC_USE_PTHREADS_WORK_STEALING model gives each worker thread its own
+  lock-free work-stealing deque; idle workers steal from randomly chosen
+  victims.  Launching and syncing don't go through a global lock, so it
+  scales much better than ISPC_USE_PTHREADS with large numbers of small
+  tasks.  It is not yet the default; select it by compiling this file with
+  -DISPC_USE_PTHREADS_WORK_STEALING.
+
+  The pthreads-based task systems read the following environment
+  variables when they start up:
+
+    ISPC_NUM_THREADS   Number of threads to run tasks on, counting the
+                       application thread that launches them.  Defaults
+                       to the number of CPUs that the process may run on.
+    ISPC_AFFINITY      "none" to leave the threads unpinned (the default,
+                       except for ISPC_USE_PTHREADS_FULLY_SUBSCRIBED),
+                       "compact" to pin one thread to each CPU that the
+                       process may run on, or a list of CPUs such as
+                       "0-3,8" to pin the threads to those CPUs.
+
+    ISPC_NUMA_POLICY   (ISPC_USE_PTHREADS_WORK_STEALING only.)  "block" to
+                       read the NUMA topology from sysfs, keep each worker
+                       on one node, and split each launch made from
+                       outside the task system into one contiguous block
+                       of task indices per node.  A given taskIndex then
+                       runs on the same node on every launch with the
+                       same task count, which keeps first-touched data
+                       local.  Workers prefer work from their own node.
+                       Defaults to "none".
+
+  Applications can also call ISPCSetNumThreads() and ISPCSetAffinity()
+  before launching any tasks; these take precedence over the environment.
+  ISPCSetAffinity() takes an array of CPU numbers; an empty array leaves
+  the threads unpinned, and NULL restores the default behavior.
+  CPUs outside of the process's sched_getaffinity() mask are never used.
+
+  All of the task systems read one more environment variable:
+
+    ISPC_TRACE         Name of a file to write a trace of the tasks to
+                       when the program exits.  Each task is recorded
+                       with the thread that ran it and its start and end
+                       times, as is the time spent in each ISPCSync().
+                       The file is in the Chrome trace event format, for
+                       chrome://tracing or ui.perfetto.dev.
+
+  ISPCTraceDump() writes the trace so far on demand.
+
 #define ISPC_USE_CREW
 
 */
 
 #if !(defined ISPC_USE_CONCRT          || defined ISPC_USE_GCD              || \
       defined ISPC_USE_PTHREADS        || defined ISPC_USE_PTHREADS_FULLY_SUBSCRIBED || \
+      defined ISPC_USE_PTHREADS_WORK_STEALING || \
       defined ISPC_USE_TBB_TASK_GROUP  || defined ISPC_USE_TBB_PARALLEL_FOR || \
       defined ISPC_USE_OMP             || defined ISPC_USE_CILK             )
 
@@ -111,20 +160,20 @@
 #endif // ISPC_IS_WINDOWS
 #ifdef ISPC_USE_CONCRT
   #include <concrt.h>
+  #include <ppl.h>
   using namespace Concurrency;
 #endif // ISPC_USE_CONCRT
 #ifdef ISPC_USE_GCD
   #include <dispatch/dispatch.h>
   #include <pthread.h>
+  #include <sched.h>
+  #include <unistd.h>
 #endif // ISPC_USE_GCD
 #ifdef ISPC_USE_PTHREADS
   #include <pthread.h>
-  #include <semaphore.h>
   #include <unistd.h>
-  #include <fcntl.h>
   #include <errno.h>
   #include <sys/types.h>
-  #include <sys/stat.h>
   #include <sys/param.h>
   #include <sys/sysctl.h>
   #include <vector>
@@ -143,13 +192,23 @@
 #include <vector>
 #include <algorithm>
 //#include <stdexcept>
-#include <stack>
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+#ifdef ISPC_USE_PTHREADS_WORK_STEALING
+  #include <pthread.h>
+  #include <sched.h>
+  #include <unistd.h>
+  #include <errno.h>
+  #include <dirent.h>
+  #include <deque>
+  #include <vector>
+#endif // ISPC_USE_PTHREADS_WORK_STEALING
 #ifdef ISPC_USE_TBB_PARALLEL_FOR
   #include <tbb/parallel_for.h>
+  #include <tbb/blocked_range.h>
 #endif // ISPC_USE_TBB_PARALLEL_FOR
 #ifdef ISPC_USE_TBB_TASK_GROUP
   #include <tbb/task_group.h>
+  #include <thread>
 #endif // ISPC_USE_TBB_TASK_GROUP
 #ifdef ISPC_USE_CILK
   #include <cilk/cilk.h>
@@ -159,6 +218,10 @@
 #endif // ISPC_USE_OMP
 #ifdef ISPC_IS_LINUX
   #include <malloc.h>
+  #include <unistd.h>
+  #include <sched.h>
+  #include <sys/syscall.h>
+  #include <linux/futex.h>
 #endif // ISPC_IS_LINUX
 
 #include <stdio.h>
@@ -166,7 +229,10 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <algorithm>
+#include <vector>
 
 // Signature of ispc-generated 'task' functions
 typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
@@ -174,34 +240,73 @@ typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
                              int taskIndex0, int taskIndex1, int taskIndex2,
                              int taskCount0, int taskCount1, int taskCount2);
 
-// Small structure used to hold the data for each task
+class TaskGroup;
+
+/* The task systems that queue up tasks themselves can hold a launch back
+   until the launches that it was made "after" have finished.  The others
+   have ISPCLaunchAfter() wait for them before launching.
+ */
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_PTHREADS_WORK_STEALING)
+#define ISPC_DEFER_LAUNCHES
+#endif
+
+struct TaskInfo;
+
+/* Node in a launch's list of the launches that are waiting for it to
+   finish.  These are allocated from the waiting launch's task group.
+ */
+struct TaskDependent {
+    TaskInfo *launch;
+    TaskDependent *next;
+};
+
+/* Small structure used to hold the data for each launch.  All of the
+   tasks from a single launch share one TaskInfo; the individual tasks are
+   identified by their index in [0, taskCount()).
+ */
 #ifdef _MSC_VER
 __declspec(align(16))
 #endif
 struct TaskInfo {
     TaskFuncType func;
     void *data;
-    int taskIndex;
     int taskCount3d[3];
 #if defined(ISPC_IS_WINDOWS)
     event taskEvent;
+#endif
+    volatile int32_t numUnfinished;  // tasks from this launch still to finish
+#if defined(ISPC_DEFER_LAUNCHES)
+    TaskGroup *group;  // group to notify when tasks finish
+    volatile int32_t numPendingPredecessors;
+    TaskDependent *volatile dependents;  // or LAUNCH_FINISHED
 #endif
     int taskCount() const { return taskCount3d[0]*taskCount3d[1]*taskCount3d[2]; }
-    int taskIndex0() const 
-    {
-      return taskIndex % taskCount3d[0];
-    }
-    int taskIndex1() const 
-    {
-      return ( taskIndex / taskCount3d[0] ) % taskCount3d[1];
-    }
-    int taskIndex2() const 
-    {
-      return taskIndex / ( taskCount3d[0]*taskCount3d[1] );
-    }
     int taskCount0() const { return taskCount3d[0]; }
     int taskCount1() const { return taskCount3d[1]; }
     int taskCount2() const { return taskCount3d[2]; }
+
+    /** Runs the tasks with indices in [begin, end).  The 3D task indices
+        are computed for the first task and then stepped along with the
+        linear index, rather than recomputed for each task. */
+    void RunTasks(int begin, int end, int threadIndex, int threadCount) const {
+        RunTasks(begin, end, threadIndex, threadCount, NeverStop());
+    }
+
+    /** Like the above, but checks stop() after each task finishes and
+        returns early if it returns true.  Returns the index of the first
+        task that wasn't run. */
+    template <typename StopFunc>
+    int RunTasks(int begin, int end, int threadIndex, int threadCount,
+                 StopFunc stop) const;
+
+    struct NeverStop {
+        bool operator()() const { return false; }
+    };
+
+    /** Called as tasks from the launch finish; once they all have, starts
+        any launches that were only waiting for this one. */
+    inline void TasksDone(int count);
+
     TaskInfo() { assert(sizeof(TaskInfo) % 32 == 0); }
 }
 #ifndef _MSC_VER
@@ -209,25 +314,239 @@ __attribute__((aligned(32)));
 #endif
 ;
 
+
+// Task tracing; see the "Tracing" section below.
+enum TraceEventKind { TRACE_TASK, TRACE_SYNC };
+static bool lTraceEnabled = false;
+static inline int64_t lTraceTime();
+static void lTraceEvent(TraceEventKind kind, const void *id, const void *func,
+                        int taskIndex, int threadIndex, int64_t start);
+
+
+template <typename StopFunc> inline int
+TaskInfo::RunTasks(int begin, int end, int threadIndex, int threadCount,
+                   StopFunc stop) const {
+    const int count = taskCount();
+    const int count0 = taskCount3d[0], count1 = taskCount3d[1];
+    int index0 = begin % count0;
+    int index1 = (begin / count0) % count1;
+    int index2 = begin / (count0 * count1);
+
+    for (int i = begin; i < end; ++i) {
+        int64_t start = lTraceEnabled ? lTraceTime() : 0;
+        func(data, threadIndex, threadCount, i, count, index0, index1, index2,
+             count0, count1, taskCount3d[2]);
+        if (lTraceEnabled)
+            lTraceEvent(TRACE_TASK, this, (const void *)func, i, threadIndex, start);
+        if (++index0 == count0) {
+            index0 = 0;
+            if (++index1 == count1) {
+                index1 = 0;
+                ++index2;
+            }
+        }
+        if (stop())
+            return i + 1;
+    }
+    return end;
+}
+
+
+/* A contiguous range of task indices from a single launch; used by the
+   task systems that queue up work themselves.
+ */
+struct TaskRange {
+    TaskInfo *info;
+    int begin, end;
+};
+
+
+/* Most of the task systems hand out the tasks of a launch in chunks of
+   consecutive task indices, as with OpenMP's "guided" schedule: each
+   chunk is a fixed fraction of the tasks that haven't been handed out
+   yet.  The first chunks are large, which keeps the scheduling overhead
+   down for launches of many small tasks, and they shrink to single tasks
+   toward the end, so that the threads finish at about the same time.
+   Programs thus don't need to tune the task counts of their launches.
+ */
+#define GUIDED_CHUNK_FACTOR 2
+
+static inline int
+lGuidedChunkSize(int remaining, int numThreads) {
+    return std::max(remaining / (GUIDED_CHUNK_FACTOR * numThreads), 1);
+}
+
 // ispc expects these functions to have C linkage / not be mangled
 extern "C" { 
-    void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
+    void *ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
+    void *ISPCLaunchAfter(void **handlePtr, void *f, void *data, int countx, int county,
+                          int countz, void **predecessors, int32_t numPredecessors);
     void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
     void ISPCSync(void *handle);
+    void ISPCBeginAsync(void **handlePtr);
+
+    // Called by the application with the handles returned by 'export
+    // async' functions.  Every handle must be passed to ISPCWait() once;
+    // ISPCTest() returns nonzero if ISPCWait() wouldn't block.
+    void ISPCWait(void *handle);
+    int ISPCTest(void *handle);
+
+    // Not used by ispc-generated code; these let applications control
+    // the task system's threads.  They must be called before the first
+    // task is launched, and return zero on success.
+    int ISPCSetNumThreads(int numThreads);
+    int ISPCSetAffinity(const int *cpus, int numCpus);
+
+    // Writes the events traced so far to the given file (or to the one
+    // named by ISPC_TRACE, if NULL).  Returns zero on success, or -1 if
+    // tracing isn't enabled or the file can't be written.
+    int ISPCTraceDump(const char *filename);
 }
 
 ///////////////////////////////////////////////////////////////////////////
-// TaskGroupBase
+// Per-thread memory arenas
 
-#define LOG_TASK_QUEUE_CHUNK_SIZE 14
-#define MAX_TASK_QUEUE_CHUNKS 8
-#define TASK_QUEUE_CHUNK_SIZE (1<<LOG_TASK_QUEUE_CHUNK_SIZE)
+#ifdef ISPC_IS_WINDOWS
+#define ISPC_THREAD_LOCAL __declspec(thread)
+#else
+#define ISPC_THREAD_LOCAL __thread
+#endif
 
-#define MAX_LAUNCHED_TASKS (MAX_TASK_QUEUE_CHUNKS * TASK_QUEUE_CHUNK_SIZE)
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define CACHE_LINE_SIZE 64
 
-#define NUM_MEM_BUFFERS 16
+/** Each thread has a MemArena that services the ISPCAlloc() calls that it
+    makes, so that allocating the arguments of a launch is just a pointer
+    bump, with no heap allocation and no locking.
+
+    The memory from ISPCAlloc() only needs to live until the matching
+    ISPCSync(), which is made by the same thread.  Since ispc functions
+    sync their launches before they return, these lifetimes nest on each
+    thread: a task group takes a Mark of the arena before its first
+    allocation and releases back to it when it syncs.  Blocks are kept
+    around once allocated, so after warming up, the arena never goes back
+    to the heap.
+
+    The task groups of 'export async' functions are the exception: they
+    can be waited for in any order, from any thread, so each of them
+    allocates from a MemArena of its own instead.
+ */
+class MemArena {
+    struct Block;
+
+public:
+    struct Mark {
+        Block *block;
+        int64_t offset;
+    };
+
+    MemArena();
+    ~MemArena();
+
+    Mark GetMark() const {
+        Mark mark = { current, offset };
+        return mark;
+    }
+    void Release(const Mark &mark) {
+        current = mark.block;
+        offset = mark.offset;
+    }
+    void *Alloc(int64_t size, int32_t alignment);
+
+private:
+    struct Block {
+        Block *next;
+        int64_t size;
+        char *mem;
+    };
+
+    static Block *NewBlock(int64_t size);
+
+    Block *first, *current;
+    int64_t offset;
+};
+
+
+inline MemArena::MemArena() {
+    first = current = NewBlock(ARENA_BLOCK_SIZE);
+    offset = 0;
+}
+
+
+inline MemArena::~MemArena() {
+    while (first != NULL) {
+        Block *next = first->next;
+        free(first);
+        first = next;
+    }
+}
+
+
+MemArena::Block *
+MemArena::NewBlock(int64_t size) {
+    // Allocate the header and the memory together, with enough slop to
+    // start the memory on a cache line boundary.
+    char *buf = (char *)malloc(sizeof(Block) + size + CACHE_LINE_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "Unable to allocate %lld bytes for ISPCAlloc().\n",
+                (long long)size);
+        exit(1);
+    }
+    Block *block = (Block *)buf;
+    intptr_t iptr = (intptr_t)(buf + sizeof(Block));
+    iptr = (iptr + (CACHE_LINE_SIZE-1)) & ~(intptr_t)(CACHE_LINE_SIZE-1);
+    block->next = NULL;
+    block->size = size;
+    block->mem = (char *)iptr;
+    return block;
+}
+
+
+inline void *
+MemArena::Alloc(int64_t size, int32_t alignment) {
+    // Start each allocation on its own cache line, so that the arguments
+    // of different launches never share a line.
+    alignment = std::max(alignment, (int32_t)CACHE_LINE_SIZE);
+
+    while (1) {
+        int64_t start = (offset + (alignment-1)) & ~(int64_t)(alignment-1);
+        if (start + size <= current->size) {
+            offset = start + size;
+            return current->mem + start;
+        }
+
+        // Move on to the next block, putting a bigger one in front of it
+        // if it's too small for this allocation.
+        Block *next = current->next;
+        if (next == NULL || next->size < size) {
+            Block *block = NewBlock(std::max(2 * current->size, size));
+            block->next = next;
+            current->next = block;
+        }
+        current = current->next;
+        offset = 0;
+    }
+}
+
+
+// This is a pointer rather than a MemArena, since thread-local variables
+// can't have constructors.  Arenas of threads that exit are not freed.
+static ISPC_THREAD_LOCAL MemArena *lThreadArena = NULL;
+
+static inline MemArena *
+lGetThreadArena() {
+    MemArena *arena = lThreadArena;
+    if (arena == NULL)
+        lThreadArena = arena = new MemArena;
+    return arena;
+}
 
-class TaskGroup;
+
+///////////////////////////////////////////////////////////////////////////
+// TaskGroupBase
+
+#define LOG_TASK_QUEUE_CHUNK_SIZE 8
+#define TASK_QUEUE_CHUNK_SIZE (1<<LOG_TASK_QUEUE_CHUNK_SIZE)
 
 /** The TaskGroupBase structure provides common functionality for "task
     groups"; a task group is the set of tasks launched from within a single
@@ -238,11 +557,22 @@ class TaskGroupBase {
 public:
     void Reset();
 
-    int AllocTaskInfo(int count);
+    TaskInfo *AllocTaskInfo();
     TaskInfo *GetTaskInfo(int index);
 
     void *AllocMemory(int64_t size, int32_t alignment);
 
+    /** Sets the group up for an 'export async' function, whose caller
+        waits for it later with ISPCWait(). */
+    void BeginAsync();
+    /** Returns true if all of the tasks launched in the group have
+        finished.  This doesn't run any of them. */
+    bool AllLaunchesDone();
+    /** Called by ISPCTest() while the group's tasks haven't all finished.
+        Task systems that may not run them until someone waits for the
+        group hide this with one that runs some of them. */
+    void Poll() { }
+
 protected:
     TaskGroupBase();
     ~TaskGroupBase();
@@ -251,62 +581,53 @@ protected:
 
 private:
     /* We allocate blocks of TASK_QUEUE_CHUNK_SIZE TaskInfo structures as
-       needed by the calling function.  We hold up to MAX_TASK_QUEUE_CHUNKS
-       of these (and then exit at runtime if more than this many tasks are
-       launched.)
+       needed by the calling function, one per launch.  Only the array of
+       pointers to them grows, so TaskInfos never move once allocated;
+       there's no limit on the number of launches.  The blocks are kept
+       for the next use of the task group.
      */
-    TaskInfo *taskInfo[MAX_TASK_QUEUE_CHUNKS];
+    std::vector<TaskInfo *> taskInfo;
 
-    /* We also allocate chunks of memory to service ISPCAlloc() calls.  The
-       memBuffers[] array holds pointers to this memory.  The first element
-       of this array is initialized to point to mem and then any subsequent
-       elements required are initialized with dynamic allocation.
+    /* ISPCAlloc() calls are serviced from the arena of the thread that
+       makes them (which is also the one that will call ISPCSync()).
+       arenaMark records where the arena was before the first of them, so
+       that all of their memory can be released in Reset().
      */
-    int curMemBuffer, curMemBufferOffset;
-    int memBufferSize[NUM_MEM_BUFFERS];
-    char *memBuffers[NUM_MEM_BUFFERS];
-    char mem[256];
+    MemArena *arena;
+    MemArena::Mark arenaMark;
+
+    // The arena for async use of the group; kept for the next time.
+    MemArena *asyncArena;
 };
 
 
 inline TaskGroupBase::TaskGroupBase() { 
     nextTaskInfoIndex = 0; 
-
-    curMemBuffer = 0; 
-    curMemBufferOffset = 0;
-    memBuffers[0] = mem;
-    memBufferSize[0] = sizeof(mem) / sizeof(mem[0]);
-    for (int i = 1; i < NUM_MEM_BUFFERS; ++i) {
-        memBuffers[i] = NULL;
-        memBufferSize[i] = 0;
-    }
-
-    for (int i = 0; i < MAX_TASK_QUEUE_CHUNKS; ++i)
-        taskInfo[i] = NULL;
+    arena = NULL;
+    asyncArena = NULL;
 }
 
 
 inline TaskGroupBase::~TaskGroupBase() {
-    // Note: don't delete memBuffers[0], since it points to the start of
-    // the "mem" member!
-    for (int i = 1; i < NUM_MEM_BUFFERS; ++i)
-        delete[](memBuffers[i]);
+    for (int i = 0; i < (int)taskInfo.size(); ++i)
+        delete[] taskInfo[i];
+    delete asyncArena;
 }
 
 
 inline void
 TaskGroupBase::Reset() {
     nextTaskInfoIndex = 0; 
-    curMemBuffer = 0; 
-    curMemBufferOffset = 0;
+    if (arena != NULL) {
+        arena->Release(arenaMark);
+        arena = NULL;
+    }
 }
 
 
-inline int
-TaskGroupBase::AllocTaskInfo(int count) {
-    int ret = nextTaskInfoIndex;
-    nextTaskInfoIndex += count;
-    return ret;
+inline TaskInfo *
+TaskGroupBase::AllocTaskInfo() {
+    return GetTaskInfo(nextTaskInfoIndex++);
 }
 
 
@@ -315,43 +636,37 @@ TaskGroupBase::GetTaskInfo(int index) {
     int chunk = (index >> LOG_TASK_QUEUE_CHUNK_SIZE);
     int offset = index & (TASK_QUEUE_CHUNK_SIZE-1);
 
-    if (chunk == MAX_TASK_QUEUE_CHUNKS) {
-        fprintf(stderr, "A total of %d tasks have been launched from the "
-                "current function--the simple built-in task system can handle "
-                "no more. You can increase the values of TASK_QUEUE_CHUNK_SIZE "
-                "and LOG_TASK_QUEUE_CHUNK_SIZE to work around this limitation.  "
-                "Sorry!  Exiting.\n", index);
-        exit(1);
-    }
-
-    if (taskInfo[chunk] == NULL)
-        taskInfo[chunk] = new TaskInfo[TASK_QUEUE_CHUNK_SIZE];
+    while (chunk >= (int)taskInfo.size())
+        taskInfo.push_back(new TaskInfo[TASK_QUEUE_CHUNK_SIZE]);
     return &taskInfo[chunk][offset];
 }
 
 
 inline void *
 TaskGroupBase::AllocMemory(int64_t size, int32_t alignment) {
-    char *basePtr = memBuffers[curMemBuffer];
-    intptr_t iptr = (intptr_t)(basePtr + curMemBufferOffset);
-    iptr = (iptr + (alignment-1)) & ~(alignment-1);
-
-    int newOffset = int(iptr - (intptr_t)basePtr + size);
-    if (newOffset < memBufferSize[curMemBuffer]) {
-        curMemBufferOffset = newOffset;
-        return (char *)iptr;
+    if (arena == NULL) {
+        arena = lGetThreadArena();
+        arenaMark = arena->GetMark();
     }
+    return arena->Alloc(size, alignment);
+}
+
+
+inline void
+TaskGroupBase::BeginAsync() {
+    if (asyncArena == NULL)
+        asyncArena = new MemArena;
+    arena = asyncArena;
+    arenaMark = arena->GetMark();
+}
 
-    ++curMemBuffer;
-    curMemBufferOffset = 0;
-    assert(curMemBuffer < NUM_MEM_BUFFERS);
 
-    int allocSize = 1 << (12 + curMemBuffer);
-    allocSize = std::max(int(size+alignment), allocSize);
-    char *newBuf = new char[allocSize];
-    memBufferSize[curMemBuffer] = allocSize;
-    memBuffers[curMemBuffer] = newBuf;
-    return AllocMemory(size, alignment);
+inline bool
+TaskGroupBase::AllLaunchesDone() {
+    for (int i = 0; i < nextTaskInfoIndex; ++i)
+        if (GetTaskInfo(i)->numUnfinished > 0)
+            return false;
+    return true;
 }
 
 
@@ -389,6 +704,17 @@ lAtomicCompareAndSwap32(volatile int32_t *v, int32_t newValue, int32_t oldValue)
 #endif // ISPC_IS_WINDOWS
 }
 
+static inline int64_t
+lAtomicCompareAndSwap64(volatile int64_t *v, int64_t newValue, int64_t oldValue) {
+#ifdef ISPC_IS_WINDOWS
+    return InterlockedCompareExchange64((volatile LONGLONG *)v, newValue, oldValue);
+#else
+    int64_t result = __sync_val_compare_and_swap(v, oldValue, newValue);
+    lMemFence();
+    return result;
+#endif // ISPC_IS_WINDOWS
+}
+
 static inline int32_t 
 lAtomicAdd(volatile int32_t *v, int32_t delta) {
 #ifdef ISPC_IS_WINDOWS
@@ -399,164 +725,774 @@ lAtomicAdd(volatile int32_t *v, int32_t delta) {
 }
 
 ///////////////////////////////////////////////////////////////////////////
+// Tracing
 
-#ifdef ISPC_USE_CONCRT
-// With ConcRT, we don't need to extend TaskGroupBase at all.
-class TaskGroup : public TaskGroupBase {
-public:
-    void Launch(int baseIndex, int count);
-    void Sync();
-};
-#endif // ISPC_USE_CONCRT
-
-#ifdef ISPC_USE_GCD
-/* With Grand Central Dispatch, we associate a GCD dispatch group with each
-   task group.  (We'll later wait on this dispatch group when we need to
-   wait on all of the tasks in the group to finish.)
+/* When tracing is enabled, each thread records its events in a ring
+   buffer of its own, so that recording one doesn't need any locking or
+   atomics.  Once a buffer fills up, its oldest events are overwritten.
+   The buffers are never freed, so that they can be written out at exit
+   after their threads have gone away.
  */
-class TaskGroup : public TaskGroupBase {
-public:
-    TaskGroup() {
-        gcdGroup = dispatch_group_create();
-    }
 
-    void Launch(int baseIndex, int count);
-    void Sync();
+#define LOG_TRACE_BUFFER_SIZE 16
+#define TRACE_BUFFER_SIZE (1<<LOG_TRACE_BUFFER_SIZE)
 
-private:
-    dispatch_group_t gcdGroup;
+struct TraceEvent {
+    int64_t start, end;  // nanoseconds
+    const void *id;      // the launch's TaskInfo, or the synced task group
+    const void *func;    // task function; NULL for syncs
+    int32_t taskIndex;
+    int16_t threadIndex;
+    int16_t kind;
 };
-#endif // ISPC_USE_GCD
-
-#ifdef ISPC_USE_PTHREADS
-static void *lTaskEntry(void *arg);
-
-class TaskGroup : public TaskGroupBase {
-public:
-    TaskGroup() {
-        numUnfinishedTasks = 0;
-        waitingTasks.reserve(128);
-        inActiveList = false;
-    }
-
-    void Reset() {
-        TaskGroupBase::Reset();
-        numUnfinishedTasks = 0;
-        assert(inActiveList == false);
-        lMemFence();
-    }
 
-    void Launch(int baseIndex, int count);
-    void Sync();
+struct TraceBuffer {
+    TraceBuffer *next;
+    int tid;
+    // Total number of events recorded; the last TRACE_BUFFER_SIZE of them
+    // are in events[].
+    volatile int64_t numEvents;
+    TraceEvent events[TRACE_BUFFER_SIZE];
+};
 
-private:
-    friend void *lTaskEntry(void *arg);
+static TraceBuffer *volatile traceBuffers = NULL;
+static volatile int32_t numTraceBuffers = 0;
+static ISPC_THREAD_LOCAL TraceBuffer *lThreadTraceBuffer = NULL;
+static const char *traceFile = NULL;
+static int64_t traceStartTime;
 
-    int32_t numUnfinishedTasks;
-    int32_t pad[3];
-    std::vector<int> waitingTasks;
-    bool inActiveList;
-};
 
-#endif // ISPC_USE_PTHREADS
+static inline int64_t
+lTraceTime() {
+#ifdef ISPC_IS_WINDOWS
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+    LARGE_INTEGER count;
+    QueryPerformanceCounter(&count);
+    return (int64_t)(count.QuadPart * (1e9 / frequency.QuadPart));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif // ISPC_IS_WINDOWS
+}
 
-#ifdef ISPC_USE_CILK
 
-class TaskGroup : public TaskGroupBase {
-public:
-    void Launch(int baseIndex, int count);
-    void Sync();
+static TraceBuffer *
+lNewTraceBuffer() {
+    TraceBuffer *buf = new TraceBuffer;
+    buf->tid = lAtomicAdd(&numTraceBuffers, 1);
+    buf->numEvents = 0;
+    TraceBuffer *head;
+    do {
+        head = traceBuffers;
+        buf->next = head;
+    } while (lAtomicCompareAndSwapPointer((void **)&traceBuffers, buf, head) != head);
+    lThreadTraceBuffer = buf;
+    return buf;
+}
 
-};
 
-#endif // ISPC_USE_CILK
+/** Records an event that started at the given time and ends now. */
+static void
+lTraceEvent(TraceEventKind kind, const void *id, const void *func,
+            int taskIndex, int threadIndex, int64_t start) {
+    TraceBuffer *buf = lThreadTraceBuffer;
+    if (buf == NULL)
+        buf = lNewTraceBuffer();
+
+    int64_t n = buf->numEvents;
+    TraceEvent &event = buf->events[n & (TRACE_BUFFER_SIZE-1)];
+    event.start = start;
+    event.end = lTraceTime();
+    event.id = id;
+    event.func = func;
+    event.taskIndex = taskIndex;
+    event.threadIndex = (int16_t)threadIndex;
+    event.kind = (int16_t)kind;
+    // Make sure the event is written before ISPCTraceDump() can see it.
+    lMemFence();
+    buf->numEvents = n + 1;
+}
 
-#ifdef ISPC_USE_OMP
 
-class TaskGroup : public TaskGroupBase {
-public:
-    void Launch(int baseIndex, int count);
-    void Sync();
+int
+ISPCTraceDump(const char *filename) {
+    if (lTraceEnabled == false)
+        return -1;
+    if (filename == NULL)
+        filename = traceFile;
 
-};
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error opening trace file \"%s\": %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
 
-#endif // ISPC_USE_OMP
+    // Events that are overwritten while this is running may come out
+    // garbled; the trace is only exact once the tasks have been synced.
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+            "\"args\":{\"name\":\"ispc tasks\"}}");
+    for (TraceBuffer *buf = traceBuffers; buf != NULL; buf = buf->next) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", buf->tid, buf->tid);
 
-#ifdef ISPC_USE_TBB_PARALLEL_FOR
+        int64_t end = buf->numEvents;
+        lMemFence();
+        int64_t begin = std::max(end - TRACE_BUFFER_SIZE, (int64_t)0);
+        for (int64_t i = begin; i < end; ++i) {
+            const TraceEvent &event = buf->events[i & (TRACE_BUFFER_SIZE-1)];
+            double ts = (event.start - traceStartTime) * 1e-3;
+            double dur = (event.end - event.start) * 1e-3;
+            if (event.kind == TRACE_TASK)
+                fprintf(f, ",\n{\"name\":\"task %p\",\"cat\":\"task\",\"ph\":\"X\","
+                        "\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"args\":{\"launch\":\"%p\",\"taskIndex\":%d,"
+                        "\"threadIndex\":%d}}", event.func, buf->tid, ts, dur,
+                        event.id, event.taskIndex, event.threadIndex);
+            else
+                fprintf(f, ",\n{\"name\":\"sync\",\"cat\":\"sync\",\"ph\":\"X\","
+                        "\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"args\":{\"group\":\"%p\"}}", buf->tid, ts, dur,
+                        event.id);
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
 
-class TaskGroup : public TaskGroupBase {
-public:
-    void Launch(int baseIndex, int count);
-    void Sync();
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Error writing trace file \"%s\": %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-};
 
-#endif // ISPC_USE_TBB_PARALLEL_FOR
+static void
+lWriteTraceAtExit() {
+    ISPCTraceDump(NULL);
+}
 
-#ifdef ISPC_USE_TBB_TASK_GROUP
 
-class TaskGroup : public TaskGroupBase {
-public:
-    void Launch(int baseIndex, int count);
-    void Sync();
-private:
-    tbb::task_group tbbTaskGroup;
-};
+/* Checks ISPC_TRACE when the program starts, so that recording an event
+   doesn't have to check whether tracing has been set up yet.
+ */
+static struct TraceSetup {
+    TraceSetup() {
+        const char *file = getenv("ISPC_TRACE");
+        if (file == NULL || *file == '\0')
+            return;
+        traceFile = file;
+        traceStartTime = lTraceTime();
+        lTraceEnabled = true;
+        atexit(lWriteTraceAtExit);
+    }
+} traceSetup;
 
-#endif // ISPC_USE_TBB_TASK_GROUP
 
 ///////////////////////////////////////////////////////////////////////////
-// Grand Central Dispatch
+// Parking idle worker threads
 
-#ifdef ISPC_USE_GCD
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_PTHREADS_FULLY_SUBSCRIBED) || \
+    defined(ISPC_USE_PTHREADS_WORK_STEALING)
 
-/* A simple task system for ispc programs based on Apple's Grand Central
-   Dispatch. */
+#define MIN_IDLE_SPINS 16
+#define MAX_IDLE_SPINS 4096
 
-static dispatch_queue_t gcdQueue;
-static volatile int32_t lock = 0;
+static inline void
+lSpinPause() {
+#if defined(ISPC_IS_KNC)
+    _mm_delay_32(8);
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#else
+    lMemFence();
+#endif
+}
 
-static void
-InitTaskSystem() {
-    if (gcdQueue != NULL)
-        return;
 
-    while (1) {
-        if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
-            if (gcdQueue == NULL) {
-                gcdQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
-                assert(gcdQueue != NULL);
-                lMemFence();
-            }
-            lock = 0;
-            break;
+/** Spins until found() returns true, for at most *spinLimit iterations.
+    The limit adapts to the workload: it doubles when spinning pays off
+    and is halved when the caller ends up having to park anyway.  Returns
+    true if found() returned true.
+ */
+template <typename FoundFunc> static bool
+lSpinWait(FoundFunc found, int *spinLimit) {
+    for (int i = 0; i < *spinLimit; ++i) {
+        lSpinPause();
+        if (found()) {
+            *spinLimit = std::min(2 * *spinLimit, MAX_IDLE_SPINS);
+            return true;
         }
     }
+    *spinLimit = std::max(*spinLimit / 2, MIN_IDLE_SPINS);
+    return false;
 }
 
 
-static void
-lRunTask(void *ti) {
-    TaskInfo *taskInfo = (TaskInfo *)ti;
-    // FIXME: these are bogus values; may cause bugs in code that depends
-    // on them having unique values in different threads.
-    int threadIndex = 0;
-    int threadCount = 1;
+/** WorkerParking is where idle worker threads sleep until new work
+    arrives.  On Linux, parked threads wait on a futex; elsewhere they
+    wait on a condition variable.  A worker parks in three steps:
+
+    - PrepareToPark() announces that it is about to sleep,
+    - it checks once more for work, calling CancelPark() if it finds any,
+    - otherwise, Park() sleeps until the next call to Wake().
+
+    Threads that make work available call Wake() with the number of
+    threads that could usefully run it; this only costs an atomic read
+    when no one is parked.
+ */
+class WorkerParking {
+public:
+    WorkerParking();
+
+    int32_t PrepareToPark();
+    void CancelPark();
+    void Park(int32_t ticket);
+    void Wake(int count);
+    void WakeAll() { Wake(numParked); }
+
+private:
+    // Incremented by each call to Wake() that finds parked threads; this
+    // is the futex word on Linux.
+    volatile int32_t epoch;
+    volatile int32_t numParked;
+#ifndef ISPC_IS_LINUX
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif // !ISPC_IS_LINUX
+};
+
 
-    // Actually run the task
-    taskInfo->func(taskInfo->data, threadIndex, threadCount, 
-                   taskInfo->taskIndex, taskInfo->taskCount(),
-            taskInfo->taskIndex0(), taskInfo->taskIndex1(), taskInfo->taskIndex2(),
-            taskInfo->taskCount0(), taskInfo->taskCount1(), taskInfo->taskCount2());
+WorkerParking::WorkerParking() {
+    epoch = 0;
+    numParked = 0;
+#ifndef ISPC_IS_LINUX
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+#endif // !ISPC_IS_LINUX
 }
 
 
-inline void
-TaskGroup::Launch(int baseIndex, int count) {
-    for (int i = 0; i < count; ++i) {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
-        dispatch_group_async_f(gcdGroup, gcdQueue, ti, lRunTask);
-    }
+inline int32_t
+WorkerParking::PrepareToPark() {
+    int32_t ticket = epoch;
+    // lAtomicAdd() is a full barrier, so either our caller's final check
+    // for work will see the work, or the thread that made the work
+    // available will see us in numParked.
+    lAtomicAdd(&numParked, 1);
+    return ticket;
+}
+
+
+inline void
+WorkerParking::CancelPark() {
+    lAtomicAdd(&numParked, -1);
+}
+
+
+inline void
+WorkerParking::Park(int32_t ticket) {
+#ifdef ISPC_IS_LINUX
+    while (epoch == ticket)
+        syscall(SYS_futex, (int32_t *)&epoch, FUTEX_WAIT_PRIVATE, ticket,
+                NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&mutex);
+    while (epoch == ticket)
+        pthread_cond_wait(&cond, &mutex);
+    pthread_mutex_unlock(&mutex);
+#endif // ISPC_IS_LINUX
+    lAtomicAdd(&numParked, -1);
+}
+
+
+inline void
+WorkerParking::Wake(int count) {
+    lMemFence();
+    if (numParked == 0 || count <= 0)
+        return;
+
+#ifdef ISPC_IS_LINUX
+    lAtomicAdd(&epoch, 1);
+    syscall(SYS_futex, (int32_t *)&epoch, FUTEX_WAKE_PRIVATE, count,
+            NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&mutex);
+    lAtomicAdd(&epoch, 1);
+    if (count >= numParked)
+        pthread_cond_broadcast(&cond);
+    else
+        for (int i = 0; i < count; ++i)
+            pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+#endif // ISPC_IS_LINUX
+}
+
+
+/* Threads in ISPCSync() that have run out of tasks to help with park
+   here, apart from the idle workers.  Whoever finishes the last task of
+   a task group wakes them all, so that the thread waiting for it resumes
+   right away; the others go back to sleep.  New launches wake them too,
+   so that they can help run them.
+ */
+static WorkerParking syncParking;
+
+#endif // ISPC_USE_PTHREADS || ISPC_USE_PTHREADS_FULLY_SUBSCRIBED ||
+       // ISPC_USE_PTHREADS_WORK_STEALING
+
+///////////////////////////////////////////////////////////////////////////
+// Thread count and CPU affinity
+
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_PTHREADS_FULLY_SUBSCRIBED) || \
+    defined(ISPC_USE_PTHREADS_WORK_STEALING)
+
+/* The pthreads-based task systems size and place their worker threads
+   according to, in order of precedence, ISPCSetNumThreads() and
+   ISPCSetAffinity(), the ISPC_NUM_THREADS and ISPC_AFFINITY environment
+   variables, and finally the set of CPUs that the process is allowed to
+   run on (as reported by sched_getaffinity(), so that cgroup and taskset
+   limits are honored).  See the comment at the top of this file for the
+   details of the settings.
+ */
+static volatile int32_t taskSysStarted = 0;
+static int requestedNumThreads = 0;
+static bool affinityRequested = false;
+static std::vector<int> requestedCpus;
+
+
+/** Returns the CPUs that this process is allowed to run on. */
+static std::vector<int>
+lAllowedCpus() {
+    std::vector<int> cpus;
+#ifdef ISPC_IS_LINUX
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+            if (CPU_ISSET(i, &cpuset))
+                cpus.push_back(i);
+    }
+#endif // ISPC_IS_LINUX
+    if (cpus.size() == 0) {
+        int n = std::max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+        for (int i = 0; i < n; ++i)
+            cpus.push_back(i);
+    }
+    return cpus;
+}
+
+
+/** Parses a list of CPUs like "0-3,8,10-11" into the given vector.
+    Returns false if the string is malformed. */
+static bool
+lParseCpuList(const char *str, std::vector<int> *cpus) {
+    while (*str != '\0') {
+        char *end;
+        long first = strtol(str, &end, 10), last = first;
+        if (end == str || first < 0)
+            return false;
+        str = end;
+        if (*str == '-') {
+            ++str;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first)
+                return false;
+            str = end;
+        }
+        for (long i = first; i <= last; ++i)
+            cpus->push_back((int)i);
+        if (*str == ',')
+            ++str;
+        else if (*str != '\0')
+            return false;
+    }
+    return true;
+}
+
+
+/** Figures out how many threads should run tasks and which CPUs they
+    should run on.  numThreads counts the thread that calls into ispc
+    code, which runs tasks too, so the task system should start
+    numThreads-1 workers.  If workerCpus comes back non-empty, worker i
+    should be pinned to (*workerCpus)[i].  defaultPinned gives the
+    behavior when no affinity has been requested.
+ */
+static void
+lConfigureThreads(bool defaultPinned, int *numThreads,
+                  std::vector<int> *workerCpus) {
+    lAtomicAdd(&taskSysStarted, 1);
+
+    std::vector<int> allowed = lAllowedCpus();
+    std::vector<int> cpus;
+    const char *affinity = getenv("ISPC_AFFINITY");
+    if (affinityRequested)
+        cpus = requestedCpus;
+    else if (affinity == NULL || *affinity == '\0') {
+        if (defaultPinned)
+            cpus = allowed;
+    }
+    else if (strcmp(affinity, "compact") == 0)
+        cpus = allowed;
+    else if (strcmp(affinity, "none") != 0 &&
+             !lParseCpuList(affinity, &cpus)) {
+        fprintf(stderr, "Ignoring malformed ISPC_AFFINITY \"%s\".\n", affinity);
+        cpus.clear();
+    }
+
+    // Only use the requested CPUs that we're actually allowed to run on.
+    std::vector<int> usable;
+    for (int i = 0; i < (int)cpus.size(); ++i)
+        if (std::find(allowed.begin(), allowed.end(), cpus[i]) != allowed.end())
+            usable.push_back(cpus[i]);
+    if (cpus.size() > 0 && usable.size() == 0)
+        fprintf(stderr, "None of the CPUs in the requested affinity are "
+                "available; not pinning task threads.\n");
+
+    const char *numStr = getenv("ISPC_NUM_THREADS");
+    if (requestedNumThreads > 0)
+        *numThreads = requestedNumThreads;
+    else if (numStr != NULL && atoi(numStr) > 0)
+        *numThreads = atoi(numStr);
+    else
+        *numThreads = usable.size() > 0 ? (int)usable.size() : (int)allowed.size();
+
+    // The calling thread gets the first CPU (though we don't pin it);
+    // the workers get the rest, wrapping around if there are more
+    // threads than CPUs.
+    workerCpus->clear();
+    if (usable.size() > 0)
+        for (int i = 1; i < *numThreads; ++i)
+            workerCpus->push_back(usable[i % usable.size()]);
+}
+
+
+/** Creates a worker thread, restricting it to the given CPUs if cpus
+    isn't empty.  Returns zero on success or an error number. */
+static int
+lCreateWorkerThread(pthread_t *thread, void *(*entry)(void *), void *arg,
+                    const std::vector<int> &cpus, size_t stackSize = 0) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (stackSize > 0)
+        pthread_attr_setstacksize(&attr, stackSize);
+#ifdef ISPC_IS_LINUX
+    if (cpus.size() > 0) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (int i = 0; i < (int)cpus.size(); ++i)
+            CPU_SET(cpus[i], &cpuset);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+    }
+#endif // ISPC_IS_LINUX
+    int err = pthread_create(thread, &attr, entry, arg);
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+
+/** Creates a worker thread, pinning it to the given CPU if cpu is
+    non-negative. */
+static inline int
+lCreateWorkerThread(pthread_t *thread, void *(*entry)(void *), void *arg,
+                    int cpu, size_t stackSize = 0) {
+    std::vector<int> cpus;
+    if (cpu >= 0)
+        cpus.push_back(cpu);
+    return lCreateWorkerThread(thread, entry, arg, cpus, stackSize);
+}
+
+
+int
+ISPCSetNumThreads(int numThreads) {
+    if (taskSysStarted || numThreads < 0)
+        return -1;
+    requestedNumThreads = numThreads;
+    return 0;
+}
+
+
+int
+ISPCSetAffinity(const int *cpus, int numCpus) {
+    if (taskSysStarted || numCpus < 0)
+        return -1;
+    affinityRequested = (cpus != NULL);
+    requestedCpus.assign(cpus, cpus + (cpus != NULL ? numCpus : 0));
+    return 0;
+}
+
+#else
+
+// The other task systems manage their own threads.
+int
+ISPCSetNumThreads(int numThreads) {
+#ifdef ISPC_USE_OMP
+    if (numThreads > 0)
+        omp_set_num_threads(numThreads);
+    return 0;
+#else
+    (void)numThreads;
+    return -1;
+#endif // ISPC_USE_OMP
+}
+
+
+int
+ISPCSetAffinity(const int *, int) {
+    return -1;
+}
+
+#endif // ISPC_USE_PTHREADS || ISPC_USE_PTHREADS_FULLY_SUBSCRIBED ||
+       // ISPC_USE_PTHREADS_WORK_STEALING
+
+///////////////////////////////////////////////////////////////////////////
+
+#ifdef ISPC_USE_CONCRT
+// With ConcRT, we don't need to extend TaskGroupBase at all.
+class TaskGroup : public TaskGroupBase {
+public:
+    void Launch(TaskInfo *ti);
+    void Sync();
+};
+#endif // ISPC_USE_CONCRT
+
+#ifdef ISPC_USE_GCD
+/* With Grand Central Dispatch, we associate a GCD dispatch group with each
+   task group.  (We'll later wait on this dispatch group when we need to
+   wait on all of the tasks in the group to finish.)
+ */
+class TaskGroup : public TaskGroupBase {
+public:
+    TaskGroup() {
+        gcdGroup = dispatch_group_create();
+    }
+
+    void Launch(TaskInfo *ti);
+    void Sync();
+
+private:
+    dispatch_group_t gcdGroup;
+};
+#endif // ISPC_USE_GCD
+
+#ifdef ISPC_USE_PTHREADS
+static void *lTaskEntry(void *arg);
+
+class TaskGroup : public TaskGroupBase {
+public:
+    TaskGroup() {
+        numUnfinishedTasks = 0;
+        waitingTasks.reserve(128);
+        inActiveList = false;
+    }
+
+    void Reset() {
+        TaskGroupBase::Reset();
+        numUnfinishedTasks = 0;
+        assert(inActiveList == false);
+        lMemFence();
+    }
+
+    void Launch(TaskInfo *ti) {
+        CountLaunch(ti);
+        StartLaunch(ti);
+    }
+    void Sync();
+
+    /** Adds the tasks from a launch to the group's count of unfinished
+        tasks, so that Sync() waits for them even if they haven't been
+        started yet. */
+    void CountLaunch(TaskInfo *ti);
+    /** Makes the tasks from a counted launch available to run. */
+    void StartLaunch(TaskInfo *ti);
+    void Poll();
+
+private:
+    friend void *lTaskEntry(void *arg);
+
+    /** Takes the next guided chunk of tasks that haven't been started
+        yet from the waitingTasks list, returning their launch and the
+        range [*begin, *end) of their indices.  Must be called with
+        taskSysMutex held and with the group in the active list. */
+    TaskInfo *TakeWaitingTasks(int *begin, int *end);
+
+    volatile int32_t numUnfinishedTasks;
+    int32_t pad[3];
+    std::vector<TaskRange> waitingTasks;
+    bool inActiveList;
+};
+
+#endif // ISPC_USE_PTHREADS
+
+#ifdef ISPC_USE_PTHREADS_WORK_STEALING
+
+class TaskGroup : public TaskGroupBase {
+public:
+    TaskGroup() {
+        numUnfinishedTasks = 0;
+    }
+
+    void Reset() {
+        TaskGroupBase::Reset();
+        numUnfinishedTasks = 0;
+        lMemFence();
+    }
+
+    void Launch(TaskInfo *ti) {
+        CountLaunch(ti);
+        StartLaunch(ti);
+    }
+    void Sync();
+
+    /** Adds the tasks from a launch to the group's count of unfinished
+        tasks, so that Sync() waits for them even if they haven't been
+        started yet. */
+    void CountLaunch(TaskInfo *ti);
+    /** Makes the tasks from a counted launch available to run. */
+    void StartLaunch(TaskInfo *ti);
+    void Poll();
+
+    void TasksDone(int count) {
+        // Note that the group may be reused as soon as the count reaches
+        // zero, so we mustn't touch it afterward.
+        if (lAtomicAdd(&numUnfinishedTasks, -count) == count)
+            syncParking.WakeAll();
+    }
+
+    bool Done() const { return numUnfinishedTasks == 0; }
+
+private:
+    volatile int32_t numUnfinishedTasks;
+};
+
+#endif // ISPC_USE_PTHREADS_WORK_STEALING
+
+#ifdef ISPC_USE_CILK
+
+class TaskGroup : public TaskGroupBase {
+public:
+    void Launch(TaskInfo *ti);
+    void Sync();
+
+};
+
+#endif // ISPC_USE_CILK
+
+#ifdef ISPC_USE_OMP
+
+class TaskGroup : public TaskGroupBase {
+public:
+    void Launch(TaskInfo *ti);
+    void Sync();
+
+};
+
+#endif // ISPC_USE_OMP
+
+#ifdef ISPC_USE_TBB_PARALLEL_FOR
+
+class TaskGroup : public TaskGroupBase {
+public:
+    void Launch(TaskInfo *ti);
+    void Sync();
+
+};
+
+#endif // ISPC_USE_TBB_PARALLEL_FOR
+
+#ifdef ISPC_USE_TBB_TASK_GROUP
+
+class TaskGroup : public TaskGroupBase {
+public:
+    void Launch(TaskInfo *ti);
+    void Sync();
+private:
+    tbb::task_group tbbTaskGroup;
+};
+
+#endif // ISPC_USE_TBB_TASK_GROUP
+
+///////////////////////////////////////////////////////////////////////////
+// Grand Central Dispatch
+
+#ifdef ISPC_USE_GCD
+
+/* A simple task system for ispc programs based on Apple's Grand Central
+   Dispatch. */
+
+static dispatch_queue_t gcdQueue;
+static int numCpus;
+static volatile int32_t lock = 0;
+
+static void
+InitTaskSystem() {
+    if (gcdQueue != NULL)
+        return;
+
+    while (1) {
+        if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+            if (gcdQueue == NULL) {
+                numCpus = std::max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+                gcdQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+                assert(gcdQueue != NULL);
+                lMemFence();
+            }
+            lock = 0;
+            break;
+        }
+    }
+}
+
+
+/* The state of a launch that's being run by dispatch_apply_f(); each of
+   its numCpus iterations takes guided chunks of tasks until there are
+   none left.
+ */
+struct GuidedLaunch {
+    TaskInfo *info;
+    volatile int32_t nextTask;
+};
+
+
+static void
+lRunChunks(void *gl, size_t index) {
+    GuidedLaunch *launch = (GuidedLaunch *)gl;
+    TaskInfo *taskInfo = launch->info;
+    const int count = taskInfo->taskCount();
+    // No two iterations run on the same thread at the same time, so the
+    // iteration index serves as the thread index.
+    int threadIndex = (int)index;
+    int threadCount = numCpus;
+
+    while (1) {
+        int32_t begin = launch->nextTask;
+        if (begin >= count)
+            break;
+        int32_t end = begin + lGuidedChunkSize(count - begin, numCpus);
+        if (lAtomicCompareAndSwap32(&launch->nextTask, end, begin) == begin)
+            taskInfo->RunTasks(begin, end, threadIndex, threadCount);
+    }
+}
+
+
+static void
+lRunLaunch(void *ti) {
+    // Let GCD fan the launch out across its threads.
+    TaskInfo *taskInfo = (TaskInfo *)ti;
+    GuidedLaunch launch = { taskInfo, 0 };
+    dispatch_apply_f(std::min(numCpus, taskInfo->taskCount()), gcdQueue,
+                     &launch, lRunChunks);
+    lMemFence();
+    taskInfo->TasksDone(taskInfo->taskCount());
+}
+
+
+inline void
+TaskGroup::Launch(TaskInfo *ti) {
+    dispatch_group_async_f(gcdGroup, gcdQueue, ti, lRunLaunch);
 }
 
 
@@ -579,28 +1515,29 @@ InitTaskSystem() {
 
 
 static void __cdecl
-lRunTask(LPVOID param) {
+lRunLaunch(LPVOID param) {
     TaskInfo *ti = (TaskInfo *)param;
     
-    // Actually run the task. 
+    // Actually run the tasks, letting parallel_for() spread them across
+    // the scheduler's threads.
     // FIXME: like the GCD implementation for OS X, this is passing bogus
     // values for the threadIndex and threadCount builtins, which in turn
     // will cause bugs in code that uses those.
     int threadIndex = 0;
     int threadCount = 1;
-    ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+    parallel_for(0, ti->taskCount(), [=](int i) {
+        ti->RunTasks(i, i + 1, threadIndex, threadCount);
+    });
+    ti->TasksDone(ti->taskCount());
 
-    // Signal the event that this task is done
+    // Signal the event that this launch is done
     ti->taskEvent.set();
 }
 
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
-    for (int i = 0; i < count; ++i)
-        CurrentScheduler::ScheduleTask(lRunTask, GetTaskInfo(baseIndex + i));
+TaskGroup::Launch(TaskInfo *ti) {
+    CurrentScheduler::ScheduleTask(lRunLaunch, ti);
 }
 
 
@@ -625,26 +1562,54 @@ static volatile int32_t lock = 0;
 static int nThreads;
 static pthread_t *threads = NULL;
 
-static pthread_mutex_t taskSysMutex;
-static std::vector<TaskGroup *> activeTaskGroups;
-static sem_t *workerSemaphore;
+static pthread_mutex_t taskSysMutex;
+static std::vector<TaskGroup *> activeTaskGroups;
+// Number of entries in activeTaskGroups, for idle workers to check
+// without taking the mutex.
+static volatile int32_t numActiveTaskGroups = 0;
+static WorkerParking workerParking;
+
+inline TaskInfo *
+TaskGroup::TakeWaitingTasks(int *begin, int *end) {
+    assert(waitingTasks.size() > 0);
+    TaskRange &range = waitingTasks.back();
+    TaskInfo *ti = range.info;
+    // Workers and the thread that syncs all run tasks.
+    *begin = range.begin;
+    range.begin += lGuidedChunkSize(range.end - range.begin, nThreads + 1);
+    *end = range.begin;
+
+    if (range.begin == range.end) {
+        waitingTasks.pop_back();
+        if (waitingTasks.size() == 0) {
+            // We just took the last task from this task group, so remove
+            // it from the active list.
+            if (activeTaskGroups.back() == this)
+                activeTaskGroups.pop_back();
+            else
+                activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
+                                                 activeTaskGroups.end(), this));
+            numActiveTaskGroups = (int32_t)activeTaskGroups.size();
+            inActiveList = false;
+        }
+    }
+    return ti;
+}
+
+
+struct HaveWaitingTasks {
+    bool operator()() const { return numActiveTaskGroups > 0; }
+};
+
 
 static void *
 lTaskEntry(void *arg) {
     int threadIndex = (int)((int64_t)arg);
     int threadCount = nThreads;
+    int spinLimit = MIN_IDLE_SPINS;
 
     while (1) {
         int err;
-        //
-        // Wait on the semaphore until we're woken up due to the arrival of
-        // more work.
-        //
-        if ((err = sem_wait(workerSemaphore)) != 0) {
-            fprintf(stderr, "Error from sem_wait: %s\n", strerror(err));
-            exit(1);
-        }
-
         //
         // Acquire the mutex
         //
@@ -654,53 +1619,55 @@ lTaskEntry(void *arg) {
         }
 
         if (activeTaskGroups.size() == 0) {
-            //
-            // Task queue is empty, go back and wait on the semaphore
-            //
             if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
                 fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
                 exit(1);
             }
+
+            //
+            // Task queue is empty.  Spin for a bit in case more tasks show
+            // up soon, and otherwise park until a launch wakes us up.
+            //
+            if (!lSpinWait(HaveWaitingTasks(), &spinLimit)) {
+                int32_t ticket = workerParking.PrepareToPark();
+                if (numActiveTaskGroups > 0)
+                    workerParking.CancelPark();
+                else
+                    workerParking.Park(ticket);
+            }
             continue;
         }
 
         //
-        // Get the last task group on the active list and the last task
-        // from its waiting tasks list.
+        // Get the next tasks from the last task group on the active list.
         //
         TaskGroup *tg = activeTaskGroups.back();
-        assert(tg->waitingTasks.size() > 0);
-        int taskNumber = tg->waitingTasks.back();
-        tg->waitingTasks.pop_back();
+        int taskBegin, taskEnd;
+        TaskInfo *myTask = tg->TakeWaitingTasks(&taskBegin, &taskEnd);
 
-        if (tg->waitingTasks.size() == 0) {
-            // We just took the last task from this task group, so remove
-            // it from the active list.
-            activeTaskGroups.pop_back();
-            tg->inActiveList = false;
-        }
-    
         if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
             fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
             exit(1);
         }
 
         //
-        // And now actually run the task
+        // And now actually run the tasks
         //
-        DBG(fprintf(stderr, "running task %d from group %p\n", taskNumber, tg));
-        TaskInfo *myTask = tg->GetTaskInfo(taskNumber);
-        myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex,
-                     myTask->taskCount(),
-            myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
-            myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
+        DBG(fprintf(stderr, "running tasks [%d, %d) from group %p\n", taskBegin,
+                    taskEnd, tg));
+        myTask->RunTasks(taskBegin, taskEnd, threadIndex, threadCount);
 
         //
         // Decrement the "number of unfinished tasks" counter in the task
-        // group.
+        // group, waking up the thread waiting for it in Sync() if these
+        // were its last tasks.  The launch goes first, since finishing it
+        // may start more tasks in the group.
         //
+        const int numRun = taskEnd - taskBegin;
         lMemFence();
-        lAtomicAdd(&tg->numUnfinishedTasks, -1);
+        myTask->TasksDone(numRun);
+        if (lAtomicAdd(&tg->numUnfinishedTasks, -numRun) == numRun)
+            syncParking.WakeAll();
     }
 
     pthread_exit(NULL);
@@ -717,7 +1684,10 @@ InitTaskSystem() {
                     // We launch one fewer thread than there are cores,
                     // since the main thread here will also grab jobs from
                     // the task queue itself.
-                    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+                    int numThreads;
+                    std::vector<int> workerCpus;
+                    lConfigureThreads(false, &numThreads, &workerCpus);
+                    nThreads = numThreads - 1;
 
                     int err;
                     if ((err = pthread_mutex_init(&taskSysMutex, NULL)) != 0) {
@@ -725,27 +1695,10 @@ InitTaskSystem() {
                         exit(1);
                     }
 
-                    char name[32];
-                    bool success = false;
-                    srand(time(NULL));
-                    for (int i = 0; i < 10; i++) {
-                        sprintf(name, "ispc_task.%d.%d", (int)getpid(), (int)rand());
-                        workerSemaphore = sem_open(name, O_CREAT, S_IRUSR|S_IWUSR, 0);
-                        if (workerSemaphore != SEM_FAILED) {
-                            success = true;
-                            break;
-                        }
-                        fprintf(stderr, "Failed to create %s\n", name);
-                    }
-
-                    if (!success) {
-                        fprintf(stderr, "Error creating semaphore (%s): %s\n", name, strerror(errno));
-                        exit(1);
-                    }
-
                     threads = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
                     for (int i = 0; i < nThreads; ++i) {
-                        err = pthread_create(&threads[i], NULL, &lTaskEntry, (void *)(i));
+                        err = lCreateWorkerThread(&threads[i], &lTaskEntry, (void *)(intptr_t)i,
+                                                  workerCpus.size() ? workerCpus[i] : -1);
                         if (err != 0) {
                             fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
                             exit(1);
@@ -767,7 +1720,21 @@ InitTaskSystem() {
 
 
 inline void
-TaskGroup::Launch(int baseCoord, int count) {
+TaskGroup::CountLaunch(TaskInfo *ti) {
+    //
+    // Update the count of the number of tasks left to run in this task
+    // group.  This happens before the tasks become visible to other
+    // threads, so that the count can't transiently drop to zero.
+    //
+    lAtomicAdd(&numUnfinishedTasks, ti->taskCount());
+    ti->group = this;
+}
+
+
+inline void
+TaskGroup::StartLaunch(TaskInfo *ti) {
+    const int count = ti->taskCount();
+
     //
     // Acquire mutex, add task
     //
@@ -777,20 +1744,21 @@ TaskGroup::Launch(int baseCoord, int count) {
         exit(1);
     }
 
-    // Add the corresponding set of tasks to the waiting-to-be-run list for
-    // this task group.
+    // Add the range of tasks from this launch to the waiting-to-be-run
+    // list for this task group.
     //
     // FIXME: it's a little ugly to hold a global mutex for this when we
     // only need to make sure no one else is accessing this task group's
     // waitingTasks list.  (But a small experiment in switching to a
     // per-TaskGroup mutex showed worse performance!)
-    for (int i = 0; i < count; ++i)
-        waitingTasks.push_back(baseCoord + i);
+    TaskRange range = { ti, 0, count };
+    waitingTasks.push_back(range);
 
     // Add the task group to the global active list if it isn't there
     // already.
     if (inActiveList == false) {
         activeTaskGroups.push_back(this);
+        numActiveTaskGroups = (int32_t)activeTaskGroups.size();
         inActiveList = true;
     }
 
@@ -800,27 +1768,28 @@ TaskGroup::Launch(int baseCoord, int count) {
     }
 
     //
-    // Update the count of the number of tasks left to run in this task
-    // group.
-    //
-    lMemFence();
-    lAtomicAdd(&numUnfinishedTasks, count);
-
-    //
-    // Post to the worker semaphore to wake up worker threads that are
-    // sleeping waiting for tasks to show up
+    // Wake up parked worker threads, but no more of them than there are
+    // tasks for.  Each worker keeps running tasks until there are none
+    // left.  Threads waiting in Sync() can help, too.
     //
-    for (int i = 0; i < count; ++i)
-        if ((err = sem_post(workerSemaphore)) != 0) {
-            fprintf(stderr, "Error from sem_post: %s\n", strerror(err));
-            exit(1);
-        }
+    workerParking.Wake(std::min(count, nThreads));
+    syncParking.Wake(count);
 }
 
 
+struct SyncCanProceed {
+    SyncCanProceed(const volatile int32_t *n) : numUnfinishedTasks(n) { }
+    bool operator()() const {
+        return *numUnfinishedTasks == 0 || numActiveTaskGroups > 0;
+    }
+    const volatile int32_t *numUnfinishedTasks;
+};
+
+
 inline void
 TaskGroup::Sync() {
     DBG(fprintf(stderr, "syncing %p - %d unfinished\n", tg, numUnfinishedTasks));
+    int spinLimit = MIN_IDLE_SPINS;
 
     while (numUnfinishedTasks > 0) {
         // All of the tasks in this group aren't finished yet.  We'll try
@@ -838,86 +1807,750 @@ TaskGroup::Sync() {
             exit(1);
         }
 
-        TaskInfo *myTask = NULL;
-        TaskGroup *runtg = this;
-        if (waitingTasks.size() > 0) {
-            int taskNumber = waitingTasks.back();
-            waitingTasks.pop_back();
+        TaskInfo *myTask = NULL;
+        TaskGroup *runtg = this;
+        int taskBegin, taskEnd;
+        if (waitingTasks.size() > 0) {
+            myTask = TakeWaitingTasks(&taskBegin, &taskEnd);
+            DBG(fprintf(stderr, "running tasks [%d, %d) from group %p in sync\n",
+                        taskBegin, taskEnd, tg));
+        }
+        else {
+            // Other threads are already working on all of the tasks in
+            // this group, so we can't help out by running one ourself.
+            // We'll try to run one from another group to make ourselves
+            // useful here.
+            if (activeTaskGroups.size() == 0) {
+                // No active task groups left--there's nothing for us to do.
+                if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
+                    fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
+                    exit(1);
+                }
+                // Spin for a bit, then sleep until either the last task in
+                // this group finishes or there are new tasks to help with.
+                if (!lSpinWait(SyncCanProceed(&numUnfinishedTasks), &spinLimit)) {
+                    int32_t ticket = syncParking.PrepareToPark();
+                    if (SyncCanProceed(&numUnfinishedTasks)())
+                        syncParking.CancelPark();
+                    else
+                        syncParking.Park(ticket);
+                }
+                continue;
+            }
+
+            // Get a task to run from another task group.
+            runtg = activeTaskGroups.back();
+            myTask = runtg->TakeWaitingTasks(&taskBegin, &taskEnd);
+            DBG(fprintf(stderr, "running tasks [%d, %d) from other group %p in sync\n",
+                        taskBegin, taskEnd, runtg));
+        }
+
+        if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
+            fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
+            exit(1);
+        }
+    
+        //
+        // Do work for _myTask_
+        //
+        // FIXME: bogus values for thread index/thread count here as well..
+        myTask->RunTasks(taskBegin, taskEnd, 0, 1);
+
+        //
+        // Decrement the number of unfinished tasks counter
+        //
+        const int numRun = taskEnd - taskBegin;
+        lMemFence();
+        myTask->TasksDone(numRun);
+        if (lAtomicAdd(&runtg->numUnfinishedTasks, -numRun) == numRun && runtg != this)
+            syncParking.WakeAll();
+    }
+    DBG(fprintf(stderr, "sync for %p done!n", tg));
+}
+
+
+inline void
+TaskGroup::Poll() {
+    // Without any worker threads, nothing runs the group's tasks until
+    // someone syncs it, so run a chunk of them here; otherwise polling
+    // would never see them finish.
+    if (nThreads > 0)
+        return;
+
+    int err;
+    if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
+        fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
+        exit(1);
+    }
+
+    TaskInfo *myTask = NULL;
+    int taskBegin, taskEnd;
+    if (waitingTasks.size() > 0)
+        myTask = TakeWaitingTasks(&taskBegin, &taskEnd);
+
+    if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
+        fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
+        exit(1);
+    }
+
+    if (myTask == NULL)
+        return;
+
+    myTask->RunTasks(taskBegin, taskEnd, 0, 1);
+
+    const int numRun = taskEnd - taskBegin;
+    lMemFence();
+    myTask->TasksDone(numRun);
+    if (lAtomicAdd(&numUnfinishedTasks, -numRun) == numRun)
+        syncParking.WakeAll();
+}
+
+#endif // ISPC_USE_PTHREADS
+
+///////////////////////////////////////////////////////////////////////////
+// pthreads with work stealing
+
+#ifdef ISPC_USE_PTHREADS_WORK_STEALING
+
+/* A work-stealing deque, following Chase and Lev, "Dynamic Circular
+   Work-Stealing Deque" (SPAA 2005).  The thread that owns the deque
+   pushes and pops ranges of tasks at the bottom end without taking any
+   locks; other threads steal from the top end with a single
+   compare-and-swap.  When the circular buffer fills up, the owner
+   switches to one that is twice as large.  Old buffers are never freed,
+   since a thief may still be reading from one of them.
+ */
+class WorkDeque {
+public:
+    WorkDeque();
+
+    void Push(const TaskRange &range);
+    bool Pop(TaskRange *range);
+    bool Steal(TaskRange *range);
+
+    /** Only meaningful when called by the owner. */
+    bool Empty() const { return bottom <= top; }
+
+private:
+    struct Buffer {
+        Buffer(int64_t s, Buffer *p)
+            : size(s), items(new TaskRange[s]), prev(p) { }
+
+        const TaskRange &Get(int64_t i) const { return items[i & (size-1)]; }
+        void Put(int64_t i, const TaskRange &r) { items[i & (size-1)] = r; }
+
+        int64_t size;
+        TaskRange *items;
+        Buffer *prev;
+    };
+
+    // top is written by thieves and bottom by the owner; keep them on
+    // separate cache lines.
+    volatile int64_t top;
+    char pad0[64 - sizeof(int64_t)];
+    volatile int64_t bottom;
+    Buffer * volatile buffer;
+    char pad1[64 - sizeof(int64_t) - sizeof(Buffer *)];
+};
+
+
+WorkDeque::WorkDeque() {
+    top = bottom = 0;
+    buffer = new Buffer(64, NULL);
+}
+
+
+inline void
+WorkDeque::Push(const TaskRange &range) {
+    int64_t b = bottom, t = top;
+    Buffer *buf = buffer;
+    if (b - t >= buf->size) {
+        Buffer *newBuf = new Buffer(2 * buf->size, buf);
+        for (int64_t i = t; i < b; ++i)
+            newBuf->Put(i, buf->Get(i));
+        buf = newBuf;
+        buffer = buf;
+    }
+    buf->Put(b, range);
+    // Make sure the range is visible before the thieves can see it.
+    lMemFence();
+    bottom = b + 1;
+}
+
+
+inline bool
+WorkDeque::Pop(TaskRange *range) {
+    int64_t b = bottom - 1;
+    Buffer *buf = buffer;
+    bottom = b;
+    lMemFence();
+    int64_t t = top;
+
+    if (t > b) {
+        // The deque was empty
+        bottom = b + 1;
+        return false;
+    }
+
+    TaskRange r = buf->Get(b);
+    if (t == b) {
+        // This is the last range; race against the thieves for it.
+        bool won = (lAtomicCompareAndSwap64(&top, t + 1, t) == t);
+        bottom = b + 1;
+        if (!won)
+            return false;
+    }
+    *range = r;
+    return true;
+}
+
+
+inline bool
+WorkDeque::Steal(TaskRange *range) {
+    int64_t t = top;
+    lMemFence();
+    int64_t b = bottom;
+    if (t >= b)
+        return false;
+
+    // The slot may be overwritten while we copy it, but only if another
+    // thread takes it first, in which case the CAS below fails and we
+    // throw the copy away.
+    TaskRange r = buffer->Get(t);
+    if (lAtomicCompareAndSwap64(&top, t + 1, t) != t)
+        return false;
+    *range = r;
+    return true;
+}
+
+
+/* Per-thread state for each of the worker threads.  It is padded out to
+   a multiple of the cache line size so that workers don't share lines.
+ */
+struct WorkerThread {
+    WorkDeque deque;
+    pthread_t thread;
+    int index;
+    int node;       // index into nodes[] of the NUMA node we run on
+    uint32_t rngState;
+    char pad[64 - sizeof(pthread_t) - 3 * sizeof(int)];
+};
+
+
+/* A queue of ranges of tasks, for launches made by threads that don't
+   have a deque of their own (or that are being placed on a particular
+   NUMA node).  Each entry is a whole launch or a block of one; the worker
+   that takes it makes parts of it available for stealing as it goes.
+ */
+struct RangeQueue {
+    RangeQueue() : count(0) { pthread_mutex_init(&mutex, NULL); }
+
+    pthread_mutex_t mutex;
+    std::deque<TaskRange> ranges;
+    volatile int32_t count;
+};
+
+
+/* The workers are grouped by the NUMA node that they run on.  Workers
+   look for work on their own node before they look on other nodes.
+   Without NUMA placement, all of the workers are in a single group.
+ */
+struct NumaNode {
+    std::vector<int> cpus;
+    std::vector<WorkerThread *> workers;
+    RangeQueue queue;
+};
+
+
+static volatile int32_t lock = 0;
+static int nWorkers;
+static WorkerThread *volatile workers = NULL;
+static NumaNode *nodes = NULL;
+static int numNodes = 1;
+static std::vector<int> cpuToNode;
+// If true, launches from outside the task system are divided into one
+// contiguous block of tasks per NUMA node.
+static bool numaBlockPolicy = false;
+
+// The worker that the current thread is running as, or NULL for threads
+// that weren't created by the task system.
+static __thread WorkerThread *lCurrentWorker = NULL;
+
+static WorkerParking workerParking;
+
+
+static inline uint32_t
+lRandom(uint32_t *state) {
+    // xorshift32
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+
+/** Reads the NUMA topology from sysfs; returns the CPUs of each node, in
+    node order.  Returns an empty vector if the topology isn't available.
+ */
+static std::vector<std::vector<int> >
+lReadNumaNodes() {
+    std::vector<std::vector<int> > nodeCpus;
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL)
+        return nodeCpus;
+
+    std::vector<int> nodeIds;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int id;
+        char c;
+        if (sscanf(entry->d_name, "node%d%c", &id, &c) == 1)
+            nodeIds.push_back(id);
+    }
+    closedir(dir);
+    std::sort(nodeIds.begin(), nodeIds.end());
+
+    for (int i = 0; i < (int)nodeIds.size(); ++i) {
+        char path[128], line[4096];
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", nodeIds[i]);
+        FILE *f = fopen(path, "r");
+        if (f == NULL)
+            continue;
+        std::vector<int> cpus;
+        if (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            if (!lParseCpuList(line, &cpus))
+                cpus.clear();
+        }
+        fclose(f);
+        // Skip memory-only nodes.
+        if (cpus.size() > 0)
+            nodeCpus.push_back(cpus);
+    }
+    return nodeCpus;
+}
+
+
+/** Returns the NUMA node that the calling thread is running on. */
+static inline int
+lCurrentNode() {
+    WorkerThread *worker = lCurrentWorker;
+    if (worker != NULL)
+        return worker->node;
+    if (numNodes == 1)
+        return 0;
+    int cpu = sched_getcpu();
+    return (cpu >= 0 && cpu < (int)cpuToNode.size()) ? cpuToNode[cpu] : 0;
+}
+
+
+struct DequeEmpty {
+    DequeEmpty(const WorkDeque *d) : deque(d) { }
+    bool operator()() const { return deque->Empty(); }
+    const WorkDeque *deque;
+};
+
+
+/* Runs the tasks in the given range.  Workers split the range lazily:
+   whenever their deque is empty--either because this range is all they
+   have, or because thieves took everything else--they push the upper
+   half of what is left so that other workers can steal it.  This only
+   splits as often as there are idle threads to take the work.
+ */
+static void
+lRunRange(const TaskRange &range, WorkerThread *worker) {
+    TaskInfo *ti = range.info;
+    // Threads outside the task system all share the last thread index.
+    int threadIndex = worker ? worker->index : nWorkers;
+    int threadCount = nWorkers + 1;
+
+    // Splitting shrinks end, so once we're done, we've run everything up
+    // to it.
+    int begin = range.begin, end = range.end;
+    while (begin < end) {
+        if (worker != NULL && end - begin > 1 && worker->deque.Empty()) {
+            int mid = begin + (end - begin) / 2;
+            TaskRange upper = { ti, mid, end };
+            worker->deque.Push(upper);
+            workerParking.Wake(1);
+            end = mid;
+        }
+
+        // Run tasks until a thief takes the work we exposed.
+        DBG(fprintf(stderr, "running tasks [%d, %d) of %p\n", begin, end, ti));
+        if (worker != NULL)
+            begin = ti->RunTasks(begin, end, threadIndex, threadCount,
+                                 DequeEmpty(&worker->deque));
+        else {
+            ti->RunTasks(begin, end, threadIndex, threadCount);
+            begin = end;
+        }
+    }
+
+    // Finishing the launch may start more tasks in the group, so it
+    // goes first.
+    TaskGroup *group = ti->group;
+    lMemFence();
+    ti->TasksDone(end - range.begin);
+    group->TasksDone(end - range.begin);
+}
+
+
+static void
+lQueueRange(RangeQueue *queue, const TaskRange &range) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->ranges.push_back(range);
+    lAtomicAdd(&queue->count, 1);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+
+static bool
+lTakeQueuedRange(RangeQueue *queue, WorkerThread *worker, TaskRange *range) {
+    if (queue->count == 0)
+        return false;
+
+    pthread_mutex_lock(&queue->mutex);
+    bool found = false;
+    if (queue->ranges.size() > 0) {
+        TaskRange &front = queue->ranges.front();
+        // Workers take the whole range, since they can share it with the
+        // other workers from their deque.  Other threads only take a
+        // share of it, so that the rest is still available to the
+        // workers.
+        int count = front.end - front.begin;
+        int share = worker ? count : std::max(1, count / (nWorkers + 1));
+        *range = front;
+        range->end = front.begin + share;
+        front.begin += share;
+        if (front.begin == front.end) {
+            queue->ranges.pop_front();
+            lAtomicAdd(&queue->count, -1);
+        }
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return found;
+}
+
+
+static bool
+lStealRange(NumaNode *node, WorkerThread *worker, TaskRange *range) {
+    int n = (int)node->workers.size();
+    if (n == 0)
+        return false;
+
+    static __thread uint32_t externalRngState = 0x9e3779b9;
+    uint32_t *rng = worker ? &worker->rngState : &externalRngState;
+    int start = lRandom(rng) % n;
+    for (int i = 0; i < n; ++i) {
+        WorkerThread *victim = node->workers[(start + i) % n];
+        if (victim != worker && victim->deque.Steal(range))
+            return true;
+    }
+    return false;
+}
+
+
+/* Find a range of tasks for the given thread to run: first from its own
+   deque, then from its node's queue, then by stealing from the other
+   workers on its node, starting with a randomly-chosen victim.  Only if
+   all of that fails do we look at the other nodes in the same way.
+ */
+static bool
+lFindRange(WorkerThread *worker, TaskRange *range) {
+    if (worker != NULL && worker->deque.Pop(range))
+        return true;
+
+    int home = lCurrentNode();
+    for (int i = 0; i < numNodes; ++i) {
+        NumaNode *node = &nodes[(home + i) % numNodes];
+        if (lTakeQueuedRange(&node->queue, worker, range) ||
+            lStealRange(node, worker, range))
+            return true;
+    }
+    return false;
+}
+
+
+struct FindRange {
+    FindRange(WorkerThread *w, TaskRange *r) : worker(w), range(r) { }
+    bool operator()() const { return lFindRange(worker, range); }
+    WorkerThread *worker;
+    TaskRange *range;
+};
+
+
+static void *
+lWorkerEntry(void *arg) {
+    WorkerThread *worker = (WorkerThread *)arg;
+    lCurrentWorker = worker;
+    int spinLimit = MIN_IDLE_SPINS;
+
+    while (1) {
+        TaskRange range;
+        if (lFindRange(worker, &range) ||
+            lSpinWait(FindRange(worker, &range), &spinLimit)) {
+            lRunRange(range, worker);
+            continue;
+        }
+
+        // Nothing to do; park until more tasks are launched.
+        int32_t ticket = workerParking.PrepareToPark();
+        if (lFindRange(worker, &range)) {
+            workerParking.CancelPark();
+            lRunRange(range, worker);
+        }
+        else
+            workerParking.Park(ticket);
+    }
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+
+/** Sets up nodes[] and decides which CPUs each worker may run on.  With
+    NUMA placement, each worker is assigned to a node--round-robin over
+    the allowed CPUs, in node order--and may run on any CPU of that node,
+    unless it has been pinned to a particular CPU already.
+ */
+static void
+lSetupNodes(WorkerThread *workers, const std::vector<int> &workerCpus,
+            std::vector<std::vector<int> > *workerAffinity) {
+    const char *policy = getenv("ISPC_NUMA_POLICY");
+    std::vector<std::vector<int> > nodeCpus;
+    if (policy != NULL && strcmp(policy, "block") == 0)
+        nodeCpus = lReadNumaNodes();
+    else if (policy != NULL && *policy != '\0' && strcmp(policy, "none") != 0)
+        fprintf(stderr, "Ignoring unknown ISPC_NUMA_POLICY \"%s\".\n", policy);
+
+    // Only keep the allowed CPUs of each node, and the nodes with any.
+    std::vector<int> allowed = lAllowedCpus();
+    std::vector<std::vector<int> > usableNodes;
+    for (int n = 0; n < (int)nodeCpus.size(); ++n) {
+        std::vector<int> cpus;
+        for (int i = 0; i < (int)nodeCpus[n].size(); ++i)
+            if (std::find(allowed.begin(), allowed.end(), nodeCpus[n][i]) != allowed.end())
+                cpus.push_back(nodeCpus[n][i]);
+        if (cpus.size() > 0)
+            usableNodes.push_back(cpus);
+    }
+
+    workerAffinity->assign(nWorkers, std::vector<int>());
+    for (int i = 0; i < (int)workerCpus.size(); ++i)
+        (*workerAffinity)[i].push_back(workerCpus[i]);
+
+    if (usableNodes.size() < 2) {
+        numNodes = 1;
+        nodes = new NumaNode[1];
+        nodes[0].cpus = allowed;
+        for (int i = 0; i < nWorkers; ++i) {
+            workers[i].node = 0;
+            nodes[0].workers.push_back(&workers[i]);
+        }
+        return;
+    }
+
+    numNodes = (int)usableNodes.size();
+    nodes = new NumaNode[numNodes];
+    std::vector<int> nodeOrderCpus;
+    for (int n = 0; n < numNodes; ++n) {
+        nodes[n].cpus = usableNodes[n];
+        for (int i = 0; i < (int)usableNodes[n].size(); ++i) {
+            int cpu = usableNodes[n][i];
+            if (cpu >= (int)cpuToNode.size())
+                cpuToNode.resize(cpu + 1, 0);
+            cpuToNode[cpu] = n;
+            nodeOrderCpus.push_back(cpu);
+        }
+    }
+
+    for (int i = 0; i < nWorkers; ++i) {
+        int node;
+        if (workerCpus.size() > 0)
+            node = workerCpus[i] < (int)cpuToNode.size() ? cpuToNode[workerCpus[i]] : 0;
+        else {
+            // Worker i is thread i+1; the calling thread takes the first
+            // CPU of the first node.
+            node = cpuToNode[nodeOrderCpus[(i + 1) % nodeOrderCpus.size()]];
+            (*workerAffinity)[i] = nodes[node].cpus;
+        }
+        workers[i].node = node;
+        nodes[node].workers.push_back(&workers[i]);
+    }
+    numaBlockPolicy = true;
+}
+
+
+static void
+InitTaskSystem() {
+    if (workers == NULL) {
+        while (1) {
+            if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+                if (workers == NULL) {
+                    // As with the regular pthreads task system, we launch
+                    // one fewer thread than there are cores, since the
+                    // thread that calls ISPCSync() runs tasks as well.
+                    int numThreads;
+                    std::vector<int> workerCpus;
+                    lConfigureThreads(false, &numThreads, &workerCpus);
+                    nWorkers = numThreads - 1;
+
+                    WorkerThread *w = new WorkerThread[std::max(nWorkers, 1)];
+                    for (int i = 0; i < nWorkers; ++i) {
+                        w[i].index = i;
+                        w[i].rngState = 2654435761u * (i + 1);
+                    }
+
+                    std::vector<std::vector<int> > workerAffinity;
+                    lSetupNodes(w, workerCpus, &workerAffinity);
+
+                    // Publish the nodes before starting any of the
+                    // workers, so that they can steal from each other
+                    // right away.
+                    lMemFence();
+
+                    for (int i = 0; i < nWorkers; ++i) {
+                        int err = lCreateWorkerThread(&w[i].thread, &lWorkerEntry, &w[i],
+                                                      workerAffinity[i]);
+                        if (err != 0) {
+                            fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
+                            exit(1);
+                        }
+                    }
+
+                    // Other threads skip the lock once they see workers
+                    // set, so it has to come last.
+                    lMemFence();
+                    workers = w;
+                }
 
-            if (waitingTasks.size() == 0) {
-                // There's nothing left to start running from this group,
-                // so remove it from the active task list.
-                activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
-                                                 activeTaskGroups.end(), this));
-                inActiveList = false;
+                lMemFence();
+                lock = 0;
+                break;
             }
-            myTask = GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from group %p in sync\n", taskNumber, tg));
         }
-        else {
-            // Other threads are already working on all of the tasks in
-            // this group, so we can't help out by running one ourself.
-            // We'll try to run one from another group to make ourselves
-            // useful here.
-            if (activeTaskGroups.size() == 0) {
-                // No active task groups left--there's nothing for us to do.
-                if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-                    fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-                    exit(1);
-                }
-                // FIXME: We basically end up busy-waiting here, which is
-                // extra wasteful in a world with hyper-threading.  It would
-                // be much better to put this thread to sleep on a
-                // condition variable that was signaled when the last task
-                // in this group was finished.
-#ifndef ISPC_IS_KNC
-                usleep(1);
-#else
-                _mm_delay_32(8);
-#endif
-                continue;
-            }
+    }
+}
 
-            // Get a task to run from another task group.
-            runtg = activeTaskGroups.back();
-            assert(runtg->waitingTasks.size() > 0);
 
-            int taskNumber = runtg->waitingTasks.back();
-            runtg->waitingTasks.pop_back();
-            if (runtg->waitingTasks.size() == 0) {
-                // There's left to start running from this group, so remove
-                // it from the active task list.
-                activeTaskGroups.pop_back();
-                runtg->inActiveList = false;
+inline void
+TaskGroup::CountLaunch(TaskInfo *ti) {
+    // Count the tasks before they become visible to other threads, so
+    // that the count can't transiently drop to zero.
+    lAtomicAdd(&numUnfinishedTasks, ti->taskCount());
+    ti->group = this;
+}
+
+
+inline void
+TaskGroup::StartLaunch(TaskInfo *ti) {
+    const int count = ti->taskCount();
+
+    WorkerThread *worker = lCurrentWorker;
+    if (worker != NULL) {
+        // The whole launch is queued up as a single range, no matter how
+        // many tasks it has.  Launches from within tasks stay on the
+        // worker's node.
+        TaskRange range = { ti, 0, count };
+        worker->deque.Push(range);
+    }
+    else if (numaBlockPolicy && nWorkers > 0) {
+        // Give each node a contiguous block of tasks, sized by how many
+        // workers it has.  Since the split only depends on the task
+        // count, a given task index goes to the same node on every
+        // launch, so data that it first touched stays local.
+        int begin = 0, workersSoFar = 0;
+        for (int n = 0; n < numNodes; ++n) {
+            workersSoFar += (int)nodes[n].workers.size();
+            int end = (int)((int64_t)count * workersSoFar / nWorkers);
+            if (end > begin) {
+                TaskRange block = { ti, begin, end };
+                lQueueRange(&nodes[n].queue, block);
             }
-            myTask = runtg->GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from other group %p in sync\n", 
-                        taskNumber, runtg));
+            begin = end;
         }
+    }
+    else {
+        TaskRange range = { ti, 0, count };
+        lQueueRange(&nodes[lCurrentNode()].queue, range);
+    }
 
-        if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-            exit(1);
+    // Wake up as many workers as could help run the launch; if any more
+    // are needed, they'll be woken as the range is split.
+    workerParking.Wake(std::min(count, nWorkers));
+    syncParking.Wake(count);
+}
+
+
+/* Stops spinning when the group is done or a range turns up; *found
+   tells the caller which it was, so that it only runs a range that it
+   actually took.
+ */
+struct FindRangeOrDone {
+    FindRangeOrDone(const TaskGroup *g, WorkerThread *w, TaskRange *r,
+                    bool *f)
+        : group(g), worker(w), range(r), found(f) { }
+    bool operator()() const {
+        if (group->Done())
+            return true;
+        *found = lFindRange(worker, range);
+        return *found;
+    }
+    const TaskGroup *group;
+    WorkerThread *worker;
+    TaskRange *range;
+    bool *found;
+};
+
+
+inline void
+TaskGroup::Sync() {
+    WorkerThread *worker = lCurrentWorker;
+    int spinLimit = MIN_IDLE_SPINS;
+
+    // Rather than waiting idly, run tasks--ours or anyone else's--until
+    // all of the tasks in this group have finished.  When there's nothing
+    // left to run, the remaining tasks are running on other threads; we
+    // sleep until the last of them finishes (or more tasks are launched).
+    while (!Done()) {
+        TaskRange range;
+        bool found = lFindRange(worker, &range);
+        if (found ||
+            lSpinWait(FindRangeOrDone(this, worker, &range, &found), &spinLimit)) {
+            if (found)
+                lRunRange(range, worker);
+            continue;
         }
-    
-        //
-        // Do work for _myTask_
-        //
-        // FIXME: bogus values for thread index/thread count here as well..
-        myTask->func(myTask->data, 0, 1, myTask->taskIndex, myTask->taskCount(),
-            myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
-            myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
 
-        //
-        // Decrement the number of unfinished tasks counter
-        //
-        lMemFence();
-        lAtomicAdd(&runtg->numUnfinishedTasks, -1);
+        int32_t ticket = syncParking.PrepareToPark();
+        if (Done())
+            syncParking.CancelPark();
+        else if (lFindRange(worker, &range)) {
+            syncParking.CancelPark();
+            lRunRange(range, worker);
+        }
+        else
+            syncParking.Park(ticket);
     }
-    DBG(fprintf(stderr, "sync for %p done!n", tg));
+    lMemFence();
 }
 
-#endif // ISPC_USE_PTHREADS
+
+inline void
+TaskGroup::Poll() {
+    // Without any worker threads, nothing runs the tasks until someone
+    // syncs, so run a range of them here; otherwise polling would never
+    // see them finish.
+    TaskRange range;
+    if (nWorkers == 0 && lFindRange(lCurrentWorker, &range))
+        lRunRange(range, lCurrentWorker);
+}
+
+#endif // ISPC_USE_PTHREADS_WORK_STEALING
 
 ///////////////////////////////////////////////////////////////////////////
 // Cilk Plus
@@ -930,16 +2563,14 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
+TaskGroup::Launch(TaskInfo *ti) {
+    const int count = ti->taskCount();
     cilk_for(int i = 0; i < count; i++) {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
-
         // Actually run the task. 
         // Cilk does not expose the task -> thread mapping so we pretend it's 1:1
-        ti->func(ti->data, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        ti->RunTasks(i, i + 1, i, count);
     }
+    ti->TasksDone(count);
 }
 
 inline void
@@ -959,18 +2590,16 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
-#pragma omp parallel for
+TaskGroup::Launch(TaskInfo *ti) {
+    const int count = ti->taskCount();
+#pragma omp parallel for schedule(guided)
     for(int i = 0; i < count; i++) {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
-
         // Actually run the task. 
         int threadIndex = omp_get_thread_num();
         int threadCount = omp_get_num_threads();
-        ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        ti->RunTasks(i, i + 1, threadIndex, threadCount);
     }
+    ti->TasksDone(count);
 }
 
 inline void
@@ -991,19 +2620,20 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
-    tbb::parallel_for(0, count, [=](int i) {
-        TaskInfo *ti = GetTaskInfo(baseIndex + i);
-
-        // Actually run the task. 
+TaskGroup::Launch(TaskInfo *ti) {
+    const int count = ti->taskCount();
+    // TBB's partitioner splits the launch into ranges of tasks as threads
+    // become free to run them.
+    tbb::parallel_for(tbb::blocked_range<int>(0, count),
+                      [=](const tbb::blocked_range<int> &range) {
+        // Actually run the tasks. 
         // TBB does not expose the task -> thread mapping so we pretend it's 1:1
-        int threadIndex = ti->taskIndex;
-        int threadCount = ti->taskCount;
+        int threadIndex = range.begin();
+        int threadCount = count;
 
-        ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+        ti->RunTasks(range.begin(), range.end(), threadIndex, threadCount);
     });
+    ti->TasksDone(count);
 }
 
 inline void
@@ -1021,18 +2651,21 @@ InitTaskSystem() {
 }
 
 inline void
-TaskGroup::Launch(int baseIndex, int count) {
-    for (int i = 0; i < count; i++) {
+TaskGroup::Launch(TaskInfo *ti) {
+    const int count = ti->taskCount();
+    static const int numThreads = std::max((int)std::thread::hardware_concurrency(), 1);
+    // Queue a TBB task for each guided chunk of the launch, rather than
+    // one per ispc task.
+    for (int begin = 0; begin < count; ) {
+        int end = begin + lGuidedChunkSize(count - begin, numThreads);
         tbbTaskGroup.run([=]() {
-            TaskInfo *ti = GetTaskInfo(baseIndex + i);
-
             // TBB does not expose the task -> thread mapping so we pretend it's 1:1
-            int threadIndex = ti->taskIndex;
-            int threadCount = ti->taskCount;
-            ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(),
-            ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(),
-            ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
+            int threadIndex = begin;
+            int threadCount = count;
+            ti->RunTasks(begin, end, threadIndex, threadCount);
+            ti->TasksDone(end - begin);
         });
+        begin = end;
     }
 }
 
@@ -1055,9 +2688,11 @@ AllocTaskGroup() {
     for (int i = 0; i < MAX_FREE_TASK_GROUPS; ++i) {
         TaskGroup *tg = freeTaskGroups[i];
         if (tg != NULL) {
+            // Another thread may have swapped in a different group in
+            // the meantime; we only own tg if the slot still held it.
             void *ptr = lAtomicCompareAndSwapPointer((void **)(&freeTaskGroups[i]), NULL, tg);
-            if (ptr != NULL) {
-                return (TaskGroup *)ptr;
+            if (ptr == tg) {
+                return tg;
             }
         }
     }
@@ -1082,30 +2717,167 @@ FreeTaskGroup(TaskGroup *tg) {
 }
 
 ///////////////////////////////////////////////////////////////////////////
+// Launch dependencies
 
-void
-ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1, int count2) {
-    const int count = count0*count1*count2;
-    TaskGroup *taskGroup;
+// Marks the dependents list of a launch whose tasks have all finished.
+#define LAUNCH_FINISHED ((TaskDependent *)1)
+
+inline void
+TaskInfo::TasksDone(int count) {
+    if (lAtomicAdd(&numUnfinished, -count) != count)
+        return;
+
+#ifdef ISPC_DEFER_LAUNCHES
+    // Take the list of launches that are waiting for this one, marking
+    // it finished so that no more are added.
+    TaskDependent *dep;
+    do {
+        dep = dependents;
+    } while (lAtomicCompareAndSwapPointer((void **)&dependents, LAUNCH_FINISHED,
+                                          dep) != dep);
+
+    while (dep != NULL) {
+        // Once a launch starts, its group may finish and release the
+        // memory of its TaskDependent, so read the next one first.
+        TaskDependent *next = dep->next;
+        TaskInfo *ti = dep->launch;
+        if (lAtomicAdd(&ti->numPendingPredecessors, -1) == 1)
+            ti->group->StartLaunch(ti);
+        dep = next;
+    }
+#endif // ISPC_DEFER_LAUNCHES
+}
+
+
+#ifdef ISPC_DEFER_LAUNCHES
+
+/** Adds the given TaskDependent to the list of launches waiting for
+    predecessor to finish.  Returns false if it already has. */
+static bool
+lAddDependent(TaskInfo *predecessor, TaskDependent *dep) {
+    while (1) {
+        TaskDependent *head = predecessor->dependents;
+        if (head == LAUNCH_FINISHED)
+            return false;
+        dep->next = head;
+        if (lAtomicCompareAndSwapPointer((void **)&predecessor->dependents, dep,
+                                         head) == head)
+            return true;
+    }
+}
+
+#else
+
+/** Waits until all of the tasks from the given launch have finished.
+    (With the task systems whose Launch() runs all of the tasks before
+    returning, they already have.) */
+static void
+lWaitForLaunch(TaskGroup *group, const TaskInfo *ti) {
+#if defined(ISPC_USE_TBB_TASK_GROUP)
+    // TBB may not run the tasks in a task_group until someone waits for
+    // it, so wait for the ones in this group (which is where the
+    // predecessors usually are) before spinning.
+    if (ti->numUnfinished > 0)
+        group->Sync();
+#else
+    (void)group;
+#endif
+    while (ti->numUnfinished > 0) {
+#if defined(ISPC_USE_GCD)
+        sched_yield();
+#elif defined(ISPC_USE_CONCRT)
+        Context::Yield();
+#elif defined(ISPC_USE_TBB_TASK_GROUP)
+        std::this_thread::yield();
+#endif
+    }
+    lMemFence();
+}
+
+#endif // ISPC_DEFER_LAUNCHES
+
+///////////////////////////////////////////////////////////////////////////
+
+static TaskInfo *
+lAllocLaunch(void **taskGroupPtr, TaskGroup **taskGroup, void *func, void *data,
+             int count0, int count1, int count2) {
     if (*taskGroupPtr == NULL) {
         InitTaskSystem();
-        taskGroup = AllocTaskGroup();
-        *taskGroupPtr = taskGroup;
+        *taskGroup = AllocTaskGroup();
+        *taskGroupPtr = *taskGroup;
     }
     else
-        taskGroup = (TaskGroup *)(*taskGroupPtr);
+        *taskGroup = (TaskGroup *)(*taskGroupPtr);
+
+    if (count0*count1*count2 <= 0)
+        return NULL;
+
+    // A single TaskInfo describes all of the tasks in the launch.
+    TaskInfo *ti = (*taskGroup)->AllocTaskInfo();
+    ti->func = (TaskFuncType)func;
+    ti->data = data;
+    ti->taskCount3d[0] = count0;
+    ti->taskCount3d[1] = count1;
+    ti->taskCount3d[2] = count2;
+    ti->numUnfinished = ti->taskCount();
+#ifdef ISPC_DEFER_LAUNCHES
+    ti->dependents = NULL;
+#endif
+    return ti;
+}
+
 
-    int baseIndex = taskGroup->AllocTaskInfo(count);
-    for (int i = 0; i < count; ++i) {
-        TaskInfo *ti = taskGroup->GetTaskInfo(baseIndex+i);
-        ti->func = (TaskFuncType)func;
-        ti->data = data;
-        ti->taskIndex = i;
-        ti->taskCount3d[0] = count0;
-        ti->taskCount3d[1] = count1;
-        ti->taskCount3d[2] = count2;
+void *
+ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1, int count2) {
+    TaskGroup *taskGroup;
+    TaskInfo *ti = lAllocLaunch(taskGroupPtr, &taskGroup, func, data,
+                                count0, count1, count2);
+    if (ti == NULL)
+        return NULL;
+
+    taskGroup->Launch(ti);
+    // The TaskInfo doubles as the launch's handle.
+    return ti;
+}
+
+
+void *
+ISPCLaunchAfter(void **taskGroupPtr, void *func, void *data, int count0, int count1,
+                int count2, void **predecessors, int32_t numPredecessors) {
+    TaskGroup *taskGroup;
+    TaskInfo *ti = lAllocLaunch(taskGroupPtr, &taskGroup, func, data,
+                                count0, count1, count2);
+    if (ti == NULL)
+        return NULL;
+
+#ifdef ISPC_DEFER_LAUNCHES
+    // The tasks are counted in the group right away, so that a sync waits
+    // for them, but aren't started until the last predecessor finishes.
+    // The extra pending predecessor keeps that from happening until all
+    // of them have been registered.
+    taskGroup->CountLaunch(ti);
+    ti->numPendingPredecessors = numPredecessors + 1;
+
+    TaskDependent *deps = (TaskDependent *)
+        taskGroup->AllocMemory(numPredecessors * sizeof(TaskDependent),
+                               sizeof(void *));
+    int notWaiting = 1;
+    for (int i = 0; i < numPredecessors; ++i) {
+        deps[i].launch = ti;
+        if (predecessors[i] == NULL ||
+            !lAddDependent((TaskInfo *)predecessors[i], &deps[i]))
+            ++notWaiting;
     }
-    taskGroup->Launch(baseIndex, count);
+
+    if (lAtomicAdd(&ti->numPendingPredecessors, -notWaiting) == notWaiting)
+        taskGroup->StartLaunch(ti);
+#else
+    for (int i = 0; i < numPredecessors; ++i)
+        if (predecessors[i] != NULL)
+            lWaitForLaunch(taskGroup, (const TaskInfo *)predecessors[i]);
+    taskGroup->Launch(ti);
+#endif // ISPC_DEFER_LAUNCHES
+    return ti;
 }
 
 
@@ -1113,12 +2885,45 @@ void
 ISPCSync(void *h) {
     TaskGroup *taskGroup = (TaskGroup *)h;
     if (taskGroup != NULL) {
+        int64_t start = lTraceEnabled ? lTraceTime() : 0;
         taskGroup->Sync();
+        if (lTraceEnabled)
+            lTraceEvent(TRACE_SYNC, taskGroup, NULL, -1, -1, start);
         FreeTaskGroup(taskGroup);
     }
 }
 
 
+void
+ISPCBeginAsync(void **taskGroupPtr) {
+    InitTaskSystem();
+    TaskGroup *taskGroup = AllocTaskGroup();
+    taskGroup->BeginAsync();
+    *taskGroupPtr = taskGroup;
+}
+
+
+void
+ISPCWait(void *h) {
+    ISPCSync(h);
+}
+
+
+int
+ISPCTest(void *h) {
+    TaskGroup *taskGroup = (TaskGroup *)h;
+    if (taskGroup == NULL)
+        return 1;
+    if (taskGroup->AllLaunchesDone() == false) {
+        taskGroup->Poll();
+        return 0;
+    }
+    // Make sure the tasks' results are visible to the caller.
+    lMemFence();
+    return 1;
+}
+
+
 void *
 ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) {
     TaskGroup *taskGroup;
@@ -1135,100 +2940,202 @@ ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) {
 
 #else  // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
 
-#define MAX_LIVE_TASKS 1024
+#define LOG_LIVE_TASK_SEGMENT_SIZE 10
+#define LIVE_TASK_SEGMENT_SIZE (1<<LOG_LIVE_TASK_SEGMENT_SIZE)
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Small structure used to hold the data for each task
+// Small structure used to hold the data for each launch
 struct Task {
 public:
     TaskFuncType func;
     void *data;
     volatile int32_t taskIndex;
     int taskCount;
+    int taskCount3d[3];
 
     volatile int numDone;
-    int liveIndex; // index in live task queue
+    struct LiveTaskSegment *liveSegment; // where it is in the live task queue,
+                                         // or NULL if it was never launched
+    int liveIndex;
+
+    // The argument block comes from the arena of the thread that called
+    // ISPCAlloc(), or from the group's own arena for an 'export async'
+    // function; it's released back to mark when the task is synced.
+    MemArena *arena;
+    MemArena::Mark arenaMark;
+    bool ownsArena;
+    // The group's handle is its most recently allocated Task; the rest of
+    // the group's Tasks are chained off of it.
+    Task *prevInGroup;
+    Task *nextFree;
 
     inline int  noMoreWork() { return taskIndex >= taskCount; }
-    /*! given thread is done working on this task --> decrease num locks */
-    // inline void lock() { lAtomicAdd(&locks,1); }
-    // inline void unlock() { lAtomicAdd(&locks,-1); }
-    inline int  nextJob() { return lAtomicAdd(&taskIndex,1); }
+    inline bool nextJobs(int *begin, int *end);
     inline int  numJobs() { return taskCount; }
-    inline void schedule(int idx) { taskIndex = 0; numDone = 0; liveIndex = idx; }
+    inline void schedule(LiveTaskSegment *seg, int idx) {
+        taskIndex = 0; numDone = 0; liveSegment = seg; liveIndex = idx;
+    }
     inline void run(int idx, int threadIdx);
-    inline void markOneDone() { lAtomicAdd(&numDone,1); }
-    inline void wait()
+    inline void markDone(int count) {
+        // Wake up the thread waiting in TaskSys::sync() after the last job.
+        if (lAtomicAdd(&numDone,count) == taskCount-count)
+            syncParking.WakeAll();
+    }
+    inline bool runJobs(int threadIdx)
     {
-        while (!noMoreWork()) {
-            int next = nextJob();
-            if (next < numJobs()) run(next, 0);
-        }
-        while (numDone != taskCount) {
-#ifndef ISPC_IS_KNC
-            usleep(1);
-#else
-            _mm_delay_32(8);
-#endif
+        bool ranAny = false;
+        int begin, end;
+        while (nextJobs(&begin, &end)) {
+            for (int i = begin; i < end; ++i)
+                run(i, threadIdx);
+            markDone(end - begin);
+            ranAny = true;
         }
+        return ranAny;
     }
+    inline bool isDone() const { return numDone == taskCount; }
 };
 
 ///////////////////////////////////////////////////////////////////////////
+
+/* A slot in the live task queue.  Any thread may run jobs from the task
+   in it, as long as it holds a lock on the slot while doing so; once the
+   task's jobs are all done, TaskSys::sync() closes the slot and waits for
+   the lock holders to leave, after which the task can be recycled.
+   Closing a slot adds LIVE_TASK_CLOSED to locks, so that threads that
+   try to take a lock after that see a negative count and back off.
+ */
+#define LIVE_TASK_CLOSED (-(1<<30))
+
+// Values of LiveTask::state.
+#define LIVE_TASK_WAITING 0  // no task has been put in the slot yet
+#define LIVE_TASK_ACTIVE  1  // the task may have jobs left to run
+#define LIVE_TASK_SYNCED  2  // the task has been synced and recycled
+
+struct LiveTask
+{
+    volatile int locks; /*!< num threads running jobs from this task,
+                             plus LIVE_TASK_CLOSED when the slot isn't
+                             live */
+    volatile int state; /*! workers will spin on this until it's no
+                            longer LIVE_TASK_WAITING */
+    Task *task;
+
+    inline bool tryLock() {
+        if (lAtomicAdd(&locks,1) >= 0)
+            return true;
+        unlock();
+        return false;
+    }
+    inline void unlock() {
+        // Wake up TaskSys::sync() if it's waiting for us to leave.
+        if (lAtomicAdd(&locks,-1) == LIVE_TASK_CLOSED+1)
+            syncParking.WakeAll();
+    }
+    inline void open() { lAtomicAdd(&locks,-LIVE_TASK_CLOSED); }
+    inline void close() { lAtomicAdd(&locks,LIVE_TASK_CLOSED); }
+    inline bool closedAndUnlocked() const { return locks == LIVE_TASK_CLOSED; }
+
+    LiveTask() : locks(LIVE_TASK_CLOSED), state(LIVE_TASK_WAITING), task(NULL) {}
+};
+
+
+/* The live task queue is a chain of segments of LIVE_TASK_SEGMENT_SIZE
+   slots, which every worker walks in order.  Slots are claimed with a
+   compare-and-swap on the segment's state, which holds the index of the
+   next free slot in its low bits and a generation count above them.  The
+   thread that claims the last slot of a segment links in the next one
+   before it makes its task active, so a new segment is only needed once
+   per LIVE_TASK_SEGMENT_SIZE launches; that's the only time the mutex is
+   taken.  A segment is retired once all of its tasks have been synced
+   and all of the workers have moved on from it; the generation count
+   keeps a thread that is slow to claim a slot from claiming one in a
+   recycled segment.
+
+   Segments are only recycled from the head of the chain, once all of the
+   ones before them have been.  A thread that is syncing a task walks the
+   chain from that task's segment to help with later tasks; since its
+   task hasn't been synced yet, neither that segment nor any after it can
+   be recycled while it's doing so.
+ */
+struct LiveTaskSegment
+{
+    LiveTask tasks[LIVE_TASK_SEGMENT_SIZE];
+    LiveTaskSegment *volatile next;
+    volatile int32_t state;
+    // Counts synced tasks and workers that have moved on to the next
+    // segment.
+    volatile int32_t numRetired;
+
+    LiveTaskSegment() : next(NULL), state(0), numRetired(0) {}
+};
+
+#define LIVE_TASK_SLOT_BITS (LOG_LIVE_TASK_SEGMENT_SIZE + 1)
+#define LIVE_TASK_SLOT_MASK ((1<<LIVE_TASK_SLOT_BITS) - 1)
+
+
 class TaskSys {
     static int numThreadsRunning;
-    struct LiveTask
-    {
-        volatile int locks; /*!< num locks on this task. gets
-                                 initialized to NUM_THREADS+1, then counted
-                                 down by every thread that sees this. this
-                                 value is only valid when 'active' is set
-                                 to true */
-        volatile int active; /*! workers will spin on this until it
-                                 becomes active */
-        Task *task;
-
-        inline void doneWithThis() { lAtomicAdd(&locks,-1); }
-        LiveTask() : active(0), locks(-1) {}
+    static volatile int32_t numThreadsStarted;
+
+    struct LiveTaskReady {
+        LiveTaskReady(const LiveTask *t) : liveTask(t) { }
+        bool operator()() const { return liveTask->state != LIVE_TASK_WAITING; }
+        const LiveTask *liveTask;
     };
 
-public:
-    volatile int nextScheduleIndex; /*! next index in the task queue
-                                        where we'll insert a live task */
+    struct TaskDone {
+        TaskDone(const Task *t) : task(t) { }
+        bool operator()() const { return task->isDone(); }
+        const Task *task;
+    };
 
-    // inline int inc_begin() { int old = begin; begin = (begin+1)%MAX_TASKS; return old; }
-    // inline int inc_end() { int old = end; end = (end+1)%MAX_TASKS; return old; }
+    struct LockHoldersDone {
+        LockHoldersDone(const LiveTask *t) : liveTask(t) { }
+        bool operator()() const { return liveTask->closedAndUnlocked(); }
+        const LiveTask *liveTask;
+    };
 
-    LiveTask taskQueue[MAX_LIVE_TASKS];
-    std::stack<Task *> taskMem;
+public:
+    LiveTaskSegment *firstSegment; /*! where the workers start */
+    LiveTaskSegment *headSegment; /*! oldest segment that hasn't been
+                                      recycled; protected by mutex */
+    LiveTaskSegment *volatile tailSegment; /*! segment where we'll insert
+                                               the next live task */
+    std::vector<LiveTaskSegment *> freeSegments; // protected by mutex
 
     static TaskSys *global;
 
-    TaskSys() : nextScheduleIndex(0)
+    TaskSys()
     {
         TaskSys::global = this;
-        Task *mem = new Task[MAX_LIVE_TASKS]; //< could actually be more than _live_ tasks
-        for (int i=0;i<MAX_LIVE_TASKS;i++) {
-            taskMem.push(mem+i);
-        }
+        firstSegment = headSegment = tailSegment = new LiveTaskSegment;
         createThreads();
     }
 
-    inline Task *allocOne()
+    /* Tasks are allocated and synced by the same thread, so each thread
+       keeps its own list of free Task structures; no locking is needed.
+       (A Task synced by ISPCWait() on another thread goes on that
+       thread's list.)
+     */
+    static ISPC_THREAD_LOCAL Task *freeTasks;
+
+    static inline Task *allocOne()
     {
-        pthread_mutex_lock(&mutex);
-        if (taskMem.empty()) {
-            fprintf(stderr, "Too many live tasks.  "
-                    "Change the value of MAX_LIVE_TASKS and recompile.\n");
-            exit(1);
-        }
-        Task *task = taskMem.top();
-        taskMem.pop();
-        pthread_mutex_unlock(&mutex);
+        Task *task = freeTasks;
+        if (task == NULL)
+            return new Task;
+        freeTasks = task->nextFree;
         return task;
     }
 
+    static inline void freeOne(Task *task)
+    {
+        task->nextFree = freeTasks;
+        freeTasks = task;
+    }
+
     static inline void init()
     {
         if (global) return;
@@ -1240,74 +3147,261 @@ public:
     void createThreads();
     int nThreads;
     pthread_t *thread;
+    WorkerParking parking;
 
     void threadFct();
 
-    inline void schedule(Task *t)
+    /** Links a new segment after the given (full) one. */
+    inline void appendSegment(LiveTaskSegment *seg)
     {
         pthread_mutex_lock(&mutex);
-        int liveIndex = nextScheduleIndex;
-        nextScheduleIndex = (nextScheduleIndex+1)%MAX_LIVE_TASKS;
-        if (taskQueue[liveIndex].active) {
-            fprintf(stderr, "Out of task queue resources.  "
-                    "Change the value of MAX_LIVE_TASKS and recompile.\n");
-            exit(1);
+        LiveTaskSegment *next;
+        if (freeSegments.size() > 0) {
+            // All of its slots are closed already; threads that still
+            // try to lock them will just back off.
+            next = freeSegments.back();
+            freeSegments.pop_back();
+            int gen = (next->state >> LIVE_TASK_SLOT_BITS) + 1;
+            for (int i = 0; i < LIVE_TASK_SEGMENT_SIZE; ++i)
+                next->tasks[i].state = LIVE_TASK_WAITING;
+            next->next = NULL;
+            next->numRetired = 0;
+            lMemFence();
+            next->state = (gen & (INT32_MAX >> LIVE_TASK_SLOT_BITS)) << LIVE_TASK_SLOT_BITS;
         }
-        taskQueue[liveIndex].task = t;
-        t->schedule(liveIndex);
-        taskQueue[liveIndex].locks = numThreadsRunning+1; // num _worker_ threads plus creator
-        taskQueue[liveIndex].active = true;
+        else
+            next = new LiveTaskSegment;
         pthread_mutex_unlock(&mutex);
+
+        seg->next = next;
+        lMemFence();
+        tailSegment = next;
     }
 
-    void sync(Task *task)
+    /** Counts one more synced task or departed worker for the segment.
+        Once that's all of them, recycles it and any retired segments
+        after it, as long as all of the ones before them have been. */
+    inline void retireFromSegment(LiveTaskSegment *seg)
     {
-        task->wait();
-        int liveIndex = task->liveIndex;
-        while (taskQueue[liveIndex].locks > 1) {
-#ifndef ISPC_IS_KNC
-            usleep(1);
-#else
-            _mm_delay_32(8);
-#endif
-        }
-        _mm_free(task->data);
+        if (lAtomicAdd(&seg->numRetired, 1) !=
+            LIVE_TASK_SEGMENT_SIZE + numThreadsRunning - 1)
+            return;
+
         pthread_mutex_lock(&mutex);
-        taskMem.push(task); // recycle task index
-        taskQueue[liveIndex].active = false;
+        while (headSegment->numRetired == LIVE_TASK_SEGMENT_SIZE + numThreadsRunning) {
+            // The head has been retired by everyone, so its next segment
+            // has been linked in.
+            LiveTaskSegment *head = headSegment;
+            headSegment = head->next;
+            freeSegments.push_back(head);
+        }
         pthread_mutex_unlock(&mutex);
     }
+
+    inline void schedule(Task *t)
+    {
+        // Claim the next slot in the live task queue.
+        LiveTaskSegment *seg;
+        int liveIndex;
+        while (1) {
+            seg = tailSegment;
+            int32_t state = seg->state;
+            liveIndex = state & LIVE_TASK_SLOT_MASK;
+            // Make sure that the state we read is for the tail segment,
+            // rather than for a segment that has since been recycled.
+            lMemFence();
+            if (seg != tailSegment)
+                continue;
+            if (liveIndex >= LIVE_TASK_SEGMENT_SIZE) {
+                // Full; the next segment is about to be linked in.
+                lSpinPause();
+                continue;
+            }
+            if (lAtomicCompareAndSwap32(&seg->state, state + 1, state) == state)
+                break;
+        }
+
+        if (liveIndex == LIVE_TASK_SEGMENT_SIZE - 1)
+            appendSegment(seg);
+
+        LiveTask *live = &seg->tasks[liveIndex];
+        live->task = t;
+        t->schedule(seg, liveIndex);
+        // Make sure the task is all set up before anyone can lock it.
+        lMemFence();
+        live->open();
+        live->state = LIVE_TASK_ACTIVE;
+
+        // Every worker has to see every live task, so wake them all.
+        parking.Wake(numThreadsRunning);
+        syncParking.Wake(t->taskCount);
+    }
+
+    /** Runs jobs from tasks that were scheduled after the given one, for
+        threads that are waiting for it in sync().  Returns true if it
+        found any jobs to run. */
+    bool helpOthers(const Task *task)
+    {
+        LiveTaskSegment *seg = task->liveSegment;
+        int i = task->liveIndex + 1;
+        while (seg != NULL) {
+            for (; i < LIVE_TASK_SEGMENT_SIZE; ++i) {
+                LiveTask *live = &seg->tasks[i];
+                if (live->state != LIVE_TASK_ACTIVE ||
+                    live->task->noMoreWork() || !live->tryLock())
+                    continue;
+                bool ranAny = live->task->runJobs(nThreads);
+                live->unlock();
+                if (ranAny)
+                    return true;
+            }
+            seg = seg->next;
+            i = 0;
+        }
+        return false;
+    }
+
+    /** Waits until found() returns true: spinning for a bit, then sleeping
+        until someone wakes up the threads in sync(). */
+    template <typename FoundFunc> void syncWait(FoundFunc found, int *spinLimit)
+    {
+        if (found() || lSpinWait(found, spinLimit))
+            return;
+        int32_t ticket = syncParking.PrepareToPark();
+        if (found())
+            syncParking.CancelPark();
+        else
+            syncParking.Park(ticket);
+    }
+
+    /** Waits until all of the jobs from the given task have finished.
+        The task must have been launched and not yet synced. */
+    void wait(Task *task, int *spinLimit)
+    {
+        // Run the task's own jobs first, and then, rather than waiting
+        // idly for the workers to finish the rest, help with later tasks
+        // (such as the ones that its jobs launched).  Since we only wait
+        // for the threads that are running jobs from this task, a worker
+        // that is itself blocked in a nested sync() can't hold us up.
+        task->runJobs(nThreads);
+        while (!task->isDone()) {
+            if (!helpOthers(task))
+                syncWait(TaskDone(task), spinLimit);
+        }
+    }
+
+    /** Waits for the task to finish and then recycles it. */
+    void sync(Task *task, int *spinLimit)
+    {
+        LiveTaskSegment *seg = task->liveSegment;
+        if (seg != NULL) {
+            wait(task, spinLimit);
+
+            LiveTask *live = &seg->tasks[task->liveIndex];
+            live->close();
+            while (!live->closedAndUnlocked())
+                syncWait(LockHoldersDone(live), spinLimit);
+            // Workers that haven't gotten to the slot yet skip it from
+            // now on.
+            live->state = LIVE_TASK_SYNCED;
+        }
+
+        task->arena->Release(task->arenaMark);
+        freeOne(task); // recycle task
+        if (seg != NULL) {
+            lMemFence();
+            retireFromSegment(seg);
+        }
+    }
+
+    /** Runs a chunk of the task's jobs if there are no workers to run
+        them, so that polling it with ISPCTest() makes progress. */
+    void poll(Task *task)
+    {
+        LiveTaskSegment *seg = task->liveSegment;
+        if (nThreads > 0 || seg == NULL)
+            return;
+        LiveTask *live = &seg->tasks[task->liveIndex];
+        int begin, end;
+        if (!live->tryLock())
+            return;
+        if (task->nextJobs(&begin, &end)) {
+            for (int i = begin; i < end; ++i)
+                task->run(i, nThreads);
+            task->markDone(end - begin);
+        }
+        live->unlock();
+    }
 };
 
 
 void TaskSys::threadFct() 
 {
-    int myIndex = 0; //lAtomicAdd(&threadIdx,1);
+    LiveTaskSegment *seg = firstSegment;
+    int myIndex = 0;
+    // Workers get thread indices [0, nThreads); the threads that sync all
+    // use nThreads.
+    int threadIndex = lAtomicAdd(&numThreadsStarted, 1);
+    int spinLimit = MIN_IDLE_SPINS;
     while (1) {
-        while (!taskQueue[myIndex].active) {
-#ifndef ISPC_IS_KNC
-            usleep(4);
-#else
-            _mm_delay_32(32);
-#endif
+        LiveTask *live = &seg->tasks[myIndex];
+        if (live->state == LIVE_TASK_WAITING &&
+            !lSpinWait(LiveTaskReady(live), &spinLimit)) {
+            // Nothing to do; park until the next task is scheduled.
+            int32_t ticket = parking.PrepareToPark();
+            if (live->state != LIVE_TASK_WAITING)
+                parking.CancelPark();
+            else
+                parking.Park(ticket);
             continue;
         }
 
-        Task *mine = taskQueue[myIndex].task;
-        while (!mine->noMoreWork()) {
-            int job = mine->nextJob();
-            if (job >= mine->numJobs()) break;
-            mine->run(job,myIndex);
+        if (live->state == LIVE_TASK_ACTIVE && live->tryLock()) {
+            live->task->runJobs(threadIndex);
+            live->unlock();
+        }
+
+        if (++myIndex == LIVE_TASK_SEGMENT_SIZE) {
+            // The next segment was linked in before the last task of this
+            // one was made active.
+            LiveTaskSegment *next = seg->next;
+            retireFromSegment(seg);
+            seg = next;
+            myIndex = 0;
+        }
+    }
+}
+
+
+/* Claims the next guided chunk of jobs, [*begin, *end); returns false
+   once they've all been claimed.  Every worker and the thread that
+   launched the task may be running its jobs.
+ */
+inline bool Task::nextJobs(int *begin, int *end) {
+    while (1) {
+        int32_t first = taskIndex;
+        if (first >= numJobs())
+            return false;
+        int32_t last = first + lGuidedChunkSize(numJobs() - first,
+                                                TaskSys::global->nThreads + 1);
+        if (lAtomicCompareAndSwap32(&taskIndex, last, first) == first) {
+            *begin = first;
+            *end = last;
+            return true;
         }
-        taskQueue[myIndex].doneWithThis();
-        myIndex = (myIndex+1)%MAX_LIVE_TASKS;
     }
 }
 
 
 inline void Task::run(int idx, int threadIdx) {
-    (*this->func)(data,threadIdx,TaskSys::global->nThreads,idx,taskCount);
-    markOneDone();
+    int64_t start = lTraceEnabled ? lTraceTime() : 0;
+    int idx0 = idx % taskCount3d[0];
+    int idx1 = (idx / taskCount3d[0]) % taskCount3d[1];
+    int idx2 = idx / (taskCount3d[0] * taskCount3d[1]);
+    (*this->func)(data, threadIdx, TaskSys::global->nThreads + 1, idx, taskCount,
+                  idx0, idx1, idx2, taskCount3d[0], taskCount3d[1], taskCount3d[2]);
+    if (lTraceEnabled)
+        lTraceEvent(TRACE_TASK, this, (const void *)func, idx, threadIdx, start);
 }
 
 
@@ -1320,26 +3414,22 @@ void *_threadFct(void *data) {
 void TaskSys::createThreads() 
 {
     init();
-    int reserved = 4;
-    int minid = 2;
-    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - reserved;
+    // This task system takes over the machine, so by default it pins one
+    // worker to each CPU that we're allowed to run on.
+    int numThreads;
+    std::vector<int> workerCpus;
+    lConfigureThreads(true, &numThreads, &workerCpus);
+    nThreads = numThreads - 1;
 
     thread = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
 
-    numThreadsRunning = 0;
+    // Every worker counts toward retiring each segment, so they all have
+    // to be counted before any of them starts.
+    numThreadsRunning = nThreads;
     for (int i = 0; i < nThreads; ++i) {
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setstacksize(&attr, 2*1024 * 1024);
-
-        int threadID = minid+i;
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(threadID,&cpuset);
-        int ret = pthread_attr_setaffinity_np(&attr,sizeof(cpuset),&cpuset);
-
-        int err = pthread_create(&thread[i], &attr, &_threadFct, this);
-        ++numThreadsRunning;
+        int err = lCreateWorkerThread(&thread[i], &_threadFct, this,
+                                      workerCpus.size() ? workerCpus[i] : -1,
+                                      2*1024 * 1024);
         if (err != 0) {
             fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
             exit(1);
@@ -1349,33 +3439,114 @@ void TaskSys::createThreads()
 
 TaskSys * TaskSys::global = NULL;
 int TaskSys::numThreadsRunning = 0;
+volatile int32_t TaskSys::numThreadsStarted = 0;
+ISPC_THREAD_LOCAL Task *TaskSys::freeTasks = NULL;
 
 ///////////////////////////////////////////////////////////////////////////
 
-void ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count) 
+void *ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0,
+                 int count1, int count2) 
 {
+    // ISPCAlloc() has just allocated the Task for this launch.
     Task *ti = *(Task**)taskGroupPtr;
+    int count = count0 * count1 * count2;
+    if (count == 0)
+        return NULL;
     ti->func = (TaskFuncType)func;
     ti->data = data;
-    ti->taskIndex = 0;
     ti->taskCount = count;
+    ti->taskCount3d[0] = count0;
+    ti->taskCount3d[1] = count1;
+    ti->taskCount3d[2] = count2;
     TaskSys::global->schedule(ti);
+    return ti;
+}
+
+void *ISPCLaunchAfter(void **taskGroupPtr, void *func, void *data, int count0,
+                      int count1, int count2, void **predecessors,
+                      int32_t numPredecessors) 
+{
+    // Tasks are scheduled as soon as they're launched here, so wait for
+    // the predecessors (helping to run them) first.
+    int spinLimit = MIN_IDLE_SPINS;
+    for (int i = 0; i < numPredecessors; ++i) {
+        Task *pred = (Task *)predecessors[i];
+        if (pred != NULL && !pred->isDone())
+            TaskSys::global->wait(pred, &spinLimit);
+    }
+    return ISPCLaunch(taskGroupPtr, func, data, count0, count1, count2);
 }
 
 void ISPCSync(void *h) 
 {
     Task *task = (Task *)h; 
-    assert(task);
-    TaskSys::global->sync(task);
+    if (task == NULL)
+        return;
+    int64_t start = lTraceEnabled ? lTraceTime() : 0;
+    // Sync the group's Tasks newest first, so that their argument blocks
+    // are released in the reverse order of their allocation.
+    int spinLimit = MIN_IDLE_SPINS;
+    while (task != NULL) {
+        Task *prev = task->prevInGroup;
+        MemArena *ownArena = (prev == NULL && task->ownsArena) ? task->arena : NULL;
+        TaskSys::global->sync(task, &spinLimit);
+        delete ownArena;
+        task = prev;
+    }
+    if (lTraceEnabled)
+        lTraceEvent(TRACE_SYNC, h, NULL, -1, -1, start);
+}
+
+// An 'export async' function's group starts with a Task that's never
+// launched and that owns the arena for the group's argument blocks, since
+// it may be waited for after its caller's other groups have been synced,
+// or from another thread.
+void ISPCBeginAsync(void **taskGroupPtr) 
+{
+    TaskSys::init();
+    Task *task = TaskSys::global->allocOne();
+    task->taskCount = task->numDone = 0;
+    task->liveSegment = NULL;
+    task->arena = new MemArena;
+    task->arenaMark = task->arena->GetMark();
+    task->ownsArena = true;
+    task->prevInGroup = NULL;
+    *taskGroupPtr = task;
+}
+
+void ISPCWait(void *h) 
+{
+    ISPCSync(h);
+}
+
+int ISPCTest(void *h) 
+{
+    for (Task *task = (Task *)h; task != NULL; task = task->prevInGroup) {
+        if (!task->isDone()) {
+            TaskSys::global->poll(task);
+            return 0;
+        }
+    }
+    // Make sure the tasks' results are visible to the caller.
+    lMemFence();
+    return 1;
 }
 
 void *ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) 
 {
     TaskSys::init();
+    Task *prev = *(Task**)taskGroupPtr;
     Task *task = TaskSys::global->allocOne();
+    // Until it's launched, the Task has no tasks to wait for.
+    task->taskCount = task->numDone = 0;
+    task->liveSegment = NULL;
+    task->arena = prev ? prev->arena : lGetThreadArena();
+    task->arenaMark = task->arena->GetMark();
+    task->ownsArena = false;
+    task->prevInGroup = prev;
     *taskGroupPtr = task;
-    task->data = _mm_malloc(size,alignment);
-    return task->data;//*taskGroupPtr;
+    task->data = task->arena->Alloc(size, alignment);
+    return task->data;
 }
 
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
@@ -288,9 +288,10 @@ lDoTypeConv(const Type *fromType, const Type *toType, Expr **expr,
         if (toPointerType->GetBaseType()->IsConstType())
             eltType = eltType->GetAsConstType();
 
-        PointerType pt(eltType, toPointerType->GetVariability(),
-                       toPointerType->IsConstType());
-        if (Type::Equal(toPointerType, &pt))
+        const PointerType *pt =
+            PointerType::Get(eltType, toPointerType->GetVariability(),
+                             toPointerType->IsConstType());
+        if (Type::Equal(toPointerType, pt))
             goto typecast_ok;
         else {
             if (!failureOk)
@@ -3551,10 +3552,11 @@ SelectExpr::Print() const {
 // FunctionCallExpr
 
 FunctionCallExpr::FunctionCallExpr(Expr *f, ExprList *a, SourcePos p,
-                                   bool il, Expr *lce[3])
+                                   bool il, Expr *lce[3], ExprList *lp)
     : Expr(p), isLaunch(il) {
     func = f;
     args = a;
+    launchPredecessors = lp;
     if (lce != NULL)
     {
       launchCountExpr[0] = lce[0];
@@ -3686,8 +3688,24 @@ FunctionCallExpr::GetValue(FunctionEmitContext *ctx) const {
           launchCountExpr[1]->GetValue(ctx),
           launchCountExpr[2]->GetValue(ctx) };
 
+        std::vector<llvm::Value *> predecessors;
+        if (launchPredecessors != NULL) {
+            for (unsigned int i = 0; i < launchPredecessors->exprs.size(); ++i) {
+                Expr *predExpr = launchPredecessors->exprs[i];
+                llvm::Value *pred = predExpr ? predExpr->GetValue(ctx) : NULL;
+                if (pred == NULL) {
+                    AssertPos(pos, m->errorCount > 0);
+                    return NULL;
+                }
+                predecessors.push_back(pred);
+            }
+        }
+
+        // The value of a "launch" expression is a handle to the launch,
+        // which can be used in the "after" clause of later launches.
         if (launchCount[0] != NULL)
-            ctx->LaunchInst(callee, argVals, launchCount);
+            return ctx->LaunchInst(callee, argVals, launchCount, predecessors);
+        return NULL;
     }
     else
         retVal = ctx->CallInst(callee, ft, argVals,
@@ -3743,6 +3761,9 @@ FunctionCallExpr::GetType() const {
         }
     }
     const FunctionType *ftype = lGetFunctionType(func);
+    if (ftype != NULL && isLaunch)
+        // Launches evaluate to a handle that identifies them.
+        return PointerType::Void;
     return ftype ? ftype->GetReturnType() : NULL;
 }
 
@@ -3820,6 +3841,17 @@ FunctionCallExpr::TypeCheck() {
               if (launchCountExpr[k] == NULL)
                 return NULL;
             }
+            if (launchPredecessors != NULL) {
+                for (unsigned int i = 0; i < launchPredecessors->exprs.size(); ++i) {
+                    Expr *&pred = launchPredecessors->exprs[i];
+                    if (pred == NULL)
+                        return NULL;
+                    pred = TypeConvertExpr(pred, PointerType::Void,
+                                           "\"after\" clause of launch");
+                    if (pred == NULL)
+                        return NULL;
+                }
+            }
         }
         else {
             if (isLaunch) {
@@ -3935,6 +3967,11 @@ FunctionCallExpr::Print() const {
 
     printf("[%s] funcall %s ", GetType()->GetString().c_str(),
            isLaunch ? "launch" : "");
+    if (launchPredecessors != NULL) {
+        printf("after (");
+        launchPredecessors->Print();
+        printf(") ");
+    }
     func->Print();
     printf(" args (");
     args->Print();
@@ -7126,8 +7163,8 @@ static const Type *
 lDeconstifyType(const Type *t) {
     const PointerType *pt = CastType<PointerType>(t);
     if (pt != NULL)
-        return new PointerType(lDeconstifyType(pt->GetBaseType()),
-                               pt->GetVariability(), false);
+        return PointerType::Get(lDeconstifyType(pt->GetBaseType()),
+                                pt->GetVariability(), false);
     else
         return t->GetAsNonConstType();
 }
@@ -8299,6 +8336,26 @@ FunctionSymbolExpr::ResolveOverloads(SourcePos argPos,
     // called.
     bool exactMatchOnly = (name.substr(0,2) == "__");
 
+    // Calls with the same argument types resolve to the same overload, so
+    // reuse an earlier call's result if there is one.  That's only valid
+    // if our candidates are all of the overloads that the symbol table
+    // currently knows about.
+    bool canMemoize = (m->symbolTable->GetOverloadCount(name.c_str()) ==
+                       (int)candidateFunctions.size());
+    SymbolTable::OverloadKey key;
+    if (canMemoize) {
+        key.first = argTypes;
+        for (int i = 0; i < (int)argTypes.size(); ++i) {
+            key.second.push_back(argCouldBeNULL != NULL && (*argCouldBeNULL)[i]);
+            key.second.push_back(argIsConstant != NULL && (*argIsConstant)[i]);
+        }
+        Symbol *func = m->symbolTable->LookupResolvedOverload(name.c_str(), key);
+        if (func != NULL) {
+            matchingFunc = func;
+            return true;
+        }
+    }
+
     // First, find the subset of overload candidates that take the same
     // number of arguments as have parameters (including functions that
     // take more arguments but have defaults starting no later than after
@@ -8340,6 +8397,8 @@ FunctionSymbolExpr::ResolveOverloads(SourcePos argPos,
     if (matches.size() == 1) {
         // Only one match: success
         matchingFunc = matches[0];
+        if (canMemoize)
+            m->symbolTable->AddResolvedOverload(name.c_str(), key, matchingFunc);
         return true;
     }
     else if (matches.size() > 1) {
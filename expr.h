@@ -248,7 +248,8 @@ class FunctionCallExpr : public Expr {
 public:
     FunctionCallExpr(Expr *func, ExprList *args, SourcePos p,
                      bool isLaunch = false, 
-                     Expr *launchCountExpr[3] = NULL);
+                     Expr *launchCountExpr[3] = NULL,
+                     ExprList *launchPredecessors = NULL);
 
     llvm::Value *GetValue(FunctionEmitContext *ctx) const;
     llvm::Value *GetLValue(FunctionEmitContext *ctx) const;
@@ -264,6 +265,9 @@ public:
     ExprList *args;
     bool isLaunch;
     Expr *launchCountExpr[3];
+    /** For launches with an "after" clause, the handles of the launches
+        that must finish before this one's tasks start; NULL otherwise. */
+    ExprList *launchPredecessors;
 };
 
 
@@ -630,6 +634,10 @@ public:
                           const std::vector<bool> *argIsConstant = NULL);
     Symbol *GetMatchingFunction();
 
+    /** Returns all of the functions with the name given in the function
+        call. */
+    const std::vector<Symbol *> &GetCandidates() const { return candidateFunctions; }
+
 private:
     std::vector<Symbol *> getCandidateFunctions(int argCount) const;
     static int computeOverloadCost(const FunctionType *ftype,
@@ -82,12 +82,27 @@
 Function::Function(Symbol *s, Stmt *c) {
     sym = s;
     code = c;
+    allOnFunction = NULL;
 
     maskSymbol = m->symbolTable->LookupVariable("__mask");
     Assert(maskSymbol != NULL);
 
+    std::string funcName = sym->function ? sym->function->getName().str() : sym->name;
+
     if (code != NULL) {
-        code = TypeCheck(code);
+        if (g->opt.soaStructArrays)
+            ConvertSOAStructArrays(code);
+
+        if (g->opt.uniformizeVariables) {
+            TimeReportScope scope("uniformization", funcName);
+            const FunctionType *ft = CastType<FunctionType>(sym->type);
+            UniformizeVariables(code, ft ? ft->GetReturnType() : NULL);
+        }
+
+        {
+            TimeReportScope scope("type checking", funcName);
+            code = TypeCheck(code);
+        }
 
         if (code != NULL && g->debugPrint) {
             printf("After typechecking function \"%s\":\n",
@@ -97,7 +112,10 @@ Function::Function(Symbol *s, Stmt *c) {
         }
 
         if (code != NULL) {
-            code = Optimize(code);
+            {
+                TimeReportScope scope("AST optimization", funcName);
+                code = Optimize(code);
+            }
             if (g->debugPrint) {
                 printf("After optimizing function \"%s\":\n",
                         sym->name.c_str());
@@ -218,6 +236,33 @@ lCopyInTaskParameter(int i, llvm::Value *structArgPtr, const
 }
 
 
+/** Returns true if code should be emitted at the start of the given
+    function that checks whether the execution mask is all on and, if
+    so, runs a variant of the function's code that takes advantage of
+    that.  This is only worthwhile for non-trivial functions that aren't
+    going to be inlined anyway.
+ */
+static bool
+lCheckMaskAtFunctionStart(const FunctionType *type, llvm::Function *function,
+                          int costEstimate) {
+    bool checkMask = (type->isTask == true) ||
+        (
+#if defined(LLVM_3_1)
+          (function->hasFnAttr(llvm::Attribute::AlwaysInline) == false)
+#elif defined(LLVM_3_2)
+          (function->getFnAttributes().hasAttribute(llvm::Attributes::AlwaysInline) == false)
+#else // LLVM 3.3+
+          (function->getAttributes().getFnAttributes().hasAttribute(llvm::AttributeSet::FunctionIndex, llvm::Attribute::AlwaysInline) == false)
+#endif
+         &&
+         costEstimate > CHECK_MASK_AT_FUNCTION_START_COST);
+    checkMask &= (type->isUnmasked == false);
+    checkMask &= (g->target->getMaskingIsFree() == false);
+    checkMask &= (g->opt.disableCoherentControlFlow == false);
+    return checkMask;
+}
+
+
 /** Given the statements implementing a function, emit the code that
     implements the function.  Most of the work do be done here just
     involves wiring up the function parameter values to be available in the
@@ -334,7 +379,11 @@ Function::emitCode(FunctionEmitContext *ctx, llvm::Function *function,
             // Otherwise use the mask to set the entry mask value
             argIter->setName("__mask");
             Assert(argIter->getType() == LLVMTypes::MaskType);
-            ctx->SetFunctionMask(argIter);
+            if (function == allOnFunction)
+                // This variant is only ever called with an all-on mask
+                ctx->SetFunctionMask(LLVMMaskAllOn);
+            else
+                ctx->SetFunctionMask(argIter);
             Assert(++argIter == function->arg_end());
         }
     }
@@ -352,20 +401,8 @@ Function::emitCode(FunctionEmitContext *ctx, llvm::Function *function,
         // entire thing inside code that tests to see if the mask is all
         // on, all off, or mixed.  If this is a simple function, then this
         // isn't worth the code bloat / overhead.
-        bool checkMask = (type->isTask == true) ||
-            (
-#if defined(LLVM_3_1)
-              (function->hasFnAttr(llvm::Attribute::AlwaysInline) == false)
-#elif defined(LLVM_3_2)
-              (function->getFnAttributes().hasAttribute(llvm::Attributes::AlwaysInline) == false)
-#else // LLVM 3.3+
-              (function->getAttributes().getFnAttributes().hasAttribute(llvm::AttributeSet::FunctionIndex, llvm::Attribute::AlwaysInline) == false)
-#endif
-             &&
-             costEstimate > CHECK_MASK_AT_FUNCTION_START_COST);
-        checkMask &= (type->isUnmasked == false);
-        checkMask &= (g->target->getMaskingIsFree() == false);
-        checkMask &= (g->opt.disableCoherentControlFlow == false);
+        bool checkMask = (function != allOnFunction &&
+                          lCheckMaskAtFunctionStart(type, function, costEstimate));
 
         if (checkMask) {
             llvm::Value *mask = ctx->GetFunctionMask();
@@ -382,11 +419,28 @@ Function::emitCode(FunctionEmitContext *ctx, llvm::Function *function,
             // codegen for this path can be improved with this knowledge in
             // hand...
             ctx->SetCurrentBasicBlock(bbAllOn);
-            if (!g->opt.disableMaskAllOnOptimizations)
-                ctx->SetFunctionMask(LLVMMaskAllOn);
-            code->EmitCode(ctx);
-            if (ctx->GetCurrentBasicBlock())
-                ctx->ReturnInst();
+            if (allOnFunction != NULL && function == sym->function) {
+                // If we've emitted a variant of the function for the
+                // all-on case, just call it.
+                std::vector<llvm::Value *> allOnArgs;
+                for (llvm::Function::arg_iterator ai = function->arg_begin();
+                     ai != function->arg_end(); ++ai)
+                    allOnArgs.push_back(ai);
+                llvm::Value *retVal =
+                    ctx->CallInst(allOnFunction, type, allOnArgs, "");
+                if (Type::Equal(type->GetReturnType(), AtomicType::Void))
+                    llvm::ReturnInst::Create(*g->ctx, ctx->GetCurrentBasicBlock());
+                else
+                    llvm::ReturnInst::Create(*g->ctx, retVal,
+                                             ctx->GetCurrentBasicBlock());
+            }
+            else {
+                if (!g->opt.disableMaskAllOnOptimizations)
+                    ctx->SetFunctionMask(LLVMMaskAllOn);
+                code->EmitCode(ctx);
+                if (ctx->GetCurrentBasicBlock())
+                    ctx->ReturnInst();
+            }
 
             // not all on: however, at least one lane must be running,
             // since we should never run with all off...  some on: reset
@@ -442,6 +496,26 @@ Function::emitCode(FunctionEmitContext *ctx, llvm::Function *function,
 }
 
 
+/** Preorder callback that checks for declarations of static variables. */
+static bool
+lCheckForStaticVariables(ASTNode *node, void *data) {
+    DeclStmt *ds = dynamic_cast<DeclStmt *>(node);
+    if (ds != NULL) {
+        for (unsigned int i = 0; i < ds->vars.size(); ++i)
+            if (ds->vars[i].sym != NULL &&
+                ds->vars[i].sym->storageClass == SC_STATIC)
+                *((bool *)data) = true;
+    }
+    return true;
+}
+
+
+llvm::Function *
+Function::GetAllOnVariant(llvm::Function *function) {
+    return m->module->getFunction(function->getName().str() + "___all_on");
+}
+
+
 void
 Function::GenerateIR() {
     if (sym == NULL)
@@ -451,6 +525,8 @@ Function::GenerateIR() {
     llvm::Function *function = sym->function;
     Assert(function != NULL);
 
+    TimeReportScope scope("IR emission", function->getName().str());
+
     // But if that function has a definition, we don't want to redefine it.
     if (function->empty() == false) {
         Error(sym->pos, "Ignoring redefinition of function \"%s\".",
@@ -470,6 +546,33 @@ Function::GenerateIR() {
             firstStmtPos = code->pos;
     }
 
+    // If the function's code will check for an all-on mask at its start,
+    // emit a separate variant of it for that case.  Calls to the function
+    // that are known to have an all-on mask are redirected to that
+    // variant by AllOnCallsPass in opt.cpp.  (Each emission of a static
+    // variable's declaration allocates new storage for it, so functions
+    // that have them are left alone.)
+    const FunctionType *type = CastType<FunctionType>(sym->type);
+    Assert(type != NULL);
+    bool hasStatics = false;
+    if (code != NULL)
+        WalkAST(code, lCheckForStaticVariables, NULL, &hasStatics);
+    if (code != NULL && hasStatics == false && type->isTask == false &&
+        !g->opt.disableMaskAllOnOptimizations &&
+        (int)function->arg_size() == type->GetNumParameters() + 1 &&
+        lCheckMaskAtFunctionStart(type, function, EstimateCost(code))) {
+        allOnFunction =
+            llvm::Function::Create(function->getFunctionType(),
+                                   llvm::GlobalValue::InternalLinkage,
+                                   function->getName().str() + "___all_on",
+                                   m->module);
+        allOnFunction->copyAttributesFrom(function);
+        allOnFunction->setLinkage(llvm::GlobalValue::InternalLinkage);
+
+        FunctionEmitContext ec(this, sym, allOnFunction, firstStmtPos);
+        emitCode(&ec, allOnFunction, firstStmtPos);
+    }
+
     // And we can now go ahead and emit the code
     {
         FunctionEmitContext ec(this, sym, function, firstStmtPos);
@@ -487,11 +590,21 @@ Function::GenerateIR() {
             FATAL("Function verificication failed");
         }
 
+        if (allOnFunction != NULL) {
+#if defined (LLVM_3_5)
+            if (llvm::verifyFunction(*allOnFunction) == true) {
+#else
+            if (llvm::verifyFunction(*allOnFunction, llvm::ReturnStatusAction) == true) {
+#endif
+                if (g->debugPrint)
+                    allOnFunction->dump();
+                FATAL("Function verificication failed");
+            }
+        }
+
         // If the function is 'export'-qualified, emit a second version of
         // it without a mask parameter and without name mangling so that
         // the application can call it
-        const FunctionType *type = CastType<FunctionType>(sym->type);
-        Assert(type != NULL);
         if (type->isExported) {
             if (!type->isTask) {
                 llvm::FunctionType *ftype = type->LLVMFunctionType(g->ctx, true);
@@ -523,7 +636,8 @@ Function::GenerateIR() {
                 }
                 else {
                     // And emit the code again
-                    FunctionEmitContext ec(this, sym, appFunction, firstStmtPos);
+                    FunctionEmitContext ec(this, sym, appFunction, firstStmtPos,
+                                           type->isAsync);
                     emitCode(&ec, appFunction, firstStmtPos);
                     if (m->errorCount == 0) {
                         sym->exportedFunction = appFunction;
@@ -51,6 +51,10 @@ public:
     /** Generate LLVM IR for the function into the current module. */
     void GenerateIR();
 
+    /** Returns the variant of the given function that was generated
+        for calls where the execution mask is all on, if there is one. */
+    static llvm::Function *GetAllOnVariant(llvm::Function *function);
+
 private:
     void emitCode(FunctionEmitContext *ctx, llvm::Function *function,
                   SourcePos firstStmtPos);
@@ -58,6 +62,10 @@ private:
     Symbol *sym;
     std::vector<Symbol *> args;
     Stmt *code;
+    /** Variant of the function's code that assumes an all-on execution
+        mask; calls to the function that are known to have an all-on
+        mask use it instead. */
+    llvm::Function *allOnFunction;
     Symbol *maskSymbol;
     Symbol *threadIndexSym, *threadCountSym;
     Symbol *taskIndexSym,   *taskCountSym;
@@ -1068,6 +1068,8 @@ Opt::Opt() {
     disableAsserts = false;
     disableFMA = false;
     forceAlignedMemory = false;
+    soaStructArrays = false;
+    uniformizeVariables = false;
     disableMaskAllOnOptimizations = false;
     disableHandlePseudoMemoryOps = false;
     disableBlendedMaskedStores = false;
@@ -1080,6 +1082,27 @@ Opt::Opt() {
     disableCoalescing = false;
 }
 
+
+std::string
+Opt::GetKey() const {
+    bool flags[] = {
+        fastMath, fastMaskedVload, unrollLoops, force32BitAddressing,
+        disableAsserts, disableFMA, forceAlignedMemory, soaStructArrays,
+        uniformizeVariables, disableMaskAllOnOptimizations,
+        disableHandlePseudoMemoryOps, disableBlendedMaskedStores,
+        disableCoherentControlFlow, disableUniformControlFlow,
+        disableGatherScatterOptimizations, disableMaskedStoreToStore,
+        disableGatherScatterFlattening, disableUniformMemoryOptimizations,
+        disableCoalescing
+    };
+    char buf[16];
+    sprintf(buf, "%d ", level);
+    std::string key = buf;
+    for (unsigned int i = 0; i < sizeof(flags) / sizeof(flags[0]); ++i)
+        key += flags[i] ? '1' : '0';
+    return key;
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Globals
 
@@ -1111,6 +1134,9 @@ Globals::Globals() {
         FATAL("Current directory path too long!");
 #endif
     forceAlignment = -1;
+    cacheMaxSize = (int64_t)1024 * 1024 * 1024;
+    timeReport = NULL;
+    diagnosticsCopy = NULL;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -89,6 +89,7 @@ namespace llvm {
     class FunctionType;
     class LLVMContext;
     class Module;
+    class Pass;
     class Target;
     class TargetMachine;
     class Type;
@@ -96,6 +97,7 @@ namespace llvm {
 }
 
 
+class Arena;
 class ArrayType;
 class AST;
 class ASTNode;
@@ -110,6 +112,7 @@ class PointerType;
 class Stmt;
 class Symbol;
 class SymbolTable;
+class TimeReport;
 class Type;
 struct VariableDeclaration;
 
@@ -391,6 +394,11 @@ private:
 struct Opt {
     Opt();
 
+    /** Returns a string that encodes all of the options' values, for use
+        in keys for cached compilation results.  Any new option has to be
+        added to it. */
+    std::string GetKey() const;
+
     /** Optimization level.  Currently, the only valid values are 0,
         indicating essentially no optimization, and 1, indicating as much
         optimization as possible. */
@@ -430,6 +438,16 @@ struct Opt {
         locations. */
     bool forceAlignedMemory;
 
+    /** If enabled, local arrays of uniform structs that are only indexed
+        into are given soa<N> layout, with N the target's vector width, so
+        that varying indexing into them turns into vector loads and stores
+        of each member rather than per-member gathers and scatters. */
+    bool soaStructArrays;
+
+    /** If enabled, local varying variables that are certain to have the
+        same value in all of the program instances are made uniform. */
+    bool uniformizeVariables;
+
     /** If enabled, disables the various optimizations that kick in when
         the execution mask can be determined to be "all on" at compile
         time. */
@@ -488,7 +506,8 @@ struct Opt {
     bool disableUniformMemoryOptimizations;
 
     /** Disables optimizations that coalesce incoherent scalar memory
-        access from gathers into wider vector operations, when possible. */
+        access from gathers and scatters into wider vector operations,
+        when possible. */
     bool disableCoalescing;
 };
 
@@ -596,6 +615,28 @@ struct Globals {
     /** Indicates that alignment in memory allocation routines should be
         forced to have given value. -1 value means natural alignment for the platforms. */
     int forceAlignment;
+
+    /** If non-empty, the directory in which to cache compiled outputs;
+        compiling the same preprocessed source with the same target and
+        options again just copies the cached outputs. */
+    std::string cacheDir;
+
+    /** Maximum total size, in bytes, of the entries in cacheDir.  The
+        least recently used entries are removed when it's exceeded. */
+    int64_t cacheMaxSize;
+
+    /** If non-NULL, the time and memory used by each phase of compilation
+        are recorded here, for the --time-report option. */
+    TimeReport *timeReport;
+
+    /** If non-empty, the time report is written to this file as JSON
+        rather than being printed. */
+    std::string timeReportFile;
+
+    /** If non-NULL, the warnings and errors that are printed are also
+        written to this file, so that the compile cache can print them
+        again when it reuses the outputs. */
+    FILE *diagnosticsCopy;
 };
 
 enum {
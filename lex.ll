@@ -51,6 +51,11 @@ static void lStringConst(YYSTYPE *, SourcePos *);
 static double lParseHexFloat(const char *ptr);
 extern void RegisterDependency(const std::string &fileName);
 
+/* The generated scanner is lNextToken(); yylex(), below, wraps it to
+   recognize "after" and "async" as keywords in the one place where each
+   can be one. */
+#define YY_DECL static int lNextToken()
+
 #define YY_USER_ACTION \
     yylloc.first_line = yylloc.last_line; \
     yylloc.first_column = yylloc.last_column; \
@@ -63,7 +68,7 @@ inline int isatty(int) { return 0; }
 #endif // ISPC_IS_WINDOWS
 
 static int allTokens[] = {
-  TOKEN_ASSERT, TOKEN_BOOL, TOKEN_BREAK, TOKEN_CASE,
+  TOKEN_AFTER, TOKEN_ASSERT, TOKEN_ASYNC, TOKEN_BOOL, TOKEN_BREAK, TOKEN_CASE,
   TOKEN_CDO, TOKEN_CFOR, TOKEN_CIF, TOKEN_CWHILE,
   TOKEN_CONST, TOKEN_CONTINUE, TOKEN_DEFAULT, TOKEN_DO,
   TOKEN_DELETE, TOKEN_DOUBLE, TOKEN_ELSE, TOKEN_ENUM,
@@ -94,7 +99,9 @@ std::map<int, std::string> tokenToName;
 std::map<std::string, std::string> tokenNameRemap;
 
 void ParserInit() {
+    tokenToName[TOKEN_AFTER] = "after";
     tokenToName[TOKEN_ASSERT] = "assert";
+    tokenToName[TOKEN_ASYNC] = "async";
     tokenToName[TOKEN_BOOL] = "bool";
     tokenToName[TOKEN_BREAK] = "break";
     tokenToName[TOKEN_CASE] = "case";
@@ -208,7 +215,9 @@ void ParserInit() {
     tokenToName['?'] = "?";
     tokenToName[';'] = ";";
 
+    tokenNameRemap["TOKEN_AFTER"] = "\'after\'";
     tokenNameRemap["TOKEN_ASSERT"] = "\'assert\'";
+    tokenNameRemap["TOKEN_ASYNC"] = "\'async\'";
     tokenNameRemap["TOKEN_BOOL"] = "\'bool\'";
     tokenNameRemap["TOKEN_BREAK"] = "\'break\'";
     tokenNameRemap["TOKEN_CASE"] = "\'case\'";
@@ -540,6 +549,52 @@ L?\"(\\.|[^\\"])*\" { lStringConst(&yylval, &yylloc); return TOKEN_STRING_LITERA
 
 %%
 
+/** "after" is only a keyword where a launch's predecessor list can start:
+    right after "launch" and its bracketed task counts, as in "launch[n]
+    after(h) f()".  Likewise, "async" is only a keyword directly after
+    "export", as in "export async void f()".  Everywhere else they're
+    ordinary identifiers, so existing code that uses them as names keeps
+    working.
+ */
+int
+yylex() {
+    // -1 when we're not in a launch; otherwise the bracket nesting depth
+    // within its task counts.
+    static int launchDepth = -1;
+    static int lastToken = 0;
+
+    int token = lNextToken();
+    bool afterExport = (lastToken == TOKEN_EXPORT);
+    lastToken = token;
+    if (afterExport && token == TOKEN_IDENTIFIER &&
+        *yylval.stringVal == "async") {
+        delete yylval.stringVal;
+        lastToken = TOKEN_ASYNC;
+        return TOKEN_ASYNC;
+    }
+
+    if (token == TOKEN_LAUNCH) {
+        launchDepth = 0;
+        return token;
+    }
+    if (launchDepth < 0)
+        return token;
+
+    if (token == '[')
+        ++launchDepth;
+    else if (token == ']')
+        --launchDepth;
+    else if (launchDepth == 0) {
+        launchDepth = -1;
+        if (token == TOKEN_IDENTIFIER && *yylval.stringVal == "after") {
+            delete yylval.stringVal;
+            return TOKEN_AFTER;
+        }
+    }
+    return token;
+}
+
+
 /*short { return TOKEN_SHORT; }*/
 /*long { return TOKEN_LONG; }*/
 /*signed { return TOKEN_SIGNED; }*/
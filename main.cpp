@@ -89,6 +89,8 @@ usage(int ret) {
     printf("    [--arch={%s}]\t\tSelect target architecture\n",
            Target::SupportedArchs());
     printf("    [--c++-include-file=<name>]\t\tSpecify name of file to emit in #include statement in generated C++ code.\n");
+    printf("    [--cache-dir=<dir>]\t\tReuse outputs from earlier identical compilations cached in <dir>\n");
+    printf("    [--cache-size=<MB>]\t\tLimit the size of the --cache-dir cache (default 1024)\n");
 #ifndef ISPC_IS_WINDOWS
     printf("    [--colored-output]\t\tAlways use terminal colors in error/warning messages.\n");
 #endif
@@ -128,6 +130,8 @@ usage(int ret) {
     printf("        fast-masked-vload\t\tFaster masked vector loads on SSE (may go past end of array)\n");
     printf("        fast-math\t\t\tPerform non-IEEE-compliant optimizations of numeric expressions\n");
     printf("        force-aligned-memory\t\tAlways issue \"aligned\" vector load and store instructions\n");
+    printf("        soa-struct-arrays\t\tUse soa<programCount> layout for local arrays of uniform structs\n");
+    printf("        uniformize-variables\t\tMake lane-invariant local varying variables uniform\n");
 #ifndef ISPC_IS_WINDOWS
     printf("    [--pic]\t\t\t\tGenerate position-independent code\n");
 #endif // !ISPC_IS_WINDOWS
@@ -137,6 +141,8 @@ usage(int ret) {
     sprintf(targetHelp, "[--target=<t>]\t\t\tSelect target ISA and width.\n"
             "<t>={%s}", Target::SupportedTargets());
     PrintWithWordBreaks(targetHelp, 24, TerminalWidth(), stdout);
+    printf("    [--time-report[=<name>]]\t\tReport the time and memory used by each phase of compilation\n");
+    printf("                            \t\t(as JSON, written to <name>, if given)\n");
     printf("    [--version]\t\t\t\tPrint ispc version\n");
     printf("    [--werror]\t\t\t\tTreat warnings as errors\n");
     printf("    [--woff]\t\t\t\tDisable warnings\n");
@@ -157,7 +163,7 @@ devUsage(int ret) {
     printf("        disable-all-on-optimizations\t\tDisable optimizations that take advantage of \"all on\" mask\n");
     printf("        disable-blended-masked-stores\t\tScalarize masked stores on SSE (vs. using vblendps)\n");
     printf("        disable-blending-removal\t\tDisable eliminating blend at same scope\n");
-    printf("        disable-coalescing\t\t\tDisable gather coalescing\n");
+    printf("        disable-coalescing\t\t\tDisable gather and scatter coalescing\n");
     printf("        disable-coherent-control-flow\t\tDisable coherent control flow optimizations\n");
     printf("        disable-gather-scatter-flattening\tDisable flattening when all lanes are on\n");
     printf("        disable-gather-scatter-optimizations\tDisable improvements to gather/scatter\n");
@@ -434,6 +440,10 @@ int main(int Argc, char *Argv[]) {
                 g->opt.disableFMA = true;
             else if (!strcmp(opt, "force-aligned-memory"))
                 g->opt.forceAlignedMemory = true;
+            else if (!strcmp(opt, "soa-struct-arrays"))
+                g->opt.soaStructArrays = true;
+            else if (!strcmp(opt, "uniformize-variables"))
+                g->opt.uniformizeVariables = true;
 
             // These are only used for performance tests of specific
             // optimizations
@@ -497,6 +507,18 @@ int main(int Argc, char *Argv[]) {
         else if (!strncmp(argv[i], "--c++-include-file=", 19)) {
             includeFileName = argv[i] + strlen("--c++-include-file=");
         }
+        else if (!strncmp(argv[i], "--cache-dir=", 12)) {
+            g->cacheDir = argv[i] + strlen("--cache-dir=");
+        }
+        else if (!strncmp(argv[i], "--cache-size=", 13)) {
+            int size = atoi(argv[i] + strlen("--cache-size="));
+            if (size <= 0) {
+                fprintf(stderr, "Invalid value \"%s\" for --cache-size.\n",
+                        argv[i] + strlen("--cache-size="));
+                usage(1);
+            }
+            g->cacheMaxSize = (int64_t)size * 1024 * 1024;
+        }
         else if (!strcmp(argv[i], "-O0")) {
             g->opt.level = 0;
         }
@@ -516,6 +538,12 @@ int main(int Argc, char *Argv[]) {
         else if (!strcmp(argv[i], "--colored-output"))
             g->forceColoredOutput = true;
 #endif // !ISPC_IS_WINDOWS
+        else if (!strcmp(argv[i], "--time-report"))
+            g->timeReport = new TimeReport;
+        else if (!strncmp(argv[i], "--time-report=", 14)) {
+            g->timeReport = new TimeReport;
+            g->timeReportFile = argv[i] + strlen("--time-report=");
+        }
         else if (!strcmp(argv[i], "--quiet"))
             g->quiet = true;
         else if (!strcmp(argv[i], "--yydebug")) {
@@ -603,12 +631,25 @@ int main(int Argc, char *Argv[]) {
               "Program will be compiled and warnings/errors will "
               "be issued, but no output will be generated.");
 
-    return Module::CompileAndOutput(file, arch, cpu, target, generatePIC,
-                                    ot,
-                                    outFileName,
-                                    headerFileName,
-                                    includeFileName,
-                                    depsFileName,
-                                    hostStubFileName,
-                                    devStubFileName);
+    int ret = Module::CompileAndOutput(file, arch, cpu, target, generatePIC,
+                                       ot,
+                                       outFileName,
+                                       headerFileName,
+                                       includeFileName,
+                                       depsFileName,
+                                       hostStubFileName,
+                                       devStubFileName);
+
+    if (g->timeReport != NULL) {
+        // For multi-target compiles, the reports for the targets have
+        // already been issued; what's left is the dispatch module.
+        std::string title = (file != NULL) ? file : "<stdin>";
+        if (target != NULL && strchr(target, ',') != NULL)
+            title += " (dispatch)";
+        if (g->timeReportFile.empty())
+            g->timeReport->Print(stderr, title);
+        else if (!g->timeReport->WriteJSON(g->timeReportFile.c_str(), title))
+            ret = 1;
+    }
+    return ret;
 }
@@ -58,10 +58,17 @@
 #include <set>
 #include <sstream>
 #include <iostream>
+#include <fstream>
 #ifdef ISPC_IS_WINDOWS
 #include <windows.h>
 #include <io.h>
 #define strcasecmp stricmp
+#else
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <utime.h>
 #endif
 
 #if defined(LLVM_3_1) || defined(LLVM_3_2)
@@ -267,6 +274,11 @@ lStripUnusedDebugInfo(llvm::Module *module) {
 // Module
 
 Module::Module(const char *fn) {
+    // Everything the front-end allocates from here on lives in this
+    // module's arena; see the Arena class in util.h.
+    arena = new Arena;
+    Arena::current = arena;
+
     // It's a hack to do this here, but it must be done after the target
     // information has been set (so e.g. the vector width is known...)  In
     // particular, if we're compiling to multiple targets with different
@@ -329,6 +341,11 @@ Module::Module(const char *fn) {
 }
 
 
+Module::~Module() {
+    delete arena;
+}
+
+
 extern FILE *yyin;
 extern int yyparse();
 typedef struct yy_buffer_state *YY_BUFFER_STATE;
@@ -338,56 +355,71 @@ extern YY_BUFFER_STATE yy_create_buffer(FILE *, int);
 extern void yy_delete_buffer(YY_BUFFER_STATE);
 
 int
-Module::CompileFile() {
+Module::CompileFile(const std::string *source) {
     extern void ParserInit();
     ParserInit();
 
+    bool runPreprocessor = g->runCPP;
+
+    // Open the file before the stdlib is set up, so that we don't return
+    // without calling DefineUsedBuiltins(), which frees the lazily-loaded
+    // builtins bitcode.  (The preprocessor also crashes if the file
+    // doesn't exist.)
+    FILE *f = NULL;
+    if (filename == NULL)
+        f = stdin;
+    else if (runPreprocessor == false || source == NULL) {
+        f = fopen(filename, "r");
+        if (f == NULL) {
+            perror(filename);
+            return 1;
+        }
+    }
+
     // FIXME: it'd be nice to do this in the Module constructor, but this
     // function ends up calling into routines that expect the global
     // variable 'm' to be initialized and available (which it isn't until
     // the Module constructor returns...)
-    DefineStdlib(symbolTable, g->ctx, module, g->includeStdlib);
-
-    bool runPreprocessor = g->runCPP;
+    {
+        TimeReportScope scope("stdlib setup");
+        ast->SetDeferUnusedFunctions(true);
+        DefineStdlib(symbolTable, g->ctx, module, g->includeStdlib);
+        ast->SetDeferUnusedFunctions(false);
+    }
 
     if (runPreprocessor) {
-        if (filename != NULL) {
-            // Try to open the file first, since otherwise we crash in the
-            // preprocessor if the file doesn't exist.
-            FILE *f = fopen(filename, "r");
-            if (!f) {
-                perror(filename);
-                return 1;
-            }
+        if (f != NULL && f != stdin)
             fclose(f);
-        }
 
         std::string buffer;
-        llvm::raw_string_ostream os(buffer);
-        execPreprocessor((filename != NULL) ? filename : "-", &os);
-        YY_BUFFER_STATE strbuf = yy_scan_string(os.str().c_str());
+        if (source == NULL) {
+            llvm::raw_string_ostream os(buffer);
+            {
+                TimeReportScope scope("preprocessing");
+                execPreprocessor((filename != NULL) ? filename : "-", &os);
+            }
+            os.flush();
+            source = &buffer;
+        }
+        TimeReportScope scope("parsing");
+        YY_BUFFER_STATE strbuf = yy_scan_string(source->c_str());
         yyparse();
         yy_delete_buffer(strbuf);
     }
     else {
-        // No preprocessor, just open up the file if it's not stdin..
-        FILE* f = NULL;
-        if (filename == NULL)
-            f = stdin;
-        else {
-            f = fopen(filename, "r");
-            if (f == NULL) {
-                perror(filename);
-                return 1;
-            }
-        }
+        // No preprocessor, just parse the file (or stdin) directly.
         yyin = f;
+        TimeReportScope scope("parsing");
         yy_switch_to_buffer(yy_create_buffer(yyin, 4096));
         yyparse();
         fclose(f);
     }
 
     ast->GenerateIR();
+    {
+        TimeReportScope scope("builtins");
+        DefineUsedBuiltins(module);
+    }
 
     if (errorCount == 0)
         Optimize(module, g->opt.level);
@@ -944,6 +976,8 @@ Module::AddExportedTypes(const std::vector<std::pair<const Type *,
 bool
 Module::writeOutput(OutputType outputType, const char *outFileName,
                     const char *includeFileName, DispatchHeaderInfo *DHI) {
+    TimeReportScope scope("output");
+
     if (diBuilder != NULL && (outputType != Header && outputType != Deps)) {
         diBuilder->finalize();
 
@@ -1074,6 +1108,8 @@ bool
 Module::writeObjectFileOrAssembly(llvm::TargetMachine *targetMachine,
                                   llvm::Module *module, OutputType outputType,
                                   const char *outFileName) {
+    TimeReportScope scope("codegen");
+
     // Figure out if we're generating object file or assembly output, and
     // set binary output for object files
     llvm::TargetMachine::CodeGenFileType fileType = (outputType == Object) ?
@@ -1102,6 +1138,11 @@ Module::writeObjectFileOrAssembly(llvm::TargetMachine *targetMachine,
 
     llvm::formatted_raw_ostream fos(of->os());
 
+    // Charge the code generator's function passes to the functions that
+    // they're run on.
+    if (g->timeReport != NULL)
+        pm.add(CreateTimeReportPass("codegen"));
+
     if (targetMachine->addPassesToEmitFile(pm, fos, fileType)) {
         fprintf(stderr, "Fatal error adding passes to emit object file!");
         exit(1);
@@ -1147,6 +1188,93 @@ lContainsPtrToVarying(const StructType *st) {
 }
 
 
+/** Returns true if lEmitSOACopy() can copy a value of the given uniform
+    type between AOS and SOA layout: atomic and enum types, and structs
+    and arrays of them. */
+static bool
+lSOAAccessorsSupported(const Type *type) {
+    if (CastType<AtomicType>(type) != NULL || CastType<EnumType>(type) != NULL)
+        return true;
+
+    const ArrayType *at = CastType<ArrayType>(type);
+    if (at != NULL)
+        return (at->GetElementCount() > 0 &&
+                lSOAAccessorsSupported(at->GetElementType()));
+
+    const StructType *st = CastType<StructType>(type);
+    if (st != NULL) {
+        for (int i = 0; i < st->GetElementCount(); ++i)
+            if (lSOAAccessorsSupported(st->GetElementType(i)) == false)
+                return false;
+        return true;
+    }
+
+    return false;
+}
+
+
+/** Emits the statements that copy the struct member at the given access
+    path between an AOS value \c v and the \c lane'th element of the SOA
+    value pointed to by \c chunk.  Arrays are copied with a loop over
+    their elements and structs one member at a time.
+ */
+static void
+lEmitSOACopy(FILE *file, const Type *type, const std::string &path,
+             bool toSOA, int depth) {
+    if (const ArrayType *at = CastType<ArrayType>(type)) {
+        char index[16];
+        sprintf(index, "i%d", depth);
+        fprintf(file, "%*sfor (int %s = 0; %s < %d; ++%s) {\n", 4 * (depth + 1), "",
+                index, index, at->GetElementCount(), index);
+        lEmitSOACopy(file, at->GetElementType(), path + "[" + index + "]",
+                     toSOA, depth + 1);
+        fprintf(file, "%*s}\n", 4 * (depth + 1), "");
+    }
+    else if (const StructType *st = CastType<StructType>(type)) {
+        for (int i = 0; i < st->GetElementCount(); ++i)
+            lEmitSOACopy(file, st->GetElementType(i),
+                         path + "." + st->GetElementName(i), toSOA, depth);
+    }
+    else if (toSOA)
+        fprintf(file, "%*schunk->%s[lane] = v->%s;\n", 4 * (depth + 1), "",
+                path.c_str() + 1, path.c_str() + 1);
+    else
+        fprintf(file, "%*sv.%s = chunk->%s[lane];\n", 4 * (depth + 1), "",
+                path.c_str() + 1, path.c_str() + 1);
+}
+
+
+/** Emits functions that read and write the i'th element of an array of
+    the given SOA struct type, so that application code can fill in and
+    read back SOA data one AOS value at a time.
+ */
+static void
+lEmitSOAAccessors(const StructType *st, FILE *file) {
+    const StructType *aos = st->GetAsUniformType();
+    if (lSOAAccessorsSupported(aos) == false)
+        return;
+
+    const char *name = aos->GetStructName().c_str();
+    int width = st->GetSOAWidth();
+
+    fprintf(file, "static inline struct %s %s_SOA%d_get(const struct %s_SOA%d *soa, "
+            "int64_t index) {\n", name, name, width, name, width);
+    fprintf(file, "    const struct %s_SOA%d *chunk = soa + index / %d;\n", name, width, width);
+    fprintf(file, "    int lane = (int)(index %% %d);\n", width);
+    fprintf(file, "    struct %s v;\n", name);
+    lEmitSOACopy(file, aos, "", false, 0);
+    fprintf(file, "    return v;\n");
+    fprintf(file, "}\n\n");
+
+    fprintf(file, "static inline void %s_SOA%d_set(struct %s_SOA%d *soa, int64_t index, "
+            "const struct %s *v) {\n", name, width, name, width, name);
+    fprintf(file, "    struct %s_SOA%d *chunk = soa + index / %d;\n", name, width, width);
+    fprintf(file, "    int lane = (int)(index %% %d);\n", width);
+    lEmitSOACopy(file, aos, "", true, 0);
+    fprintf(file, "}\n");
+}
+
+
 /** Emits a declaration for the given struct to the given file.  This
     function first makes sure that declarations for any structs that are
     (recursively) members of this struct are emitted first.
@@ -1168,6 +1296,12 @@ lEmitStructDecl(const StructType *st, std::vector<const StructType *> *emittedSt
         if (Type::EqualIgnoringConst(st, (*emittedStructs)[i]))
             return;
 
+    // SOA structs are emitted along with the corresponding regular struct,
+    // which their accessor functions use.
+    if (st->GetSOAWidth() > 0)
+        lEmitStructDecl(st->GetAsUniformType(), emittedStructs, file,
+                        printGenericHeader, emitUnifs);
+
     // Otherwise first make sure any contained structs have been declared.
     for (int i = 0; i < st->GetElementCount(); ++i) {
         const StructType *elementStructType =
@@ -1189,13 +1323,19 @@ lEmitStructDecl(const StructType *st, std::vector<const StructType *> *emittedSt
               g->target->getVectorWidth());
     }
     else {
-      fprintf(file, "#ifndef __ISPC_STRUCT_%s__\n",st->GetStructName().c_str());
-      fprintf(file, "#define __ISPC_STRUCT_%s__\n",st->GetStructName().c_str());
+      // This has to match the naming scheme in
+      // StructType::GetCDeclaration().
+      std::string name = st->GetStructName();
+      if (st->GetSOAWidth() > 0) {
+          char buf[16];
+          sprintf(buf, "_SOA%d", st->GetSOAWidth());
+          name += buf;
+      }
+      fprintf(file, "#ifndef __ISPC_STRUCT_%s__\n", name.c_str());
+      fprintf(file, "#define __ISPC_STRUCT_%s__\n", name.c_str());
     }
     fprintf(file, "struct %s", st->GetStructName().c_str());
     if (st->GetSOAWidth() > 0)
-        // This has to match the naming scheme in
-        // StructType::GetCDeclaration().
         fprintf(file, "_SOA%d", st->GetSOAWidth());
     if (printGenericHeader && lContainsPtrToVarying(st)) {
       fprintf(file, "%d", g->target->getVectorWidth());
@@ -1208,6 +1348,10 @@ lEmitStructDecl(const StructType *st, std::vector<const StructType *> *emittedSt
         fprintf(file, "    %s;\n", d.c_str());
     }
     fprintf(file, "};\n");
+    if (st->GetSOAWidth() > 0) {
+        fprintf(file, "\n");
+        lEmitSOAAccessors(st, file);
+    }
     fprintf(file, "#endif\n\n");
 }
 
@@ -1411,6 +1555,30 @@ lPrintFunctionDeclarations(FILE *file, const std::vector<Symbol *> &funcs,
 
 
 
+/** If any of the given functions are 'export async', emits the
+    declarations of the ISPCHandle type that their application entry
+    points return and of the task system functions that wait for them. */
+static void
+lEmitAsyncDecls(FILE *file, const std::vector<Symbol *> &funcs) {
+    bool anyAsync = false;
+    for (unsigned int i = 0; i < funcs.size(); ++i) {
+        const FunctionType *ftype = CastType<FunctionType>(funcs[i]->type);
+        Assert(ftype);
+        anyAsync |= ftype->isAsync;
+    }
+    if (!anyAsync)
+        return;
+
+    fprintf(file, "#ifndef ISPC_HANDLE_DEFINED\n#define ISPC_HANDLE_DEFINED\n");
+    fprintf(file, "typedef void *ISPCHandle;\n");
+    fprintf(file, "#endif // ISPC_HANDLE_DEFINED\n");
+    fprintf(file, "#if defined(__cplusplus) && !defined(__ISPC_NO_EXTERN_C)\nextern \"C\" {\n#endif // __cplusplus\n");
+    fprintf(file, "    extern void ISPCWait(ISPCHandle handle);\n");
+    fprintf(file, "    extern int ISPCTest(ISPCHandle handle);\n");
+    fprintf(file, "#if defined(__cplusplus) && !defined(__ISPC_NO_EXTERN_C)\n} /* end extern C */\n#endif // __cplusplus\n");
+}
+
+
 static bool
 lIsExported(const Symbol *sym) {
     const FunctionType *ft = CastType<FunctionType>(sym->type);
@@ -1670,6 +1838,10 @@ Module::writeHostStub(const char *fn)
       Warning(sym->pos,"When emitting offload-stubs, ignoring \"export\"ed function with non-void return types.\n");
       continue;
     }
+    if (fct->isAsync) {
+      Warning(sym->pos,"When emitting offload-stubs, ignoring \"export async\" function.\n");
+      continue;
+    }
 
 
 
@@ -1820,6 +1992,7 @@ Module::writeHeader(const char *fn) {
         fprintf(f, "///////////////////////////////////////////////////////////////////////////\n");
         fprintf(f, "// Functions exported from ispc code\n");
         fprintf(f, "///////////////////////////////////////////////////////////////////////////\n");
+        lEmitAsyncDecls(f, exportedFuncs);
         lPrintFunctionDeclarations(f, exportedFuncs);
     }
 #if 0
@@ -1855,6 +2028,36 @@ struct DispatchHeaderInfo {
   const char *fn;
 };
 
+// Returns true if the part of the dispatch header for a target with the
+// given vector width declares the exported types.
+static bool
+lDispatchHeaderEmitsTypes(const DispatchHeaderInfo *DHI, int programCount) {
+  return ((DHI->Emit4 && (programCount == 4)) ||
+          (DHI->Emit8 && (programCount == 8)) ||
+          (DHI->Emit16 && (programCount == 16)));
+}
+
+// Updates the flags in DHI once the part of the dispatch header for a
+// target with the given vector width has been written.
+static void
+lAdvanceDispatchHeaderInfo(DispatchHeaderInfo *DHI, int programCount) {
+  if (lDispatchHeaderEmitsTypes(DHI, programCount)) {
+    DHI->EmitUnifs = false;
+    if (programCount == 4) {
+      DHI->Emit4 = false;
+    }
+    else if (programCount == 8) {
+      DHI->Emit8 = false;
+    }
+    else if (programCount == 16) {
+      DHI->Emit16 = false;
+    }
+  }
+  DHI->EmitFrontMatter = false;
+  DHI->EmitFuncs = false;
+  DHI->EmitBackMatter = false;
+}
+
 bool
 Module::writeDispatchHeader(DispatchHeaderInfo *DHI) {
   FILE *f = DHI->file;
@@ -1892,7 +2095,6 @@ Module::writeDispatchHeader(DispatchHeaderInfo *DHI) {
       // end namespace
       fprintf(f, "\n");
       fprintf(f, "\n#ifdef __cplusplus\nnamespace ispc { /* namespace */\n#endif // __cplusplus\n\n");
-      DHI->EmitFrontMatter = false;
     }
 
 
@@ -1904,9 +2106,7 @@ Module::writeDispatchHeader(DispatchHeaderInfo *DHI) {
      
     int programCount = g->target->getVectorWidth();
     
-    if ((DHI->Emit4 && (programCount == 4)) || 
-        (DHI->Emit8 && (programCount == 8)) ||
-        (DHI->Emit16 && (programCount == 16))) {
+    if (lDispatchHeaderEmitsTypes(DHI, programCount)) {
         // Get all of the struct, vector, and enumerant types used as function
         // parameters.  These vectors may have repeats.
         std::vector<const StructType *> exportedStructTypes;
@@ -1936,18 +2136,6 @@ Module::writeDispatchHeader(DispatchHeaderInfo *DHI) {
           lEmitEnumDecls(exportedEnumTypes, f);
         }
         lEmitStructDecls(exportedStructTypes, f, true, DHI->EmitUnifs);
-        
-        // Update flags
-        DHI->EmitUnifs = false;
-        if (programCount == 4) {
-          DHI->Emit4 = false;
-        } 
-        else if (programCount == 8) {
-          DHI->Emit8 = false;
-        }
-        else if (programCount == 16) {
-          DHI->Emit16 = false;
-        }
     }
     if (DHI->EmitFuncs) {
       // emit function declarations for exported stuff...
@@ -1956,10 +2144,10 @@ Module::writeDispatchHeader(DispatchHeaderInfo *DHI) {
         fprintf(f, "///////////////////////////////////////////////////////////////////////////\n");
         fprintf(f, "// Functions exported from ispc code\n");
         fprintf(f, "///////////////////////////////////////////////////////////////////////////\n");
+        lEmitAsyncDecls(f, exportedFuncs);
         lPrintFunctionDeclarations(f, exportedFuncs, 1, true);
         fprintf(f, "\n");
       }
-      DHI->EmitFuncs = false;
     }
 
     if (DHI->EmitBackMatter) {
@@ -1969,27 +2157,32 @@ Module::writeDispatchHeader(DispatchHeaderInfo *DHI) {
       
       // end guard
       fprintf(f, "\n#endif // %s\n", guard.c_str());
-      DHI->EmitBackMatter = false;
     }
-    
+
+    lAdvanceDispatchHeaderInfo(DHI, programCount);
     return true;
 }
 
 void
-Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostream) const
+Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostream,
+                         std::string *diagnostics)
 {
     clang::CompilerInstance inst;
     inst.createFileManager();
 
     llvm::raw_fd_ostream stderrRaw(2, false);
+    std::string unusedDiagnostics;
+    llvm::raw_string_ostream stringRaw(diagnostics ? *diagnostics : unusedDiagnostics);
+    llvm::raw_ostream &diagStream =
+        diagnostics ? (llvm::raw_ostream &)stringRaw : (llvm::raw_ostream &)stderrRaw;
 
 #if defined(LLVM_3_1)
     clang::TextDiagnosticPrinter *diagPrinter =
-        new clang::TextDiagnosticPrinter(stderrRaw, clang::DiagnosticOptions());
+        new clang::TextDiagnosticPrinter(diagStream, clang::DiagnosticOptions());
 #else
     clang::DiagnosticOptions *diagOptions = new clang::DiagnosticOptions();
     clang::TextDiagnosticPrinter *diagPrinter =
-        new clang::TextDiagnosticPrinter(stderrRaw, diagOptions);
+        new clang::TextDiagnosticPrinter(diagStream, diagOptions);
 #endif
     llvm::IntrusiveRefCntPtr<clang::DiagnosticIDs> diagIDs(new clang::DiagnosticIDs);
 #if defined(LLVM_3_1)
@@ -2002,7 +2195,7 @@ Module::execPreprocessor(const char *infilename, llvm::raw_string_ostream *ostre
     inst.setDiagnostics(diagEngine);
 
     clang::TargetOptions &options = inst.getTargetOpts();
-    llvm::Triple triple(module->getTargetTriple());
+    llvm::Triple triple(g->target->GetTripleString());
     if (triple.getTriple().empty()) {
         triple.setTriple(llvm::sys::getDefaultTargetTriple());
     }
@@ -2171,16 +2364,16 @@ lSymbolIsExported(const Symbol *s) {
 // llvm::Function that were compiled for different compilation target ISAs.
 struct FunctionTargetVariants {
     FunctionTargetVariants() {
-      for (int i = 0; i < Target::NUM_ISAS; ++i) {
+      for (int i = 0; i < Target::NUM_ISAS; ++i)
             func[i] = NULL;
-            FTs[i] = NULL;
-      }
     }
     // The func array is indexed with the Target::ISA enumerant.  Some
     // values may be NULL, indicating that the original function wasn't
     // compiled to the corresponding target ISA.
     llvm::Function *func[Target::NUM_ISAS];
-    const FunctionType *FTs[Target::NUM_ISAS];
+    // For each parameter of each variant, whether it's a pointer to a
+    // varying type.
+    std::vector<bool> varyingPointerParams[Target::NUM_ISAS];
 };
 
 
@@ -2195,7 +2388,15 @@ lGetExportedFunctions(SymbolTable *symbolTable,
     for (unsigned int i = 0; i < syms.size(); ++i) {
         FunctionTargetVariants &ftv = functions[syms[i]->name];
         ftv.func[g->target->getISA()] = syms[i]->exportedFunction;
-        ftv.FTs[g->target->getISA()] = CastType<FunctionType>(syms[i]->type);
+
+        const FunctionType *ft = CastType<FunctionType>(syms[i]->type);
+        std::vector<bool> &varyingPointers =
+            ftv.varyingPointerParams[g->target->getISA()];
+        for (int j = 0; j < ft->GetNumParameters(); ++j) {
+            const Type *arg = ft->GetParameterType(j);
+            varyingPointers.push_back(arg->IsPointerType() &&
+                CastType<PointerType>(arg)->GetBaseType()->IsVaryingType());
+        }
     }
 }
 
@@ -2289,8 +2490,15 @@ lAddExtractedGlobals(llvm::Module *module,
 
                 // It is possible that the types may not match, though--for
                 // example, this happens with varying globals if we compile
-                // to different vector widths.
-                if (gv2->getType() != gv->getType())
+                // to different vector widths.  The modules may have been
+                // read from bitcode files compiled in different processes,
+                // which gives each one its own copies of the named struct
+                // types, so compare the sizes of the types rather than the
+                // types themselves.
+                llvm::Type *type2 = gv2->getType()->getElementType();
+                if (type2 != type &&
+                    g->target->getDataLayout()->getTypeAllocSize(type2) !=
+                    g->target->getDataLayout()->getTypeAllocSize(type))
                     Warning(rgi.pos, "Mismatch in size/layout of global "
                           "variable \"%s\" with different targets. "
                           "Globals must not include \"varying\" types or arrays "
@@ -2313,26 +2521,21 @@ lGetVaryingDispatchType(FunctionTargetVariants &funcs) {
     }
     else {
       bool foundVarying = false;
-      const FunctionType *ft = funcs.FTs[i];
+      const std::vector<bool> &varyingPointers = funcs.varyingPointerParams[i];
       resultFuncTy = funcs.func[i]->getFunctionType();
 
-      int numArgs = ft->GetNumParameters();
+      int numArgs = (int)varyingPointers.size();
       llvm::SmallVector<llvm::Type *, 8> ftype;
       for (int j = 0; j < numArgs; ++j) {
         ftype.push_back(resultFuncTy->getParamType(j));
       }
 
       for (int j = 0; j < numArgs; ++j) {
-        const Type *arg = ft->GetParameterType(j);
-
-        if (arg->IsPointerType()) {
-          const Type *baseType = CastType<PointerType>(arg)->GetBaseType();
-          // For each varying type pointed to, swap the LLVM pointer type
-          // with i8 * (as close as we can get to void *)
-          if (baseType->IsVaryingType()) {
-            ftype[j] = ptrToInt8Ty;
-            foundVarying = true;
-          }
+        // For each varying type pointed to, swap the LLVM pointer type
+        // with i8 * (as close as we can get to void *)
+        if (varyingPointers[j]) {
+          ftype[j] = ptrToInt8Ty;
+          foundVarying = true;
         }
       }
       if (foundVarying) {
@@ -2541,6 +2744,647 @@ lCreateDispatchModule(std::map<std::string, FunctionTargetVariants> &functions)
 }
 
 
+// Writes the exported functions and the globals of the given target to a
+// file that lReadTargetInterface() can read, so that a target can be
+// compiled in a separate process from the one that generates the dispatch
+// module.  Each line describes either an exported function--its name, the
+// name of its target-specific variant, and which of its parameters are
+// pointers to varying types--or a global and its source position.
+static bool
+lWriteTargetInterface(const char *fileName, Target::ISA isa,
+                      std::map<std::string, FunctionTargetVariants> &functions,
+                      const std::vector<RewriteGlobalInfo> &globals) {
+    FILE *f = fopen(fileName, "w");
+    if (f == NULL) {
+        perror(fileName);
+        return false;
+    }
+
+    std::map<std::string, FunctionTargetVariants>::iterator iter;
+    for (iter = functions.begin(); iter != functions.end(); ++iter) {
+        FunctionTargetVariants &ftv = iter->second;
+        fprintf(f, "function %s %s :", iter->first.c_str(),
+                ftv.func[isa]->getName().str().c_str());
+        for (unsigned int i = 0; i < ftv.varyingPointerParams[isa].size(); ++i)
+            fputc(ftv.varyingPointerParams[isa][i] ? '1' : '0', f);
+        fputc('\n', f);
+    }
+
+    for (unsigned int i = 0; i < globals.size(); ++i) {
+        const SourcePos &pos = globals[i].pos;
+        fprintf(f, "global %s %d %d %d %d %s\n",
+                globals[i].gv->getName().str().c_str(), pos.first_line,
+                pos.first_column, pos.last_line, pos.last_column,
+                pos.name ? pos.name : "");
+    }
+
+    if (fclose(f) != 0) {
+        perror(fileName);
+        return false;
+    }
+    return true;
+}
+
+
+// Reads the given bitcode file into a new llvm::Module.
+static llvm::Module *
+lReadBitcodeFile(const char *fileName) {
+    FILE *f = fopen(fileName, "rb");
+    if (f == NULL) {
+        perror(fileName);
+        return NULL;
+    }
+    std::string bitcode;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        bitcode.append(buf, n);
+    fclose(f);
+
+    llvm::MemoryBuffer *bcBuf = llvm::MemoryBuffer::getMemBufferCopy(bitcode);
+#if defined(LLVM_3_5)
+    llvm::ErrorOr<llvm::Module *> ModuleOrErr = llvm::parseBitcodeFile(bcBuf, *g->ctx);
+    if (llvm::error_code EC = ModuleOrErr.getError()) {
+        Error(SourcePos(), "Error parsing bitcode file \"%s\": %s", fileName,
+              EC.message().c_str());
+        return NULL;
+    }
+    return ModuleOrErr.get();
+#else
+    std::string bcErr;
+    llvm::Module *module = llvm::ParseBitcodeFile(bcBuf, *g->ctx, &bcErr);
+    if (module == NULL)
+        Error(SourcePos(), "Error parsing bitcode file \"%s\": %s", fileName,
+              bcErr.c_str());
+    return module;
+#endif
+}
+
+
+// Reads the exported functions and globals of a target that was compiled
+// in another process, as written by lWriteTargetInterface() and
+// Module::compileTargetVariant(), and adds them to functions and
+// globals[isa].
+static bool
+lReadTargetInterface(const std::string &prefix, Target::ISA isa,
+                     std::map<std::string, FunctionTargetVariants> &functions,
+                     std::vector<RewriteGlobalInfo> globals[Target::NUM_ISAS]) {
+    llvm::Module *module = lReadBitcodeFile((prefix + ".bc").c_str());
+    if (module == NULL)
+        return false;
+
+    std::ifstream in((prefix + ".txt").c_str());
+    if (!in) {
+        perror((prefix + ".txt").c_str());
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind, name;
+        fields >> kind >> name;
+        if (kind == "function") {
+            std::string variantName, varyingPointers;
+            fields >> variantName >> varyingPointers;
+            FunctionTargetVariants &ftv = functions[name];
+            ftv.func[isa] = module->getFunction(variantName);
+            if (ftv.func[isa] == NULL || varyingPointers.empty())
+                return false;
+            for (unsigned int i = 1; i < varyingPointers.size(); ++i)
+                ftv.varyingPointerParams[isa].push_back(varyingPointers[i] == '1');
+        }
+        else if (kind == "global") {
+            int firstLine, firstColumn, lastLine, lastColumn;
+            std::string file;
+            fields >> firstLine >> firstColumn >> lastLine >> lastColumn;
+            std::getline(fields >> std::ws, file);
+            llvm::GlobalVariable *gv = module->getNamedGlobal(name);
+            if (gv == NULL || !gv->hasInitializer())
+                return false;
+            SourcePos pos(file.empty() ? NULL : strdup(file.c_str()),
+                          firstLine, firstColumn, lastLine, lastColumn);
+            globals[isa].push_back(RewriteGlobalInfo(gv, gv->getInitializer(),
+                                                     pos));
+        }
+        else
+            return false;
+    }
+    return true;
+}
+
+
+#ifndef ISPC_IS_WINDOWS
+// Creates a directory for the files that the processes of a multi-target
+// compilation pass back to the main one, returning its name or an empty
+// string if it couldn't be created.
+static std::string
+lMakeTempDir() {
+    const char *tmpDir = getenv("TMPDIR");
+    std::string dirName = std::string((tmpDir && *tmpDir) ? tmpDir : "/tmp") +
+        "/ispc-XXXXXX";
+    std::vector<char> buf(dirName.begin(), dirName.end());
+    buf.push_back('\0');
+    if (mkdtemp(&buf[0]) == NULL) {
+        perror(dirName.c_str());
+        return "";
+    }
+    return &buf[0];
+}
+
+
+// Returns the prefix for the names of the files for the given target in
+// the directory from lMakeTempDir().
+static std::string
+lTempFilePrefix(const std::string &tmpDir, int target) {
+    char buf[32];
+    sprintf(buf, "/%d", target);
+    return tmpDir + buf;
+}
+
+
+// Appends the contents of the given file, if it exists, to f.
+static void
+lAppendFile(FILE *f, const std::string &fileName) {
+    FILE *in = fopen(fileName.c_str(), "rb");
+    if (in == NULL)
+        return;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, f);
+    fclose(in);
+}
+
+
+// Removes the directory from lMakeTempDir() and the files in it.
+static void
+lRemoveTempDir(const std::string &tmpDir, int numTargets) {
+    const char *suffixes[] = { ".bc", ".txt", ".h", ".err" };
+    for (int i = 0; i < numTargets; ++i) {
+        std::string prefix = lTempFilePrefix(tmpDir, i);
+        for (int j = 0; j < (int)(sizeof(suffixes) / sizeof(suffixes[0])); ++j)
+            unlink((prefix + suffixes[j]).c_str());
+    }
+    rmdir(tmpDir.c_str());
+}
+#endif // !ISPC_IS_WINDOWS
+
+
+///////////////////////////////////////////////////////////////////////////
+// Compile cache
+//
+// Each entry in the g->cacheDir directory is a directory named with a hash
+// of the key of the compilation that it holds the outputs of.  In it are
+// the outputs, named by their position in the list of outputs, a "key"
+// file with the full text of the key, which is compared with the key of
+// the compilation before the entry is used, and a "stderr" file with the
+// compilation's warnings, which are printed again each time the entry is
+// used.  An entry's
+// modification time is updated each time it's used, so that the least
+// recently used ones can be removed when the cache gets too big.
+
+// Returns the 64-bit FNV-1a hash of the given string.
+static uint64_t
+lHashFNV1a(const std::string &str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < str.size(); ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static std::string
+lCacheEntryName(const std::string &key) {
+    char buf[32];
+    sprintf(buf, "/%016llx", (unsigned long long)lHashFNV1a(key));
+    return g->cacheDir + buf;
+}
+
+
+// Returns the part of the cache key that doesn't depend on the target:
+// the compiler version, the options that affect the generated code, and
+// the names of the files that it's written to.
+static std::string
+lCacheKeyOptions(const char *arch, const char *cpu, bool generatePIC,
+                 Module::OutputType outputType, const char *includeFileName,
+                 const std::vector<std::string> &outputs) {
+    std::ostringstream key;
+    key << "ispc " << ISPC_VERSION;
+#if defined(BUILD_VERSION) && defined(BUILD_DATE)
+    key << " " << BUILD_VERSION << " " << BUILD_DATE;
+#endif
+    key << " " << __DATE__ << " " << __TIME__ << "\n";
+
+    key << "arch " << (arch ? arch : "") << "\n"
+        << "cpu " << (cpu ? cpu : "") << "\n"
+        << "pic " << generatePIC << "\n"
+        << "output " << (int)outputType << "\n"
+        << "include " << (includeFileName ? includeFileName : "") << "\n";
+
+    key << "opt " << g->opt.GetKey() << "\n";
+    key << "globals " << (int)g->mathLib << g->includeStdlib
+        << g->disableWarnings << g->warningsAsErrors << g->emitPerfWarnings
+        << g->emitInstrumentation << g->generateDebuggingSymbols << " "
+        << g->forceAlignment << "\n";
+    for (std::set<int>::const_iterator iter = g->off_stages.begin();
+         iter != g->off_stages.end(); ++iter)
+        key << "off " << *iter << "\n";
+    // The debugging information records the directory of the source file.
+    if (g->generateDebuggingSymbols)
+        key << "cwd " << g->currentDirectory << "\n";
+
+    for (unsigned int i = 0; i < outputs.size(); ++i)
+        key << "out " << outputs[i] << "\n";
+    return key.str();
+}
+
+
+// Returns the part of the cache key for compiling the given preprocessed
+// source for the current target.
+static std::string
+lCacheKeySource(const std::string &source) {
+    std::ostringstream key;
+    key << "target " << g->target->GetISAString() << " "
+        << g->target->GetTripleString() << "\n"
+        << "source " << source.size() << "\n" << source;
+    return key.str();
+}
+
+
+// Returns true if the outputs of compiling the given file can be cached.
+static bool
+lUseCompileCache(const char *srcFile, const char *outFileName,
+                 const char *headerFileName, const char *depsFileName,
+                 const char *hostStubFileName, const char *devStubFileName) {
+    if (g->cacheDir.empty())
+        return false;
+
+    // The key is computed from the preprocessed source.  Standard input
+    // isn't cached, and neither are files that can't be opened, which
+    // CompileFile() reports rather than having the preprocessor crash.
+    if (srcFile == NULL || !strcmp(srcFile, "-") || !g->runCPP)
+        return false;
+    FILE *f = fopen(srcFile, "r");
+    if (f == NULL)
+        return false;
+    fclose(f);
+
+    // Nothing is gained if the outputs go to standard output, or if the
+    // point of the compile is the debugging output or time report that it
+    // prints.
+    const char *outputs[] = { outFileName, headerFileName, depsFileName,
+                              hostStubFileName, devStubFileName };
+    bool anyOutput = false;
+    for (int i = 0; i < (int)(sizeof(outputs) / sizeof(outputs[0])); ++i) {
+        if (outputs[i] != NULL && !strcmp(outputs[i], "-"))
+            return false;
+        anyOutput |= (outputs[i] != NULL);
+    }
+#ifdef ISPC_IS_WINDOWS
+    Warning(SourcePos(), "The compile cache isn't supported on Windows; "
+            "ignoring \"--cache-dir\".");
+    return false;
+#else
+    return (anyOutput && !g->debugPrint && g->debug_stages.empty() &&
+            g->debugIR == -1 && !g->enableFuzzTest && g->timeReport == NULL);
+#endif
+}
+
+
+#ifndef ISPC_IS_WINDOWS
+
+
+// Copies the file from to the file to, returning true on success.
+static bool
+lCopyFile(const std::string &from, const std::string &to) {
+    FILE *in = fopen(from.c_str(), "rb");
+    if (in == NULL)
+        return false;
+    FILE *out = fopen(to.c_str(), "wb");
+    if (out == NULL) {
+        fclose(in);
+        return false;
+    }
+
+    char buf[65536];
+    size_t n;
+    bool ok = true;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        ok &= (fwrite(buf, 1, n, out) == n);
+    ok &= (ferror(in) == 0);
+    fclose(in);
+    ok &= (fclose(out) == 0);
+    return ok;
+}
+
+
+// Reads the whole file into contents, returning true on success.
+static bool
+lReadFile(const std::string &fileName, std::string *contents) {
+    FILE *f = fopen(fileName.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    contents->clear();
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        contents->append(buf, n);
+    bool ok = (ferror(f) == 0);
+    fclose(f);
+    return ok;
+}
+
+
+// Writes contents to the file, returning true on success.
+static bool
+lWriteFile(const std::string &fileName, const std::string &contents) {
+    FILE *f = fopen(fileName.c_str(), "wb");
+    if (f == NULL)
+        return false;
+    bool ok = (fwrite(contents.data(), 1, contents.size(), f) ==
+               contents.size());
+    ok &= (fclose(f) == 0);
+    return ok;
+}
+
+
+static std::string
+lCacheOutputName(const std::string &entry, int output) {
+    char buf[32];
+    sprintf(buf, "/%d", output);
+    return entry + buf;
+}
+
+
+// Returns the number of bytes taken by the files in the given cache entry,
+// removing the entry and its files if remove is true.
+static int64_t
+lRemoveCacheEntry(const std::string &entry, bool remove) {
+    DIR *dir = opendir(entry.c_str());
+    if (dir == NULL)
+        return 0;
+
+    int64_t size = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        std::string fileName = entry + "/" + de->d_name;
+        struct stat st;
+        if (stat(fileName.c_str(), &st) == 0)
+            size += st.st_size;
+        if (remove)
+            unlink(fileName.c_str());
+    }
+    closedir(dir);
+
+    if (remove)
+        rmdir(entry.c_str());
+    return size;
+}
+
+
+// Copies the outputs from the cache entry for the given key, if there is
+// one, and prints the warnings that were issued when they were compiled.
+// Returns true if the outputs were all copied.
+static bool
+lCacheRestore(const std::string &key, const std::vector<std::string> &outputs) {
+    std::string entry = lCacheEntryName(key);
+
+    // Entries are named by a hash of their key, so make sure that this
+    // one's for the same key rather than another one that collides.
+    std::string entryKey;
+    if (!lReadFile(entry + "/key", &entryKey) || entryKey != key)
+        return false;
+
+    for (unsigned int i = 0; i < outputs.size(); ++i)
+        if (!lCopyFile(lCacheOutputName(entry, i), outputs[i]))
+            return false;
+
+    lAppendFile(stderr, entry + "/stderr");
+    utime(entry.c_str(), NULL);
+    return true;
+}
+
+
+struct CacheEntryInfo {
+    CacheEntryInfo(const std::string &n, time_t t, int64_t s)
+        : name(n), lastUse(t), size(s) { }
+
+    bool operator<(const CacheEntryInfo &other) const {
+        return lastUse < other.lastUse;
+    }
+
+    std::string name;
+    time_t lastUse;
+    int64_t size;
+};
+
+
+// Removes the least recently used entries from the cache until it's no
+// bigger than g->cacheMaxSize.
+static void
+lTrimCache() {
+    DIR *dir = opendir(g->cacheDir.c_str());
+    if (dir == NULL)
+        return;
+
+    std::vector<CacheEntryInfo> entries;
+    int64_t totalSize = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        std::string entry = g->cacheDir + "/" + de->d_name;
+        struct stat st;
+        if (stat(entry.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+        int64_t size = lRemoveCacheEntry(entry, false);
+        entries.push_back(CacheEntryInfo(entry, st.st_mtime, size));
+        totalSize += size;
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end());
+    for (unsigned int i = 0;
+         i < entries.size() && totalSize > g->cacheMaxSize; ++i)
+        totalSize -= lRemoveCacheEntry(entries[i].name, true);
+}
+
+
+// Adds the outputs of a successful compilation, and the warnings that it
+// printed, to the cache.  The entry is assembled in a temporary directory
+// that's then renamed, so that other compiles never see a partially-written
+// one.
+static void
+lCacheStore(const std::string &key, const std::vector<std::string> &outputs,
+            const std::string &diagnostics) {
+    mkdir(g->cacheDir.c_str(), 0777);
+
+    std::string tmpName = g->cacheDir + "/tmp-XXXXXX";
+    std::vector<char> buf(tmpName.begin(), tmpName.end());
+    buf.push_back('\0');
+    if (mkdtemp(&buf[0]) == NULL) {
+        Warning(SourcePos(), "Unable to add outputs to the compile cache "
+                "in \"%s\".", g->cacheDir.c_str());
+        return;
+    }
+    std::string tmpDir = &buf[0];
+
+    bool ok = true;
+    for (unsigned int i = 0; ok && i < outputs.size(); ++i)
+        ok = lCopyFile(outputs[i], lCacheOutputName(tmpDir, i));
+
+    if (ok)
+        ok = lWriteFile(tmpDir + "/key", key) &&
+            lWriteFile(tmpDir + "/stderr", diagnostics);
+
+    // If another compile already added the same entry, keep that one.
+    if (!ok || rename(tmpDir.c_str(), lCacheEntryName(key).c_str()) != 0)
+        lRemoveCacheEntry(tmpDir, true);
+
+    lTrimCache();
+}
+#else
+static bool
+lCacheRestore(const std::string &key, const std::vector<std::string> &outputs) {
+    return false;
+}
+
+
+static void
+lCacheStore(const std::string &key, const std::vector<std::string> &outputs,
+            const std::string &diagnostics) {
+}
+#endif // !ISPC_IS_WINDOWS
+
+
+/** While it's in scope, the warnings and errors that are printed are also
+    kept in a temporary file, so that they can be stored in the compile
+    cache along with the outputs. */
+class DiagnosticsCapture {
+public:
+    DiagnosticsCapture(bool enable) {
+        Assert(g->diagnosticsCopy == NULL);
+        if (enable)
+            g->diagnosticsCopy = tmpfile();
+    }
+    ~DiagnosticsCapture() {
+        if (g->diagnosticsCopy != NULL)
+            fclose(g->diagnosticsCopy);
+        g->diagnosticsCopy = NULL;
+    }
+
+    /** Prints diagnostics that were collected rather than printed, such
+        as the preprocessor's, and keeps a copy of them. */
+    static void Print(const std::string &diagnostics) {
+        fputs(diagnostics.c_str(), stderr);
+        if (g->diagnosticsCopy != NULL)
+            fputs(diagnostics.c_str(), g->diagnosticsCopy);
+    }
+
+    /** Returns the diagnostics printed so far in text; returns false if
+        they couldn't be kept. */
+    bool GetText(std::string *text) {
+        FILE *f = g->diagnosticsCopy;
+        if (f == NULL || fflush(f) != 0)
+            return false;
+        rewind(f);
+        text->clear();
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+            text->append(buf, n);
+        bool ok = (ferror(f) == 0);
+        fseek(f, 0, SEEK_END);
+        return ok;
+    }
+};
+
+
+int
+Module::compileTargetVariant(const char *srcFile, const char *arch,
+                             const char *cpu, const char *target,
+                             bool generatePIC, OutputType outputType,
+                             const char *outFileName,
+                             const char *headerFileName,
+                             DispatchHeaderInfo *DHI,
+                             const char *interfaceFileName,
+                             const std::string *source,
+                             std::map<std::string, FunctionTargetVariants> &exportedFunctions,
+                             std::vector<RewriteGlobalInfo> *globals) {
+    g->target = new Target(arch, cpu, target, generatePIC);
+    if (!g->target->isValid())
+        return -1;
+    Target::ISA isa = g->target->getISA();
+
+    m = new Module(srcFile);
+    if (m->CompileFile(source) == 0) {
+        // Grab pointers to the exported functions from the module we
+        // just compiled, for use in generating the dispatch function
+        // later.
+        lGetExportedFunctions(m->symbolTable, exportedFunctions);
+
+        // The bitcode has to be written while the globals still have
+        // their initializers.
+        std::string interfaceName = interfaceFileName ? interfaceFileName : "";
+        if (interfaceFileName != NULL &&
+            !writeBitcode(m->module, (interfaceName + ".bc").c_str()))
+            return -1;
+
+        lExtractAndRewriteGlobals(m->module, &globals[isa]);
+
+        if (interfaceFileName != NULL &&
+            !lWriteTargetInterface((interfaceName + ".txt").c_str(), isa,
+                                   exportedFunctions, globals[isa]))
+            return -1;
+
+        if (outFileName != NULL) {
+            const char *isaName = g->target->GetISAString();
+            std::string targetOutFileName =
+                lGetTargetFileName(outFileName, isaName);
+            if (!m->writeOutput(outputType, targetOutFileName.c_str()))
+                return -1;
+        }
+    }
+    int errorCount = m->errorCount;
+
+    if (headerFileName != NULL) {
+        const char *isaName = g->target->GetISAString();
+        std::string targetHeaderFileName =
+            lGetTargetFileName(headerFileName, isaName);
+        // Add this target's part of the header w/o target name
+        if (!m->writeOutput(Module::Header, headerFileName, "", DHI))
+            return -1;
+        if (!m->writeOutput(Module::Header, targetHeaderFileName.c_str()))
+            return -1;
+    }
+
+    if (g->timeReport != NULL) {
+        const char *isaName = g->target->GetISAString();
+        std::string title = std::string(srcFile) + " (" + isaName + ")";
+        if (g->timeReportFile.empty())
+            g->timeReport->Print(stderr, title);
+        else if (!g->timeReport->WriteJSON(
+                     lGetTargetFileName(g->timeReportFile.c_str(), isaName).c_str(),
+                     title))
+            return -1;
+        g->timeReport->Reset();
+    }
+
+    delete g->target;
+    g->target = NULL;
+
+    // Important: Don't delete the llvm::Module *m here; we need to keep
+    // it around so the llvm::Functions *s stay valid for when we generate
+    // the dispatch module's functions...
+    return errorCount;
+}
+
+
 int
 Module::CompileAndOutput(const char *srcFile,
                          const char *arch,
@@ -2561,8 +3405,40 @@ Module::CompileAndOutput(const char *srcFile,
         if (!g->target->isValid())
             return 1;
 
+        std::vector<std::string> cacheOutputs;
+        std::string cacheKey, source, sourceDiagnostics;
+        bool useCache = lUseCompileCache(srcFile, outFileName, headerFileName,
+                                         depsFileName, hostStubFileName,
+                                         devStubFileName);
+        if (useCache) {
+            const char *outputs[] = { outFileName, headerFileName, depsFileName,
+                                      hostStubFileName, devStubFileName };
+            for (int i = 0; i < (int)(sizeof(outputs) / sizeof(outputs[0])); ++i)
+                if (outputs[i] != NULL)
+                    cacheOutputs.push_back(outputs[i]);
+            {
+                TimeReportScope scope("preprocessing");
+                llvm::raw_string_ostream os(source);
+                execPreprocessor(srcFile, &os, &sourceDiagnostics);
+            }
+            cacheKey = lCacheKeyOptions(arch, cpu, generatePIC, outputType,
+                                        includeFileName, cacheOutputs) +
+                lCacheKeySource(source);
+
+            // The cache entry's warnings include the preprocessor's.
+            if (lCacheRestore(cacheKey, cacheOutputs)) {
+                delete g->target;
+                g->target = NULL;
+                return 0;
+            }
+        }
+
+        DiagnosticsCapture capture(useCache);
+        DiagnosticsCapture::Print(sourceDiagnostics);
+
         m = new Module(srcFile);
-        if (m->CompileFile() == 0) {
+        // The source has already been preprocessed for the cache key.
+        if (m->CompileFile(useCache ? &source : NULL) == 0) {
             if (outputType == CXX) {
                 if (target == NULL || strncmp(target, "generic-", 8) != 0) {
                     Error(SourcePos(), "When generating C++ output, one of the \"generic-*\" "
@@ -2599,6 +3475,9 @@ Module::CompileAndOutput(const char *srcFile,
             ++m->errorCount;
 
         int errorCount = m->errorCount;
+        std::string diagnostics;
+        if (useCache && errorCount == 0 && capture.GetText(&diagnostics))
+            lCacheStore(cacheKey, cacheOutputs, diagnostics);
         delete m;
         m = NULL;
 
@@ -2634,35 +3513,30 @@ Module::CompileAndOutput(const char *srcFile,
         // the target ISA appended to them.
         g->mangleFunctionsWithTarget = true;
 
+        // Check the targets and find their ISAs and vector widths before
+        // compiling any of them.
         llvm::TargetMachine *targetMachines[Target::NUM_ISAS];
         for (int i = 0; i < Target::NUM_ISAS; ++i)
             targetMachines[i] = NULL;
-
-        std::map<std::string, FunctionTargetVariants> exportedFunctions;
-        std::vector<RewriteGlobalInfo> globals[Target::NUM_ISAS];
-        int errorCount = 0;
-        
-        // Handle creating a "generic" header file for multiple targets
-        // that use exported varyings
-        DispatchHeaderInfo DHI;
-        if ((targets.size() > 1) && (headerFileName != NULL)) {
-          DHI.file  = fopen(headerFileName, "w");
-          if (!DHI.file) {
-            perror("fopen");
-            return false;
-          }
-          DHI.fn = headerFileName;
-          DHI.EmitUnifs = true;
-          DHI.EmitFuncs = true;
-          DHI.EmitFrontMatter = true;
-          DHI.Emit4 = true;
-          DHI.Emit8 = true;
-          DHI.Emit16 = true;
-          // This is toggled later.
-          DHI.EmitBackMatter = false;
+        std::vector<Target::ISA> isas;
+        std::vector<int> vectorWidths;
+
+        // The outputs from all of the targets are cached together, under a
+        // key that includes the source as preprocessed for each of them.
+        // Each target then compiles the source that was preprocessed for it.
+        std::vector<std::string> cacheOutputs;
+        std::string cacheKey;
+        std::vector<std::string> sources(targets.size());
+        std::vector<std::string> sourceDiagnostics(targets.size());
+        bool useCache = lUseCompileCache(srcFile, outFileName, headerFileName,
+                                         NULL, NULL, NULL);
+        if (useCache) {
+            if (outFileName != NULL)
+                cacheOutputs.push_back(outFileName);
+            if (headerFileName != NULL)
+                cacheOutputs.push_back(headerFileName);
         }
 
-
         for (unsigned int i = 0; i < targets.size(); ++i) {
             g->target = new Target(arch, cpu, targets[i].c_str(), generatePIC);
             if (!g->target->isValid())
@@ -2677,57 +3551,185 @@ Module::CompileAndOutput(const char *srcFile,
                 return 1;
             }
             targetMachines[g->target->getISA()] = g->target->GetTargetMachine();
-
-            m = new Module(srcFile);
-            if (m->CompileFile() == 0) {
-                // Grab pointers to the exported functions from the module we
-                // just compiled, for use in generating the dispatch function
-                // later.
-                lGetExportedFunctions(m->symbolTable, exportedFunctions);
-
-                lExtractAndRewriteGlobals(m->module, &globals[i]);
-
-                if (outFileName != NULL) {
-                    const char *isaName = g->target->GetISAString();
-                    std::string targetOutFileName =
-                        lGetTargetFileName(outFileName, isaName);
-                    if (!m->writeOutput(outputType, targetOutFileName.c_str()))
-                        return 1;
+            isas.push_back(g->target->getISA());
+            vectorWidths.push_back(g->target->getVectorWidth());
+
+            if (useCache) {
+                const char *isaName = g->target->GetISAString();
+                if (outFileName != NULL)
+                    cacheOutputs.push_back(lGetTargetFileName(outFileName, isaName));
+                if (headerFileName != NULL)
+                    cacheOutputs.push_back(lGetTargetFileName(headerFileName, isaName));
+
+                {
+                    TimeReportScope scope("preprocessing");
+                    llvm::raw_string_ostream os(sources[i]);
+                    execPreprocessor(srcFile, &os, &sourceDiagnostics[i]);
                 }
+                cacheKey += lCacheKeySource(sources[i]);
             }
-            errorCount += m->errorCount;
 
-            // Only write the generate header file, if desired, the first
-            // time through the loop here.
-            if (headerFileName != NULL) {
-              if (i == targets.size()-1) {
-                // only print backmatter on the last target.
+            delete g->target;
+            g->target = NULL;
+        }
+
+        if (useCache) {
+            cacheKey = lCacheKeyOptions(arch, cpu, generatePIC, outputType,
+                                        includeFileName, cacheOutputs) + cacheKey;
+            if (lCacheRestore(cacheKey, cacheOutputs))
+                return 0;
+        }
+
+        DiagnosticsCapture capture(useCache);
+
+        std::map<std::string, FunctionTargetVariants> exportedFunctions;
+        std::vector<RewriteGlobalInfo> globals[Target::NUM_ISAS];
+        int errorCount = 0;
+        
+        // Handle creating a "generic" header file for multiple targets
+        // that use exported varyings
+        DispatchHeaderInfo DHI;
+        DHI.file  = NULL;
+        DHI.fn = headerFileName;
+        DHI.EmitUnifs = true;
+        DHI.EmitFuncs = true;
+        DHI.EmitFrontMatter = true;
+        DHI.Emit4 = true;
+        DHI.Emit8 = true;
+        DHI.Emit16 = true;
+        // This is toggled later.
+        DHI.EmitBackMatter = false;
+
+#ifdef ISPC_IS_WINDOWS
+        if (headerFileName != NULL) {
+          DHI.file  = fopen(headerFileName, "w");
+          if (!DHI.file) {
+            perror("fopen");
+            return false;
+          }
+        }
+
+        for (unsigned int i = 0; i < targets.size(); ++i) {
+            // only print backmatter on the last target.
+            if (i == targets.size()-1)
                 DHI.EmitBackMatter = true;
-              }
-              
-              const char *isaName = g->target->GetISAString();
-              std::string targetHeaderFileName = 
-                lGetTargetFileName(headerFileName, isaName);
-              // write out a header w/o target name for the first target only
-              if (!m->writeOutput(Module::Header, headerFileName, "", &DHI)) {
-                return 1;
-              }
-              if (!m->writeOutput(Module::Header, targetHeaderFileName.c_str())) {
+
+            int targetErrors =
+                compileTargetVariant(srcFile, arch, cpu, targets[i].c_str(),
+                                     generatePIC, outputType, outFileName,
+                                     headerFileName, &DHI, NULL, NULL,
+                                     exportedFunctions, globals);
+            if (targetErrors < 0)
                 return 1;
-              }
-              if (i == targets.size()-1) {
-                fclose(DHI.file);
-              }
+            errorCount += targetErrors;
+        }
+
+        if (headerFileName != NULL)
+            fclose(DHI.file);
+#else
+        // Compile each target in a process of its own, so that they all
+        // run at the same time, each with its own copy of the compiler's
+        // global state.  Each process writes its own output files, its
+        // part of the dispatch header, and its diagnostics to files in
+        // tmpDir, which we then gather in the order of the targets.  The
+        // exported functions and globals come back as bitcode.
+        std::string tmpDir = lMakeTempDir();
+        if (tmpDir.empty())
+            return 1;
+
+        fflush(NULL);
+        std::vector<pid_t> pids;
+        for (unsigned int i = 0; i < targets.size(); ++i) {
+            std::string prefix = lTempFilePrefix(tmpDir, i);
+            // Each target's part of the dispatch header depends on the
+            // vector widths of the targets before it.
+            DispatchHeaderInfo targetDHI = DHI;
+            if (i == targets.size()-1)
+                targetDHI.EmitBackMatter = true;
+            if (headerFileName != NULL)
+                lAdvanceDispatchHeaderInfo(&DHI, vectorWidths[i]);
+
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("fork");
+                break;
+            }
+            if (pid == 0) {
+                if (g->timeReport != NULL)
+                    g->timeReport->Reset();
+                // The parent keeps the copy of what's written to stderr.
+                g->diagnosticsCopy = NULL;
+                int targetErrors = -1;
+                if (freopen((prefix + ".err").c_str(), "w", stderr) != NULL &&
+                    (headerFileName == NULL ||
+                     (targetDHI.file = fopen((prefix + ".h").c_str(), "w")) != NULL)) {
+                    fputs(sourceDiagnostics[i].c_str(), stderr);
+                    targetErrors =
+                        compileTargetVariant(srcFile, arch, cpu, targets[i].c_str(),
+                                             generatePIC, outputType, outFileName,
+                                             headerFileName, &targetDHI,
+                                             prefix.c_str(),
+                                             useCache ? &sources[i] : NULL,
+                                             exportedFunctions, globals);
+                }
+                if (targetDHI.file != NULL && fclose(targetDHI.file) != 0)
+                    targetErrors = -1;
+                fflush(NULL);
+                _exit(targetErrors < 0 ? 2 : (targetErrors > 0 ? 1 : 0));
             }
+            pids.push_back(pid);
+        }
 
-            delete g->target;
-            g->target = NULL;
+        bool failed = (pids.size() < targets.size());
+        for (unsigned int i = 0; i < pids.size(); ++i) {
+            std::string prefix = lTempFilePrefix(tmpDir, i);
+            int status;
+            while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR)
+                ;
+            lAppendFile(stderr, prefix + ".err");
+            if (g->diagnosticsCopy != NULL)
+                lAppendFile(g->diagnosticsCopy, prefix + ".err");
+
+            if (!WIFEXITED(status)) {
+                Error(SourcePos(), "Compilation to target \"%s\" failed "
+                      "unexpectedly.", targets[i].c_str());
+                failed = true;
+            }
+            else if (WEXITSTATUS(status) == 2)
+                failed = true;
+            else if (WEXITSTATUS(status) == 1)
+                ++errorCount;
+            else if (!failed &&
+                     !lReadTargetInterface(prefix, isas[i], exportedFunctions,
+                                           globals)) {
+                Error(SourcePos(), "Unable to read the exported functions "
+                      "and globals compiled for target \"%s\".",
+                      targets[i].c_str());
+                failed = true;
+            }
+        }
 
-            // Important: Don't delete the llvm::Module *m here; we need to
-            // keep it around so the llvm::Functions *s stay valid for when
-            // we generate the dispatch module's functions...
+        if (!failed && headerFileName != NULL) {
+            FILE *f = fopen(headerFileName, "w");
+            if (f == NULL) {
+                perror(headerFileName);
+                failed = true;
+            }
+            else {
+                for (unsigned int i = 0; i < targets.size(); ++i)
+                    lAppendFile(f, lTempFilePrefix(tmpDir, i) + ".h");
+                if (fclose(f) != 0) {
+                    perror(headerFileName);
+                    failed = true;
+                }
+            }
         }
 
+        lRemoveTempDir(tmpDir, targets.size());
+        if (failed)
+            return 1;
+#endif // ISPC_IS_WINDOWS
+
         // Find the first non-NULL target machine from the targets we
         // compiled to above.  We'll use this as the target machine for
         // compiling the dispatch module--this is safe in that it is the
@@ -2746,6 +3748,11 @@ Module::CompileAndOutput(const char *srcFile,
             return 1;
         }
 
+        // The dispatch module is generated with a Module for the first
+        // target set up as 'm', since linking in the dispatch builtins
+        // and the LLVMTypes it uses depend on it.
+        m = new Module(srcFile);
+
         llvm::Module *dispatchModule =
             lCreateDispatchModule(exportedFunctions);
 
@@ -2759,9 +3766,15 @@ Module::CompileAndOutput(const char *srcFile,
                                           outputType, outFileName);
         }
 
+        delete m;
+        m = NULL;
+
         delete g->target;
         g->target = NULL;
 
+        std::string diagnostics;
+        if (useCache && errorCount == 0 && capture.GetText(&diagnostics))
+            lCacheStore(cacheKey, cacheOutputs, diagnostics);
 
         return errorCount > 0;
     }
@@ -41,6 +41,7 @@
 
 #include "ispc.h"
 #include "ast.h"
+#include <map>
 #if !defined(LLVM_3_1) && !defined(LLVM_3_2) && !defined(LLVM_3_3)
   #include <llvm/DebugInfo.h>
 #endif
@@ -51,6 +52,8 @@ namespace llvm
 }
 
 struct DispatchHeaderInfo;
+struct FunctionTargetVariants;
+struct RewriteGlobalInfo;
 
 class Module {
 public:
@@ -58,10 +61,16 @@ public:
         module name. */
     Module(const char *filename);
 
+    /** Releases the types, symbols and AST nodes allocated while the
+        module was being compiled. */
+    ~Module();
+
     /** Compiles the source file passed to the Module constructor, adding
         its global variables and functions to both the llvm::Module and
-        SymbolTable.  Returns the number of errors during compilation.  */
-    int CompileFile();
+        SymbolTable.  If source is non-NULL, it's the file as already
+        preprocessed, and it's parsed instead.  Returns the number of
+        errors during compilation.  */
+    int CompileFile(const std::string *source = NULL);
 
     /** Add a named type definition to the module. */
     void AddTypeDef(const std::string &name, const Type *type,
@@ -166,6 +175,10 @@ private:
     const char *filename;
     AST *ast;
 
+    /** Arena from which the module's Types, Symbols and ASTNodes are
+        allocated; they are all freed together when the Module is. */
+    Arena *arena;
+
     std::vector<std::pair<const Type *, SourcePos> > exportedTypes;
 
     /** Write the corresponding output type to the given file.  Returns
@@ -186,7 +199,32 @@ private:
                                           const char *outFileName);
     static bool writeBitcode(llvm::Module *module, const char *outFileName);
 
-    void execPreprocessor(const char *infilename, llvm::raw_string_ostream* ostream) const;
+    /** Compiles srcFile to one of the targets of a multi-target
+        compilation, writing its target-specific output and header files
+        and its part of the dispatch header.  Its exported functions and
+        globals are added to exportedFunctions and globals, for generating
+        the dispatch module.  If interfaceFileName is non-NULL, they're
+        also written to files with that prefix, so that another process
+        can read them with lReadTargetInterface().  If source is non-NULL,
+        it's the program as already preprocessed for the target.  Returns
+        the number of errors in the program, or -1 if an output file
+        couldn't be written. */
+    static int compileTargetVariant(const char *srcFile, const char *arch,
+                                    const char *cpu, const char *target,
+                                    bool generatePIC, OutputType outputType,
+                                    const char *outFileName,
+                                    const char *headerFileName,
+                                    DispatchHeaderInfo *DHI,
+                                    const char *interfaceFileName,
+                                    const std::string *source,
+                                    std::map<std::string, FunctionTargetVariants> &exportedFunctions,
+                                    std::vector<RewriteGlobalInfo> *globals);
+
+    /** Runs the C preprocessor over the given file for the current
+        target, writing its output to ostream.  Its warnings and errors
+        are printed, or appended to diagnostics if it's non-NULL. */
+    static void execPreprocessor(const char *infilename, llvm::raw_string_ostream* ostream,
+                                 std::string *diagnostics = NULL);
 };
 
 #endif // ISPC_MODULE_H
@@ -40,6 +40,7 @@
 #include "ctx.h"
 #include "sym.h"
 #include "module.h"
+#include "func.h"
 #include "util.h"
 #include "llvmutil.h"
 
@@ -82,6 +83,13 @@
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Analysis/LoopPass.h>
+#if defined(LLVM_3_5)
+  #include <llvm/Analysis/CallGraphSCCPass.h>
+#else
+  #include <llvm/CallGraphSCCPass.h>
+#endif
+#include <llvm/Analysis/CallGraph.h>
 #include <llvm/Target/TargetOptions.h>
 #if defined(LLVM_3_1)
   #include <llvm/Target/TargetData.h>
@@ -119,10 +127,12 @@
 
 static llvm::Pass *CreateIntrinsicsOptPass();
 static llvm::Pass *CreateInstructionSimplifyPass();
+static llvm::Pass *CreateAllOnCallsPass();
 static llvm::Pass *CreatePeepholePass();
 
-static llvm::Pass *CreateImproveMemoryOpsPass();
+static llvm::Pass *CreateImproveMemoryOpsPass(bool handleStrided = false);
 static llvm::Pass *CreateGatherCoalescePass();
+static llvm::Pass *CreateScatterCoalescePass();
 static llvm::Pass *CreateReplacePseudoMemoryOpsPass();
 
 static llvm::Pass *CreateIsCompileTimeConstantPass(bool isLastTry);
@@ -439,6 +449,12 @@ DebugPassManager::add(llvm::Pass * P, int stage = -1) {
         number = stage;
     }
     if (g->off_stages.find(number) == g->off_stages.end()) {
+        if (g->timeReport != NULL) {
+            // charging the time until the next optimization to this one
+            char buf[100];
+            sprintf(buf, "opt phase %d: %s", number, P->getPassName());
+            PM.add(CreateTimeReportPass(buf, P));
+        }
         // adding optimization (not switched off)
         PM.add(P);
         if (g->debug_stages.find(number) != g->debug_stages.end()) {
@@ -560,6 +576,7 @@ Optimize(llvm::Module *module, int optLevel) {
         if (!g->opt.disableMaskAllOnOptimizations) {
             optPM.add(CreateIntrinsicsOptPass(), 215);
             optPM.add(CreateInstructionSimplifyPass());
+            optPM.add(CreateAllOnCallsPass());
         }
         optPM.add(llvm::createDeadInstEliminationPass(), 220);
 
@@ -618,6 +635,7 @@ Optimize(llvm::Module *module, int optLevel) {
                 // finding matching gathers we can coalesce..
                 optPM.add(llvm::createEarlyCSEPass(), 260);
                 optPM.add(CreateGatherCoalescePass());
+                optPM.add(CreateScatterCoalescePass());
             }
         }
 
@@ -625,11 +643,15 @@ Optimize(llvm::Module *module, int optLevel) {
         optPM.add(llvm::createConstantPropagationPass());
         optPM.add(CreateIntrinsicsOptPass());
         optPM.add(CreateInstructionSimplifyPass());
+        if (!g->opt.disableMaskAllOnOptimizations)
+            optPM.add(CreateAllOnCallsPass());
 
         if (g->opt.disableGatherScatterOptimizations == false &&
             g->target->getVectorWidth() > 1) {
             optPM.add(llvm::createInstructionCombiningPass(), 270);
-            optPM.add(CreateImproveMemoryOpsPass());
+            // Now that gather coalescing has run, the remaining strided
+            // gathers can be turned into vector loads.
+            optPM.add(CreateImproveMemoryOpsPass(true));
         }
 
         optPM.add(llvm::createIPSCCPPass(), 275);
@@ -694,7 +716,10 @@ Optimize(llvm::Module *module, int optLevel) {
     // Finish up by making sure we didn't mess anything up in the IR along
     // the way.
     optPM.add(llvm::createVerifierPass(), LAST_OPT_NUMBER);
-    optPM.run(*module);
+    {
+        TimeReportScope scope("optimization");
+        optPM.run(*module);
+    }
 
     if (g->debugPrint) {
         printf("\n*****\nFINAL OUTPUT\n*****\n");
@@ -1176,6 +1201,75 @@ CreateInstructionSimplifyPass() {
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// AllOnCallsPass
+
+/** Non-trivial functions start by checking whether the execution mask is
+    all on and, if so, call a variant of the function that was generated
+    assuming an all-on mask (see Function::GenerateIR()).  This pass finds
+    calls to these functions where the mask is known to be all on at
+    compile time (e.g. calls from the body of a foreach loop) and calls
+    the all-on variant directly, skipping the check.
+ */
+class AllOnCallsPass : public llvm::BasicBlockPass {
+public:
+    AllOnCallsPass()
+        : BasicBlockPass(ID) { }
+
+    const char *getPassName() const { return "All-On Mask Calls"; }
+    bool runOnBasicBlock(llvm::BasicBlock &BB);
+
+    static char ID;
+};
+
+char AllOnCallsPass::ID = 0;
+
+
+bool
+AllOnCallsPass::runOnBasicBlock(llvm::BasicBlock &bb) {
+    DEBUG_START_PASS("AllOnCallsPass");
+
+    bool modifiedAny = false;
+
+    for (llvm::BasicBlock::iterator iter = bb.begin(), e = bb.end(); iter != e; ++iter) {
+        llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(&*iter);
+        if (callInst == NULL)
+            continue;
+
+        llvm::Function *callee = callInst->getCalledFunction();
+        if (callee == NULL || callInst->getNumArgOperands() == 0)
+            continue;
+
+        llvm::Function *allOnCallee = Function::GetAllOnVariant(callee);
+        // The variant's signature may have been changed by other passes
+        // (e.g. dead argument elimination), in which case we leave the
+        // call alone.
+        if (allOnCallee == NULL ||
+            allOnCallee->getFunctionType() != callee->getFunctionType())
+            continue;
+
+        // The mask is the last argument to the function
+        llvm::Value *mask =
+            callInst->getArgOperand(callInst->getNumArgOperands() - 1);
+        if (lGetMaskStatus(mask) != ALL_ON)
+            continue;
+
+        callInst->setCalledFunction(allOnCallee);
+        modifiedAny = true;
+    }
+
+    DEBUG_END_PASS("AllOnCallsPass");
+
+    return modifiedAny;
+}
+
+
+static llvm::Pass *
+CreateAllOnCallsPass() {
+    return new AllOnCallsPass;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // ImproveMemoryOpsPass
 
@@ -1192,10 +1286,17 @@ CreateInstructionSimplifyPass() {
 class ImproveMemoryOpsPass : public llvm::BasicBlockPass {
 public:
     static char ID;
-    ImproveMemoryOpsPass() : BasicBlockPass(ID) { }
+    ImproveMemoryOpsPass(bool strided = false) : BasicBlockPass(ID) {
+        handleStrided = strided;
+    }
 
     const char *getPassName() const { return "Improve Memory Ops"; }
     bool runOnBasicBlock(llvm::BasicBlock &BB);
+
+    /** Whether gathers that access memory with a constant stride should
+        be turned into vector loads and shuffles.  This is only done after
+        gather coalescing has had a chance to handle groups of them. */
+    bool handleStrided;
 };
 
 char ImproveMemoryOpsPass::ID = 0;
@@ -2447,6 +2548,65 @@ lGetOffsetScaleVec(llvm::Value *offsetScale, llvm::Type *vecType) {
 }
 
 
+llvm::Value *lGEPAndLoad(llvm::Value *basePtr, int64_t offset, int align,
+                         llvm::Instruction *insertBefore, llvm::Type *type);
+
+
+/** Given a pointer to the first element read by a gather with the mask
+    all on where the program instances read elements with a constant
+    stride of more than one element, emit the equivalent unmasked vector
+    loads of the memory spanned by the gather and the shuffles that pick
+    out each program instance's element from them.  The last load is
+    positioned to end at the last element that the gather reads, so that
+    nothing past it is accessed.
+ */
+static llvm::Value *
+lStridedGatherToLoads(llvm::Value *ptr, int stride, llvm::Type *scalarType,
+                      int elementSize, llvm::Instruction *insertBefore) {
+    int width = g->target->getVectorWidth();
+    llvm::Type *vecType = llvm::VectorType::get(scalarType, width);
+
+    // Element offsets of the starts of the loads: stride-1 of them back
+    // to back from the first element, and then the last one.
+    int64_t span = (int64_t)(width - 1) * stride + 1;
+    std::vector<int64_t> loadStarts;
+    for (int i = 0; i < stride - 1; ++i)
+        loadStarts.push_back(i * width);
+    loadStarts.push_back(span - width);
+
+    llvm::Value *result = llvm::UndefValue::get(vecType);
+    for (int i = 0; i < (int)loadStarts.size(); ++i) {
+        // Shuffle the elements that come from this load into the result,
+        // keeping the ones from previous loads.
+        std::vector<llvm::Constant *> shufMask;
+        bool used = false;
+        for (int lane = 0; lane < width; ++lane) {
+            int64_t elt = (int64_t)lane * stride;
+            int load = (elt < (int64_t)(stride - 1) * width) ?
+                (int)(elt / width) : stride - 1;
+            if (load == i) {
+                shufMask.push_back(LLVMInt32((int32_t)(width + elt -
+                                                       loadStarts[i])));
+                used = true;
+            }
+            else if (load < i)
+                shufMask.push_back(LLVMInt32(lane));
+            else
+                shufMask.push_back(llvm::UndefValue::get(LLVMTypes::Int32Type));
+        }
+        if (used == false)
+            continue;
+
+        llvm::Value *load = lGEPAndLoad(ptr, loadStarts[i] * elementSize,
+                                        elementSize, insertBefore, vecType);
+        result = new llvm::ShuffleVectorInst(result, load,
+                                             llvm::ConstantVector::get(shufMask),
+                                             "strided_shuf", insertBefore);
+    }
+    return result;
+}
+
+
 /** After earlier optimization passes have run, we are sometimes able to
     determine that gathers/scatters are actually accessing memory in a more
     regular fashion and then change the operation to something simpler and
@@ -2455,15 +2615,17 @@ lGetOffsetScaleVec(llvm::Value *offsetScale, llvm::Type *vecType) {
     broadcast.  This pass examines gathers and scatters and tries to
     simplify them if at all possible.
 
-    @todo Currently, this only looks for all program instances going to the
-    same location and all going to a linear sequence of locations in
-    memory.  There are a number of other cases that might make sense to
-    look for, including things that could be handled with a vector load +
-    shuffle or things that could be handled with hybrids of e.g. 2 4-wide
-    vector loads with AVX, etc.
+    If handleStrided is true, gathers with the mask all on where the
+    program instances access elements with a constant stride (e.g.
+    a[3*programIndex+k], for interleaved data) are also turned into a few
+    vector loads and shuffles.
+
+    @todo There are a number of other cases that might make sense to look
+    for, including things that could be handled with hybrids of e.g. 2
+    4-wide vector loads with AVX, etc.
 */
 static bool
-lGSToLoadStore(llvm::CallInst *callInst) {
+lGSToLoadStore(llvm::CallInst *callInst, bool handleStrided) {
     struct GatherImpInfo {
         GatherImpInfo(const char *pName, const char *lmName, llvm::Type *st,
                       int a)
@@ -2728,6 +2890,33 @@ lGSToLoadStore(llvm::CallInst *callInst) {
                 return true;
             }
         }
+
+        // Strided accesses: it's only worth doing fewer loads than there
+        // are program instances.  Scatters are left alone, since stores
+        // would also write the elements in between the ones being
+        // scattered; ScatterCoalescePass handles groups of scatters that
+        // write all of them.
+        if (handleStrided && gatherInfo != NULL &&
+            lGetMaskStatus(mask) == ALL_ON) {
+            int width = g->target->getVectorWidth();
+            for (int stride = 2; stride <= 8 && stride < width; ++stride) {
+                if (!LLVMVectorIsLinear(fullOffsets, stride * step))
+                    continue;
+
+                Debug(pos, "Transformed gather with stride %d to vector "
+                      "loads and shuffles!", stride);
+                llvm::Value *ptr = lComputeCommonPointer(base, fullOffsets,
+                                                         callInst);
+                lCopyMetadata(ptr, callInst);
+                llvm::Value *result =
+                    lStridedGatherToLoads(ptr, stride, gatherInfo->scalarType,
+                                          gatherInfo->align, callInst);
+                lCopyMetadata(result, callInst);
+                callInst->replaceAllUsesWith(result);
+                callInst->eraseFromParent();
+                return true;
+            }
+        }
         return false;
     }
 }
@@ -2910,7 +3099,7 @@ ImproveMemoryOpsPass::runOnBasicBlock(llvm::BasicBlock &bb) {
             modifiedAny = true;
             goto restart;
         }
-        if (lGSToLoadStore(callInst)) {
+        if (lGSToLoadStore(callInst, handleStrided)) {
             modifiedAny = true;
             goto restart;
         }
@@ -2931,8 +3120,8 @@ ImproveMemoryOpsPass::runOnBasicBlock(llvm::BasicBlock &bb) {
 
 
 static llvm::Pass *
-CreateImproveMemoryOpsPass() {
-    return new ImproveMemoryOpsPass;
+CreateImproveMemoryOpsPass(bool handleStrided) {
+    return new ImproveMemoryOpsPass(handleStrided);
 }
 
 
@@ -4009,6 +4198,383 @@ CreateGatherCoalescePass() {
 }
 
 
+///////////////////////////////////////////////////////////////////////////
+// ScatterCoalescePass
+
+// This pass is the counterpart to GatherCoalescePass for scatters.  It
+// looks for a series of scatters of 32-bit values with the mask all on
+// and the same base pointer, varying offset and offset scale, so that
+// each one writes to the common base pointer plus constant offsets.  It
+// then replaces them with a set of scalar and vector stores, with the
+// stored values shuffled together from the scatters' values.  This is
+// specifically helpful when a program writes data with AOS layout (e.g.
+// storing the x, y, and z components of a varying float3 to an array of
+// structs), where the scatters' elements interleave in memory.
+//
+// Unlike loads, stores can't touch memory that the original code didn't,
+// so only runs of offsets that are entirely written by the scatters in
+// the group turn into vector stores.
+
+class ScatterCoalescePass : public llvm::BasicBlockPass {
+public:
+    static char ID;
+    ScatterCoalescePass() : BasicBlockPass(ID) { }
+
+    const char *getPassName() const { return "Scatter Coalescing"; }
+    bool runOnBasicBlock(llvm::BasicBlock &BB);
+};
+
+char ScatterCoalescePass::ID = 0;
+
+
+/** Representation of a memory store that the scatter coalescing code has
+    decided to generate.
+ */
+struct CoalescedStoreOp {
+    CoalescedStoreOp(int64_t s, int c) {
+        start = s;
+        count = c;
+    }
+
+    /** Starting offset of the store from the common base pointer (in
+        terms of numbers of items of the underlying element type). */
+    int64_t start;
+
+    /** Number of elements to store at this location */
+    int count;
+};
+
+
+/** Given the set of offsets from a common base pointer that a group of
+    scatters writes to, determine a set of store operations that writes
+    to exactly those locations, using vector stores of up to maxWidth
+    elements for runs of consecutive offsets.
+ */
+static void
+lSelectStores(const std::set<int64_t> &offsets, int maxWidth,
+              std::vector<CoalescedStoreOp> *stores) {
+    std::set<int64_t>::const_iterator iter = offsets.begin();
+    while (iter != offsets.end()) {
+        // Find the number of consecutive offsets starting from this one.
+        int64_t start = *iter;
+        int run = 0;
+        std::set<int64_t>::const_iterator runIter = iter;
+        while (runIter != offsets.end() && *runIter == start + run &&
+               run < maxWidth) {
+            ++run;
+            ++runIter;
+        }
+
+        // Use the widest store that they fill completely.
+        int count = 1;
+        for (int width = maxWidth; width > 1; width /= 2) {
+            if (run >= width) {
+                count = width;
+                break;
+            }
+        }
+
+        stores->push_back(CoalescedStoreOp(start, count));
+        for (int i = 0; i < count; ++i)
+            ++iter;
+    }
+}
+
+
+/** Print a performance message with the details of the result of
+    coalescing over a group of scatters. */
+static void
+lCoalesceScatterPerfInfo(const std::vector<llvm::CallInst *> &coalesceGroup,
+                         const std::vector<CoalescedStoreOp> &storeOps) {
+    SourcePos pos;
+    lGetSourcePosFromMetadata(coalesceGroup[0], &pos);
+
+    // Count how many stores of each size there were.
+    std::map<int, int> storeOpsCount;
+    for (int i = 0; i < (int)storeOps.size(); ++i)
+        ++storeOpsCount[storeOps[i].count];
+
+    char storeOpsInfo[512];
+    storeOpsInfo[0] = '\0';
+    std::map<int, int>::const_iterator iter = storeOpsCount.begin();
+    while (iter != storeOpsCount.end()) {
+        char buf[32];
+        sprintf(buf, "%d x %d-wide", iter->second, iter->first);
+        strcat(storeOpsInfo, buf);
+        ++iter;
+        if (iter != storeOpsCount.end())
+            strcat(storeOpsInfo, ", ");
+    }
+
+    if (coalesceGroup.size() == 1)
+        PerformanceWarning(pos, "Coalesced scatter into %d store%s (%s).",
+                           (int)storeOps.size(),
+                           (storeOps.size() > 1) ? "s" : "", storeOpsInfo);
+    else
+        PerformanceWarning(pos, "Coalesced %d scatters starting here into %d "
+                           "store%s (%s).", (int)coalesceGroup.size(),
+                           (int)storeOps.size(),
+                           (storeOps.size() > 1) ? "s" : "", storeOpsInfo);
+}
+
+
+/** Returns the value to be stored by the given store operation, given the
+    scatter and program instance that provides the value for each offset.
+    Values from up to two scatters are combined with a single shuffle;
+    any others are inserted one element at a time.
+ */
+static llvm::Value *
+lAssembleStoreValue(const CoalescedStoreOp &store,
+                    const std::map<int64_t, std::pair<int, int> > &sources,
+                    const std::vector<llvm::CallInst *> &coalesceGroup,
+                    llvm::Instruction *insertBefore) {
+    std::vector<std::pair<int, int> > elements;
+    for (int i = 0; i < store.count; ++i) {
+        std::map<int64_t, std::pair<int, int> >::const_iterator iter =
+            sources.find(store.start + i);
+        Assert(iter != sources.end());
+        elements.push_back(iter->second);
+    }
+
+    if (store.count == 1)
+        return llvm::ExtractElementInst::Create(
+            coalesceGroup[elements[0].first]->getArgOperand(4),
+            LLVMInt32(elements[0].second), "scatter_elt", insertBefore);
+
+    // Shuffle together the elements that come from the first two scatters
+    // that contribute to this store.
+    int width = g->target->getVectorWidth();
+    int src0 = elements[0].first, src1 = -1;
+    std::vector<llvm::Constant *> shufMask;
+    for (int i = 0; i < store.count; ++i) {
+        if (src1 == -1 && elements[i].first != src0)
+            src1 = elements[i].first;
+
+        if (elements[i].first == src0)
+            shufMask.push_back(LLVMInt32(elements[i].second));
+        else if (elements[i].first == src1)
+            shufMask.push_back(LLVMInt32(width + elements[i].second));
+        else
+            shufMask.push_back(llvm::UndefValue::get(LLVMTypes::Int32Type));
+    }
+
+    llvm::Value *v0 = coalesceGroup[src0]->getArgOperand(4);
+    llvm::Value *v1 = (src1 != -1) ? coalesceGroup[src1]->getArgOperand(4) :
+        llvm::UndefValue::get(v0->getType());
+    llvm::Value *result =
+        new llvm::ShuffleVectorInst(v0, v1, llvm::ConstantVector::get(shufMask),
+                                    "scatter_shuf", insertBefore);
+
+    // And then insert the rest of them.
+    for (int i = 0; i < store.count; ++i) {
+        if (elements[i].first == src0 || elements[i].first == src1)
+            continue;
+        llvm::Value *elt = llvm::ExtractElementInst::Create(
+            coalesceGroup[elements[i].first]->getArgOperand(4),
+            LLVMInt32(elements[i].second), "scatter_elt", insertBefore);
+        result = llvm::InsertElementInst::Create(result, elt, LLVMInt32(i),
+                                                 "scatter_insert", insertBefore);
+    }
+    return result;
+}
+
+
+/** Actually do the coalescing.  We have a set of scatters all writing to
+    addresses of the form basePtr + constOffset (see lCoalesceGathers()).
+    Returns false, leaving the scatters as they are, if they can't be
+    turned into fewer, wider stores.
+ */
+static bool
+lCoalesceScatters(const std::vector<llvm::CallInst *> &coalesceGroup) {
+    int width = g->target->getVectorWidth();
+
+    int elementSize = 0;
+    llvm::Type *valueType = coalesceGroup[0]->getArgOperand(4)->getType();
+    if (valueType == LLVMTypes::Int32VectorType ||
+        valueType == LLVMTypes::FloatVectorType)
+        elementSize = 4;
+    else
+        FATAL("Unexpected scatter type in lCoalesceScatters");
+
+    // Get the constant byte offsets for all of the scatters, and make sure
+    // that they're all at element granularity.
+    std::vector<int64_t> constOffsets(coalesceGroup.size() * width, 0);
+    for (int i = 0; i < (int)coalesceGroup.size(); ++i) {
+        int nElts;
+        if (!LLVMExtractVectorInts(coalesceGroup[i]->getArgOperand(3),
+                                   &constOffsets[i * width], &nElts))
+            return false;
+        Assert(nElts == width);
+    }
+
+    // Record which scatter and which program instance writes to each
+    // offset.  If more than one writes to the same location, give up
+    // rather than worrying about which of them wins.
+    std::map<int64_t, std::pair<int, int> > sources;
+    std::set<int64_t> offsets;
+    for (int i = 0; i < (int)constOffsets.size(); ++i) {
+        if ((constOffsets[i] % elementSize) != 0)
+            return false;
+        int64_t offset = constOffsets[i] / elementSize;
+        if (offsets.find(offset) != offsets.end())
+            return false;
+        offsets.insert(offset);
+        sources[offset] = std::make_pair(i / width, i % width);
+    }
+
+    std::vector<CoalescedStoreOp> storeOps;
+    lSelectStores(offsets, (width >= 8) ? 8 : 4, &storeOps);
+
+    // It's only worth doing if we get at least one vector store out of it.
+    int i;
+    for (i = 0; i < (int)storeOps.size(); ++i)
+        if (storeOps[i].count > 1)
+            break;
+    if (i == (int)storeOps.size())
+        return false;
+
+    lCoalesceScatterPerfInfo(coalesceGroup, storeOps);
+
+    // The stores go where the last scatter was; there aren't any other
+    // memory accesses between the scatters in the group, and all of the
+    // values to be stored are available there.
+    llvm::Instruction *insertBefore = coalesceGroup.back();
+    llvm::Value *basePtr = lComputeBasePtr(coalesceGroup[0], insertBefore);
+
+    Debug(SourcePos(), "Coalesce doing %d stores.", (int)storeOps.size());
+    for (i = 0; i < (int)storeOps.size(); ++i) {
+        Debug(SourcePos(), "Store #%d @ %" PRId64 ", %d items", i,
+              storeOps[i].start, storeOps[i].count);
+
+        llvm::Value *value = lAssembleStoreValue(storeOps[i], sources,
+                                                 coalesceGroup, insertBefore);
+
+        int align = elementSize;
+        if (storeOps[i].count >= 4 && g->opt.forceAlignedMemory)
+            align = g->target->getNativeVectorAlignment();
+
+        // basePtr is an i8 *, so the offset from it is in bytes.
+        llvm::Value *ptr = lGEPInst(basePtr,
+                                    LLVMInt64(storeOps[i].start * elementSize),
+                                    "new_base", insertBefore);
+        ptr = new llvm::BitCastInst(ptr,
+                                    llvm::PointerType::get(value->getType(), 0),
+                                    "ptr_cast", insertBefore);
+        llvm::Instruction *store =
+            new llvm::StoreInst(value, ptr, false /* not volatile */, align,
+                                insertBefore);
+        lCopyMetadata(store, coalesceGroup[0]);
+    }
+
+    for (i = 0; i < (int)coalesceGroup.size(); ++i)
+        coalesceGroup[i]->eraseFromParent();
+
+    return true;
+}
+
+
+bool
+ScatterCoalescePass::runOnBasicBlock(llvm::BasicBlock &bb) {
+    DEBUG_START_PASS("ScatterCoalescePass");
+
+    llvm::Function *scatterFuncs[] = {
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets32_i32"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets32_float"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets64_i32"),
+        m->module->getFunction("__pseudo_scatter_factored_base_offsets64_float"),
+    };
+    int nScatterFuncs = sizeof(scatterFuncs) / sizeof(scatterFuncs[0]);
+
+    bool modifiedAny = false;
+
+ restart:
+    for (llvm::BasicBlock::iterator iter = bb.begin(), e = bb.end(); iter != e;
+         ++iter) {
+        llvm::CallInst *callInst = llvm::dyn_cast<llvm::CallInst>(&*iter);
+        if (callInst == NULL)
+            continue;
+
+        llvm::Function *calledFunc = callInst->getCalledFunction();
+        if (calledFunc == NULL)
+            continue;
+
+        int i;
+        for (i = 0; i < nScatterFuncs; ++i)
+            if (scatterFuncs[i] != NULL && calledFunc == scatterFuncs[i])
+                break;
+        if (i == nScatterFuncs)
+            continue;
+
+        SourcePos pos;
+        lGetSourcePosFromMetadata(callInst, &pos);
+        Debug(pos, "Checking for coalescable scatters starting here...");
+
+        llvm::Value *base = callInst->getArgOperand(0);
+        llvm::Value *variableOffsets = callInst->getArgOperand(1);
+        llvm::Value *offsetScale = callInst->getArgOperand(2);
+        llvm::Value *mask = callInst->getArgOperand(5);
+
+        // As with gathers, we need the mask to be all on and the variable
+        // offsets to be uniform, so that all of the scatters in the group
+        // write to a common base pointer plus constant offsets.
+        if (lGetMaskStatus(mask) != ALL_ON)
+            continue;
+
+        if (!LLVMVectorValuesAllEqual(variableOffsets))
+            continue;
+
+        std::vector<llvm::CallInst *> coalesceGroup;
+        coalesceGroup.push_back(callInst);
+
+        // Look for matching scatters in the rest of the basic block, up
+        // until any other instruction that accesses memory: the stores
+        // will be emitted at the last scatter in the group, so the earlier
+        // ones' writes can't be moved past anything that might read or
+        // write the same memory.
+        llvm::BasicBlock::iterator fwdIter = iter;
+        ++fwdIter;
+        for (; fwdIter != bb.end(); ++fwdIter) {
+            llvm::CallInst *fwdCall = llvm::dyn_cast<llvm::CallInst>(&*fwdIter);
+            if (fwdCall != NULL &&
+                fwdCall->getCalledFunction() == calledFunc &&
+                base == fwdCall->getArgOperand(0) &&
+                variableOffsets == fwdCall->getArgOperand(1) &&
+                offsetScale == fwdCall->getArgOperand(2) &&
+                mask == fwdCall->getArgOperand(5)) {
+                SourcePos fwdPos;
+                lGetSourcePosFromMetadata(fwdCall, &fwdPos);
+                Debug(fwdPos, "This scatter can be coalesced.");
+                coalesceGroup.push_back(fwdCall);
+
+                // As with gathers, don't try to coalesce over a window of
+                // more than 4 scatters.
+                if (coalesceGroup.size() == 4)
+                    break;
+            }
+            else if (fwdIter->mayReadOrWriteMemory())
+                break;
+        }
+
+        Debug(pos, "Done with checking for matching scatters");
+
+        if (lCoalesceScatters(coalesceGroup)) {
+            modifiedAny = true;
+            goto restart;
+        }
+    }
+
+    DEBUG_END_PASS("ScatterCoalescePass");
+
+    return modifiedAny;
+}
+
+
+static llvm::Pass *
+CreateScatterCoalescePass() {
+    return new ScatterCoalescePass;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // ReplacePseudoMemoryOpsPass
 
@@ -4486,9 +5052,207 @@ CreateDebugPass(char * output) {
     return new DebugPass(output);
 }
 
+///////////////////////////////////////////////////////////////////////////
+// TimeReportPass
+
+/** These passes don't change anything; they just tell g->timeReport that
+    the pass after them is starting to run, and on which function.  There's
+    one for each kind of pass that's used in the optimization and code
+    generation pipelines, since e.g. a module pass between two basic block
+    passes would make the pass manager run each of them over the whole
+    module in turn rather than running both of them on each block. */
+class TimeReportModulePass : public llvm::ModulePass {
+public:
+    static char ID;
+    TimeReportModulePass(const std::string &p) : ModulePass(ID), phase(p) { }
+
+    const char *getPassName() const { return "Time Report"; }
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const { AU.setPreservesAll(); }
+    bool runOnModule(llvm::Module &module) {
+        g->timeReport->Switch(phase);
+        return false;
+    }
+
+private:
+    std::string phase;
+};
+
+char TimeReportModulePass::ID = 0;
+
+
+class TimeReportSCCPass : public llvm::CallGraphSCCPass {
+public:
+    static char ID;
+    TimeReportSCCPass(const std::string &p) : CallGraphSCCPass(ID), phase(p) { }
+
+    const char *getPassName() const { return "Time Report"; }
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const {
+        CallGraphSCCPass::getAnalysisUsage(AU);
+        AU.setPreservesAll();
+    }
+    bool runOnSCC(llvm::CallGraphSCC &scc) {
+        llvm::Function *func = (*scc.begin())->getFunction();
+        g->timeReport->Switch(phase, func ? func->getName().str() : "");
+        return false;
+    }
+
+private:
+    std::string phase;
+};
+
+char TimeReportSCCPass::ID = 0;
+
+
+class TimeReportFunctionPass : public llvm::FunctionPass {
+public:
+    static char ID;
+    TimeReportFunctionPass(const std::string &p) : FunctionPass(ID), phase(p) { }
+
+    const char *getPassName() const { return "Time Report"; }
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const { AU.setPreservesAll(); }
+    bool runOnFunction(llvm::Function &func) {
+        g->timeReport->Switch(phase, func.getName().str());
+        return false;
+    }
+
+private:
+    std::string phase;
+};
+
+char TimeReportFunctionPass::ID = 0;
+
+
+class TimeReportLoopPass : public llvm::LoopPass {
+public:
+    static char ID;
+    TimeReportLoopPass(const std::string &p) : LoopPass(ID), phase(p) { }
+
+    const char *getPassName() const { return "Time Report"; }
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const { AU.setPreservesAll(); }
+    bool runOnLoop(llvm::Loop *loop, llvm::LPPassManager &LPM) {
+        g->timeReport->Switch(phase, loop->getHeader()->getParent()->getName().str());
+        return false;
+    }
+
+private:
+    std::string phase;
+};
+
+char TimeReportLoopPass::ID = 0;
+
+
+class TimeReportBasicBlockPass : public llvm::BasicBlockPass {
+public:
+    static char ID;
+    TimeReportBasicBlockPass(const std::string &p) : BasicBlockPass(ID), phase(p) { }
+
+    const char *getPassName() const { return "Time Report"; }
+    void getAnalysisUsage(llvm::AnalysisUsage &AU) const { AU.setPreservesAll(); }
+    bool runOnBasicBlock(llvm::BasicBlock &bb) {
+        g->timeReport->Switch(phase, bb.getParent()->getName().str());
+        return false;
+    }
+
+private:
+    std::string phase;
+};
+
+char TimeReportBasicBlockPass::ID = 0;
+
+
+llvm::Pass *
+CreateTimeReportPass(const std::string &phase, llvm::Pass *pass) {
+    switch (pass ? pass->getPassKind() : llvm::PT_Function) {
+    case llvm::PT_BasicBlock:
+        return new TimeReportBasicBlockPass(phase);
+    case llvm::PT_Loop:
+        return new TimeReportLoopPass(phase);
+    case llvm::PT_Function:
+        return new TimeReportFunctionPass(phase);
+    case llvm::PT_CallGraphSCC:
+        return new TimeReportSCCPass(phase);
+    default:
+        return new TimeReportModulePass(phase);
+    }
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // MakeInternalFuncsStaticPass
 
+/** The target-specific functions that the optimization passes may add
+    calls to.  See MakeInternalFuncsStaticPass below. */
+static const char *lOptimizerBuiltins[] = {
+    "__avg_up_uint8",
+    "__avg_up_int8",
+    "__avg_up_uint16",
+    "__avg_up_int16",
+    "__avg_down_uint8",
+    "__avg_down_int8",
+    "__avg_down_uint16",
+    "__avg_down_int16",
+    "__fast_masked_vload",
+    "__gather_factored_base_offsets32_i8", "__gather_factored_base_offsets32_i16",
+    "__gather_factored_base_offsets32_i32", "__gather_factored_base_offsets32_i64",
+    "__gather_factored_base_offsets32_float", "__gather_factored_base_offsets32_double",
+    "__gather_factored_base_offsets64_i8", "__gather_factored_base_offsets64_i16",
+    "__gather_factored_base_offsets64_i32", "__gather_factored_base_offsets64_i64",
+    "__gather_factored_base_offsets64_float", "__gather_factored_base_offsets64_double",
+    "__gather_base_offsets32_i8", "__gather_base_offsets32_i16",
+    "__gather_base_offsets32_i32", "__gather_base_offsets32_i64",
+    "__gather_base_offsets32_float", "__gather_base_offsets32_double",
+    "__gather_base_offsets64_i8", "__gather_base_offsets64_i16",
+    "__gather_base_offsets64_i32", "__gather_base_offsets64_i64",
+    "__gather_base_offsets64_float", "__gather_base_offsets64_double",
+    "__gather32_i8", "__gather32_i16",
+    "__gather32_i32", "__gather32_i64",
+    "__gather32_float", "__gather32_double",
+    "__gather64_i8", "__gather64_i16",
+    "__gather64_i32", "__gather64_i64",
+    "__gather64_float", "__gather64_double",
+    "__gather_elt32_i8", "__gather_elt32_i16",
+    "__gather_elt32_i32", "__gather_elt32_i64",
+    "__gather_elt32_float", "__gather_elt32_double",
+    "__gather_elt64_i8", "__gather_elt64_i16",
+    "__gather_elt64_i32", "__gather_elt64_i64",
+    "__gather_elt64_float", "__gather_elt64_double",
+    "__masked_load_i8", "__masked_load_i16",
+    "__masked_load_i32", "__masked_load_i64",
+    "__masked_load_float", "__masked_load_double",
+    "__masked_store_i8", "__masked_store_i16",
+    "__masked_store_i32", "__masked_store_i64",
+    "__masked_store_float", "__masked_store_double",
+    "__masked_store_blend_i8", "__masked_store_blend_i16",
+    "__masked_store_blend_i32", "__masked_store_blend_i64",
+    "__masked_store_blend_float", "__masked_store_blend_double",
+    "__scatter_factored_base_offsets32_i8", "__scatter_factored_base_offsets32_i16",
+    "__scatter_factored_base_offsets32_i32", "__scatter_factored_base_offsets32_i64",
+    "__scatter_factored_base_offsets32_float", "__scatter_factored_base_offsets32_double",
+    "__scatter_factored_base_offsets64_i8", "__scatter_factored_base_offsets64_i16",
+    "__scatter_factored_base_offsets64_i32", "__scatter_factored_base_offsets64_i64",
+    "__scatter_factored_base_offsets64_float", "__scatter_factored_base_offsets64_double",
+    "__scatter_base_offsets32_i8", "__scatter_base_offsets32_i16",
+    "__scatter_base_offsets32_i32", "__scatter_base_offsets32_i64",
+    "__scatter_base_offsets32_float", "__scatter_base_offsets32_double",
+    "__scatter_base_offsets64_i8", "__scatter_base_offsets64_i16",
+    "__scatter_base_offsets64_i32", "__scatter_base_offsets64_i64",
+    "__scatter_base_offsets64_float", "__scatter_base_offsets64_double",
+    "__scatter_elt32_i8", "__scatter_elt32_i16",
+    "__scatter_elt32_i32", "__scatter_elt32_i64",
+    "__scatter_elt32_float", "__scatter_elt32_double",
+    "__scatter_elt64_i8", "__scatter_elt64_i16",
+    "__scatter_elt64_i32", "__scatter_elt64_i64",
+    "__scatter_elt64_float", "__scatter_elt64_double",
+    "__scatter32_i8", "__scatter32_i16",
+    "__scatter32_i32", "__scatter32_i64",
+    "__scatter32_float", "__scatter32_double",
+    "__scatter64_i8", "__scatter64_i16",
+    "__scatter64_i32", "__scatter64_i64",
+    "__scatter64_float", "__scatter64_double",
+    "__keep_funcs_live",
+};
+
+
 /** There are a number of target-specific functions that we use during
     these optimization passes.  By the time we are done with optimization,
     any uses of these should be inlined and no calls to these functions
@@ -4518,80 +5282,10 @@ char MakeInternalFuncsStaticPass::ID = 0;
 
 bool
 MakeInternalFuncsStaticPass::runOnModule(llvm::Module &module) {
-    const char *names[] = {
-        "__avg_up_uint8",
-        "__avg_up_int8",
-        "__avg_up_uint16",
-        "__avg_up_int16",
-        "__avg_down_uint8",
-        "__avg_down_int8",
-        "__avg_down_uint16",
-        "__avg_down_int16",
-        "__fast_masked_vload",
-        "__gather_factored_base_offsets32_i8", "__gather_factored_base_offsets32_i16",
-        "__gather_factored_base_offsets32_i32", "__gather_factored_base_offsets32_i64",
-        "__gather_factored_base_offsets32_float", "__gather_factored_base_offsets32_double",
-        "__gather_factored_base_offsets64_i8", "__gather_factored_base_offsets64_i16",
-        "__gather_factored_base_offsets64_i32", "__gather_factored_base_offsets64_i64",
-        "__gather_factored_base_offsets64_float", "__gather_factored_base_offsets64_double",
-        "__gather_base_offsets32_i8", "__gather_base_offsets32_i16",
-        "__gather_base_offsets32_i32", "__gather_base_offsets32_i64",
-        "__gather_base_offsets32_float", "__gather_base_offsets32_double",
-        "__gather_base_offsets64_i8", "__gather_base_offsets64_i16",
-        "__gather_base_offsets64_i32", "__gather_base_offsets64_i64",
-        "__gather_base_offsets64_float", "__gather_base_offsets64_double",
-        "__gather32_i8", "__gather32_i16",
-        "__gather32_i32", "__gather32_i64",
-        "__gather32_float", "__gather32_double",
-        "__gather64_i8", "__gather64_i16",
-        "__gather64_i32", "__gather64_i64",
-        "__gather64_float", "__gather64_double",
-        "__gather_elt32_i8", "__gather_elt32_i16",
-        "__gather_elt32_i32", "__gather_elt32_i64",
-        "__gather_elt32_float", "__gather_elt32_double",
-        "__gather_elt64_i8", "__gather_elt64_i16",
-        "__gather_elt64_i32", "__gather_elt64_i64",
-        "__gather_elt64_float", "__gather_elt64_double",
-        "__masked_load_i8", "__masked_load_i16",
-        "__masked_load_i32", "__masked_load_i64",
-        "__masked_load_float", "__masked_load_double",
-        "__masked_store_i8", "__masked_store_i16",
-        "__masked_store_i32", "__masked_store_i64",
-        "__masked_store_float", "__masked_store_double",
-        "__masked_store_blend_i8", "__masked_store_blend_i16",
-        "__masked_store_blend_i32", "__masked_store_blend_i64",
-        "__masked_store_blend_float", "__masked_store_blend_double",
-        "__scatter_factored_base_offsets32_i8", "__scatter_factored_base_offsets32_i16",
-        "__scatter_factored_base_offsets32_i32", "__scatter_factored_base_offsets32_i64",
-        "__scatter_factored_base_offsets32_float", "__scatter_factored_base_offsets32_double",
-        "__scatter_factored_base_offsets64_i8", "__scatter_factored_base_offsets64_i16",
-        "__scatter_factored_base_offsets64_i32", "__scatter_factored_base_offsets64_i64",
-        "__scatter_factored_base_offsets64_float", "__scatter_factored_base_offsets64_double",
-        "__scatter_base_offsets32_i8", "__scatter_base_offsets32_i16",
-        "__scatter_base_offsets32_i32", "__scatter_base_offsets32_i64",
-        "__scatter_base_offsets32_float", "__scatter_base_offsets32_double",
-        "__scatter_base_offsets64_i8", "__scatter_base_offsets64_i16",
-        "__scatter_base_offsets64_i32", "__scatter_base_offsets64_i64",
-        "__scatter_base_offsets64_float", "__scatter_base_offsets64_double",
-        "__scatter_elt32_i8", "__scatter_elt32_i16",
-        "__scatter_elt32_i32", "__scatter_elt32_i64",
-        "__scatter_elt32_float", "__scatter_elt32_double",
-        "__scatter_elt64_i8", "__scatter_elt64_i16",
-        "__scatter_elt64_i32", "__scatter_elt64_i64",
-        "__scatter_elt64_float", "__scatter_elt64_double",
-        "__scatter32_i8", "__scatter32_i16",
-        "__scatter32_i32", "__scatter32_i64",
-        "__scatter32_float", "__scatter32_double",
-        "__scatter64_i8", "__scatter64_i16",
-        "__scatter64_i32", "__scatter64_i64",
-        "__scatter64_float", "__scatter64_double",
-        "__keep_funcs_live",
-    };
-
     bool modifiedAny = false;
-    int count = sizeof(names) / sizeof(names[0]);
+    int count = sizeof(lOptimizerBuiltins) / sizeof(lOptimizerBuiltins[0]);
     for (int i = 0; i < count; ++i) {
-        llvm::Function *f = m->module->getFunction(names[i]);
+        llvm::Function *f = m->module->getFunction(lOptimizerBuiltins[i]);
         if (f != NULL && f->empty() == false) {
             f->setLinkage(llvm::GlobalValue::InternalLinkage);
             modifiedAny = true;
@@ -4602,6 +5296,16 @@ MakeInternalFuncsStaticPass::runOnModule(llvm::Module &module) {
 }
 
 
+bool
+IsOptimizerBuiltin(const char *name) {
+    int count = sizeof(lOptimizerBuiltins) / sizeof(lOptimizerBuiltins[0]);
+    for (int i = 0; i < count; ++i)
+        if (!strcmp(name, lOptimizerBuiltins[i]))
+            return true;
+    return false;
+}
+
+
 static llvm::Pass *
 CreateMakeInternalFuncsStaticPass() {
     return new MakeInternalFuncsStaticPass;
@@ -47,4 +47,19 @@
 */
 void Optimize(llvm::Module *module, int optLevel);
 
+/** Returns true if the optimization passes may add calls to the builtin
+    function with the given name, in which case its definition needs to be
+    in the module before optimization even if nothing calls it yet.
+*/
+bool IsOptimizerBuiltin(const char *name);
+
+/** Returns a pass that switches g->timeReport to the given phase when it
+    runs, charging the time to the function it's run on.  The pass is of
+    the same kind (module, function, loop, ...) as the given pass, or a
+    function pass if it's NULL, so that adding it just before that pass
+    doesn't change how the pass manager groups the passes together.
+*/
+llvm::Pass *CreateTimeReportPass(const std::string &phase,
+                                 llvm::Pass *pass = NULL);
+
 #endif // ISPC_OPT_H
@@ -195,7 +195,7 @@ struct ForeachDimension {
 %token TOKEN_AND_ASSIGN TOKEN_OR_ASSIGN TOKEN_XOR_ASSIGN
 %token TOKEN_SIZEOF TOKEN_NEW TOKEN_DELETE TOKEN_IN
 
-%token TOKEN_EXTERN TOKEN_EXPORT TOKEN_STATIC TOKEN_INLINE TOKEN_TASK TOKEN_DECLSPEC
+%token TOKEN_EXTERN TOKEN_EXPORT TOKEN_ASYNC TOKEN_STATIC TOKEN_INLINE TOKEN_TASK TOKEN_DECLSPEC
 %token TOKEN_UNIFORM TOKEN_VARYING TOKEN_TYPEDEF TOKEN_SOA TOKEN_UNMASKED
 %token TOKEN_CHAR TOKEN_INT TOKEN_SIGNED TOKEN_UNSIGNED TOKEN_FLOAT TOKEN_DOUBLE
 %token TOKEN_INT8 TOKEN_INT16 TOKEN_INT64 TOKEN_CONST TOKEN_VOID TOKEN_BOOL
@@ -206,7 +206,7 @@ struct ForeachDimension {
 %token TOKEN_FOREACH_UNIQUE TOKEN_FOREACH_ACTIVE TOKEN_DOTDOTDOT
 %token TOKEN_FOR TOKEN_GOTO TOKEN_CONTINUE TOKEN_BREAK TOKEN_RETURN
 %token TOKEN_CIF TOKEN_CDO TOKEN_CFOR TOKEN_CWHILE
-%token TOKEN_SYNC TOKEN_PRINT TOKEN_ASSERT
+%token TOKEN_SYNC TOKEN_PRINT TOKEN_ASSERT TOKEN_AFTER
 
 %type <expr> primary_expression postfix_expression integer_dotdotdot
 %type <expr> unary_expression cast_expression funcall_expression launch_expression
@@ -216,7 +216,7 @@ struct ForeachDimension {
 %type <expr> logical_and_expression logical_or_expression new_expression
 %type <expr> conditional_expression assignment_expression expression
 %type <expr> initializer constant_expression for_test
-%type <exprList> argument_expression_list initializer_list
+%type <exprList> argument_expression_list initializer_list launch_predecessors
 
 %type <stmt> statement labeled_statement compound_statement for_init_statement
 %type <stmt> expression_statement selection_statement iteration_statement
@@ -350,76 +350,76 @@ primary_expression
     ;
 
 launch_expression
-    : TOKEN_LAUNCH postfix_expression '(' argument_expression_list ')'
+    : TOKEN_LAUNCH launch_predecessors postfix_expression '(' argument_expression_list ')'
       {
-          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @2);
+          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @3);
           Expr *launchCount[3] = {oneExpr, oneExpr, oneExpr};
-          $$ = new FunctionCallExpr($2, $4, Union(@2, @5), true, launchCount);
+          $$ = new FunctionCallExpr($3, $5, Union(@3, @6), true, launchCount, $2);
       }
-    | TOKEN_LAUNCH postfix_expression '(' ')'
+    | TOKEN_LAUNCH launch_predecessors postfix_expression '(' ')'
       {
-          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @2);
+          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @3);
           Expr *launchCount[3] = {oneExpr, oneExpr, oneExpr};
-          $$ = new FunctionCallExpr($2, new ExprList(Union(@3,@4)), Union(@2, @4), true, launchCount);
+          $$ = new FunctionCallExpr($3, new ExprList(Union(@4,@5)), Union(@3, @5), true, launchCount, $2);
        }
 
-    | TOKEN_LAUNCH '[' assignment_expression ']' postfix_expression '(' argument_expression_list ')'
+    | TOKEN_LAUNCH '[' assignment_expression ']' launch_predecessors postfix_expression '(' argument_expression_list ')'
       { 
-          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @5);
+          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @6);
           Expr *launchCount[3] = {$3, oneExpr, oneExpr};
-          $$ = new FunctionCallExpr($5, $7, Union(@5,@8), true, launchCount);
+          $$ = new FunctionCallExpr($6, $8, Union(@6,@9), true, launchCount, $5);
       }
-    | TOKEN_LAUNCH '[' assignment_expression ']' postfix_expression '(' ')'
+    | TOKEN_LAUNCH '[' assignment_expression ']' launch_predecessors postfix_expression '(' ')'
       { 
-          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @5);
+          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @6);
           Expr *launchCount[3] = {$3, oneExpr, oneExpr};
-          $$ = new FunctionCallExpr($5, new ExprList(Union(@5,@6)), Union(@5,@7), true, launchCount);
+          $$ = new FunctionCallExpr($6, new ExprList(Union(@6,@7)), Union(@6,@8), true, launchCount, $5);
       }
 
-    | TOKEN_LAUNCH '[' assignment_expression ',' assignment_expression ']' postfix_expression '(' argument_expression_list ')'
+    | TOKEN_LAUNCH '[' assignment_expression ',' assignment_expression ']' launch_predecessors postfix_expression '(' argument_expression_list ')'
       { 
-          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @7);
+          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @8);
           Expr *launchCount[3] = {$3, $5, oneExpr};
-          $$ = new FunctionCallExpr($7, $9, Union(@7,@10), true, launchCount);
+          $$ = new FunctionCallExpr($8, $10, Union(@8,@11), true, launchCount, $7);
       }
-    | TOKEN_LAUNCH '[' assignment_expression ',' assignment_expression ']' postfix_expression '(' ')'
+    | TOKEN_LAUNCH '[' assignment_expression ',' assignment_expression ']' launch_predecessors postfix_expression '(' ')'
       { 
-          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @7);
+          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @8);
           Expr *launchCount[3] = {$3, $5, oneExpr};
-          $$ = new FunctionCallExpr($7, new ExprList(Union(@7,@8)), Union(@7,@9), true, launchCount);
+          $$ = new FunctionCallExpr($8, new ExprList(Union(@8,@9)), Union(@8,@10), true, launchCount, $7);
       }
-    | TOKEN_LAUNCH '[' assignment_expression ']' '[' assignment_expression ']' postfix_expression '(' argument_expression_list ')'
+    | TOKEN_LAUNCH '[' assignment_expression ']' '[' assignment_expression ']' launch_predecessors postfix_expression '(' argument_expression_list ')'
       { 
-          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @8);
+          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @9);
           Expr *launchCount[3] = {$6, $3, oneExpr};
-          $$ = new FunctionCallExpr($8, $10, Union(@8,@11), true, launchCount);
+          $$ = new FunctionCallExpr($9, $11, Union(@9,@12), true, launchCount, $8);
       }
-    | TOKEN_LAUNCH '[' assignment_expression ']' '[' assignment_expression ']' postfix_expression '(' ')'
+    | TOKEN_LAUNCH '[' assignment_expression ']' '[' assignment_expression ']' launch_predecessors postfix_expression '(' ')'
       { 
-          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @8);
+          ConstExpr *oneExpr = new ConstExpr(AtomicType::UniformInt32, (int32_t)1, @9);
           Expr *launchCount[3] = {$6, $3, oneExpr};
-          $$ = new FunctionCallExpr($8, new ExprList(Union(@8,@9)), Union(@8,@10), true, launchCount);
+          $$ = new FunctionCallExpr($9, new ExprList(Union(@9,@10)), Union(@9,@11), true, launchCount, $8);
       }
 
-    | TOKEN_LAUNCH '[' assignment_expression ',' assignment_expression ',' assignment_expression ']' postfix_expression '(' argument_expression_list ')'
+    | TOKEN_LAUNCH '[' assignment_expression ',' assignment_expression ',' assignment_expression ']' launch_predecessors postfix_expression '(' argument_expression_list ')'
       { 
           Expr *launchCount[3] = {$3, $5, $7};
-          $$ = new FunctionCallExpr($9, $11, Union(@9,@12), true, launchCount);
+          $$ = new FunctionCallExpr($10, $12, Union(@10,@13), true, launchCount, $9);
       }
-    | TOKEN_LAUNCH '[' assignment_expression ',' assignment_expression ',' assignment_expression ']' postfix_expression '(' ')'
+    | TOKEN_LAUNCH '[' assignment_expression ',' assignment_expression ',' assignment_expression ']' launch_predecessors postfix_expression '(' ')'
       { 
           Expr *launchCount[3] = {$3, $5, $7};
-          $$ = new FunctionCallExpr($9, new ExprList(Union(@9,@10)), Union(@9,@11), true, launchCount);
+          $$ = new FunctionCallExpr($10, new ExprList(Union(@10,@11)), Union(@10,@12), true, launchCount, $9);
       }
-    | TOKEN_LAUNCH '[' assignment_expression ']' '[' assignment_expression ']' '[' assignment_expression ']' postfix_expression '(' argument_expression_list ')'
+    | TOKEN_LAUNCH '[' assignment_expression ']' '[' assignment_expression ']' '[' assignment_expression ']' launch_predecessors postfix_expression '(' argument_expression_list ')'
       { 
           Expr *launchCount[3] = {$9, $6, $3};
-          $$ = new FunctionCallExpr($11, $13, Union(@11,@14), true, launchCount);
+          $$ = new FunctionCallExpr($12, $14, Union(@12,@15), true, launchCount, $11);
       }
-    | TOKEN_LAUNCH '[' assignment_expression ']' '[' assignment_expression ']' '[' assignment_expression ']' postfix_expression '(' ')'
+    | TOKEN_LAUNCH '[' assignment_expression ']' '[' assignment_expression ']' '[' assignment_expression ']' launch_predecessors postfix_expression '(' ')'
       { 
           Expr *launchCount[3] = {$9, $6, $3};
-          $$ = new FunctionCallExpr($11, new ExprList(Union(@11,@12)), Union(@11,@13), true, launchCount);
+          $$ = new FunctionCallExpr($12, new ExprList(Union(@12,@13)), Union(@12,@14), true, launchCount, $11);
       }
 
 
@@ -449,6 +449,11 @@ launch_expression
        }
     ;
 
+launch_predecessors
+    : /* empty */ { $$ = NULL; }
+    | TOKEN_AFTER '(' argument_expression_list ')' { $$ = $3; }
+    ;
+
 postfix_expression
     : primary_expression
     | postfix_expression '[' expression ']'
@@ -1135,6 +1140,11 @@ specifier_qualifier_list
                       "function declarations.");
                 $$ = $2;
             }
+            else if ($1 == TYPEQUAL_ASYNC) {
+                Error(@1, "\"async\" qualifier is illegal outside of "
+                      "function declarations.");
+                $$ = $2;
+            }
             else
                 FATAL("Unhandled type qualifier in parser.");
         }
@@ -1269,6 +1279,7 @@ type_qualifier
     | TOKEN_TASK       { $$ = TYPEQUAL_TASK; }
     | TOKEN_UNMASKED   { $$ = TYPEQUAL_UNMASKED; }
     | TOKEN_EXPORT     { $$ = TYPEQUAL_EXPORT; }
+    | TOKEN_ASYNC      { $$ = TYPEQUAL_ASYNC; }
     | TOKEN_INLINE     { $$ = TYPEQUAL_INLINE; }
     | TOKEN_SIGNED     { $$ = TYPEQUAL_SIGNED; }
     | TOKEN_UNSIGNED   { $$ = TYPEQUAL_UNSIGNED; }
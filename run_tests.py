@@ -110,6 +110,12 @@ def add_prefix(path):
     return path
 
 
+def tasksys_define(tasksys):
+    # "default" leaves the choice to examples/tasksys.cpp
+    if tasksys == "default":
+        return ""
+    return "-DISPC_USE_" + tasksys.upper()
+
 def check_test(filename):
     prev_arch = False
     prev_os = False
@@ -146,6 +152,16 @@ def check_test(filename):
     return done
 
 
+# Returns the extra ispc flags that a test asks for with a comment line
+# like "// ispc-flags: --opt=uniformize-variables", for tests of features
+# that aren't enabled by default.
+def test_ispc_flags(filename):
+    flags = ""
+    for line in re.finditer('// *ispc-flags:(.*)', open(filename).read()):
+        flags += " " + line.group(1).strip()
+    return flags
+
+
 def run_test(testname):
     # testname is a path to the test from the root of ispc dir
     # filename is a path to the test from the current dir
@@ -158,6 +174,7 @@ def run_test(testname):
     if want_error == True:
         ispc_cmd = ispc_exe_rel + " --werror --nowrap %s --arch=%s --target=%s" % \
             (filename, options.arch, options.target)
+        ispc_cmd += test_ispc_flags(filename)
         (return_code, output) = run_command(ispc_cmd)
         got_error = (return_code != 0)
 
@@ -185,7 +202,7 @@ def run_test(testname):
         # We need to figure out the signature of the test
         # function that this test has.
         sig2def = { "f_v(" : 0, "f_f(" : 1, "f_fu(" : 2, "f_fi(" : 3, 
-                    "f_du(" : 4, "f_duf(" : 5, "f_di(" : 6 }
+                    "f_du(" : 4, "f_duf(" : 5, "f_di(" : 6, "f_async(" : 7 }
         file = open(filename, 'r')
         match = -1
         for line in file:
@@ -244,6 +261,9 @@ def run_test(testname):
 
                 cc_cmd = "%s -O2 -I. %s %s test_static.cpp -DTEST_SIG=%d %s -o %s" % \
                          (options.compiler_exe, gcc_arch, gcc_isa, match, obj_name, exe_name)
+                if options.tasksys != "":
+                    cc_cmd += " -DTEST_TASKSYS %s examples/tasksys.cpp -lpthread" % \
+                              tasksys_define(options.tasksys)
                 if platform.system() == 'Darwin':
                     cc_cmd += ' -Wl,-no_pie'
                 if should_fail:
@@ -255,6 +275,7 @@ def run_test(testname):
                 ispc_cmd += " -O0" 
             if is_generic_target:
                 ispc_cmd += " --emit-c++ --c++-include-file=%s" % add_prefix(options.include_file)
+            ispc_cmd += test_ispc_flags(filename)
 
         # compile the ispc code, make the executable, and run it...
         (compile_error, run_error) = run_cmds([ispc_cmd, cc_cmd], 
@@ -749,6 +770,9 @@ if __name__ == "__main__":
                   action = "store_true")
     parser.add_option("--file", dest='in_file', help='file to save run_tests output', default="")
     parser.add_option("--verify", dest='verify', help='verify the file fail_db.txt', default=False, action="store_true")
+    parser.add_option("--tasksys", dest='tasksys',
+                  help='Run tasks with the given task system from examples/tasksys.cpp (default, pthreads, pthreads_work_stealing, pthreads_fully_subscribed, omp, ...) rather than serially',
+                  default="")
     (options, args) = parser.parse_args()
     L = run_tests(options, args, 1)
     exit(0)
@@ -130,13 +130,13 @@ public:
     /** Statements to run if the 'if' test returns a false value */
     Stmt *falseStmts;
 
-private:
     /** This value records if this was a 'coherent' if statement in the
         source and thus, if the emitted code should check to see if all
         active program instances want to follow just one of the 'true' or
         'false' blocks. */
     const bool doAllCheck;
 
+private:
     void emitMaskedTrueAndFalse(FunctionEmitContext *ctx, llvm::Value *oldMask,
                                 llvm::Value *test) const;
     void emitVaryingIf(FunctionEmitContext *ctx, llvm::Value *test) const;
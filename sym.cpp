@@ -56,6 +56,18 @@ Symbol::Symbol(const std::string &n, SourcePos p, const Type *t,
 }
 
 
+static void
+lDestroySymbol(void *sym) {
+    ((Symbol *)sym)->~Symbol();
+}
+
+
+void *
+Symbol::operator new(size_t size) {
+    return Arena::Allocate(size, lDestroySymbol);
+}
+
+
 ///////////////////////////////////////////////////////////////////////////
 // SymbolTable
 
@@ -73,23 +85,37 @@ SymbolTable::~SymbolTable() {
 
 void
 SymbolTable::PushScope() {
-    SymbolMapType *sm;
-    if (freeSymbolMaps.size() > 0) {
-        sm = freeSymbolMaps.back();
-        freeSymbolMaps.pop_back();
-        sm->erase(sm->begin(), sm->end());
+    SymbolVectorType *sv;
+    if (freeSymbolVectors.size() > 0) {
+        sv = freeSymbolVectors.back();
+        freeSymbolVectors.pop_back();
+        sv->clear();
     }
     else
-        sm = new SymbolMapType;
+        sv = new SymbolVectorType;
 
-    variables.push_back(sm);
+    variables.push_back(sv);
 }
 
 
 void
 SymbolTable::PopScope() {
     Assert(variables.size() > 1);
-    freeSymbolMaps.push_back(variables.back());
+
+    // Remove the scope's variables from the name map, which uncovers any
+    // that they were shadowing.
+    SymbolVectorType &sv = *(variables.back());
+    for (int i = (int)sv.size() - 1; i >= 0; --i) {
+        VariableMapType::iterator iter = variableMap.find(sv[i]->name);
+        Assert(iter != variableMap.end());
+        std::vector<std::pair<int, Symbol *> > &syms = iter->getValue();
+        Assert(syms.size() > 0 && syms.back().second == sv[i]);
+        syms.pop_back();
+        if (syms.size() == 0)
+            variableMap.erase(iter);
+    }
+
+    freeSymbolVectors.push_back(variables.back());
     variables.pop_back();
 }
 
@@ -99,46 +125,38 @@ SymbolTable::AddVariable(Symbol *symbol) {
     Assert(symbol != NULL);
 
     // Check to see if a symbol of the same name has already been declared.
-    for (int i = (int)variables.size() - 1; i >= 0; --i) {
-        SymbolMapType &sm = *(variables[i]);
-        if (sm.find(symbol->name) != sm.end()) {
-            if (i == (int)variables.size()-1) {
-                // If a symbol of the same name was declared in the
-                // same scope, it's an error.
-                Error(symbol->pos, "Ignoring redeclaration of symbol \"%s\".",
-                      symbol->name.c_str());
-                return false;
-            }
-            else {
-                // Otherwise it's just shadowing something else, which
-                // is legal but dangerous..
-                Warning(symbol->pos,
-                        "Symbol \"%s\" shadows symbol declared in outer scope.",
-                        symbol->name.c_str());
-                (*variables.back())[symbol->name] = symbol;
-                return true;
-            }
+    int scope = (int)variables.size() - 1;
+    std::vector<std::pair<int, Symbol *> > &syms = variableMap[symbol->name];
+    if (syms.size() > 0) {
+        if (syms.back().first == scope) {
+            // If a symbol of the same name was declared in the same
+            // scope, it's an error.
+            Error(symbol->pos, "Ignoring redeclaration of symbol \"%s\".",
+                  symbol->name.c_str());
+            return false;
         }
+        else
+            // Otherwise it's just shadowing something else, which is
+            // legal but dangerous..
+            Warning(symbol->pos,
+                    "Symbol \"%s\" shadows symbol declared in outer scope.",
+                    symbol->name.c_str());
     }
 
-    // No matches, so go ahead and add it...
-    (*variables.back())[symbol->name] = symbol;
+    syms.push_back(std::make_pair(scope, symbol));
+    variables.back()->push_back(symbol);
     return true;
 }
 
 
 Symbol *
 SymbolTable::LookupVariable(const char *name) {
-    // Note that we iterate through the variables vectors backwards, since
-    // we want to search from the innermost scope to the outermost, so that
-    // we get the right symbol if we have multiple variables in different
-    // scopes that shadow each other.
-    for (int i = (int)variables.size() - 1; i >= 0; --i) {
-        SymbolMapType &sm = *(variables[i]);
-        SymbolMapType::iterator iter = sm.find(name);
-        if (iter != sm.end())
-            return iter->second;
-    }
+    // The innermost declaration is at the end of the vector, so we get
+    // the right symbol if we have multiple variables in different scopes
+    // that shadow each other.
+    VariableMapType::iterator iter = variableMap.find(name);
+    if (iter != variableMap.end())
+        return iter->getValue().back().second;
     return NULL;
 }
 
@@ -154,18 +172,27 @@ SymbolTable::AddFunction(Symbol *symbol) {
 
     std::vector<Symbol *> &funOverloads = functions[symbol->name];
     funOverloads.push_back(symbol);
+    functionIndex[symbol->name] = &funOverloads;
+
+    // The new overload may be a better match for calls that have already
+    // been resolved.
+    llvm::StringMap<ResolvedOverloadMapType>::iterator iter =
+        resolvedOverloads.find(symbol->name);
+    if (iter != resolvedOverloads.end())
+        resolvedOverloads.erase(iter);
     return true;
 }
 
 
 bool
 SymbolTable::LookupFunction(const char *name, std::vector<Symbol *> *matches) {
-    FunctionMapType::iterator iter = functions.find(name);
-    if (iter != functions.end()) {
+    llvm::StringMap<std::vector<Symbol *> *>::iterator iter =
+        functionIndex.find(name);
+    if (iter != functionIndex.end()) {
         if (matches == NULL)
             return true;
         else {
-            const std::vector<Symbol *> &funcs = iter->second;
+            const std::vector<Symbol *> &funcs = *(iter->getValue());
             for (int j = 0; j < (int)funcs.size(); ++j)
                 matches->push_back(funcs[j]);
         }
@@ -176,9 +203,10 @@ SymbolTable::LookupFunction(const char *name, std::vector<Symbol *> *matches) {
 
 Symbol *
 SymbolTable::LookupFunction(const char *name, const FunctionType *type) {
-    FunctionMapType::iterator iter = functions.find(name);
-    if (iter != functions.end()) {
-        std::vector<Symbol *> funcs = iter->second;
+    llvm::StringMap<std::vector<Symbol *> *>::iterator iter =
+        functionIndex.find(name);
+    if (iter != functionIndex.end()) {
+        const std::vector<Symbol *> &funcs = *(iter->getValue());
         for (int j = 0; j < (int)funcs.size(); ++j) {
             if (Type::Equal(funcs[j]->type, type))
                 return funcs[j];
@@ -188,6 +216,35 @@ SymbolTable::LookupFunction(const char *name, const FunctionType *type) {
 }
 
 
+int
+SymbolTable::GetOverloadCount(const char *name) const {
+    llvm::StringMap<std::vector<Symbol *> *>::const_iterator iter =
+        functionIndex.find(name);
+    return (iter != functionIndex.end()) ? (int)iter->getValue()->size() : 0;
+}
+
+
+Symbol *
+SymbolTable::LookupResolvedOverload(const char *name,
+                                    const OverloadKey &key) const {
+    llvm::StringMap<ResolvedOverloadMapType>::const_iterator iter =
+        resolvedOverloads.find(name);
+    if (iter == resolvedOverloads.end())
+        return NULL;
+
+    const ResolvedOverloadMapType &resolved = iter->getValue();
+    ResolvedOverloadMapType::const_iterator riter = resolved.find(key);
+    return (riter != resolved.end()) ? riter->second : NULL;
+}
+
+
+void
+SymbolTable::AddResolvedOverload(const char *name, const OverloadKey &key,
+                                 Symbol *func) {
+    resolvedOverloads[name][key] = func;
+}
+
+
 bool
 SymbolTable::AddType(const char *name, const Type *type, SourcePos pos) {
     const Type *t = LookupType(name);
@@ -237,10 +294,9 @@ SymbolTable::ClosestVariableOrFunctionMatch(const char *str) const {
     std::vector<std::string> matches[maxDelta+1];
 
     for (int i = 0; i < (int)variables.size(); ++i) {
-        const SymbolMapType &sv = *(variables[i]);
-        SymbolMapType::const_iterator iter;
-        for (iter = sv.begin(); iter != sv.end(); ++iter) {
-            const Symbol *sym = iter->second;
+        const SymbolVectorType &sv = *(variables[i]);
+        for (int j = 0; j < (int)sv.size(); ++j) {
+            const Symbol *sym = sv[j];
             int dist = StringEditDistance(str, sym->name, maxDelta+1);
             if (dist <= maxDelta)
                 matches[dist].push_back(sym->name);
@@ -314,11 +370,10 @@ SymbolTable::Print() {
     int depth = 0;
     fprintf(stderr, "Variables:\n----------------\n");
     for (int i = 0; i < (int)variables.size(); ++i) {
-        SymbolMapType &sm = *(variables[i]);
-        SymbolMapType::iterator iter;
-        for (iter = sm.begin(); iter != sm.end(); ++iter) {
+        SymbolVectorType &sv = *(variables[i]);
+        for (int j = 0; j < (int)sv.size(); ++j) {
             fprintf(stderr, "%*c", depth, ' ');
-            Symbol *sym = iter->second;
+            Symbol *sym = sv[j];
             fprintf(stderr, "%s [%s]", sym->name.c_str(),
                     sym->type->GetString().c_str());
         }
@@ -363,12 +418,7 @@ SymbolTable::RandomSymbol() {
     if (variables[v]->size() == 0)
         return NULL;
     int count = ispcRand() % variables[v]->size();
-    SymbolMapType::iterator iter = variables[v]->begin();
-    while (count-- > 0) {
-        ++iter;
-        Assert(iter != variables[v]->end());
-    }
-    return iter->second;
+    return (*variables[v])[count];
 }
 
 
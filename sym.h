@@ -43,6 +43,7 @@
 #include "ispc.h"
 #include "decl.h"
 #include <map>
+#include <llvm/ADT/StringMap.h>
 
 class StructType;
 class ConstExpr;
@@ -67,6 +68,11 @@ public:
     Symbol(const std::string &name, SourcePos pos, const Type *t = NULL,
            StorageClass sc = SC_NONE);
 
+    /** Symbols are allocated from the current Arena and freed along with
+        it, never individually. */
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr) { }
+
     SourcePos pos;            /*!< Source file position where the symbol was defined */
     std::string name;         /*!< Symbol's name */
     llvm::Value *storagePtr;  /*!< For symbols with storage associated with
@@ -174,6 +180,29 @@ public:
         @return pointer to matching Symbol; NULL if none is found. */
     Symbol *LookupFunction(const char *name, const FunctionType *type);
 
+    /** Returns the number of overloads of the function with the given
+        name that are in the symbol table. */
+    int GetOverloadCount(const char *name) const;
+
+    /** Overload resolution results are memoized per function name; this
+        key identifies the call that a result applies to by the types of
+        its arguments, followed by a vector with the "could be NULL" and
+        "is constant" flags for each one. */
+    typedef std::pair<std::vector<const Type *>, std::vector<bool> >
+        OverloadKey;
+
+    /** Returns the function that a call with the given key to the
+        function with the given name was previously resolved to, or NULL
+        if there's no memoized result. */
+    Symbol *LookupResolvedOverload(const char *name,
+                                   const OverloadKey &key) const;
+
+    /** Records the result of resolving a call to an overloaded function.
+        The memoized results for a name are discarded if another overload
+        with that name is added to the symbol table. */
+    void AddResolvedOverload(const char *name, const OverloadKey &key,
+                             Symbol *func);
+
     /** Returns all of the functions in the symbol table that match the given
         predicate.
 
@@ -257,24 +286,39 @@ private:
     std::vector<std::string> closestTypeMatch(const char *str,
                                               bool structsVsEnums) const;
 
-    /** This member variable holds one SymbolMap for each of the current
-        active scopes as the program is being parsed.  New maps are added
-        and removed from the end of the main vector, so searches for
-        symbols start looking at the end of \c variables and work
-        backwards.
-     */
-    typedef std::map<std::string, Symbol *> SymbolMapType;
-    std::vector<SymbolMapType *> variables;
+    /** This member variable holds the variables declared in each of the
+        current active scopes as the program is being parsed, in the order
+        they were declared.  New scopes are added and removed from the end
+        of the main vector. */
+    typedef std::vector<Symbol *> SymbolVectorType;
+    std::vector<SymbolVectorType *> variables;
 
-    std::vector<SymbolMapType *> freeSymbolMaps;
+    std::vector<SymbolVectorType *> freeSymbolVectors;
+
+    /** For each variable name, the symbols with that name in the active
+        scopes, paired with the index in \c variables of the scope that
+        each one was declared in.  The innermost one is at the end of the
+        vector, so looking up a variable is a single hash table lookup
+        rather than a search through all of the enclosing scopes. */
+    typedef llvm::StringMap<std::vector<std::pair<int, Symbol *> > >
+        VariableMapType;
+    VariableMapType variableMap;
 
     /** Function declarations are *not* scoped.  (C99, for example, allows
         an implementation to maintain function declarations in a single
         namespace.)  A STL \c vector is used to store the function symbols
         for a given name since, due to function overloading, a name can
-        have multiple function symbols associated with it. */
+        have multiple function symbols associated with it.  An ordered map
+        is used so that iterating over the functions (e.g. to emit the
+        exported ones in the header file) gives a stable order; \c
+        functionIndex provides hashed lookups into it. */
     typedef std::map<std::string, std::vector<Symbol *> > FunctionMapType;
     FunctionMapType functions;
+    llvm::StringMap<std::vector<Symbol *> *> functionIndex;
+
+    /** Memoized overload resolution results for each function name. */
+    typedef std::map<OverloadKey, Symbol *> ResolvedOverloadMapType;
+    llvm::StringMap<ResolvedOverloadMapType> resolvedOverloads;
 
     /** Type definitions can't currently be scoped.
      */
@@ -303,11 +347,10 @@ template <typename Predicate> void
 SymbolTable::GetMatchingVariables(Predicate pred,
                                   std::vector<Symbol *> *matches) const {
     for (unsigned int i = 0; i < variables.size(); ++i) {
-        SymbolMapType &sm = *(variables[i]);
-        SymbolMapType::const_iterator iter;
-        for (iter = sm.begin(); iter != sm.end(); ++iter) {
-            if (pred(iter->second))
-                matches->push_back(iter->second);
+        const SymbolVectorType &sv = *(variables[i]);
+        for (unsigned int j = 0; j < sv.size(); ++j) {
+            if (pred(sv[j]))
+                matches->push_back(sv[j]);
         }
     }
 }
@@ -60,14 +60,24 @@ extern "C" {
     extern void f_du(float *result, double *a, double b);
     extern void f_duf(float *result, double *a, float b);
     extern void f_di(float *result, double *a, int *b);
+    extern void *f_async(float *result, float *a);
     extern void result(float *val);
 
-    void ISPCLaunch(void **handlePtr, void *f, void *d, int,int,int);
+    void *ISPCLaunch(void **handlePtr, void *f, void *d, int,int,int);
+    void *ISPCLaunchAfter(void **handlePtr, void *f, void *d, int,int,int,
+                          void **predecessors, int32_t numPredecessors);
     void ISPCSync(void *handle);
     void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
+    void ISPCBeginAsync(void **handlePtr);
+    void ISPCWait(void *handle);
+    int ISPCTest(void *handle);
 }
- 
-void ISPCLaunch(void **handle, void *f, void *d, int count0, int count1, int count2) {
+
+// run_tests.py --tasksys links in examples/tasksys.cpp instead of these,
+// which run each launch's tasks serially, right away.
+#ifndef TEST_TASKSYS
+
+void *ISPCLaunch(void **handle, void *f, void *d, int count0, int count1, int count2) {
     *handle = (void *)0xdeadbeef;
     typedef void (*TaskFuncType)(void *, int, int, int, int, int, int, int, int, int, int);
     TaskFuncType func = (TaskFuncType)f;
@@ -76,11 +86,29 @@ void ISPCLaunch(void **handle, void *f, void *d, int count0, int count1, int cou
       for (int j = 0; j < count1; ++j)
         for (int i = 0; i < count0; ++i)
         func(d, 0, 1, idx++, count, i,j,k,count0,count1,count2);
+    return (void *)0xdeadbeef;
+}
+
+void *ISPCLaunchAfter(void **handle, void *f, void *d, int count0, int count1, int count2,
+                      void **, int32_t) {
+    // Tasks run as soon as they're launched, so the predecessors are done.
+    return ISPCLaunch(handle, f, d, count0, count1, count2);
 }
 
 void ISPCSync(void *) {
 }
 
+void ISPCBeginAsync(void **handle) {
+    *handle = (void *)0xdeadbeef;
+}
+
+void ISPCWait(void *) {
+}
+
+int ISPCTest(void *) {
+    return 1;
+}
+
 
 void *ISPCAlloc(void **handle, int64_t size, int32_t alignment) {
     *handle = (void *)0xdeadbeef;
@@ -101,6 +129,8 @@ void *ISPCAlloc(void **handle, int64_t size, int32_t alignment) {
 #endif
 }
 
+#endif // !TEST_TASKSYS
+
 
 #if defined(_WIN32) || defined(_WIN64)
 #define ALIGN
@@ -142,6 +172,13 @@ int main(int argc, char *argv[]) {
     f_duf(returned_result, vdouble, 5.f);
 #elif (TEST_SIG == 6)
     f_di(returned_result, vdouble, vint2);
+#elif (TEST_SIG == 7)
+    // An 'export async' function: poll its handle until the tasks are
+    // done, then release it.
+    void *handle = f_async(returned_result, vfloat);
+    while (ISPCTest(handle) == 0)
+        ;
+    ISPCWait(handle);
 #else
 #error "Unknown or unset TEST_SIG value"
 #endif
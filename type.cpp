@@ -145,52 +145,64 @@ Variability::MangleString() const {
 ///////////////////////////////////////////////////////////////////////////
 // AtomicType
 
+// AtomicTypes are interned: there's a single instance of each distinct
+// one, so that they can be compared by pointer.  The map is keyed by
+// lAtomicTypeKey().
+static std::map<int64_t, const AtomicType *> lAtomicTypes;
+
+static int64_t
+lAtomicTypeKey(AtomicType::BasicType basicType, Variability v, bool isConst) {
+    return (((int64_t)v.soaWidth << 16) | ((int64_t)v.type << 12) |
+            ((int64_t)basicType << 1) | (isConst ? 1 : 0));
+}
+
+
 const AtomicType *AtomicType::UniformBool =
-    new AtomicType(AtomicType::TYPE_BOOL, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_BOOL, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingBool =
-    new AtomicType(AtomicType::TYPE_BOOL, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_BOOL, Variability::Varying, false);
 const AtomicType *AtomicType::UniformInt8 =
-    new AtomicType(AtomicType::TYPE_INT8, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_INT8, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingInt8 =
-    new AtomicType(AtomicType::TYPE_INT8, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_INT8, Variability::Varying, false);
 const AtomicType *AtomicType::UniformUInt8 =
-    new AtomicType(AtomicType::TYPE_UINT8, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_UINT8, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingUInt8 =
-    new AtomicType(AtomicType::TYPE_UINT8, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_UINT8, Variability::Varying, false);
 const AtomicType *AtomicType::UniformInt16 =
-    new AtomicType(AtomicType::TYPE_INT16, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_INT16, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingInt16 =
-    new AtomicType(AtomicType::TYPE_INT16, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_INT16, Variability::Varying, false);
 const AtomicType *AtomicType::UniformUInt16 =
-    new AtomicType(AtomicType::TYPE_UINT16, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_UINT16, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingUInt16 =
-    new AtomicType(AtomicType::TYPE_UINT16, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_UINT16, Variability::Varying, false);
 const AtomicType *AtomicType::UniformInt32 =
-    new AtomicType(AtomicType::TYPE_INT32, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_INT32, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingInt32 =
-    new AtomicType(AtomicType::TYPE_INT32, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_INT32, Variability::Varying, false);
 const AtomicType *AtomicType::UniformUInt32 =
-    new AtomicType(AtomicType::TYPE_UINT32, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_UINT32, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingUInt32 =
-    new AtomicType(AtomicType::TYPE_UINT32, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_UINT32, Variability::Varying, false);
 const AtomicType *AtomicType::UniformFloat =
-    new AtomicType(AtomicType::TYPE_FLOAT, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_FLOAT, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingFloat =
-    new AtomicType(AtomicType::TYPE_FLOAT, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_FLOAT, Variability::Varying, false);
 const AtomicType *AtomicType::UniformInt64 =
-    new AtomicType(AtomicType::TYPE_INT64, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_INT64, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingInt64 =
-    new AtomicType(AtomicType::TYPE_INT64, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_INT64, Variability::Varying, false);
 const AtomicType *AtomicType::UniformUInt64 =
-    new AtomicType(AtomicType::TYPE_UINT64, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_UINT64, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingUInt64 =
-    new AtomicType(AtomicType::TYPE_UINT64, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_UINT64, Variability::Varying, false);
 const AtomicType *AtomicType::UniformDouble =
-    new AtomicType(AtomicType::TYPE_DOUBLE, Variability::Uniform, false);
+    AtomicType::Get(AtomicType::TYPE_DOUBLE, Variability::Uniform, false);
 const AtomicType *AtomicType::VaryingDouble =
-    new AtomicType(AtomicType::TYPE_DOUBLE, Variability::Varying, false);
+    AtomicType::Get(AtomicType::TYPE_DOUBLE, Variability::Varying, false);
 const AtomicType *AtomicType::Void =
-    new AtomicType(TYPE_VOID, Variability::Uniform, false);
+    AtomicType::Get(TYPE_VOID, Variability::Uniform, false);
 
 
 AtomicType::AtomicType(BasicType bt, Variability v, bool ic)
@@ -200,6 +212,23 @@ AtomicType::AtomicType(BasicType bt, Variability v, bool ic)
 }
 
 
+const AtomicType *
+AtomicType::Get(BasicType basicType, Variability v, bool isConst) {
+    int64_t key = lAtomicTypeKey(basicType, v, isConst);
+    std::map<int64_t, const AtomicType *>::iterator iter =
+        lAtomicTypes.find(key);
+    if (iter != lAtomicTypes.end())
+        return iter->second;
+
+    // There are only ever a handful of these, and they're shared by all
+    // of the Modules, so they're allocated from the heap.
+    ArenaScope scope(NULL);
+    const AtomicType *type = new AtomicType(basicType, v, isConst);
+    lAtomicTypes[key] = type;
+    return type;
+}
+
+
 Variability
 AtomicType::GetVariability() const {
     return variability;
@@ -270,13 +299,13 @@ AtomicType::GetAsUnsignedType() const {
 
     switch (basicType) {
     case TYPE_INT8:
-        return new AtomicType(TYPE_UINT8, variability, isConst);
+        return Get(TYPE_UINT8, variability, isConst);
     case TYPE_INT16:
-        return new AtomicType(TYPE_UINT16, variability, isConst);
+        return Get(TYPE_UINT16, variability, isConst);
     case TYPE_INT32:
-        return new AtomicType(TYPE_UINT32, variability, isConst);
+        return Get(TYPE_UINT32, variability, isConst);
     case TYPE_INT64:
-        return new AtomicType(TYPE_UINT64, variability, isConst);
+        return Get(TYPE_UINT64, variability, isConst);
     default:
         FATAL("Unexpected basicType in GetAsUnsignedType()");
         return NULL;
@@ -290,7 +319,7 @@ AtomicType::GetAsConstType() const {
         return this;
 
     if (asOtherConstType == NULL) {
-        asOtherConstType = new AtomicType(basicType, variability, true);
+        asOtherConstType = Get(basicType, variability, true);
         asOtherConstType->asOtherConstType = this;
     }
     return asOtherConstType;
@@ -303,7 +332,7 @@ AtomicType::GetAsNonConstType() const {
         return this;
 
     if (asOtherConstType == NULL) {
-        asOtherConstType = new AtomicType(basicType, variability, false);
+        asOtherConstType = Get(basicType, variability, false);
         asOtherConstType->asOtherConstType = this;
     }
     return asOtherConstType;
@@ -323,7 +352,7 @@ AtomicType::GetAsVaryingType() const {
         return this;
 
     if (asVaryingType == NULL) {
-        asVaryingType = new AtomicType(basicType, Variability::Varying, isConst);
+        asVaryingType = Get(basicType, Variability::Varying, isConst);
         if (variability == Variability::Uniform)
             asVaryingType->asUniformType = this;
     }
@@ -338,7 +367,7 @@ AtomicType::GetAsUniformType() const {
         return this;
 
     if (asUniformType == NULL) {
-        asUniformType = new AtomicType(basicType, Variability::Uniform, isConst);
+        asUniformType = Get(basicType, Variability::Uniform, isConst);
         if (variability == Variability::Varying)
             asUniformType->asVaryingType = this;
     }
@@ -351,7 +380,7 @@ AtomicType::GetAsUnboundVariabilityType() const {
     Assert(basicType != TYPE_VOID);
     if (variability == Variability::Unbound)
         return this;
-    return new AtomicType(basicType, Variability::Unbound, isConst);
+    return Get(basicType, Variability::Unbound, isConst);
 }
 
 
@@ -360,7 +389,7 @@ AtomicType::GetAsSOAType(int width) const {
     Assert(basicType != TYPE_VOID);
     if (variability == Variability(Variability::SOA, width))
         return this;
-    return new AtomicType(basicType, Variability(Variability::SOA, width), isConst);
+    return Get(basicType, Variability(Variability::SOA, width), isConst);
 }
 
 
@@ -369,7 +398,7 @@ AtomicType::ResolveUnboundVariability(Variability v) const {
     Assert(v != Variability::Unbound);
     if (variability != Variability::Unbound)
         return this;
-    return new AtomicType(basicType, v, isConst);
+    return Get(basicType, v, isConst);
 }
 
 
@@ -875,8 +904,35 @@ EnumType::GetEnumerator(int i) const {
 ///////////////////////////////////////////////////////////////////////////
 // PointerType
 
-PointerType *PointerType::Void =
-    new PointerType(AtomicType::Void, Variability(Variability::Uniform), false);
+/** Key for the map of interned PointerTypes. */
+struct PointerTypeKey {
+    PointerTypeKey(const Type *t, Variability v, bool ic, bool is, bool fr)
+        : baseType(t), variability(v), isConst(ic), isSlice(is),
+          isFrozen(fr) { }
+
+    bool operator<(const PointerTypeKey &k) const {
+        if (baseType != k.baseType)
+            return baseType < k.baseType;
+        if (variability.type != k.variability.type)
+            return variability.type < k.variability.type;
+        if (variability.soaWidth != k.variability.soaWidth)
+            return variability.soaWidth < k.variability.soaWidth;
+        if (isConst != k.isConst)
+            return isConst < k.isConst;
+        if (isSlice != k.isSlice)
+            return isSlice < k.isSlice;
+        return isFrozen < k.isFrozen;
+    }
+
+    const Type *baseType;
+    Variability variability;
+    bool isConst, isSlice, isFrozen;
+};
+
+static std::map<PointerTypeKey, const PointerType *> lPointerTypes;
+
+const PointerType *PointerType::Void =
+    PointerType::Get(AtomicType::Void, Variability(Variability::Uniform), false);
 
 
 PointerType::PointerType(const Type *t, Variability v, bool ic, bool is,
@@ -886,15 +942,40 @@ PointerType::PointerType(const Type *t, Variability v, bool ic, bool is,
 }
 
 
-PointerType *
+PointerType::~PointerType() {
+    // The pointer type is going away along with the arena that it and
+    // its base type were allocated from; forget about it so that a later
+    // type allocated at the same address isn't mistaken for its base.
+    lPointerTypes.erase(PointerTypeKey(baseType, variability, isConst,
+                                       isSlice, isFrozen));
+}
+
+
+const PointerType *
+PointerType::Get(const Type *t, Variability v, bool ic, bool is, bool fr) {
+    PointerTypeKey key(t, v, ic, is, fr);
+    std::map<PointerTypeKey, const PointerType *>::iterator iter =
+        lPointerTypes.find(key);
+    if (iter != lPointerTypes.end())
+        return iter->second;
+
+    // The pointer type has to live exactly as long as its base type does.
+    ArenaScope scope(t);
+    const PointerType *type = new PointerType(t, v, ic, is, fr);
+    lPointerTypes[key] = type;
+    return type;
+}
+
+
+const PointerType *
 PointerType::GetUniform(const Type *t, bool is) {
-    return new PointerType(t, Variability(Variability::Uniform), false, is);
+    return Get(t, Variability(Variability::Uniform), false, is);
 }
 
 
-PointerType *
+const PointerType *
 PointerType::GetVarying(const Type *t) {
-    return new PointerType(t, Variability(Variability::Varying), false);
+    return Get(t, Variability(Variability::Varying), false);
 }
 
 
@@ -952,8 +1033,8 @@ PointerType::GetAsVaryingType() const {
     if (variability == Variability::Varying)
         return this;
     else
-        return new PointerType(baseType, Variability(Variability::Varying),
-                               isConst, isSlice, isFrozen);
+        return Get(baseType, Variability(Variability::Varying),
+                   isConst, isSlice, isFrozen);
 }
 
 
@@ -962,8 +1043,8 @@ PointerType::GetAsUniformType() const {
     if (variability == Variability::Uniform)
         return this;
     else
-        return new PointerType(baseType, Variability(Variability::Uniform),
-                               isConst, isSlice, isFrozen);
+        return Get(baseType, Variability(Variability::Uniform),
+                   isConst, isSlice, isFrozen);
 }
 
 
@@ -972,8 +1053,8 @@ PointerType::GetAsUnboundVariabilityType() const {
     if (variability == Variability::Unbound)
         return this;
     else
-        return new PointerType(baseType, Variability(Variability::Unbound),
-                               isConst, isSlice, isFrozen);
+        return Get(baseType, Variability(Variability::Unbound),
+                   isConst, isSlice, isFrozen);
 }
 
 
@@ -982,8 +1063,8 @@ PointerType::GetAsSOAType(int width) const {
     if (GetSOAWidth() == width)
         return this;
     else
-        return new PointerType(baseType, Variability(Variability::SOA, width),
-                               isConst, isSlice, isFrozen);
+        return Get(baseType, Variability(Variability::SOA, width),
+                   isConst, isSlice, isFrozen);
 }
 
 
@@ -991,7 +1072,7 @@ const PointerType *
 PointerType::GetAsSlice() const {
     if (isSlice)
         return this;
-    return new PointerType(baseType, variability, isConst, true);
+    return Get(baseType, variability, isConst, true);
 }
 
 
@@ -999,7 +1080,7 @@ const PointerType *
 PointerType::GetAsNonSlice() const {
     if (isSlice == false)
         return this;
-    return new PointerType(baseType, variability, isConst, false);
+    return Get(baseType, variability, isConst, false);
 }
 
 
@@ -1007,7 +1088,7 @@ const PointerType *
 PointerType::GetAsFrozenSlice() const {
     if (isFrozen)
         return this;
-    return new PointerType(baseType, variability, isConst, true, true);
+    return Get(baseType, variability, isConst, true, true);
 }
 
 
@@ -1023,8 +1104,7 @@ PointerType::ResolveUnboundVariability(Variability v) const {
         variability;
     const Type *resolvedBaseType =
         baseType->ResolveUnboundVariability(Variability::Uniform);
-    return new PointerType(resolvedBaseType, ptrVariability, isConst, isSlice,
-                           isFrozen);
+    return Get(resolvedBaseType, ptrVariability, isConst, isSlice, isFrozen);
 }
 
 
@@ -1033,7 +1113,7 @@ PointerType::GetAsConstType() const {
     if (isConst == true)
         return this;
     else
-        return new PointerType(baseType, variability, true, isSlice);
+        return Get(baseType, variability, true, isSlice);
 }
 
 
@@ -1042,7 +1122,7 @@ PointerType::GetAsNonConstType() const {
     if (isConst == false)
         return this;
     else
-        return new PointerType(baseType, variability, false, isSlice);
+        return Get(baseType, variability, false, isSlice);
 }
 
 
@@ -1999,6 +2079,7 @@ StructType::GetAsConstType() const {
     else if (oppositeConstStructType != NULL)
         return oppositeConstStructType;
     else {
+        ArenaScope scope(this);
         oppositeConstStructType =
             new StructType(name, elementTypes, elementNames, elementPositions,
                            true, variability, pos);
@@ -2015,6 +2096,7 @@ StructType::GetAsNonConstType() const {
     else if (oppositeConstStructType != NULL)
         return oppositeConstStructType;
     else {
+        ArenaScope scope(this);
         oppositeConstStructType =
             new StructType(name, elementTypes, elementNames, elementPositions,
                            false, variability, pos);
@@ -2079,17 +2161,15 @@ StructType::GetCDeclaration(const std::string &n) const {
     std::string ret;
     if (isConst) ret += "const ";
     ret += std::string("struct ") + name;
-    if (lShouldPrintName(n)) {
-        ret += std::string(" ") + n;
-
-        if (variability.soaWidth > 0) {
-            char buf[32];
-            // This has to match the naming scheme used in lEmitStructDecls()
-            // in module.cpp
-            sprintf(buf, "_SOA%d", variability.soaWidth);
-            ret += buf;
-        }
+    if (variability.soaWidth > 0) {
+        char buf[32];
+        // This has to match the naming scheme used in lEmitStructDecls()
+        // in module.cpp
+        sprintf(buf, "_SOA%d", variability.soaWidth);
+        ret += buf;
     }
+    if (lShouldPrintName(n))
+        ret += std::string(" ") + n;
 
     return ret;
 }
@@ -2207,26 +2287,28 @@ StructType::GetElementNumber(const std::string &n) const {
 
 
 bool
-StructType::checkIfCanBeSOA(const StructType *st) {
+StructType::checkIfCanBeSOA(const StructType *st, bool issueErrors) {
     bool ok = true;
     for (int i = 0; i < (int)st->elementTypes.size(); ++i) {
         const Type *eltType = st->elementTypes[i];
         const StructType *childStructType = CastType<StructType>(eltType);
 
         if (childStructType != NULL)
-            ok &= checkIfCanBeSOA(childStructType);
+            ok &= checkIfCanBeSOA(childStructType, issueErrors);
         else if (eltType->HasUnboundVariability() == false) {
-            Error(st->elementPositions[i], "Unable to apply SOA conversion to "
-                  "struct due to \"%s\" member \"%s\" with bound \"%s\" "
-                  "variability.", eltType->GetString().c_str(),
-                  st->elementNames[i].c_str(),
-                  eltType->IsUniformType() ? "uniform" : "varying");
+            if (issueErrors)
+                Error(st->elementPositions[i], "Unable to apply SOA conversion to "
+                      "struct due to \"%s\" member \"%s\" with bound \"%s\" "
+                      "variability.", eltType->GetString().c_str(),
+                      st->elementNames[i].c_str(),
+                      eltType->IsUniformType() ? "uniform" : "varying");
             ok = false;
         }
         else if (CastType<ReferenceType>(eltType)) {
-            Error(st->elementPositions[i], "Unable to apply SOA conversion to "
-                  "struct due to member \"%s\" with reference type \"%s\".",
-                  st->elementNames[i].c_str(), eltType->GetString().c_str());
+            if (issueErrors)
+                Error(st->elementPositions[i], "Unable to apply SOA conversion to "
+                      "struct due to member \"%s\" with reference type \"%s\".",
+                      st->elementNames[i].c_str(), eltType->GetString().c_str());
             ok = false;
         }
     }
@@ -2555,6 +2637,7 @@ ReferenceType::GetAsConstType() const {
         return this;
 
     if (asOtherConstType == NULL) {
+        ArenaScope scope(this);
         asOtherConstType = new ReferenceType(targetType->GetAsConstType());
         asOtherConstType->asOtherConstType = this;
     }
@@ -2572,6 +2655,7 @@ ReferenceType::GetAsNonConstType() const {
         return this;
 
     if (asOtherConstType == NULL) {
+        ArenaScope scope(this);
         asOtherConstType = new ReferenceType(targetType->GetAsNonConstType());
         asOtherConstType->asOtherConstType = this;
     }
@@ -2679,7 +2763,7 @@ FunctionType::FunctionType(const Type *r,
                            const llvm::SmallVector<const Type *, 8> &a,
                            SourcePos p)
     : Type(FUNCTION_TYPE), isTask(false), isExported(false), isExternC(false),
-      isUnmasked(false), returnType(r), paramTypes(a),
+      isUnmasked(false), isAsync(false), returnType(r), paramTypes(a),
       paramNames(llvm::SmallVector<std::string, 8>(a.size(), "")),
       paramDefaults(llvm::SmallVector<Expr *, 8>(a.size(), NULL)),
       paramPositions(llvm::SmallVector<SourcePos, 8>(a.size(), p)) {
@@ -2694,9 +2778,9 @@ FunctionType::FunctionType(const Type *r,
                            const llvm::SmallVector<std::string, 8> &an,
                            const llvm::SmallVector<Expr *, 8> &ad,
                            const llvm::SmallVector<SourcePos, 8> &ap,
-                           bool it, bool is, bool ec, bool ium)
+                           bool it, bool is, bool ec, bool ium, bool ia)
     : Type(FUNCTION_TYPE), isTask(it), isExported(is), isExternC(ec),
-      isUnmasked(ium), returnType(r), paramTypes(a), paramNames(an),
+      isUnmasked(ium), isAsync(ia), returnType(r), paramTypes(a), paramNames(an),
       paramDefaults(ad), paramPositions(ap) {
     Assert(paramTypes.size() == paramNames.size() &&
            paramNames.size() == paramDefaults.size() &&
@@ -2797,7 +2881,7 @@ FunctionType::ResolveUnboundVariability(Variability v) const {
 
     FunctionType *ret = new FunctionType(rt, pt, paramNames, paramDefaults,
                                          paramPositions, isTask, isExported,
-                                         isExternC, isUnmasked);
+                                         isExternC, isUnmasked, isAsync);
     ret->isSafe = isSafe;
     ret->costOverride = costOverride;
 
@@ -2854,7 +2938,11 @@ FunctionType::Mangle() const {
 std::string
 FunctionType::GetCDeclaration(const std::string &fname) const {
     std::string ret;
-    ret += returnType->GetCDeclaration("");
+    if (isAsync)
+        // See Module::writeHeader() for the typedef.
+        ret += "ISPCHandle";
+    else
+        ret += returnType->GetCDeclaration("");
     ret += " ";
     ret += fname;
     ret += "(";
@@ -2885,7 +2973,11 @@ FunctionType::GetCDeclaration(const std::string &fname) const {
 std::string
 FunctionType::GetCDeclarationForDispatch(const std::string &fname) const {
     std::string ret;
-    ret += returnType->GetCDeclaration("");
+    if (isAsync)
+        // See Module::writeHeader() for the typedef.
+        ret += "ISPCHandle";
+    else
+        ret += returnType->GetCDeclaration("");
     ret += " ";
     ret += fname;
     ret += "(";
@@ -2903,7 +2995,7 @@ FunctionType::GetCDeclarationForDispatch(const std::string &fname) const {
         
         // Change pointers to varying thingies to void *
         if (pt != NULL && pt->GetBaseType()->IsVaryingType()) {
-          PointerType *t = PointerType::Void;
+          const PointerType *t = PointerType::Void;
           
           if (paramNames[i] != "")
             ret += t->GetCDeclaration(paramNames[i]);
@@ -2966,6 +3058,8 @@ FunctionType::GetReturnTypeString() const {
         ret += "task ";
     if (isExported)
         ret += "export ";
+    if (isAsync)
+        ret += "async ";
     if (isExternC)
         ret += "extern \"C\" ";
     if (isUnmasked)
@@ -3040,6 +3134,9 @@ FunctionType::LLVMFunctionType(llvm::LLVMContext *ctx, bool removeMask) const {
     llvm::Type *llvmReturnType = returnType->LLVMType(g->ctx);
     if (llvmReturnType == NULL)
         return NULL;
+    if (isAsync && removeMask)
+        // The application's entry point returns the task group handle.
+        llvmReturnType = LLVMTypes::VoidPointerType;
 
     return llvm::FunctionType::get(llvmReturnType, callTypes, false);
 }
@@ -3076,6 +3173,18 @@ FunctionType::GetParameterName(int i) const {
 ///////////////////////////////////////////////////////////////////////////
 // Type
 
+static void
+lDestroyType(void *type) {
+    ((Type *)type)->~Type();
+}
+
+
+void *
+Type::operator new(size_t size) {
+    return Arena::Allocate(size, lDestroyType);
+}
+
+
 const Type *
 Type::GetReferenceTarget() const {
     // only ReferenceType needs to override this method
@@ -3297,6 +3406,11 @@ lCheckTypeEquality(const Type *a, const Type *b, bool ignoreConst) {
     if (a == NULL || b == NULL)
         return false;
 
+    // AtomicTypes and PointerTypes are interned, so most of the time
+    // equal types are the same object.
+    if (a == b)
+        return true;
+
     if (ignoreConst == false &&
         a->IsConstType() != b->IsConstType())
         return false;
@@ -3376,7 +3490,8 @@ lCheckTypeEquality(const Type *a, const Type *b, bool ignoreConst) {
         if (fta->isTask != ftb->isTask ||
             fta->isExported != ftb->isExported ||
             fta->isExternC != ftb->isExternC ||
-            fta->isUnmasked != ftb->isUnmasked)
+            fta->isUnmasked != ftb->isUnmasked ||
+            fta->isAsync != ftb->isAsync)
             return false;
 
         if (fta->GetNumParameters() != ftb->GetNumParameters())
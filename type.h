@@ -270,6 +270,13 @@ public:
         using dynamic_cast. */
     const TypeId typeId;
 
+    virtual ~Type() { }
+
+    /** Types are allocated from the current Arena and freed along with
+        it, never individually. */
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr) { }
+
 protected:
     Type(TypeId id) : typeId(id) { }
 };
@@ -351,6 +358,11 @@ private:
     const bool isConst;
     AtomicType(BasicType basicType, Variability v, bool isConst);
 
+    /** Returns the unique AtomicType with the given properties, creating
+        it if this is the first time it's been asked for. */
+    static const AtomicType *Get(BasicType basicType, Variability v,
+                                 bool isConst);
+
     mutable const AtomicType *asOtherConstType, *asUniformType, *asVaryingType;
 };
 
@@ -431,13 +443,16 @@ private:
  */
 class PointerType : public Type {
 public:
-    PointerType(const Type *t, Variability v, bool isConst,
-                bool isSlice = false, bool frozen = false);
+    /** PointerTypes are interned: this returns the unique PointerType
+        with the given properties, so that two pointer types are equal
+        exactly when they're the same object. */
+    static const PointerType *Get(const Type *t, Variability v, bool isConst,
+                                  bool isSlice = false, bool frozen = false);
 
     /** Helper method to return a uniform pointer to the given type. */
-    static PointerType *GetUniform(const Type *t, bool isSlice = false);
+    static const PointerType *GetUniform(const Type *t, bool isSlice = false);
     /** Helper method to return a varying pointer to the given type. */
-    static PointerType *GetVarying(const Type *t);
+    static const PointerType *GetVarying(const Type *t);
 
     /** Returns true if the given type is a void * type. */
     static bool IsVoidPointer(const Type *t);
@@ -473,9 +488,13 @@ public:
     llvm::Type *LLVMType(llvm::LLVMContext *ctx) const;
     llvm::DIType GetDIType(llvm::DIDescriptor scope) const;
 
-    static PointerType *Void;
+    static const PointerType *Void;
 
 private:
+    PointerType(const Type *t, Variability v, bool isConst, bool isSlice,
+                bool frozen);
+    ~PointerType();
+
     const Variability variability;
     const bool isConst;
     const bool isSlice, isFrozen;
@@ -716,8 +735,12 @@ public:
     /** Returns the name of the structure type.  (e.g. struct Foo -> "Foo".) */
     const std::string &GetStructName() const { return name; }
 
+    /** Returns true if GetAsSOAType() can be applied to this struct type.
+        Unlike GetAsSOAType(), no errors are issued if it can't. */
+    bool CanBeSOA() const { return checkIfCanBeSOA(this, false); }
+
 private:
-    static bool checkIfCanBeSOA(const StructType *st);
+    static bool checkIfCanBeSOA(const StructType *st, bool issueErrors = true);
 
     /*const*/ std::string name;
     /** The types of the struct elements.  Note that we store these with
@@ -849,7 +872,8 @@ public:
                  const llvm::SmallVector<std::string, 8> &argNames,
                  const llvm::SmallVector<Expr *, 8> &argDefaults,
                  const llvm::SmallVector<SourcePos, 8> &argPos,
-                 bool isTask, bool isExported, bool isExternC, bool isUnmasked);
+                 bool isTask, bool isExported, bool isExternC, bool isUnmasked,
+                 bool isAsync);
 
     Variability GetVariability() const;
 
@@ -884,7 +908,9 @@ public:
     /** This method returns the LLVM FunctionType that corresponds to this
         function type.  The \c disableMask parameter indicates whether the
         llvm::FunctionType should have the trailing mask parameter, if
-        present, removed from the return function signature. */
+        present, removed from the return function signature.  (That is the
+        application's entry point for exported functions, which returns a
+        handle for 'export async' ones.) */
     llvm::FunctionType *LLVMFunctionType(llvm::LLVMContext *ctx,
                                          bool disableMask = false) const;
 
@@ -911,6 +937,11 @@ public:
         mask). */
     const bool isUnmasked;
 
+    /** This value is true for 'export async' functions, whose entry point
+        for the application returns a handle for the tasks they launched
+        rather than waiting for them to finish. */
+    const bool isAsync;
+
     /** Indicates whether this function has been declared to be safe to run
         with an all-off mask. */
     bool isSafe;
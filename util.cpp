@@ -57,14 +57,18 @@
 #include <io.h>
 #include <direct.h>
 #include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
 #else
 #include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <unistd.h>
 #include <errno.h>
 #endif // ISPC_IS_WINDOWS
 #include <set>
 #include <algorithm>
 
+#include <llvm/Support/TimeValue.h>
 #if defined(LLVM_3_1)
   #include <llvm/Target/TargetData.h>
 #elif defined(LLVM_3_2)
@@ -159,11 +163,11 @@ lFindWordEnd(const char *buf) {
 
 /** When printing error messages, we sometimes want to include the source
     file line for context.  This function print the line(s) of the file
-    corresponding to the provided SourcePos and underlines the range of the
-    SourcePos with '^' symbols.
+    corresponding to the provided SourcePos to the given FILE and
+    underlines the range of the SourcePos with '^' symbols.
 */
 static void
-lPrintFileLineContext(SourcePos p) {
+lPrintFileLineContext(SourcePos p, FILE *out) {
     if (p.first_line == 0)
         return;
 
@@ -177,7 +181,7 @@ lPrintFileLineContext(SourcePos p) {
         // and we're probably doing the wrong thing...)
         if (curLine >= std::max(p.first_line, p.last_line-2) &&
             curLine <= p.last_line)
-            fputc(c, stderr);
+            fputc(c, out);
         if (c == '\n')
             ++curLine;
         if (curLine > p.last_line)
@@ -186,13 +190,13 @@ lPrintFileLineContext(SourcePos p) {
 
     int i = 1;
     for (; i < p.first_column; ++i)
-        fputc(' ', stderr);
-    fputc('^', stderr);
+        fputc(' ', out);
+    fputc('^', out);
     ++i;
     for (; i < p.last_column; ++i)
-        fputc('^', stderr);
-    fputc('\n', stderr);
-    fputc('\n', stderr);
+        fputc('^', out);
+    fputc('\n', out);
+    fputc('\n', out);
 
     fclose(f);
 }
@@ -376,7 +380,12 @@ lPrint(const char *type, bool isError, SourcePos p, const char *fmt,
     printed.insert(formattedBuf);
 
     PrintWithWordBreaks(formattedBuf, indent, TerminalWidth(), stderr);
-    lPrintFileLineContext(p);
+    lPrintFileLineContext(p, stderr);
+    if (g->diagnosticsCopy != NULL) {
+        PrintWithWordBreaks(formattedBuf, indent, TerminalWidth(),
+                            g->diagnosticsCopy);
+        lPrintFileLineContext(p, g->diagnosticsCopy);
+    }
 
     free(errorBuf);
     free(formattedBuf);
@@ -663,3 +672,323 @@ VerifyDataLayoutCompatibility(const std::string &module_dl,
     return true;
 }
 
+
+///////////////////////////////////////////////////////////////////////////
+// Arena
+
+// Memory is handed out from blocks of this size; larger objects get a
+// block of their own.
+#define ARENA_BLOCK_SIZE (256 * 1024)
+#define ARENA_ALIGNMENT 16
+
+Arena *Arena::current = NULL;
+
+
+Arena::Arena() {
+    next = end = NULL;
+}
+
+
+Arena::~Arena() {
+    // Destroy the objects in the reverse of the order they were created
+    // in, like the stack would.
+    for (int i = (int)destructors.size() - 1; i >= 0; --i)
+        destructors[i].second(destructors[i].first);
+    for (unsigned int i = 0; i < blocks.size(); ++i)
+        free(blocks[i].first);
+    if (current == this)
+        current = NULL;
+}
+
+
+void *
+Arena::alloc(size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (size > ARENA_BLOCK_SIZE / 4) {
+        char *block = (char *)malloc(size);
+        if (block == NULL)
+            FATAL("Out of memory");
+        blocks.push_back(std::make_pair(block, size));
+        return block;
+    }
+
+    if (next == NULL || size > (size_t)(end - next)) {
+        // malloc()'s alignment is enough for ARENA_ALIGNMENT.
+        next = (char *)malloc(ARENA_BLOCK_SIZE);
+        if (next == NULL)
+            FATAL("Out of memory");
+        end = next + ARENA_BLOCK_SIZE;
+        blocks.push_back(std::make_pair(next, (size_t)ARENA_BLOCK_SIZE));
+    }
+    void *ptr = next;
+    next += size;
+    return ptr;
+}
+
+
+void *
+Arena::Allocate(size_t size, void (*destroy)(void *)) {
+    if (current == NULL)
+        return ::operator new(size);
+
+    void *ptr = current->alloc(size);
+    if (destroy != NULL)
+        current->destructors.push_back(std::make_pair(ptr, destroy));
+    return ptr;
+}
+
+
+bool
+Arena::Contains(const void *ptr) const {
+    const char *p = (const char *)ptr;
+    for (unsigned int i = 0; i < blocks.size(); ++i)
+        if (p >= blocks[i].first && p < blocks[i].first + blocks[i].second)
+            return true;
+    return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+// TimeReport
+
+static double
+lCurrentTime() {
+    llvm::sys::TimeValue now = llvm::sys::TimeValue::now();
+    return now.seconds() + now.nanoseconds() * 1e-9;
+}
+
+
+/** Returns the most memory that the process has had resident at any one
+    time so far, in bytes. */
+static size_t
+lPeakMemoryUse() {
+#ifdef ISPC_IS_WINDOWS
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef ISPC_IS_APPLE
+    return (size_t)usage.ru_maxrss;
+#else
+    // Linux reports kilobytes.
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif // ISPC_IS_WINDOWS
+}
+
+
+TimeReport::TimeReport() {
+    Reset();
+}
+
+
+void
+TimeReport::Reset() {
+    startTime = lastTime = lCurrentTime();
+    lastPeakMemory = lPeakMemoryUse();
+    phases.clear();
+    functions.clear();
+}
+
+
+/** Charges the time since the last call to the activity that's been
+    running since then, along with however much it raised the process's
+    peak memory use. */
+void
+TimeReport::charge() {
+    double now = lCurrentTime();
+    Activity activity = stack.empty() ? Activity("other", "") : stack.back();
+
+    std::map<std::string, PhaseInfo>::iterator iter = phases.find(activity.first);
+    if (iter == phases.end()) {
+        iter = phases.insert(std::make_pair(activity.first, PhaseInfo())).first;
+        iter->second.order = (int)phases.size();
+    }
+    iter->second.time += now - lastTime;
+    size_t peakMemory = lPeakMemoryUse();
+    if (peakMemory > lastPeakMemory) {
+        iter->second.peakGrowth += peakMemory - lastPeakMemory;
+        lastPeakMemory = peakMemory;
+    }
+
+    if (!activity.second.empty())
+        functions[activity.second][activity.first] += now - lastTime;
+    lastTime = now;
+}
+
+
+void
+TimeReport::Push(const std::string &phase, const std::string &function) {
+    charge();
+    stack.push_back(Activity(phase, function));
+}
+
+
+void
+TimeReport::Pop() {
+    Assert(!stack.empty());
+    charge();
+    stack.pop_back();
+}
+
+
+void
+TimeReport::Switch(const std::string &phase, const std::string &function) {
+    Assert(!stack.empty());
+    // The optimization passes switch phases for each function and basic
+    // block they run on; don't bother with the clock if nothing changed.
+    if (stack.back().first == phase && stack.back().second == function)
+        return;
+    charge();
+    stack.back() = Activity(phase, function);
+}
+
+
+/** Returns the phases in the order that they first ran. */
+void
+TimeReport::getPhases(std::vector<std::pair<std::string, PhaseInfo> > *result) {
+    charge();
+    result->assign(phases.begin(), phases.end());
+    for (unsigned int i = 1; i < result->size(); ++i)
+        for (unsigned int j = i; j > 0 &&
+                 (*result)[j].second.order < (*result)[j-1].second.order; --j)
+            std::swap((*result)[j], (*result)[j-1]);
+}
+
+
+static bool
+lSlowerFunction(const std::pair<std::string, double> &a,
+                const std::pair<std::string, double> &b) {
+    return a.second > b.second;
+}
+
+
+/** Returns the functions along with their total times, slowest first. */
+void
+TimeReport::getFunctions(std::vector<std::pair<std::string, double> > *result) {
+    result->clear();
+    std::map<std::string, std::map<std::string, double> >::iterator iter;
+    for (iter = functions.begin(); iter != functions.end(); ++iter) {
+        double total = 0;
+        std::map<std::string, double>::iterator p;
+        for (p = iter->second.begin(); p != iter->second.end(); ++p)
+            total += p->second;
+        result->push_back(std::make_pair(iter->first, total));
+    }
+    std::stable_sort(result->begin(), result->end(), lSlowerFunction);
+}
+
+
+void
+TimeReport::Print(FILE *file, const std::string &title) {
+    std::vector<std::pair<std::string, PhaseInfo> > phaseList;
+    getPhases(&phaseList);
+    double total = lastTime - startTime;
+
+    // The memory column shows how much each phase raised the process's
+    // peak memory use; the total is the peak itself.
+    fprintf(file, "\n*** Time report: %s ***\n\n", title.c_str());
+    fprintf(file, "   Wall time   Percent   Peak growth   Phase\n");
+    for (unsigned int i = 0; i < phaseList.size(); ++i) {
+        const PhaseInfo &info = phaseList[i].second;
+        fprintf(file, "  %9.4fs    %5.1f%%    %7.1f MB   %s\n", info.time,
+                total > 0 ? 100. * info.time / total : 0.,
+                info.peakGrowth / (1024. * 1024.), phaseList[i].first.c_str());
+    }
+    fprintf(file, "  %9.4fs    100.0%%    %7.1f MB   Total (peak memory)\n",
+            total, lastPeakMemory / (1024. * 1024.));
+
+    std::vector<std::pair<std::string, double> > functionList;
+    getFunctions(&functionList);
+    if (functionList.empty())
+        return;
+
+    // For each of the slowest functions, show the phases that took the
+    // most time for it.
+    const int maxFunctions = 10, maxPhases = 3;
+    fprintf(file, "\n   Wall time   Percent   Slowest functions\n");
+    for (int i = 0; i < (int)functionList.size() && i < maxFunctions; ++i) {
+        fprintf(file, "  %9.4fs    %5.1f%%    %s\n", functionList[i].second,
+                total > 0 ? 100. * functionList[i].second / total : 0.,
+                functionList[i].first.c_str());
+
+        std::map<std::string, double> &fp = functions[functionList[i].first];
+        std::vector<std::pair<std::string, double> > funcPhases(fp.begin(), fp.end());
+        std::stable_sort(funcPhases.begin(), funcPhases.end(), lSlowerFunction);
+        for (int j = 0; j < (int)funcPhases.size() && j < maxPhases; ++j)
+            fprintf(file, "  %9.4fs                  %s\n",
+                    funcPhases[j].second, funcPhases[j].first.c_str());
+    }
+}
+
+
+static void
+lPrintJSONString(FILE *file, const std::string &str) {
+    fputc('"', file);
+    for (unsigned int i = 0; i < str.size(); ++i) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+
+bool
+TimeReport::WriteJSON(const char *fileName, const std::string &title) {
+    FILE *file = fopen(fileName, "w");
+    if (file == NULL) {
+        perror(fileName);
+        return false;
+    }
+
+    std::vector<std::pair<std::string, PhaseInfo> > phaseList;
+    getPhases(&phaseList);
+
+    fprintf(file, "{\n  \"title\": ");
+    lPrintJSONString(file, title);
+    fprintf(file, ",\n  \"time\": %f,\n  \"peak_memory\": %lu,\n",
+            lastTime - startTime, (unsigned long)lastPeakMemory);
+
+    fprintf(file, "  \"phases\": [");
+    for (unsigned int i = 0; i < phaseList.size(); ++i) {
+        fprintf(file, "%s\n    { \"name\": ", i > 0 ? "," : "");
+        lPrintJSONString(file, phaseList[i].first);
+        fprintf(file, ", \"time\": %f, \"peak_growth\": %lu }",
+                phaseList[i].second.time,
+                (unsigned long)phaseList[i].second.peakGrowth);
+    }
+    fprintf(file, "\n  ],\n");
+
+    std::vector<std::pair<std::string, double> > functionList;
+    getFunctions(&functionList);
+    fprintf(file, "  \"functions\": [");
+    for (unsigned int i = 0; i < functionList.size(); ++i) {
+        fprintf(file, "%s\n    { \"name\": ", i > 0 ? "," : "");
+        lPrintJSONString(file, functionList[i].first);
+        fprintf(file, ", \"time\": %f, \"phases\": {", functionList[i].second);
+        std::map<std::string, double> &fp = functions[functionList[i].first];
+        std::map<std::string, double>::iterator iter;
+        for (iter = fp.begin(); iter != fp.end(); ++iter) {
+            fprintf(file, "%s ", iter == fp.begin() ? "" : ",");
+            lPrintJSONString(file, iter->first);
+            fprintf(file, ": %f", iter->second);
+        }
+        fprintf(file, " } }");
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    if (fclose(file) != 0) {
+        perror(fileName);
+        return false;
+    }
+    return true;
+}
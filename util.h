@@ -40,6 +40,7 @@
 #define ISPC_UTIL_H
 
 #include "ispc.h"
+#include <map>
 #ifdef ISPC_IS_WINDOWS
 #include <stdarg.h>
 #endif
@@ -170,4 +171,127 @@ void PrintWithWordBreaks(const char *buf, int indent, int columnWidth,
  */
 int TerminalWidth();
 
+/** @brief A bump allocator for the compiler's front-end objects.
+
+    Types, symbols and AST nodes are allocated from the current arena (see
+    their operator new), which is the one that belongs to the Module being
+    compiled.  That makes allocating them cheap and keeps the nodes of a
+    function's AST close together in memory; they're all destroyed and
+    their memory freed at once when the arena is deleted.
+ */
+class Arena {
+public:
+    Arena();
+    ~Arena();
+
+    /** Allocates memory for an object of the given size from the current
+        arena, or from the heap if there isn't one.  If destroy is
+        non-NULL, it's called with the object when the arena is deleted. */
+    static void *Allocate(size_t size, void (*destroy)(void *));
+
+    /** Returns true if the given pointer is to memory in this arena. */
+    bool Contains(const void *ptr) const;
+
+    /** The arena that objects are allocated from; when it's NULL, they're
+        allocated from the heap and live as long as the compiler does
+        (e.g. the AtomicType::Uniform* types). */
+    static Arena *current;
+
+private:
+    void *alloc(size_t size);
+
+    std::vector<std::pair<char *, size_t> > blocks;
+    char *next, *end;
+    std::vector<std::pair<void *, void (*)(void *)> > destructors;
+};
+
+/** Objects that are cached by another object (e.g. StructType's const
+    and non-const variants of itself) have to live as long as it does.
+    While an ArenaScope for the caching object exists, new objects are
+    allocated from the heap if that object didn't come from the current
+    arena. */
+class ArenaScope {
+public:
+    ArenaScope(const void *owner) : saved(Arena::current) {
+        if (Arena::current != NULL && !Arena::current->Contains(owner))
+            Arena::current = NULL;
+    }
+    ~ArenaScope() {
+        Arena::current = saved;
+    }
+
+private:
+    Arena *saved;
+};
+
+/** @brief Records where the time and memory go during compilation, for
+    the --time-report option.
+
+    Phases of compilation are started and finished with Push() and Pop();
+    time is charged to the innermost phase that's running, so that the
+    times of all of the phases add up to the total.  A phase may be run
+    for a particular function, in which case its time is also added to
+    that function's total.
+ */
+class TimeReport {
+public:
+    TimeReport();
+
+    /** Starts running the given phase inside the current one, for the
+        given function if it's non-empty. */
+    void Push(const std::string &phase, const std::string &function = "");
+
+    /** Finishes the phase started by the last call to Push(). */
+    void Pop();
+
+    /** Replaces the phase that's currently running with the given one. */
+    void Switch(const std::string &phase, const std::string &function = "");
+
+    /** Prints a table of the time of each phase and how much it raised
+        the process's peak memory use, followed by the slowest functions,
+        to the given file. */
+    void Print(FILE *file, const std::string &title);
+
+    /** Writes the same information as Print(), for all functions, as
+        JSON to the given file.  Returns false if it couldn't be
+        written. */
+    bool WriteJSON(const char *fileName, const std::string &title);
+
+    /** Discards everything recorded so far. */
+    void Reset();
+
+private:
+    struct PhaseInfo {
+        PhaseInfo() : time(0), peakGrowth(0), order(0) { }
+        double time;
+        size_t peakGrowth;  // bytes added to the peak while it ran
+        int order;
+    };
+    typedef std::pair<std::string, std::string> Activity;
+
+    void charge();
+    void getPhases(std::vector<std::pair<std::string, PhaseInfo> > *result);
+    void getFunctions(std::vector<std::pair<std::string, double> > *result);
+
+    double startTime, lastTime;
+    size_t lastPeakMemory;
+    std::vector<Activity> stack;
+    std::map<std::string, PhaseInfo> phases;
+    std::map<std::string, std::map<std::string, double> > functions;
+};
+
+/** Runs the given phase of compilation for as long as the object exists,
+    if g->timeReport is non-NULL. */
+class TimeReportScope {
+public:
+    TimeReportScope(const std::string &phase, const std::string &function = "") {
+        if (g->timeReport != NULL)
+            g->timeReport->Push(phase, function);
+    }
+    ~TimeReportScope() {
+        if (g->timeReport != NULL)
+            g->timeReport->Pop();
+    }
+};
+
 #endif // ISPC_UTIL_H